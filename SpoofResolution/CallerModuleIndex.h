@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <windows.h>
+
+// Lookup of the module a return address is in among the address ranges of the loaded modules
+// Note: the ranges are kept in an array sorted by base address and do not overlap, since modules do not, so the
+//   module of an address is the last range that starts at or below it if the address is also below its end
+
+// Address range of a loaded module
+struct CallerModuleRange
+{
+  ULONG_PTR base;
+  ULONG_PTR end;
+  uint64_t callers; // Bit per caller module in the config that this module is
+};
+
+// IsInCallerModuleRange function
+// Note: the unsigned subtraction checks both ends of the range with a single comparison
+inline bool IsInCallerModuleRange(const CallerModuleRange& range, ULONG_PTR address)
+{
+  return address - range.base < range.end - range.base;
+}
+
+// FindCallerModuleRange function
+// Note: returns the range the address is in or nullptr if it is not in any of them
+inline const CallerModuleRange* FindCallerModuleRange(const CallerModuleRange* ranges, size_t count, ULONG_PTR address)
+{
+  // Find the last range that starts at or below the address using a binary search that the compiler turns into
+  //   conditional moves so the only branch is the loop itself
+  if (count == 0)
+    return nullptr;
+  const CallerModuleRange* range = ranges;
+  while (count > 1)
+  {
+    size_t half = count / 2;
+    range = range[half].base <= address ? range + half : range;
+    count -= half;
+  }
+  return IsInCallerModuleRange(*range, address) ? range : nullptr;
+}
@@ -11,6 +11,7 @@
 #define DETOURS_INTERNAL
 #include "detours.h"
 #include <stddef.h>
+#include <stdlib.h>
 
 #if DETOURS_VERSION != 0x4c0c1   // 0xMAJORcMINORcPATCH
 #error detours.h version mismatch
@@ -29,70 +30,355 @@ const GUID DETOUR_EXE_HELPER_GUID = { /* ea0251b9-5cde-41b5-98d0-2af4a26b0fee */
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// Enumerate through modules in the target process.
+//  Remote memory session.
+//
+//  Reads of the target process are served from page-aligned spans, each read
+//  with a single ReadProcessMemory the first time it is touched.  Writes are
+//  staged in the same spans and only reach the target in Flush, which makes
+//  one protection change and one WriteProcessMemory per run of dirty pages
+//  that share a protection.  All access to the target goes through a
+//  DETOUR_REMOTE_MEMORY backend so the batching can be driven against a fake
+//  process.
 //
-static PVOID LoadNtHeaderFromProcess(_In_ HANDLE hProcess,
-                                     _In_ HMODULE hModule,
-                                     _Out_ PIMAGE_NT_HEADERS32 pNtHeader)
+struct DETOUR_REMOTE_MEMORY
 {
-    ZeroMemory(pNtHeader, sizeof(*pNtHeader));
-    PBYTE pbModule = (PBYTE)hModule;
+    BOOL    (*pfRead)(HANDLE hProcess, LPCVOID pvRemote, PVOID pvLocal, SIZE_T cb);
+    BOOL    (*pfWrite)(HANDLE hProcess, PVOID pvRemote, LPCVOID pvLocal, SIZE_T cb);
+    BOOL    (*pfProtect)(HANDLE hProcess, PVOID pvRemote, SIZE_T cb,
+                         DWORD dwNewProtect, PDWORD pdwOldProtect);
+    SIZE_T  (*pfQuery)(HANDLE hProcess, LPCVOID pvRemote, PMEMORY_BASIC_INFORMATION pmbi);
+};
+
+static BOOL detour_remote_read(HANDLE hProcess, LPCVOID pvRemote, PVOID pvLocal, SIZE_T cb)
+{
+    SIZE_T cbRead = 0;
+    if (!ReadProcessMemory(hProcess, pvRemote, pvLocal, cb, &cbRead)) {
+        return FALSE;
+    }
+    if (cbRead < cb) {
+        SetLastError(ERROR_PARTIAL_COPY);
+        return FALSE;
+    }
+    return TRUE;
+}
 
-    if (pbModule == NULL) {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return NULL;
+static BOOL detour_remote_write(HANDLE hProcess, PVOID pvRemote, LPCVOID pvLocal, SIZE_T cb)
+{
+    SIZE_T cbWritten = 0;
+    if (!WriteProcessMemory(hProcess, pvRemote, pvLocal, cb, &cbWritten)) {
+        return FALSE;
+    }
+    if (cbWritten < cb) {
+        SetLastError(ERROR_PARTIAL_COPY);
+        return FALSE;
     }
+    return TRUE;
+}
 
-    MEMORY_BASIC_INFORMATION mbi;
-    ZeroMemory(&mbi, sizeof(mbi));
+static BOOL detour_remote_protect(HANDLE hProcess, PVOID pvRemote, SIZE_T cb,
+                                  DWORD dwNewProtect, PDWORD pdwOldProtect)
+{
+    return VirtualProtectEx(hProcess, pvRemote, cb, dwNewProtect, pdwOldProtect);
+}
 
-    if (VirtualQueryEx(hProcess, hModule, &mbi, sizeof(mbi)) == 0) {
-        return NULL;
+static SIZE_T detour_remote_query(HANDLE hProcess, LPCVOID pvRemote, PMEMORY_BASIC_INFORMATION pmbi)
+{
+    return VirtualQueryEx(hProcess, pvRemote, pmbi, sizeof(*pmbi));
+}
+
+static const DETOUR_REMOTE_MEMORY s_DetourRemoteMemory = {
+    detour_remote_read,
+    detour_remote_write,
+    detour_remote_protect,
+    detour_remote_query,
+};
+
+#define DETOUR_REMOTE_PAGE_SIZE     0x1000
+#define DETOUR_REMOTE_MAX_SPANS     8
+
+class CDetourRemoteSession
+{
+  public:
+    CDetourRemoteSession(_In_ HANDLE hProcess,
+                         _In_opt_ const DETOUR_REMOTE_MEMORY *pMemory = NULL)
+        : m_hProcess(hProcess),
+          m_pMemory(pMemory != NULL ? pMemory : &s_DetourRemoteMemory),
+          m_cSpans(0)
+    {
+    }
+
+    ~CDetourRemoteSession()
+    {
+        for (DWORD n = 0; n < m_cSpans; n++) {
+            delete[] m_rSpans[n].pbLocal;
+        }
     }
 
-    IMAGE_DOS_HEADER idh;
-    if (!ReadProcessMemory(hProcess, pbModule, &idh, sizeof(idh), NULL)) {
-        DETOUR_TRACE(("ReadProcessMemory(idh@%p..%p) failed: %lu\n",
-                      pbModule, pbModule + sizeof(idh), GetLastError()));
+    HANDLE  Process() const { return m_hProcess; }
+
+    BOOL    Read(_In_ LPCVOID pvRemote, _Out_writes_bytes_(cb) PVOID pvLocal, _In_ SIZE_T cb);
+    BOOL    Write(_In_ PVOID pvRemote, _In_reads_bytes_(cb) LPCVOID pvLocal, _In_ SIZE_T cb);
+    BOOL    WriteUncached(_In_ PVOID pvRemote, _In_reads_bytes_(cb) LPCVOID pvLocal, _In_ SIZE_T cb);
+    SIZE_T  Query(_In_ LPCVOID pvRemote, _Out_ PMEMORY_BASIC_INFORMATION pmbi);
+    BOOL    Flush();
+
+  private:
+    struct SPAN
+    {
+        PBYTE   pbRemote;
+        PBYTE   pbLocal;
+        SIZE_T  cb;
+        SIZE_T  obDirtyBeg;     // Staged bytes are [obDirtyBeg, obDirtyEnd).
+        SIZE_T  obDirtyEnd;
+    };
+
+    SPAN *  Map(_In_ PBYTE pbRemote, _In_ SIZE_T cb);
+
+    HANDLE                      m_hProcess;
+    const DETOUR_REMOTE_MEMORY *m_pMemory;
+    SPAN                        m_rSpans[DETOUR_REMOTE_MAX_SPANS];
+    DWORD                       m_cSpans;
+};
+
+CDetourRemoteSession::SPAN * CDetourRemoteSession::Map(_In_ PBYTE pbRemote, _In_ SIZE_T cb)
+{
+    // Compare as integers, a pointer that wraps is undefined and the check
+    // would be dropped; the end must also leave room to round up to a page.
+    //
+    ULONG_PTR nEnd = (ULONG_PTR)pbRemote + cb;
+    if (cb == 0 || nEnd < (ULONG_PTR)pbRemote ||
+        nEnd > ~(ULONG_PTR)(DETOUR_REMOTE_PAGE_SIZE - 1)) {
+        SetLastError(ERROR_INVALID_PARAMETER);
         return NULL;
     }
 
-    if (idh.e_magic != IMAGE_DOS_SIGNATURE ||
-        (DWORD)idh.e_lfanew > mbi.RegionSize ||
-        (DWORD)idh.e_lfanew < sizeof(idh)) {
+    DWORD n;
+    for (n = 0; n < m_cSpans; n++) {
+        if (pbRemote >= m_rSpans[n].pbRemote &&
+            pbRemote + cb <= m_rSpans[n].pbRemote + m_rSpans[n].cb) {
+            return &m_rSpans[n];
+        }
+    }
+
+    // Widen the request to whole pages, then to every span it overlaps or
+    // touches so that no byte of the target is ever cached twice.
+    //
+    PBYTE pbBeg = (PBYTE)((ULONG_PTR)pbRemote & ~(ULONG_PTR)(DETOUR_REMOTE_PAGE_SIZE - 1));
+    PBYTE pbEnd = (PBYTE)(((ULONG_PTR)(pbRemote + cb) + DETOUR_REMOTE_PAGE_SIZE - 1) &
+                          ~(ULONG_PTR)(DETOUR_REMOTE_PAGE_SIZE - 1));
+    BOOL fWidened;
+    do {
+        fWidened = FALSE;
+        for (n = 0; n < m_cSpans; n++) {
+            PBYTE pbSpanBeg = m_rSpans[n].pbRemote;
+            PBYTE pbSpanEnd = pbSpanBeg + m_rSpans[n].cb;
+            if (pbSpanBeg <= pbEnd && pbSpanEnd >= pbBeg &&
+                (pbSpanBeg < pbBeg || pbSpanEnd > pbEnd)) {
+                if (pbSpanBeg < pbBeg) {
+                    pbBeg = pbSpanBeg;
+                }
+                if (pbSpanEnd > pbEnd) {
+                    pbEnd = pbSpanEnd;
+                }
+                fWidened = TRUE;
+            }
+        }
+    } while (fWidened);
 
-        SetLastError(ERROR_BAD_EXE_FORMAT);
+    DWORD cAbsorbed = 0;
+    for (n = 0; n < m_cSpans; n++) {
+        if (m_rSpans[n].pbRemote >= pbBeg && m_rSpans[n].pbRemote < pbEnd) {
+            cAbsorbed++;
+        }
+    }
+    if (m_cSpans - cAbsorbed >= DETOUR_REMOTE_MAX_SPANS) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
         return NULL;
     }
 
-    if (!ReadProcessMemory(hProcess, pbModule + idh.e_lfanew,
-                           pNtHeader, sizeof(*pNtHeader), NULL)) {
-        DETOUR_TRACE(("ReadProcessMemory(inh@%p..%p:%p) failed: %lu\n",
-                      pbModule + idh.e_lfanew,
-                      pbModule + idh.e_lfanew + sizeof(*pNtHeader),
-                      pbModule,
-                      GetLastError()));
+    SPAN span;
+    span.pbRemote = pbBeg;
+    span.cb = pbEnd - pbBeg;
+    span.obDirtyBeg = span.cb;
+    span.obDirtyEnd = 0;
+    span.pbLocal = new NOTHROW BYTE [span.cb];
+    if (span.pbLocal == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
         return NULL;
     }
 
-    if (pNtHeader->Signature != IMAGE_NT_SIGNATURE) {
-        SetLastError(ERROR_BAD_EXE_FORMAT);
+    if (!m_pMemory->pfRead(m_hProcess, span.pbRemote, span.pbLocal, span.cb)) {
+        DETOUR_TRACE(("ReadProcessMemory(span@%p..%p) failed: %lu\n",
+                      span.pbRemote, span.pbRemote + span.cb, GetLastError()));
+        delete[] span.pbLocal;
         return NULL;
     }
 
-    return pbModule + idh.e_lfanew;
+    // Carry the absorbed spans over, including anything staged in them.
+    //
+    DWORD nKeep = 0;
+    for (n = 0; n < m_cSpans; n++) {
+        SPAN& old = m_rSpans[n];
+        if (old.pbRemote >= pbBeg && old.pbRemote < pbEnd) {
+            SIZE_T ob = old.pbRemote - span.pbRemote;
+            CopyMemory(span.pbLocal + ob, old.pbLocal, old.cb);
+            if (old.obDirtyBeg < old.obDirtyEnd) {
+                if (ob + old.obDirtyBeg < span.obDirtyBeg) {
+                    span.obDirtyBeg = ob + old.obDirtyBeg;
+                }
+                if (ob + old.obDirtyEnd > span.obDirtyEnd) {
+                    span.obDirtyEnd = ob + old.obDirtyEnd;
+                }
+            }
+            delete[] old.pbLocal;
+        }
+        else {
+            m_rSpans[nKeep++] = old;
+        }
+    }
+    m_rSpans[nKeep] = span;
+    m_cSpans = nKeep + 1;
+    return &m_rSpans[nKeep];
 }
 
-static HMODULE EnumerateModulesInProcess(_In_ HANDLE hProcess,
-                                         _In_opt_ HMODULE hModuleLast,
-                                         _Out_ PIMAGE_NT_HEADERS32 pNtHeader,
-                                         _Out_opt_ PVOID *pRemoteNtHeader)
+BOOL CDetourRemoteSession::Read(_In_ LPCVOID pvRemote,
+                                _Out_writes_bytes_(cb) PVOID pvLocal,
+                                _In_ SIZE_T cb)
 {
-    ZeroMemory(pNtHeader, sizeof(*pNtHeader));
-    if (pRemoteNtHeader) {
-        *pRemoteNtHeader = NULL;
+    SPAN *pSpan = Map((PBYTE)pvRemote, cb);
+    if (pSpan == NULL) {
+        return FALSE;
     }
+    CopyMemory(pvLocal, pSpan->pbLocal + ((PBYTE)pvRemote - pSpan->pbRemote), cb);
+    return TRUE;
+}
 
+BOOL CDetourRemoteSession::Write(_In_ PVOID pvRemote,
+                                 _In_reads_bytes_(cb) LPCVOID pvLocal,
+                                 _In_ SIZE_T cb)
+{
+    SPAN *pSpan = Map((PBYTE)pvRemote, cb);
+    if (pSpan == NULL) {
+        return FALSE;
+    }
+    SIZE_T ob = (PBYTE)pvRemote - pSpan->pbRemote;
+    CopyMemory(pSpan->pbLocal + ob, pvLocal, cb);
+    if (ob < pSpan->obDirtyBeg) {
+        pSpan->obDirtyBeg = ob;
+    }
+    if (ob + cb > pSpan->obDirtyEnd) {
+        pSpan->obDirtyEnd = ob + cb;
+    }
+    return TRUE;
+}
+
+BOOL CDetourRemoteSession::WriteUncached(_In_ PVOID pvRemote,
+                                         _In_reads_bytes_(cb) LPCVOID pvLocal,
+                                         _In_ SIZE_T cb)
+// Write straight through to memory the session does not cache, such as a
+// block that was just allocated in the target.
+{
+    return m_pMemory->pfWrite(m_hProcess, pvRemote, pvLocal, cb);
+}
+
+SIZE_T CDetourRemoteSession::Query(_In_ LPCVOID pvRemote, _Out_ PMEMORY_BASIC_INFORMATION pmbi)
+{
+    ZeroMemory(pmbi, sizeof(*pmbi));
+    return m_pMemory->pfQuery(m_hProcess, pvRemote, pmbi);
+}
+
+BOOL CDetourRemoteSession::Flush()
+{
+    for (DWORD n = 0; n < m_cSpans; n++) {
+        SPAN& span = m_rSpans[n];
+        if (span.obDirtyBeg >= span.obDirtyEnd) {
+            continue;
+        }
+
+        PBYTE pbDirty = span.pbRemote + span.obDirtyBeg;
+        PBYTE pbDirtyEnd = span.pbRemote + span.obDirtyEnd;
+        while (pbDirty < pbDirtyEnd) {
+            // Make each run of pages that share a protection writable while
+            // keeping its executability, then put the protection back.
+            //
+            MEMORY_BASIC_INFORMATION mbi;
+            if (Query(pbDirty, &mbi) == 0) {
+                DETOUR_TRACE(("VirtualQueryEx(%p) failed: %lu\n", pbDirty, GetLastError()));
+                return FALSE;
+            }
+            PBYTE pbRunEnd = (PBYTE)mbi.BaseAddress + mbi.RegionSize;
+            if (pbRunEnd <= pbDirty || pbRunEnd > pbDirtyEnd) {
+                pbRunEnd = pbDirtyEnd;
+            }
+            SIZE_T cbRun = pbRunEnd - pbDirty;
+
+            DWORD dwNewProtect = (mbi.Protect & (PAGE_EXECUTE |
+                                                 PAGE_EXECUTE_READ |
+                                                 PAGE_EXECUTE_READWRITE |
+                                                 PAGE_EXECUTE_WRITECOPY))
+                ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE;
+            DWORD dwOldProtect = 0;
+            if (!m_pMemory->pfProtect(m_hProcess, pbDirty, cbRun, dwNewProtect, &dwOldProtect)) {
+                DETOUR_TRACE(("VirtualProtectEx(%p..%p) write failed: %lu\n",
+                              pbDirty, pbRunEnd, GetLastError()));
+                return FALSE;
+            }
+
+            BOOL fWritten = m_pMemory->pfWrite(m_hProcess, pbDirty,
+                                               span.pbLocal + (pbDirty - span.pbRemote), cbRun);
+            DWORD dwError = GetLastError();
+            if (!fWritten) {
+                DETOUR_TRACE(("WriteProcessMemory(%p..%p) failed: %lu\n",
+                              pbDirty, pbRunEnd, dwError));
+            }
+            DETOUR_TRACE(("WriteProcessMemory(%p..%p)\n", pbDirty, pbRunEnd));
+
+            if (!m_pMemory->pfProtect(m_hProcess, pbDirty, cbRun, dwOldProtect, &dwNewProtect)) {
+                DETOUR_TRACE(("VirtualProtectEx(%p..%p) restore failed: %lu\n",
+                              pbDirty, pbRunEnd, GetLastError()));
+                return FALSE;
+            }
+            if (!fWritten) {
+                SetLastError(dwError);
+                return FALSE;
+            }
+            pbDirty = pbRunEnd;
+        }
+        span.obDirtyBeg = span.cb;
+        span.obDirtyEnd = 0;
+    }
+    return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Read the headers of remote images with CDetourImageView, either through a
+// remote session, so that the writes staged in it are seen, or directly.
+//
+static BOOL CALLBACK detour_read_session(_In_opt_ PVOID pContext,
+                                         _In_ LPCVOID pvRemote,
+                                         _Out_writes_bytes_(cbData) PVOID pvLocal,
+                                         _In_ SIZE_T cbData)
+{
+    return ((CDetourRemoteSession *)pContext)->Read(pvRemote, pvLocal, cbData);
+}
+
+static BOOL CALLBACK detour_read_process(_In_opt_ PVOID pContext,
+                                         _In_ LPCVOID pvRemote,
+                                         _Out_writes_bytes_(cbData) PVOID pvLocal,
+                                         _In_ SIZE_T cbData)
+{
+    return detour_remote_read((HANDLE)pContext, pvRemote, pvLocal, cbData);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Enumerate through modules in the target process.
+//
+static HMODULE EnumerateModulesInProcess(_In_ HANDLE hProcess,
+                                         _In_opt_ HMODULE hModuleLast,
+                                         _Out_ CDetourImageView& view)
+{
     PBYTE pbLast = (PBYTE)hModuleLast + MM_ALLOCATION_GRANULARITY;
 
     MEMORY_BASIC_INFORMATION mbi;
@@ -124,13 +410,7 @@ static HMODULE EnumerateModulesInProcess(_In_ HANDLE hProcess,
             continue;
         }
 
-        PVOID remoteHeader
-            = LoadNtHeaderFromProcess(hProcess, (HMODULE)pbLast, pNtHeader);
-        if (remoteHeader) {
-            if (pRemoteNtHeader) {
-                *pRemoteNtHeader = remoteHeader;
-            }
-
+        if (view.AttachRemote((HMODULE)pbLast, detour_read_process, hProcess)) {
             return (HMODULE)pbLast;
         }
     }
@@ -142,42 +422,21 @@ static HMODULE EnumerateModulesInProcess(_In_ HANDLE hProcess,
 // Find payloads in target process.
 //
 
-static PVOID FindDetourSectionInRemoteModule(_In_ HANDLE hProcess,
-                                             _In_ HMODULE hModule,
-                                             _In_ const IMAGE_NT_HEADERS32 *pNtHeader,
-                                             _In_ PVOID pRemoteNtHeader)
+static PVOID FindDetourSectionInRemoteModule(_In_ const CDetourImageView& view)
 {
-    if (pNtHeader->FileHeader.SizeOfOptionalHeader == 0) {
-        SetLastError(ERROR_EXE_MARKED_INVALID);
-        return NULL;
-    }
-
-    PIMAGE_SECTION_HEADER pRemoteSectionHeaders
-        = (PIMAGE_SECTION_HEADER)((PBYTE)pRemoteNtHeader
-                                  + sizeof(pNtHeader->Signature)
-                                  + sizeof(pNtHeader->FileHeader)
-                                  + pNtHeader->FileHeader.SizeOfOptionalHeader);
-
-    IMAGE_SECTION_HEADER header;
-    for (DWORD n = 0; n < pNtHeader->FileHeader.NumberOfSections; ++n) {
-        if (!ReadProcessMemory(hProcess, pRemoteSectionHeaders + n, &header, sizeof(header), NULL)) {
-            DETOUR_TRACE(("ReadProcessMemory(ish@%p..%p) failed: %lu\n",
-                pRemoteSectionHeaders + n,
-                (PBYTE)(pRemoteSectionHeaders + n) + sizeof(header),
-                GetLastError()));
+    DWORD cSections;
+    PIMAGE_SECTION_HEADER pSectionHeaders = view.Sections(&cSections);
 
-            return NULL;
-        }
-
-        if (strcmp((PCHAR)header.Name, ".detour") == 0) {
-            if (header.VirtualAddress == 0 ||
-                header.SizeOfRawData == 0) {
+    for (DWORD n = 0; n < cSections; ++n) {
+        if (strncmp((PCHAR)pSectionHeaders[n].Name, ".detour", sizeof(pSectionHeaders[n].Name)) == 0) {
+            if (pSectionHeaders[n].VirtualAddress == 0 ||
+                pSectionHeaders[n].SizeOfRawData == 0) {
 
                 break;
             }
 
             SetLastError(NO_ERROR);
-            return (PBYTE)hModule + header.VirtualAddress;
+            return view.Base() + pSectionHeaders[n].VirtualAddress;
         }
     }
 
@@ -215,7 +474,52 @@ static PVOID FindPayloadInRemoteDetourSection(_In_ HANDLE hProcess,
         header.nDataOffset = header.cbHeaderSize;
     }
 
-    for (PVOID pvSection = pbData + header.nDataOffset; pvSection < pbData + header.cbDataSize;) {
+    // A directory in the first record is authoritative, but only if it lies
+    // within the section; otherwise the records are walked one by one.
+    DETOUR_SECTION_RECORD first;
+    if (header.nDataOffset + sizeof(first) <= header.cbDataSize &&
+        ReadProcessMemory(hProcess, pbData + header.nDataOffset, &first, sizeof(first), NULL) &&
+        first.cbBytes >= sizeof(first) &&
+        first.cbBytes <= header.cbDataSize - header.nDataOffset &&
+        DetourAreSameGuid(first.guid, DETOUR_PAYLOAD_DIRECTORY_GUID) &&
+        !DetourAreSameGuid(rguid, DETOUR_PAYLOAD_DIRECTORY_GUID)) {
+
+        DWORD cEntries = (first.cbBytes - sizeof(first)) / sizeof(DETOUR_PAYLOAD_DIRECTORY_ENTRY);
+        PDETOUR_PAYLOAD_DIRECTORY_ENTRY pEntries = new NOTHROW DETOUR_PAYLOAD_DIRECTORY_ENTRY [cEntries];
+        if (pEntries == NULL) {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return NULL;
+        }
+        if (!ReadProcessMemory(hProcess, pbData + header.nDataOffset + sizeof(first), pEntries,
+                               cEntries * sizeof(DETOUR_PAYLOAD_DIRECTORY_ENTRY), NULL)) {
+            DETOUR_TRACE(("ReadProcessMemory(directory@%p) failed: %lu\n",
+                pbData + header.nDataOffset + sizeof(first),
+                GetLastError()));
+            delete[] pEntries;
+            return NULL;
+        }
+
+        PVOID pvFound = NULL;
+        PDETOUR_PAYLOAD_DIRECTORY_ENTRY pEntry
+            = detour_find_payload_directory_entry(pEntries, cEntries, rguid);
+        if (pEntry != NULL &&
+            pEntry->nOffset >= header.nDataOffset &&
+            pEntry->nOffset <= header.cbDataSize &&
+            pEntry->cbData <= header.cbDataSize - pEntry->nOffset) {
+
+            if (pcbData) {
+                *pcbData = pEntry->cbData;
+            }
+            pvFound = pbData + pEntry->nOffset;
+            SetLastError(NO_ERROR);
+        }
+        delete[] pEntries;
+        return pvFound;
+    }
+
+    PBYTE pbEnd = pbData + header.cbDataSize;
+    for (PVOID pvSection = pbData + header.nDataOffset;
+         (PBYTE)pvSection + sizeof(DETOUR_SECTION_RECORD) <= pbEnd;) {
         DETOUR_SECTION_RECORD section;
         if (!ReadProcessMemory(hProcess, pvSection, &section, sizeof(section), NULL)) {
             DETOUR_TRACE(("ReadProcessMemory(dsr@%p..%p) failed: %lu\n",
@@ -225,6 +529,13 @@ static PVOID FindPayloadInRemoteDetourSection(_In_ HANDLE hProcess,
             return NULL;
         }
 
+        // A record that does not fit ends the walk, rather than looping on it
+        // or stepping past the section.
+        if (section.cbBytes < sizeof(section) ||
+            section.cbBytes > (DWORD)(pbEnd - (PBYTE)pvSection)) {
+            break;
+        }
+
         if (DetourAreSameGuid(section.guid, rguid)) {
             if (pcbData) {
                 *pcbData = section.cbBytes - sizeof(section);
@@ -249,10 +560,9 @@ PVOID WINAPI DetourFindRemotePayload(_In_ HANDLE hProcess,
         return NULL;
     }
 
-    IMAGE_NT_HEADERS32 header;
-    PVOID pvRemoteHeader;
-    for (HMODULE hMod = NULL; (hMod = EnumerateModulesInProcess(hProcess, hMod, &header, &pvRemoteHeader)) != NULL;) {
-        PVOID pvData = FindDetourSectionInRemoteModule(hProcess, hMod, &header, pvRemoteHeader);
+    CDetourImageView view;
+    for (HMODULE hMod = NULL; (hMod = EnumerateModulesInProcess(hProcess, hMod, view)) != NULL;) {
+        PVOID pvData = FindDetourSectionInRemoteModule(view);
         if (pvData != NULL) {
             pvData = FindPayloadInRemoteDetourSection(hProcess, rguid, pcbData, pvData);
             if (pvData != NULL) {
@@ -323,7 +633,11 @@ static PBYTE FindAndAllocateNearBase(HANDLE hProcess, PBYTE pbModule, PBYTE pbBa
                       mbi.BaseAddress,
                       (PBYTE)mbi.BaseAddress + mbi.RegionSize));
 
-        for (; pbAddress < (PBYTE)mbi.BaseAddress + mbi.RegionSize; pbAddress += MM_ALLOCATION_GRANULARITY) {
+        // Only try addresses where the whole allocation fits in the free region,
+        // anything else is bound to fail.
+        PBYTE pbLimit = (PBYTE)mbi.BaseAddress + mbi.RegionSize;
+        for (; pbAddress < pbLimit && cbAlloc <= (DWORD_PTR)(pbLimit - pbAddress);
+             pbAddress += MM_ALLOCATION_GRANULARITY) {
             PBYTE pbAlloc = (PBYTE)VirtualAllocEx(hProcess, pbAddress, cbAlloc,
                                                   MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
             if (pbAlloc == NULL) {
@@ -377,75 +691,107 @@ static inline HRESULT ReplaceOptionalSizeA(_Inout_z_count_(cchDest) LPSTR pszDes
     return S_OK;
 }
 
-static BOOL RecordExeRestore(HANDLE hProcess, HMODULE hModule, DETOUR_EXE_RESTORE& der)
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Layout of the import directory that UPDATE_IMPORTS_XX builds for the
+//  target.  The whole block is laid out in one local buffer and written into
+//  the target with a single WriteProcessMemory: the descriptors for the new
+//  DLLs followed by the old descriptors (or a terminator when there are
+//  none), then the import name table for the new DLLs, then their import
+//  address table, then their names.  Each table starts pointer aligned and
+//  each new DLL takes two thunks in both tables, an import of ordinal 1 and
+//  the terminator.
+//
+struct DETOUR_IMPORT_LAYOUT
 {
-    // Save the various headers for DetourRestoreAfterWith.
-    ZeroMemory(&der, sizeof(der));
-    der.cb = sizeof(der);
+    DWORD   nDescriptors;       // New descriptors followed by the old ones.
+    DWORD   obOriginalThunks;
+    DWORD   obFirstThunks;
+    DWORD   obNames;
+    DWORD   cbTotal;
+};
+
+static BOOL PlanImportLayout(_In_ DWORD cbThunk,
+                             _In_ DWORD nOldDescriptors,
+                             _In_reads_(nDlls) LPCSTR *plpDlls,
+                             _In_ DWORD nDlls,
+                             _Out_ DETOUR_IMPORT_LAYOUT& layout)
+// nOldDescriptors comes from another process and could be corrupt, so every
+// size is checked for overflow.
+{
+    ZeroMemory(&layout, sizeof(layout));
 
-    der.pidh = (PBYTE)hModule;
-    der.cbidh = sizeof(der.idh);
-    if (!ReadProcessMemory(hProcess, der.pidh, &der.idh, sizeof(der.idh), NULL)) {
-        DETOUR_TRACE(("ReadProcessMemory(idh@%p..%p) failed: %lu\n",
-                      der.pidh, der.pidh + der.cbidh, GetLastError()));
+    DWORD cbDescriptors;
+    if (DWordAdd(nDlls, nOldDescriptors != 0 ? nOldDescriptors : 1, &layout.nDescriptors) != S_OK ||
+        DWordMult(sizeof(IMAGE_IMPORT_DESCRIPTOR), layout.nDescriptors, &cbDescriptors) != S_OK) {
+        DETOUR_TRACE(("Import descriptors overflow.\n"));
         return FALSE;
     }
-    DETOUR_TRACE(("IDH: %p..%p\n", der.pidh, der.pidh + der.cbidh));
 
-    // We read the NT header in two passes to get the full size.
-    // First we read just the Signature and FileHeader.
-    der.pinh = der.pidh + der.idh.e_lfanew;
-    der.cbinh = FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader);
-    if (!ReadProcessMemory(hProcess, der.pinh, &der.inh, der.cbinh, NULL)) {
-        DETOUR_TRACE(("ReadProcessMemory(inh@%p..%p) failed: %lu\n",
-                      der.pinh, der.pinh + der.cbinh, GetLastError()));
+    DWORD cbThunks;
+    if (DWordMult(cbThunk * 2, nDlls, &cbThunks) != S_OK) {
+        DETOUR_TRACE(("Import thunks overflow.\n"));
         return FALSE;
     }
 
-    // Second we read the OptionalHeader and Section headers.
-    der.cbinh = (FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader) +
-                 der.inh.FileHeader.SizeOfOptionalHeader +
-                 der.inh.FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER));
+    DWORD cbNames = 0;
+    for (DWORD n = 0; n < nDlls; n++) {
+        if (DWordAdd(cbNames, PadToDword((DWORD)strlen(plpDlls[n]) + 1), &cbNames) != S_OK) {
+            DETOUR_TRACE(("Import names overflow.\n"));
+            return FALSE;
+        }
+    }
 
-    if (der.cbinh > sizeof(der.raw)) {
+    layout.obOriginalThunks = PadToDwordPtr(cbDescriptors);
+    if (layout.obOriginalThunks < cbDescriptors ||
+        DWordAdd(layout.obOriginalThunks, cbThunks, &layout.obFirstThunks) != S_OK ||
+        DWordAdd(layout.obFirstThunks, cbThunks, &layout.obNames) != S_OK ||
+        DWordAdd(layout.obNames, cbNames, &layout.cbTotal) != S_OK) {
+        DETOUR_TRACE(("Import table size overflow.\n"));
         return FALSE;
     }
+    return TRUE;
+}
 
-    if (!ReadProcessMemory(hProcess, der.pinh, &der.inh, der.cbinh, NULL)) {
-        DETOUR_TRACE(("ReadProcessMemory(inh@%p..%p) failed: %lu\n",
-                      der.pinh, der.pinh + der.cbinh, GetLastError()));
+static BOOL RecordExeRestore(CDetourRemoteSession& session, HMODULE hModule, DETOUR_EXE_RESTORE& der)
+{
+    // Save the various headers for DetourRestoreAfterWith.
+    ZeroMemory(&der, sizeof(der));
+    der.cb = sizeof(der);
+
+    CDetourImageView view;
+    if (!view.AttachRemote(hModule, detour_read_session, &session)) {
         return FALSE;
     }
-    DETOUR_TRACE(("INH: %p..%p\n", der.pinh, der.pinh + der.cbinh));
 
-    // Third, we read the CLR header
-
-    if (der.inh.OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
-        if (der.inh32.CLR_DIRECTORY.VirtualAddress != 0 &&
-            der.inh32.CLR_DIRECTORY.Size != 0) {
+    der.pidh = (PBYTE)hModule;
+    der.cbidh = sizeof(der.idh);
+    CopyMemory(&der.idh, view.DosHeader(), sizeof(der.idh));
+    DETOUR_TRACE(("IDH: %p..%p\n", der.pidh, der.pidh + der.cbidh));
 
-            DETOUR_TRACE(("CLR32.VirtAddr=%08lx, CLR.Size=%lu\n",
-                          der.inh32.CLR_DIRECTORY.VirtualAddress,
-                          der.inh32.CLR_DIRECTORY.Size));
+    // The NT header is saved with the OptionalHeader and Section headers.
+    PIMAGE_NT_HEADERS pNtHeader = view.NtHeader();
+    der.pinh = der.pidh + der.idh.e_lfanew;
+    der.cbinh = (FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader) +
+                 pNtHeader->FileHeader.SizeOfOptionalHeader +
+                 pNtHeader->FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER));
 
-            der.pclr = ((PBYTE)hModule) + der.inh32.CLR_DIRECTORY.VirtualAddress;
-        }
+    if (der.cbinh > sizeof(der.raw) || !view.Contains(pNtHeader, der.cbinh)) {
+        SetLastError(ERROR_EXE_MARKED_INVALID);
+        return FALSE;
     }
-    else if (der.inh.OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
-        if (der.inh64.CLR_DIRECTORY.VirtualAddress != 0 &&
-            der.inh64.CLR_DIRECTORY.Size != 0) {
-
-            DETOUR_TRACE(("CLR64.VirtAddr=%08lx, CLR.Size=%lu\n",
-                          der.inh64.CLR_DIRECTORY.VirtualAddress,
-                          der.inh64.CLR_DIRECTORY.Size));
+    CopyMemory(&der.inh, pNtHeader, der.cbinh);
+    DETOUR_TRACE(("INH: %p..%p\n", der.pinh, der.pinh + der.cbinh));
 
-            der.pclr = ((PBYTE)hModule) + der.inh64.CLR_DIRECTORY.VirtualAddress;
-        }
-    }
+    // Then the CLR header, which the view finds in either optional header.
+    DWORD cbClr = 0;
+    DWORD nClr = view.DirectoryRva(IMAGE_DIRECTORY_ENTRY_COM_DESCRIPTOR, &cbClr);
+    if (nClr != 0) {
+        DETOUR_TRACE(("CLR.VirtAddr=%08lx, CLR.Size=%lu\n", nClr, cbClr));
 
-    if (der.pclr != 0) {
+        der.pclr = ((PBYTE)hModule) + nClr;
         der.cbclr = sizeof(der.clr);
-        if (!ReadProcessMemory(hProcess, der.pclr, &der.clr, der.cbclr, NULL)) {
+        if (!view.Read(nClr, &der.clr, der.cbclr)) {
             DETOUR_TRACE(("ReadProcessMemory(clr@%p..%p) failed: %lu\n",
                           der.pclr, der.pclr + der.cbclr, GetLastError()));
             return FALSE;
@@ -465,6 +811,7 @@ static BOOL RecordExeRestore(HANDLE hProcess, HMODULE hModule, DETOUR_EXE_RESTOR
 #define IMAGE_ORDINAL_FLAG_XX           IMAGE_ORDINAL_FLAG32
 #define IMAGE_THUNK_DATAXX              IMAGE_THUNK_DATA32
 #define UPDATE_IMPORTS_XX               UpdateImports32
+#define BUILD_IMPORTS_XX                BuildImports32
 #define DETOURS_BITS_XX                 32
 #include "uimports.cpp"
 #undef DETOUR_EXE_RESTORE_FIELD_XX
@@ -473,6 +820,7 @@ static BOOL RecordExeRestore(HANDLE hProcess, HMODULE hModule, DETOUR_EXE_RESTOR
 #undef IMAGE_NT_OPTIONAL_HDR_MAGIC_XX
 #undef IMAGE_ORDINAL_FLAG_XX
 #undef UPDATE_IMPORTS_XX
+#undef BUILD_IMPORTS_XX
 #endif // DETOURS_32BIT
 
 #if DETOURS_64BIT
@@ -482,6 +830,7 @@ static BOOL RecordExeRestore(HANDLE hProcess, HMODULE hModule, DETOUR_EXE_RESTOR
 #define IMAGE_ORDINAL_FLAG_XX           IMAGE_ORDINAL_FLAG64
 #define IMAGE_THUNK_DATAXX              IMAGE_THUNK_DATA64
 #define UPDATE_IMPORTS_XX               UpdateImports64
+#define BUILD_IMPORTS_XX                BuildImports64
 #define DETOURS_BITS_XX                 64
 #include "uimports.cpp"
 #undef DETOUR_EXE_RESTORE_FIELD_XX
@@ -490,6 +839,7 @@ static BOOL RecordExeRestore(HANDLE hProcess, HMODULE hModule, DETOUR_EXE_RESTOR
 #undef IMAGE_NT_OPTIONAL_HDR_MAGIC_XX
 #undef IMAGE_ORDINAL_FLAG_XX
 #undef UPDATE_IMPORTS_XX
+#undef BUILD_IMPORTS_XX
 #endif // DETOURS_64BIT
 
 //////////////////////////////////////////////////////////////////////////////
@@ -498,10 +848,9 @@ static BOOL RecordExeRestore(HANDLE hProcess, HMODULE hModule, DETOUR_EXE_RESTOR
 
 C_ASSERT(sizeof(IMAGE_NT_HEADERS64) == sizeof(IMAGE_NT_HEADERS32) + 16);
 
-static BOOL UpdateFrom32To64(HANDLE hProcess, HMODULE hModule, WORD machine,
+static BOOL UpdateFrom32To64(CDetourRemoteSession& session, HMODULE hModule, WORD machine,
                              DETOUR_EXE_RESTORE& der)
 {
-    IMAGE_DOS_HEADER idh;
     IMAGE_NT_HEADERS32 inh32;
     IMAGE_NT_HEADERS64 inh64;
     IMAGE_SECTION_HEADER sects[32];
@@ -515,36 +864,26 @@ static BOOL UpdateFrom32To64(HANDLE hProcess, HMODULE hModule, WORD machine,
     DETOUR_TRACE(("UpdateFrom32To64(%04x)\n", machine));
     //////////////////////////////////////////////////////// Read old headers.
     //
-    if (!ReadProcessMemory(hProcess, pbModule, &idh, sizeof(idh), NULL)) {
-        DETOUR_TRACE(("ReadProcessMemory(idh@%p..%p) failed: %lu\n",
-                      pbModule, pbModule + sizeof(idh), GetLastError()));
+    CDetourImageView view;
+    if (!view.AttachRemote(hModule, detour_read_session, &session)) {
         return FALSE;
     }
-    DETOUR_TRACE(("ReadProcessMemory(idh@%p..%p)\n",
-                  pbModule, pbModule + sizeof(idh)));
-
-    PBYTE pnh = pbModule + idh.e_lfanew;
-    if (!ReadProcessMemory(hProcess, pnh, &inh32, sizeof(inh32), NULL)) {
-        DETOUR_TRACE(("ReadProcessMemory(inh@%p..%p) failed: %lu\n",
-                      pnh, pnh + sizeof(inh32), GetLastError()));
+    if (view.NtHeader()->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
+        SetLastError(ERROR_INVALID_BLOCK);
         return FALSE;
     }
-    DETOUR_TRACE(("ReadProcessMemory(inh@%p..%p)\n", pnh, pnh + sizeof(inh32)));
 
-    if (inh32.FileHeader.NumberOfSections > (sizeof(sects)/sizeof(sects[0]))) {
-        return FALSE;
-    }
+    PBYTE pnh = pbModule + view.DosHeader()->e_lfanew;
+    CopyMemory(&inh32, view.NtHeader(), sizeof(inh32));
+    DETOUR_TRACE(("ReadProcessMemory(inh@%p..%p)\n", pnh, pnh + sizeof(inh32)));
 
-    PBYTE psects = pnh +
-        FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader) +
-        inh32.FileHeader.SizeOfOptionalHeader;
-    ULONG cb = inh32.FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER);
-    if (!ReadProcessMemory(hProcess, psects, &sects, cb, NULL)) {
-        DETOUR_TRACE(("ReadProcessMemory(ish@%p..%p) failed: %lu\n",
-                      psects, psects + cb, GetLastError()));
+    DWORD cSections;
+    PIMAGE_SECTION_HEADER pSections = view.Sections(&cSections);
+    if (pSections == NULL || cSections > (sizeof(sects)/sizeof(sects[0]))) {
         return FALSE;
     }
-    DETOUR_TRACE(("ReadProcessMemory(ish@%p..%p)\n", psects, psects + cb));
+    CopyMemory(sects, pSections, cSections * sizeof(IMAGE_SECTION_HEADER));
+    DETOUR_TRACE(("ReadProcessMemory(ish[%lu])\n", cSections));
 
     ////////////////////////////////////////////////////////// Convert header.
     //
@@ -590,24 +929,21 @@ static BOOL UpdateFrom32To64(HANDLE hProcess, HMODULE hModule, WORD machine,
 
     /////////////////////////////////////////////////////// Write new headers.
     //
-    DWORD dwProtect = 0;
-    if (!DetourVirtualProtectSameExecuteEx(hProcess, pbModule, inh64.OptionalHeader.SizeOfHeaders,
-                                           PAGE_EXECUTE_READWRITE, &dwProtect)) {
-        return FALSE;
-    }
-
-    if (!WriteProcessMemory(hProcess, pnh, &inh64, sizeof(inh64), NULL)) {
+    // The writes are staged in the session and reach the target when the
+    // caller flushes it.
+    //
+    if (!session.Write(pnh, &inh64, sizeof(inh64))) {
         DETOUR_TRACE(("WriteProcessMemory(inh@%p..%p) failed: %lu\n",
                       pnh, pnh + sizeof(inh64), GetLastError()));
         return FALSE;
     }
     DETOUR_TRACE(("WriteProcessMemory(inh@%p..%p)\n", pnh, pnh + sizeof(inh64)));
 
-    psects = pnh +
+    PBYTE psects = pnh +
         FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader) +
         inh64.FileHeader.SizeOfOptionalHeader;
-    cb = inh64.FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER);
-    if (!WriteProcessMemory(hProcess, psects, &sects, cb, NULL)) {
+    ULONG cb = inh64.FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER);
+    if (!session.Write(psects, &sects, cb)) {
         DETOUR_TRACE(("WriteProcessMemory(ish@%p..%p) failed: %lu\n",
                       psects, psects + cb, GetLastError()));
         return FALSE;
@@ -615,7 +951,7 @@ static BOOL UpdateFrom32To64(HANDLE hProcess, HMODULE hModule, WORD machine,
     DETOUR_TRACE(("WriteProcessMemory(ish@%p..%p)\n", psects, psects + cb));
 
     // Record the updated headers.
-    if (!RecordExeRestore(hProcess, hModule, der)) {
+    if (!RecordExeRestore(session, hModule, der)) {
         return FALSE;
     }
 
@@ -624,19 +960,13 @@ static BOOL UpdateFrom32To64(HANDLE hProcess, HMODULE hModule, WORD machine,
         inh64.IMPORT_DIRECTORY.VirtualAddress = 0;
         inh64.IMPORT_DIRECTORY.Size = 0;
 
-        if (!WriteProcessMemory(hProcess, pnh, &inh64, sizeof(inh64), NULL)) {
+        if (!session.Write(pnh, &inh64, sizeof(inh64))) {
             DETOUR_TRACE(("WriteProcessMemory(inh@%p..%p) failed: %lu\n",
                           pnh, pnh + sizeof(inh64), GetLastError()));
             return FALSE;
         }
     }
 
-    DWORD dwOld = 0;
-    if (!VirtualProtectEx(hProcess, pbModule, inh64.OptionalHeader.SizeOfHeaders,
-                          dwProtect, &dwOld)) {
-        return FALSE;
-    }
-
     return TRUE;
 }
 #endif // DETOURS_64BIT
@@ -688,16 +1018,17 @@ BOOL WINAPI DetourUpdateProcessWithDll(_In_ HANDLE hProcess,
     DETOUR_TRACE(("DetourUpdateProcessWithDll(%p,dlls=%lu)\n", hProcess, nDlls));
 
     for (;;) {
-        IMAGE_NT_HEADERS32 inh;
+        CDetourImageView view;
 
-        if ((hLast = EnumerateModulesInProcess(hProcess, hLast, &inh, NULL)) == NULL) {
+        if ((hLast = EnumerateModulesInProcess(hProcess, hLast, view)) == NULL) {
             break;
         }
 
+        PIMAGE_NT_HEADERS pinh = view.NtHeader();
         DETOUR_TRACE(("%p  machine=%04x magic=%04x\n",
-                      hLast, inh.FileHeader.Machine, inh.OptionalHeader.Magic));
+                      hLast, pinh->FileHeader.Machine, pinh->OptionalHeader.Magic));
 
-        if ((inh.FileHeader.Characteristics & IMAGE_FILE_DLL) == 0) {
+        if ((pinh->FileHeader.Characteristics & IMAGE_FILE_DLL) == 0) {
             hModule = hLast;
             DETOUR_TRACE(("%p  Found EXE\n", hLast));
         }
@@ -759,15 +1090,20 @@ BOOL WINAPI DetourUpdateProcessWithDllEx(_In_ HANDLE hProcess,
 
     DETOUR_TRACE(("DetourUpdateProcessWithDllEx(%p,%p,dlls=%lu)\n", hProcess, hModule, nDlls));
 
-    IMAGE_NT_HEADERS32 inh;
+    // Every header, section and import read below is served from one remote
+    // session and every header write is staged in it, so the target sees one
+    // protection change and one write per dirty page range when it is flushed.
+    //
+    CDetourRemoteSession session(hProcess);
+    CDetourImageView view;
 
-    if (hModule == NULL || !LoadNtHeaderFromProcess(hProcess, hModule, &inh)) {
+    if (hModule == NULL || !view.AttachRemote(hModule, detour_read_session, &session)) {
         SetLastError(ERROR_INVALID_OPERATION);
         return FALSE;
     }
 
-    if (inh.OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC
-        && inh.FileHeader.Machine != 0) {
+    if (view.NtHeader()->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC
+        && view.NtHeader()->FileHeader.Machine != 0) {
 
         bIs32BitExe = TRUE;
     }
@@ -783,7 +1119,7 @@ BOOL WINAPI DetourUpdateProcessWithDllEx(_In_ HANDLE hProcess,
     //
     DETOUR_EXE_RESTORE der;
 
-    if (!RecordExeRestore(hProcess, hModule, der)) {
+    if (!RecordExeRestore(session, hModule, der)) {
         return FALSE;
     }
 
@@ -798,7 +1134,7 @@ BOOL WINAPI DetourUpdateProcessWithDllEx(_In_ HANDLE hProcess,
             return FALSE;
         }
 
-        if (!UpdateFrom32To64(hProcess, hModule,
+        if (!UpdateFrom32To64(session, hModule,
 #if defined(DETOURS_X64)
                               IMAGE_FILE_MACHINE_AMD64,
 #elif defined(DETOURS_IA64)
@@ -820,7 +1156,7 @@ BOOL WINAPI DetourUpdateProcessWithDllEx(_In_ HANDLE hProcess,
 #if defined(DETOURS_32BIT)
     if (bIs32BitProcess) {
         // 32-bit native or 32-bit managed process on any platform.
-        if (!UpdateImports32(hProcess, hModule, rlpDlls, nDlls)) {
+        if (!UpdateImports32(session, hModule, rlpDlls, nDlls)) {
             return FALSE;
         }
     }
@@ -842,7 +1178,7 @@ BOOL WINAPI DetourUpdateProcessWithDllEx(_In_ HANDLE hProcess,
     }
     else {
         // 64-bit native or 64-bit managed process on any platform.
-        if (!UpdateImports64(hProcess, hModule, rlpDlls, nDlls)) {
+        if (!UpdateImports64(session, hModule, rlpDlls, nDlls)) {
             return FALSE;
         }
     }
@@ -857,21 +1193,10 @@ BOOL WINAPI DetourUpdateProcessWithDllEx(_In_ HANDLE hProcess,
         CopyMemory(&clr, &der.clr, sizeof(clr));
         clr.Flags &= ~COMIMAGE_FLAGS_ILONLY;    // Clear the IL_ONLY flag.
 
-        DWORD dwProtect;
-        if (!DetourVirtualProtectSameExecuteEx(hProcess, der.pclr, sizeof(clr), PAGE_READWRITE, &dwProtect)) {
-            DETOUR_TRACE(("VirtualProtectEx(clr) write failed: %lu\n", GetLastError()));
-            return FALSE;
-        }
-
-        if (!WriteProcessMemory(hProcess, der.pclr, &clr, sizeof(clr), NULL)) {
+        if (!session.Write(der.pclr, &clr, sizeof(clr))) {
             DETOUR_TRACE(("WriteProcessMemory(clr) failed: %lu\n", GetLastError()));
             return FALSE;
         }
-
-        if (!VirtualProtectEx(hProcess, der.pclr, sizeof(clr), dwProtect, &dwProtect)) {
-            DETOUR_TRACE(("VirtualProtectEx(clr) restore failed: %lu\n", GetLastError()));
-            return FALSE;
-        }
         DETOUR_TRACE(("CLR: %p..%p\n", der.pclr, der.pclr + der.cbclr));
 
 #if DETOURS_64BIT
@@ -885,6 +1210,13 @@ BOOL WINAPI DetourUpdateProcessWithDllEx(_In_ HANDLE hProcess,
 #endif // DETOURS_64BIT
     }
 
+    /////////////////////////////////// Write the staged headers to the target.
+    //
+    if (!session.Flush()) {
+        DETOUR_TRACE(("Flush failed: %lu\n", GetLastError()));
+        return FALSE;
+    }
+
     //////////////////////////////// Save the undo data to the target process.
     //
     if (!DetourCopyPayloadToProcess(hProcess, DETOUR_EXE_RESTORE_GUID, &der, sizeof(der))) {
@@ -1023,24 +1355,73 @@ PVOID WINAPI DetourCopyPayloadToProcessEx(_In_ HANDLE hProcess,
                                           _In_ REFGUID rguid,
                                           _In_reads_bytes_(cbData) LPCVOID pvData,
                                           _In_ DWORD cbData)
+{
+    PVOID pvRemoteData = NULL;
+    if (!DetourCopyPayloadsToProcess(hProcess, 1, &rguid, &pvData, &cbData, &pvRemoteData)) {
+        return NULL;
+    }
+    return pvRemoteData;
+}
+
+// Orders directory entries by the bytes of their GUIDs.
+static int __cdecl CompareDirectoryEntries(const void *pvLeft, const void *pvRight)
+{
+    return memcmp(&((const DETOUR_PAYLOAD_DIRECTORY_ENTRY *)pvLeft)->guid,
+                  &((const DETOUR_PAYLOAD_DIRECTORY_ENTRY *)pvRight)->guid,
+                  sizeof(GUID));
+}
+
+_Success_(return != FALSE)
+BOOL WINAPI DetourCopyPayloadsToProcess(_In_ HANDLE hProcess,
+                                        _In_ DWORD cPayloads,
+                                        _In_reads_(cPayloads) const GUID *pGuids,
+                                        _In_reads_(cPayloads) LPCVOID *ppvData,
+                                        _In_reads_(cPayloads) const DWORD *pcbData,
+                                        _Out_writes_opt_(cPayloads) PVOID *ppvRemoteData)
 {
     if (hProcess == NULL) {
         SetLastError(ERROR_INVALID_HANDLE);
-        return NULL;
+        return FALSE;
+    }
+    if (cPayloads == 0 || pGuids == NULL || ppvData == NULL || pcbData == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
     }
 
-    DWORD cbTotal = (sizeof(IMAGE_DOS_HEADER) +
-                     sizeof(IMAGE_NT_HEADERS) +
-                     sizeof(IMAGE_SECTION_HEADER) +
-                     sizeof(DETOUR_SECTION_HEADER) +
-                     sizeof(DETOUR_SECTION_RECORD) +
-                     cbData);
+    // A directory only pays for itself when there is more than one payload.
+    BOOL fDirectory = (cPayloads > 1);
+    ULONGLONG cbSection = sizeof(DETOUR_SECTION_HEADER);
+    if (fDirectory) {
+        cbSection += sizeof(DETOUR_SECTION_RECORD) +
+            (ULONGLONG)cPayloads * sizeof(DETOUR_PAYLOAD_DIRECTORY_ENTRY);
+    }
+    for (DWORD n = 0; n < cPayloads; n++) {
+        cbSection += sizeof(DETOUR_SECTION_RECORD) + (ULONGLONG)pcbData[n];
+    }
+    ULONGLONG cbTotal64 = (sizeof(IMAGE_DOS_HEADER) +
+                           sizeof(IMAGE_NT_HEADERS) +
+                           sizeof(IMAGE_SECTION_HEADER) +
+                           cbSection);
+    if (cbTotal64 > MAXDWORD) {
+        SetLastError(ERROR_ARITHMETIC_OVERFLOW);
+        return FALSE;
+    }
+    DWORD cbTotal = (DWORD)cbTotal64;
+
+    // Build the whole block locally so that it is written with one call.
+    PBYTE pbLocal = new NOTHROW BYTE [cbTotal];
+    if (pbLocal == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    ZeroMemory(pbLocal, cbTotal);
 
     PBYTE pbBase = (PBYTE)VirtualAllocEx(hProcess, NULL, cbTotal,
                                          MEM_COMMIT, PAGE_READWRITE);
     if (pbBase == NULL) {
         DETOUR_TRACE(("VirtualAllocEx(%lu) failed: %lu\n", cbTotal, GetLastError()));
-        return NULL;
+        delete[] pbLocal;
+        return FALSE;
     }
 
     // As you can see in the following code,
@@ -1048,81 +1429,94 @@ PVOID WINAPI DetourCopyPayloadToProcessEx(_In_ HANDLE hProcess,
     // so DetourFreePayload can use "DetourGetContainingModule(Payload pointer)" to get the above "pbBase" pointer,
     // pbBase: the memory block allocated by VirtualAllocEx will be released in DetourFreePayload by VirtualFree.
 
-    PBYTE pbTarget = pbBase;
-    IMAGE_DOS_HEADER idh;
-    IMAGE_NT_HEADERS inh;
-    IMAGE_SECTION_HEADER ish;
-    DETOUR_SECTION_HEADER dsh;
-    DETOUR_SECTION_RECORD dsr;
-    SIZE_T cbWrote = 0;
-
-    ZeroMemory(&idh, sizeof(idh));
-    idh.e_magic = IMAGE_DOS_SIGNATURE;
-    idh.e_lfanew = sizeof(idh);
-    if (!WriteProcessMemory(hProcess, pbTarget, &idh, sizeof(idh), &cbWrote) ||
-        cbWrote != sizeof(idh)) {
-        DETOUR_TRACE(("WriteProcessMemory(idh) failed: %lu\n", GetLastError()));
-        return NULL;
-    }
-    pbTarget += sizeof(idh);
-
-    ZeroMemory(&inh, sizeof(inh));
-    inh.Signature = IMAGE_NT_SIGNATURE;
-    inh.FileHeader.SizeOfOptionalHeader = sizeof(inh.OptionalHeader);
-    inh.FileHeader.Characteristics = IMAGE_FILE_DLL;
-    inh.FileHeader.NumberOfSections = 1;
-    inh.OptionalHeader.Magic = IMAGE_NT_OPTIONAL_HDR_MAGIC;
-    if (!WriteProcessMemory(hProcess, pbTarget, &inh, sizeof(inh), &cbWrote) ||
-        cbWrote != sizeof(inh)) {
-        return NULL;
+    PBYTE pbTarget = pbLocal;
+
+    PIMAGE_DOS_HEADER pidh = (PIMAGE_DOS_HEADER)pbTarget;
+    pidh->e_magic = IMAGE_DOS_SIGNATURE;
+    pidh->e_lfanew = sizeof(*pidh);
+    pbTarget += sizeof(*pidh);
+
+    PIMAGE_NT_HEADERS pinh = (PIMAGE_NT_HEADERS)pbTarget;
+    pinh->Signature = IMAGE_NT_SIGNATURE;
+    pinh->FileHeader.SizeOfOptionalHeader = sizeof(pinh->OptionalHeader);
+    pinh->FileHeader.Characteristics = IMAGE_FILE_DLL;
+    pinh->FileHeader.NumberOfSections = 1;
+    pinh->OptionalHeader.Magic = IMAGE_NT_OPTIONAL_HDR_MAGIC;
+    pinh->OptionalHeader.SizeOfImage = cbTotal;
+    pbTarget += sizeof(*pinh);
+
+    PIMAGE_SECTION_HEADER pish = (PIMAGE_SECTION_HEADER)pbTarget;
+    memcpy(pish->Name, ".detour", sizeof(pish->Name));
+    pish->VirtualAddress = (DWORD)((pbTarget + sizeof(*pish)) - pbLocal);
+    pish->SizeOfRawData = (DWORD)cbSection;
+    pbTarget += sizeof(*pish);
+
+    PDETOUR_SECTION_HEADER pdsh = (PDETOUR_SECTION_HEADER)pbTarget;
+    pdsh->cbHeaderSize = sizeof(*pdsh);
+    pdsh->nSignature = DETOUR_SECTION_HEADER_SIGNATURE;
+    pdsh->nDataOffset = sizeof(DETOUR_SECTION_HEADER);
+    pdsh->cbDataSize = (DWORD)cbSection;
+    pbTarget += sizeof(*pdsh);
+
+    PDETOUR_PAYLOAD_DIRECTORY_ENTRY pEntries = NULL;
+    if (fDirectory) {
+        PDETOUR_SECTION_RECORD pdsr = (PDETOUR_SECTION_RECORD)pbTarget;
+        pdsr->cbBytes = sizeof(*pdsr) + cPayloads * sizeof(DETOUR_PAYLOAD_DIRECTORY_ENTRY);
+        pdsr->guid = DETOUR_PAYLOAD_DIRECTORY_GUID;
+        pEntries = (PDETOUR_PAYLOAD_DIRECTORY_ENTRY)(pdsr + 1);
+        pbTarget += pdsr->cbBytes;
+    }
+
+    for (DWORD n = 0; n < cPayloads; n++) {
+        PDETOUR_SECTION_RECORD pdsr = (PDETOUR_SECTION_RECORD)pbTarget;
+        pdsr->cbBytes = pcbData[n] + sizeof(DETOUR_SECTION_RECORD);
+        pdsr->nReserved = 0;
+        pdsr->guid = pGuids[n];
+        pbTarget += sizeof(*pdsr);
+
+        if (pcbData[n] != 0) {
+            CopyMemory(pbTarget, ppvData[n], pcbData[n]);
+        }
+        if (pEntries != NULL) {
+            pEntries[n].guid = pGuids[n];
+            pEntries[n].nOffset = (DWORD)(pbTarget - (PBYTE)pdsh);
+            pEntries[n].cbData = pcbData[n];
+        }
+        if (ppvRemoteData != NULL) {
+            ppvRemoteData[n] = pbBase + (pbTarget - pbLocal);
+        }
+        pbTarget += pcbData[n];
     }
-    pbTarget += sizeof(inh);
 
-    ZeroMemory(&ish, sizeof(ish));
-    memcpy(ish.Name, ".detour", sizeof(ish.Name));
-    ish.VirtualAddress = (DWORD)((pbTarget + sizeof(ish)) - pbBase);
-    ish.SizeOfRawData = (sizeof(DETOUR_SECTION_HEADER) +
-                         sizeof(DETOUR_SECTION_RECORD) +
-                         cbData);
-    if (!WriteProcessMemory(hProcess, pbTarget, &ish, sizeof(ish), &cbWrote) ||
-        cbWrote != sizeof(ish)) {
-        return NULL;
+    if (pEntries != NULL) {
+        qsort(pEntries, cPayloads, sizeof(pEntries[0]), CompareDirectoryEntries);
     }
-    pbTarget += sizeof(ish);
-
-    ZeroMemory(&dsh, sizeof(dsh));
-    dsh.cbHeaderSize = sizeof(dsh);
-    dsh.nSignature = DETOUR_SECTION_HEADER_SIGNATURE;
-    dsh.nDataOffset = sizeof(DETOUR_SECTION_HEADER);
-    dsh.cbDataSize = (sizeof(DETOUR_SECTION_HEADER) +
-                      sizeof(DETOUR_SECTION_RECORD) +
-                      cbData);
-    if (!WriteProcessMemory(hProcess, pbTarget, &dsh, sizeof(dsh), &cbWrote) ||
-        cbWrote != sizeof(dsh)) {
-        return NULL;
-    }
-    pbTarget += sizeof(dsh);
 
-    ZeroMemory(&dsr, sizeof(dsr));
-    dsr.cbBytes = cbData + sizeof(DETOUR_SECTION_RECORD);
-    dsr.nReserved = 0;
-    dsr.guid = rguid;
-    if (!WriteProcessMemory(hProcess, pbTarget, &dsr, sizeof(dsr), &cbWrote) ||
-        cbWrote != sizeof(dsr)) {
-        return NULL;
+    SIZE_T cbWrote = 0;
+    if (!WriteProcessMemory(hProcess, pbBase, pbLocal, cbTotal, &cbWrote) ||
+        cbWrote != cbTotal) {
+        DWORD dwError = (cbWrote != cbTotal && GetLastError() == NO_ERROR)
+            ? ERROR_PARTIAL_COPY : GetLastError();
+        DETOUR_TRACE(("WriteProcessMemory(payloads) failed: %lu\n", dwError));
+
+        // Nothing in the target refers to the block yet, so release it.
+        VirtualFreeEx(hProcess, pbBase, 0, MEM_RELEASE);
+        if (ppvRemoteData != NULL) {
+            for (DWORD n = 0; n < cPayloads; n++) {
+                ppvRemoteData[n] = NULL;
+            }
+        }
+        delete[] pbLocal;
+        SetLastError(dwError);
+        return FALSE;
     }
-    pbTarget += sizeof(dsr);
+    delete[] pbLocal;
 
-    if (!WriteProcessMemory(hProcess, pbTarget, pvData, cbData, &cbWrote) ||
-        cbWrote != cbData) {
-        return NULL;
-    }
+    DETOUR_TRACE(("Copied %lu payloads (%lu bytes) into target process at %p\n",
+                  cPayloads, cbTotal, pbBase));
 
-    DETOUR_TRACE(("Copied %lu byte payload into target process at %p\n",
-                  cbData, pbTarget));
-    
     SetLastError(NO_ERROR);
-    return pbTarget;
+    return TRUE;
 }
 
 static BOOL s_fSearchedForHelper = FALSE;
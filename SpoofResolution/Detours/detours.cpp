@@ -11,6 +11,7 @@
 //#define DETOUR_DEBUG 1
 #define DETOURS_INTERNAL
 #include "detours.h"
+#include <tlhelp32.h>
 
 #if DETOURS_VERSION != 0x4c0c1   // 0xMAJORcMINORcPATCH
 #error detours.h version mismatch
@@ -1179,7 +1180,7 @@ inline ULONG detour_is_code_filler(PBYTE pbCode)
 struct DETOUR_REGION
 {
     ULONG               dwSignature;
-    DETOUR_REGION *     pNext;  // Next region in list of regions.
+    ULONG               cFree;  // Number of trampolines on the free list.
     DETOUR_TRAMPOLINE * pFree;  // List of free trampolines in this region.
 };
 typedef DETOUR_REGION * PDETOUR_REGION;
@@ -1188,15 +1189,29 @@ const ULONG DETOUR_REGION_SIGNATURE = 'Rrtd';
 const ULONG DETOUR_REGION_SIZE = 0x10000;
 const ULONG DETOUR_TRAMPOLINES_PER_REGION = (DETOUR_REGION_SIZE
                                              / sizeof(DETOUR_TRAMPOLINE)) - 1;
-static PDETOUR_REGION s_pRegions = NULL;            // List of all regions.
+// The first two trampolines after the region header are never handed out.
+const ULONG DETOUR_FREE_TRAMPOLINES_PER_REGION = DETOUR_TRAMPOLINES_PER_REGION - 2;
+
+// All regions are kept in an array sorted by base address so that the
+// regions within the jump bounds of a target can be found with a binary
+// search rather than by walking every region.  The regions that still have
+// a free trampoline are also kept in a second sorted array, so that full
+// regions never have to be skipped over.  Both arrays share one capacity,
+// which means that a region can always join the free array without
+// allocating, even while threads are suspended.
+static PDETOUR_REGION * s_ppRegions = NULL;         // Regions sorted by address.
+static ULONG s_cRegions = 0;                        // Regions in s_ppRegions.
+static ULONG s_cRegionsMax = 0;                     // Capacity of both arrays.
+static PDETOUR_REGION * s_ppFreeRegions = NULL;     // Regions with cFree > 0.
+static ULONG s_cFreeRegions = 0;                    // Regions in s_ppFreeRegions.
 static PDETOUR_REGION s_pRegion = NULL;             // Default region.
 
 static DWORD detour_writable_trampoline_regions()
 {
     // Mark all of the regions as writable.
-    for (PDETOUR_REGION pRegion = s_pRegions; pRegion != NULL; pRegion = pRegion->pNext) {
+    for (ULONG i = 0; i < s_cRegions; i++) {
         DWORD dwOld;
-        if (!VirtualProtect(pRegion, DETOUR_REGION_SIZE, PAGE_EXECUTE_READWRITE, &dwOld)) {
+        if (!VirtualProtect(s_ppRegions[i], DETOUR_REGION_SIZE, PAGE_EXECUTE_READWRITE, &dwOld)) {
             return GetLastError();
         }
     }
@@ -1208,13 +1223,120 @@ static void detour_runnable_trampoline_regions()
     HANDLE hProcess = GetCurrentProcess();
 
     // Mark all of the regions as executable.
-    for (PDETOUR_REGION pRegion = s_pRegions; pRegion != NULL; pRegion = pRegion->pNext) {
+    for (ULONG i = 0; i < s_cRegions; i++) {
         DWORD dwOld;
-        VirtualProtect(pRegion, DETOUR_REGION_SIZE, PAGE_EXECUTE_READ, &dwOld);
-        FlushInstructionCache(hProcess, pRegion, DETOUR_REGION_SIZE);
+        VirtualProtect(s_ppRegions[i], DETOUR_REGION_SIZE, PAGE_EXECUTE_READ, &dwOld);
+        FlushInstructionCache(hProcess, s_ppRegions[i], DETOUR_REGION_SIZE);
     }
 }
 
+// Returns the index of the first region in ppRegions whose base is at or
+// above pbAddress.
+
+static ULONG detour_find_region_index(PDETOUR_REGION *ppRegions,
+                                      ULONG cRegions,
+                                      PBYTE pbAddress)
+{
+    ULONG nLo = 0;
+    ULONG nHi = cRegions;
+
+    while (nLo < nHi) {
+        ULONG nMid = nLo + (nHi - nLo) / 2;
+        if ((PBYTE)ppRegions[nMid] < pbAddress) {
+            nLo = nMid + 1;
+        }
+        else {
+            nHi = nMid;
+        }
+    }
+    return nLo;
+}
+
+static BOOL detour_insert_region(PDETOUR_REGION pRegion)
+{
+    if (s_cRegions == s_cRegionsMax) {
+        ULONG cRegionsMax = s_cRegionsMax != 0 ? s_cRegionsMax * 2 : 16;
+        PDETOUR_REGION *ppRegions = new NOTHROW PDETOUR_REGION [cRegionsMax];
+        if (ppRegions == NULL) {
+            return FALSE;
+        }
+        PDETOUR_REGION *ppFreeRegions = new NOTHROW PDETOUR_REGION [cRegionsMax];
+        if (ppFreeRegions == NULL) {
+            delete[] ppRegions;
+            return FALSE;
+        }
+        if (s_ppRegions != NULL) {
+            memcpy(ppRegions, s_ppRegions, s_cRegions * sizeof(PDETOUR_REGION));
+            memcpy(ppFreeRegions, s_ppFreeRegions, s_cFreeRegions * sizeof(PDETOUR_REGION));
+            delete[] s_ppRegions;
+            delete[] s_ppFreeRegions;
+        }
+        s_ppRegions = ppRegions;
+        s_ppFreeRegions = ppFreeRegions;
+        s_cRegionsMax = cRegionsMax;
+    }
+
+    ULONG nIndex = detour_find_region_index(s_ppRegions, s_cRegions, (PBYTE)pRegion);
+    memmove(&s_ppRegions[nIndex + 1], &s_ppRegions[nIndex],
+            (s_cRegions - nIndex) * sizeof(PDETOUR_REGION));
+    s_ppRegions[nIndex] = pRegion;
+    s_cRegions++;
+    return TRUE;
+}
+
+// Adds a region that just gained its first free trampoline to s_ppFreeRegions.
+
+static void detour_insert_free_region(PDETOUR_REGION pRegion)
+{
+    // Never allocates, the region is in s_ppRegions so there is room for it.
+    ULONG nIndex = detour_find_region_index(s_ppFreeRegions, s_cFreeRegions, (PBYTE)pRegion);
+    memmove(&s_ppFreeRegions[nIndex + 1], &s_ppFreeRegions[nIndex],
+            (s_cFreeRegions - nIndex) * sizeof(PDETOUR_REGION));
+    s_ppFreeRegions[nIndex] = pRegion;
+    s_cFreeRegions++;
+}
+
+// Removes a region that just handed out its last free trampoline from
+// s_ppFreeRegions.
+
+static void detour_remove_full_region(PDETOUR_REGION pRegion)
+{
+    ULONG nIndex = detour_find_region_index(s_ppFreeRegions, s_cFreeRegions, (PBYTE)pRegion);
+    if (nIndex < s_cFreeRegions && s_ppFreeRegions[nIndex] == pRegion) {
+        memmove(&s_ppFreeRegions[nIndex], &s_ppFreeRegions[nIndex + 1],
+                (s_cFreeRegions - nIndex - 1) * sizeof(PDETOUR_REGION));
+        s_cFreeRegions--;
+    }
+}
+
+// Returns a region with a free trampoline within pLo..pHi, or NULL.
+
+static PDETOUR_REGION detour_find_region_in_bounds(PDETOUR_TRAMPOLINE pLo,
+                                                   PDETOUR_TRAMPOLINE pHi)
+{
+    // A region's trampolines all lie in the DETOUR_REGION_SIZE bytes above
+    // its base, so start with the first region that could reach pLo.
+    PBYTE pbLo = (PBYTE)pLo;
+    pbLo = (pbLo > (PBYTE)DETOUR_REGION_SIZE) ? pbLo - DETOUR_REGION_SIZE : NULL;
+
+    // Regions are aligned and don't overlap, so only the first candidate can
+    // start below pLo and only a region starting within DETOUR_REGION_SIZE of
+    // pHi can reach past it.  Every other candidate has all of its
+    // trampolines in bounds, so at most two regions are ever looked at.
+    for (ULONG i = detour_find_region_index(s_ppFreeRegions, s_cFreeRegions, pbLo);
+         i < s_cFreeRegions && (PBYTE)s_ppFreeRegions[i] <= (PBYTE)pHi; i++) {
+
+        PDETOUR_REGION pRegion = s_ppFreeRegions[i];
+        if (pRegion->pFree >= pLo && pRegion->pFree <= pHi) {
+            return pRegion;
+        }
+        if (pRegion->pFree > pHi) {
+            break;
+        }
+    }
+    return NULL;
+}
+
 static PBYTE detour_alloc_round_down_to_region(PBYTE pbTry)
 {
     // WinXP64 returns free areas that aren't REGION aligned to 32-bit applications.
@@ -1236,9 +1358,10 @@ static PBYTE detour_alloc_round_up_to_region(PBYTE pbTry)
     return pbTry;
 }
 
-// Starting at pbLo, try to allocate a memory region, continue until pbHi.
+// Starting at pbLo, probe for and allocate a memory region, continue until pbHi.
+// Used when the free range map cannot be built.
 
-static PVOID detour_alloc_region_from_lo(PBYTE pbLo, PBYTE pbHi)
+static PVOID detour_probe_region_from_lo(PBYTE pbLo, PBYTE pbHi)
 {
     PBYTE pbTry = detour_alloc_round_up_to_region(pbLo);
 
@@ -1285,9 +1408,10 @@ static PVOID detour_alloc_region_from_lo(PBYTE pbLo, PBYTE pbHi)
     return NULL;
 }
 
-// Starting at pbHi, try to allocate a memory region, continue until pbLo.
+// Starting at pbHi, probe for and allocate a memory region, continue until pbLo.
+// Used when the free range map cannot be built.
 
-static PVOID detour_alloc_region_from_hi(PBYTE pbLo, PBYTE pbHi)
+static PVOID detour_probe_region_from_hi(PBYTE pbLo, PBYTE pbHi)
 {
     PBYTE pbTry = detour_alloc_round_down_to_region(pbHi - DETOUR_REGION_SIZE);
 
@@ -1336,9 +1460,273 @@ static PVOID detour_alloc_region_from_hi(PBYTE pbLo, PBYTE pbHi)
     return NULL;
 }
 
-static PVOID detour_alloc_trampoline_allocate_new(PBYTE pbTarget,
-                                                  PDETOUR_TRAMPOLINE pLo,
-                                                  PDETOUR_TRAMPOLINE pHi)
+//////////////////////////////////////////////////////// Free Range Map.
+//
+// Rather than probing the address space one VirtualQuery at a time for every
+// new region, we sweep it once and keep the free, region aligned ranges in an
+// array sorted by address.  Near target placement then becomes a binary
+// search.  The map is only a hint: other code in the process allocates and
+// frees memory behind our back, so a failed VirtualAlloc just removes the
+// candidate from the map, and a search that comes up empty rebuilds the map
+// and tries once more.
+//
+struct DETOUR_FREE_RANGE
+{
+    PBYTE   pbBase;     // First free byte, region aligned.
+    PBYTE   pbLimit;    // First byte past the range, region aligned.
+};
+
+static DETOUR_FREE_RANGE * s_pFreeRanges = NULL;    // Free ranges sorted by address.
+static ULONG s_cFreeRanges = 0;                     // Ranges in s_pFreeRanges.
+static ULONG s_cFreeRangesMax = 0;                  // Capacity of s_pFreeRanges.
+static BOOL s_fFreeRangesValid = FALSE;             // Map has been built.
+
+static BOOL detour_reserve_free_ranges(ULONG cFreeRanges)
+{
+    if (cFreeRanges <= s_cFreeRangesMax) {
+        return TRUE;
+    }
+
+    ULONG cFreeRangesMax = s_cFreeRangesMax != 0 ? s_cFreeRangesMax : 64;
+    while (cFreeRangesMax < cFreeRanges) {
+        cFreeRangesMax *= 2;
+    }
+
+    DETOUR_FREE_RANGE *pFreeRanges = new NOTHROW DETOUR_FREE_RANGE [cFreeRangesMax];
+    if (pFreeRanges == NULL) {
+        return FALSE;
+    }
+    if (s_pFreeRanges != NULL) {
+        memcpy(pFreeRanges, s_pFreeRanges, s_cFreeRanges * sizeof(DETOUR_FREE_RANGE));
+        delete[] s_pFreeRanges;
+    }
+    s_pFreeRanges = pFreeRanges;
+    s_cFreeRangesMax = cFreeRangesMax;
+    return TRUE;
+}
+
+static BOOL detour_build_free_ranges()
+{
+    s_cFreeRanges = 0;
+    s_fFreeRangesValid = FALSE;
+
+    PBYTE pbTry = (PBYTE)(ULONG_PTR)DETOUR_REGION_SIZE;
+    for (;;) {
+        MEMORY_BASIC_INFORMATION mbi;
+
+        ZeroMemory(&mbi, sizeof(mbi));
+        if (!VirtualQuery(pbTry, &mbi, sizeof(mbi))) {
+            break;
+        }
+
+        PBYTE pbNext = (PBYTE)mbi.BaseAddress + mbi.RegionSize;
+        if (mbi.State == MEM_FREE) {
+            PBYTE pbBase = detour_alloc_round_up_to_region((PBYTE)mbi.BaseAddress);
+            PBYTE pbLimit = detour_alloc_round_down_to_region(pbNext);
+
+            if (pbBase < pbLimit) {
+                if (!detour_reserve_free_ranges(s_cFreeRanges + 1)) {
+                    s_cFreeRanges = 0;
+                    return FALSE;
+                }
+                s_pFreeRanges[s_cFreeRanges].pbBase = pbBase;
+                s_pFreeRanges[s_cFreeRanges].pbLimit = pbLimit;
+                s_cFreeRanges++;
+            }
+        }
+        if (pbNext <= pbTry) {
+            break;
+        }
+        pbTry = pbNext;
+    }
+
+    DETOUR_TRACE((" Found %lu free ranges.\n", s_cFreeRanges));
+    s_fFreeRangesValid = TRUE;
+    return TRUE;
+}
+
+// Returns the index of the first free range that ends above pbAddress.
+
+static ULONG detour_find_free_range_index(PBYTE pbAddress)
+{
+    ULONG nLo = 0;
+    ULONG nHi = s_cFreeRanges;
+
+    while (nLo < nHi) {
+        ULONG nMid = nLo + (nHi - nLo) / 2;
+        if (s_pFreeRanges[nMid].pbLimit <= pbAddress) {
+            nLo = nMid + 1;
+        }
+        else {
+            nHi = nMid;
+        }
+    }
+    return nLo;
+}
+
+// Removes the region at pbRegion from free range nIndex.
+
+static void detour_remove_free_region(ULONG nIndex, PBYTE pbRegion)
+{
+    DETOUR_FREE_RANGE *pRange = &s_pFreeRanges[nIndex];
+    PBYTE pbEnd = pbRegion + DETOUR_REGION_SIZE;
+
+    if (pRange->pbBase == pbRegion && pRange->pbLimit == pbEnd) {
+        memmove(pRange, pRange + 1, (s_cFreeRanges - nIndex - 1) * sizeof(DETOUR_FREE_RANGE));
+        s_cFreeRanges--;
+    }
+    else if (pRange->pbBase == pbRegion) {
+        pRange->pbBase = pbEnd;
+    }
+    else if (pRange->pbLimit == pbEnd) {
+        pRange->pbLimit = pbRegion;
+    }
+    else if (detour_reserve_free_ranges(s_cFreeRanges + 1)) {
+        // Split the range around the region.
+        pRange = &s_pFreeRanges[nIndex];
+        memmove(pRange + 1, pRange, (s_cFreeRanges - nIndex) * sizeof(DETOUR_FREE_RANGE));
+        s_cFreeRanges++;
+        pRange[0].pbLimit = pbRegion;
+        pRange[1].pbBase = pbEnd;
+    }
+    else {
+        // Out of memory, drop the upper part of the range rather than risk
+        // handing out the same region twice.
+        pRange->pbLimit = pbRegion;
+    }
+}
+
+static BOOL detour_is_system_region(PBYTE pbTry)
+{
+    return pbTry >= s_pSystemRegionLowerBound && pbTry <= s_pSystemRegionUpperBound;
+}
+
+// Allocates the region at pbTry taken from free range nIndex.
+
+static PVOID detour_alloc_free_region(ULONG nIndex, PBYTE pbTry, PBOOL pfBlocked)
+{
+    PVOID pv = VirtualAlloc(pbTry,
+                            DETOUR_REGION_SIZE,
+                            MEM_COMMIT|MEM_RESERVE,
+                            PAGE_EXECUTE_READWRITE);
+    if (pv == NULL && GetLastError() == ERROR_DYNAMIC_CODE_BLOCKED) {
+        *pfBlocked = TRUE;
+        return NULL;
+    }
+
+    // Whether we got it or someone else did, it is no longer free.
+    DETOUR_TRACE(("  Try %p => %s\n", pbTry, pv != NULL ? "allocated" : "in use"));
+    detour_remove_free_region(nIndex, pbTry);
+    return pv;
+}
+
+// Starting at pbLo, try to allocate a memory region, continue until pbHi.
+
+static PVOID detour_alloc_region_from_lo(PBYTE pbLo, PBYTE pbHi)
+{
+    if (!s_fFreeRangesValid) {
+        return detour_probe_region_from_lo(pbLo, pbHi);
+    }
+
+    PBYTE pbTry = detour_alloc_round_up_to_region(pbLo);
+
+    DETOUR_TRACE((" Looking for free range in %p..%p from %p:\n", pbLo, pbHi, pbTry));
+
+    ULONG nIndex = detour_find_free_range_index(pbTry);
+    while (nIndex < s_cFreeRanges && pbTry < pbHi) {
+        DETOUR_FREE_RANGE *pRange = &s_pFreeRanges[nIndex];
+
+        if (pbTry < pRange->pbBase) {
+            pbTry = pRange->pbBase;
+            continue;
+        }
+        if (detour_is_system_region(pbTry)) {
+            // Skip region reserved for system DLLs, but preserve address space entropy.
+            pbTry += 0x08000000;
+            nIndex = detour_find_free_range_index(pbTry);
+            continue;
+        }
+        if (pbTry + DETOUR_REGION_SIZE > pRange->pbLimit) {
+            nIndex++;
+            continue;
+        }
+
+        BOOL fBlocked = FALSE;
+        PVOID pv = detour_alloc_free_region(nIndex, pbTry, &fBlocked);
+        if (pv != NULL || fBlocked) {
+            return pv;
+        }
+        pbTry += DETOUR_REGION_SIZE;
+        nIndex = detour_find_free_range_index(pbTry);
+    }
+    return NULL;
+}
+
+// Starting at pbHi, try to allocate a memory region, continue until pbLo.
+
+static PVOID detour_alloc_region_from_hi(PBYTE pbLo, PBYTE pbHi)
+{
+    if (!s_fFreeRangesValid) {
+        return detour_probe_region_from_hi(pbLo, pbHi);
+    }
+
+    PBYTE pbTry = detour_alloc_round_down_to_region(pbHi - DETOUR_REGION_SIZE);
+
+    DETOUR_TRACE((" Looking for free range in %p..%p from %p:\n", pbLo, pbHi, pbTry));
+
+    // Start with the last range that begins at or below pbTry.
+    ULONG nIndex = detour_find_free_range_index(pbTry);
+    if (nIndex == s_cFreeRanges || s_pFreeRanges[nIndex].pbBase > pbTry) {
+        if (nIndex == 0) {
+            return NULL;
+        }
+        nIndex--;
+    }
+
+    for (;;) {
+        if (pbTry <= pbLo) {
+            return NULL;
+        }
+
+        DETOUR_FREE_RANGE *pRange = &s_pFreeRanges[nIndex];
+
+        if (pbTry + DETOUR_REGION_SIZE > pRange->pbLimit) {
+            pbTry = pRange->pbLimit - DETOUR_REGION_SIZE;
+            continue;
+        }
+        if (pbTry < pRange->pbBase) {
+            if (nIndex == 0) {
+                return NULL;
+            }
+            nIndex--;
+            continue;
+        }
+        if (detour_is_system_region(pbTry)) {
+            // Skip region reserved for system DLLs, but preserve address space entropy.
+            pbTry -= 0x08000000;
+            continue;
+        }
+
+        BOOL fBlocked = FALSE;
+        PVOID pv = detour_alloc_free_region(nIndex, pbTry, &fBlocked);
+        if (pv != NULL || fBlocked) {
+            return pv;
+        }
+        pbTry -= DETOUR_REGION_SIZE;
+
+        // The range may have shrunk or been removed by the failed allocation.
+        if (nIndex >= s_cFreeRanges) {
+            if (s_cFreeRanges == 0) {
+                return NULL;
+            }
+            nIndex = s_cFreeRanges - 1;
+        }
+    }
+}
+
+static PVOID detour_alloc_region_near(PBYTE pbTarget,
+                                      PDETOUR_TRAMPOLINE pLo,
+                                      PDETOUR_TRAMPOLINE pHi)
 {
     PVOID pbTry = NULL;
 
@@ -1376,6 +1764,29 @@ static PVOID detour_alloc_trampoline_allocate_new(PBYTE pbTarget,
     return pbTry;
 }
 
+static PVOID detour_alloc_trampoline_allocate_new(PBYTE pbTarget,
+                                                  PDETOUR_TRAMPOLINE pLo,
+                                                  PDETOUR_TRAMPOLINE pHi)
+{
+    // Build the free range map on first use.  If it can't be built, the
+    // searches fall back to probing the address space directly.
+    BOOL fFresh = FALSE;
+    if (!s_fFreeRangesValid) {
+        fFresh = detour_build_free_ranges();
+    }
+
+    PVOID pbTry = detour_alloc_region_near(pbTarget, pLo, pHi);
+
+    // Memory may have been freed since the map was built, so rebuild it and
+    // try once more before giving up.
+    if (pbTry == NULL && s_fFreeRangesValid && !fFresh) {
+        detour_build_free_ranges();
+        pbTry = detour_alloc_region_near(pbTarget, pLo, pHi);
+    }
+
+    return pbTry;
+}
+
 PVOID WINAPI DetourAllocateRegionWithinJumpBounds(_In_ LPCVOID pbTarget,
                                                   _Out_ PDWORD pcbAllocatedSize)
 {
@@ -1413,8 +1824,8 @@ static PDETOUR_TRAMPOLINE detour_alloc_trampoline(PBYTE pbTarget)
     PDETOUR_TRAMPOLINE pTrampoline = NULL;
 
     // Insure that there is a default region.
-    if (s_pRegion == NULL && s_pRegions != NULL) {
-        s_pRegion = s_pRegions;
+    if (s_pRegion == NULL && s_cRegions != 0) {
+        s_pRegion = s_ppRegions[0];
     }
 
     // First check the default region for an valid free block.
@@ -1428,16 +1839,18 @@ static PDETOUR_TRAMPOLINE detour_alloc_trampoline(PBYTE pbTarget)
             return NULL;
         }
         s_pRegion->pFree = (PDETOUR_TRAMPOLINE)pTrampoline->pbRemain;
+        s_pRegion->cFree--;
+        if (s_pRegion->cFree == 0) {
+            detour_remove_full_region(s_pRegion);
+        }
         memset(pTrampoline, 0xcc, sizeof(*pTrampoline));
         return pTrampoline;
     }
 
-    // Then check the existing regions for a valid free block.
-    for (s_pRegion = s_pRegions; s_pRegion != NULL; s_pRegion = s_pRegion->pNext) {
-        if (s_pRegion != NULL && s_pRegion->pFree != NULL &&
-            s_pRegion->pFree >= pLo && s_pRegion->pFree <= pHi) {
-            goto found_region;
-        }
+    // Then check the existing regions within the bounds for a valid free block.
+    s_pRegion = detour_find_region_in_bounds(pLo, pHi);
+    if (s_pRegion != NULL) {
+        goto found_region;
     }
 
     // We need to allocate a new region.
@@ -1449,11 +1862,14 @@ static PDETOUR_TRAMPOLINE detour_alloc_trampoline(PBYTE pbTarget)
     PVOID pbNewlyAllocated =
         detour_alloc_trampoline_allocate_new(pbTarget, pLo, pHi);
     if (pbNewlyAllocated != NULL) {
+        if (!detour_insert_region((DETOUR_REGION*)pbNewlyAllocated)) {
+            VirtualFree(pbNewlyAllocated, 0, MEM_RELEASE);
+            DETOUR_TRACE(("Couldn't grow the region index!\n"));
+            return NULL;
+        }
         s_pRegion = (DETOUR_REGION*)pbNewlyAllocated;
         s_pRegion->dwSignature = DETOUR_REGION_SIGNATURE;
         s_pRegion->pFree = NULL;
-        s_pRegion->pNext = s_pRegions;
-        s_pRegions = s_pRegion;
         DETOUR_TRACE(("  Allocated region %p..%p\n\n",
                       s_pRegion, ((PBYTE)s_pRegion) + DETOUR_REGION_SIZE - 1));
 
@@ -1465,6 +1881,8 @@ static PDETOUR_TRAMPOLINE detour_alloc_trampoline(PBYTE pbTarget)
             pFree = (PBYTE)&pTrampoline[i];
         }
         s_pRegion->pFree = (PDETOUR_TRAMPOLINE)pFree;
+        s_pRegion->cFree = DETOUR_FREE_TRAMPOLINES_PER_REGION;
+        detour_insert_free_region(s_pRegion);
         goto found_region;
     }
 
@@ -1480,6 +1898,9 @@ static void detour_free_trampoline(PDETOUR_TRAMPOLINE pTrampoline)
     memset(pTrampoline, 0, sizeof(*pTrampoline));
     pTrampoline->pbRemain = (PBYTE)pRegion->pFree;
     pRegion->pFree = pTrampoline;
+    if (pRegion->cFree++ == 0) {
+        detour_insert_free_region(pRegion);
+    }
 }
 
 static BOOL detour_is_region_empty(PDETOUR_REGION pRegion)
@@ -1489,40 +1910,36 @@ static BOOL detour_is_region_empty(PDETOUR_REGION pRegion)
         return FALSE;
     }
 
-    PBYTE pbRegionBeg = (PBYTE)pRegion;
-    PBYTE pbRegionLim  = pbRegionBeg + DETOUR_REGION_SIZE;
-
-    // Stop if any of the trampolines aren't free.
-    PDETOUR_TRAMPOLINE pTrampoline = ((PDETOUR_TRAMPOLINE)pRegion) + 1;
-    for (int i = 0; i < DETOUR_TRAMPOLINES_PER_REGION; i++) {
-        if (pTrampoline[i].pbRemain != NULL &&
-            (pTrampoline[i].pbRemain < pbRegionBeg ||
-             pTrampoline[i].pbRemain >= pbRegionLim)) {
-            return FALSE;
-        }
-    }
-
-    // OK, the region is empty.
-    return TRUE;
+    // The region is empty if every trampoline is back on the free list.
+    return pRegion->cFree == DETOUR_FREE_TRAMPOLINES_PER_REGION;
 }
 
 static void detour_free_unused_trampoline_regions()
 {
-    PDETOUR_REGION *ppRegionBase = &s_pRegions;
-    PDETOUR_REGION pRegion = s_pRegions;
+    ULONG nKeep = 0;
 
-    while (pRegion != NULL) {
-        if (detour_is_region_empty(pRegion)) {
-            *ppRegionBase = pRegion->pNext;
+    // Drop the empty regions from the free array while their headers can
+    // still be read.
+    for (ULONG i = 0; i < s_cFreeRegions; i++) {
+        PDETOUR_REGION pRegion = s_ppFreeRegions[i];
+        if (!detour_is_region_empty(pRegion)) {
+            s_ppFreeRegions[nKeep++] = pRegion;
+        }
+    }
+    s_cFreeRegions = nKeep;
 
+    nKeep = 0;
+    for (ULONG i = 0; i < s_cRegions; i++) {
+        PDETOUR_REGION pRegion = s_ppRegions[i];
+        if (detour_is_region_empty(pRegion)) {
             VirtualFree(pRegion, 0, MEM_RELEASE);
             s_pRegion = NULL;
         }
         else {
-            ppRegionBase = &pRegion->pNext;
+            s_ppRegions[nKeep++] = pRegion;
         }
-        pRegion = *ppRegionBase;
     }
+    s_cRegions = nKeep;
 }
 
 ///////////////////////////////////////////////////////// Transaction Structs.
@@ -1531,6 +1948,7 @@ struct DetourThread
 {
     DetourThread *      pNext;
     HANDLE              hThread;
+    BOOL                fFromSnapshot;  // Lives in s_pPendingThreadBlock, owns hThread.
 };
 
 struct DetourOperation
@@ -1540,17 +1958,140 @@ struct DetourOperation
     PBYTE *             ppbPointer;
     PBYTE               pbTarget;
     PDETOUR_TRAMPOLINE  pTrampoline;
-    ULONG               dwPerm;
+    BOOL                fHotPatch;  // Entry is a 2-byte jmp into the padding.
+};
+
+// A target page made writable by the pending transaction.
+struct DetourPage
+{
+    PBYTE               pbPage;
+    DWORD               dwPerm;     // Protection to restore at commit or abort.
 };
 
 static BOOL                 s_fIgnoreTooSmall       = FALSE;
 static BOOL                 s_fRetainRegions        = FALSE;
+static BOOL                 s_fHotPatch             = FALSE;
 
 static LONG                 s_nPendingThreadId      = 0; // Thread owning pending transaction.
 static LONG                 s_nPendingError         = NO_ERROR;
 static PVOID *              s_ppPendingError        = NULL;
 static DetourThread *       s_pPendingThreads       = NULL;
 static DetourOperation *    s_pPendingOperations    = NULL;
+static DetourThread *       s_pPendingThreadBlock   = NULL; // From DetourUpdateAllThreads.
+static LARGE_INTEGER        s_liSuspendStart        = {};   // When the first thread was suspended.
+static ULONGLONG            s_nLastSuspendMicroseconds = 0;
+static ULONG                s_cLastSuspendThreads   = 0;
+static DetourPage *         s_pPendingPages         = NULL; // Sorted by address.
+static ULONG                s_cPendingPages         = 0;
+static ULONG                s_cPendingPagesMax      = 0;
+static ULONG_PTR            s_cbPage                = 0;
+
+//////////////////////////////////////////////////////////// Target Pages.
+//
+// Many targets often share a page, so rather than changing the protection
+// once per operation, each page is made writable the first time a pending
+// operation touches it and restored once when the transaction ends.
+//
+static ULONG detour_find_pending_page_index(PBYTE pbPage)
+{
+    ULONG nLo = 0;
+    ULONG nHi = s_cPendingPages;
+
+    while (nLo < nHi) {
+        ULONG nMid = nLo + (nHi - nLo) / 2;
+        if (s_pPendingPages[nMid].pbPage < pbPage) {
+            nLo = nMid + 1;
+        }
+        else {
+            nHi = nMid;
+        }
+    }
+    return nLo;
+}
+
+static LONG detour_writable_target_pages(PBYTE pbTarget, ULONG cbTarget)
+{
+    if (s_cbPage == 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        s_cbPage = si.dwPageSize;
+    }
+
+    PBYTE pbPage = (PBYTE)((ULONG_PTR)pbTarget & ~(s_cbPage - 1));
+    for (; pbPage < pbTarget + cbTarget; pbPage += s_cbPage) {
+        ULONG nIndex = detour_find_pending_page_index(pbPage);
+        if (nIndex < s_cPendingPages && s_pPendingPages[nIndex].pbPage == pbPage) {
+            continue;
+        }
+
+        if (s_cPendingPages == s_cPendingPagesMax) {
+            ULONG cPagesMax = s_cPendingPagesMax != 0 ? s_cPendingPagesMax * 2 : 16;
+            DetourPage *pPages = new NOTHROW DetourPage [cPagesMax];
+            if (pPages == NULL) {
+                return ERROR_NOT_ENOUGH_MEMORY;
+            }
+            if (s_pPendingPages != NULL) {
+                memcpy(pPages, s_pPendingPages, s_cPendingPages * sizeof(DetourPage));
+                delete[] s_pPendingPages;
+            }
+            s_pPendingPages = pPages;
+            s_cPendingPagesMax = cPagesMax;
+        }
+
+        DWORD dwOld = 0;
+        if (!VirtualProtect(pbPage, s_cbPage, PAGE_EXECUTE_READWRITE, &dwOld)) {
+            return GetLastError();
+        }
+
+        memmove(&s_pPendingPages[nIndex + 1], &s_pPendingPages[nIndex],
+                (s_cPendingPages - nIndex) * sizeof(DetourPage));
+        s_pPendingPages[nIndex].pbPage = pbPage;
+        s_pPendingPages[nIndex].dwPerm = dwOld;
+        s_cPendingPages++;
+    }
+    return NO_ERROR;
+}
+
+static void detour_restore_target_pages(BOOL fFlush)
+{
+    HANDLE hProcess = GetCurrentProcess();
+
+    for (ULONG i = 0; i < s_cPendingPages;) {
+        // Find the run of adjacent pages starting here.
+        PBYTE pbRun = s_pPendingPages[i].pbPage;
+        PBYTE pbRunEnd = pbRun + s_cbPage;
+        ULONG nRunEnd = i + 1;
+        for (; nRunEnd < s_cPendingPages && s_pPendingPages[nRunEnd].pbPage == pbRunEnd; nRunEnd++) {
+            pbRunEnd += s_cbPage;
+        }
+
+        // Restore each part of the run that had the same protection with a
+        // single call.  The part may span allocations, which VirtualProtect
+        // refuses, so fall back to one call per page if it fails.
+        // We don't care if these fail, because the code is still accessible.
+        while (i < nRunEnd) {
+            ULONG nPartEnd = i + 1;
+            while (nPartEnd < nRunEnd && s_pPendingPages[nPartEnd].dwPerm == s_pPendingPages[i].dwPerm) {
+                nPartEnd++;
+            }
+
+            DWORD dwOld;
+            if (!VirtualProtect(s_pPendingPages[i].pbPage, (nPartEnd - i) * s_cbPage,
+                                s_pPendingPages[i].dwPerm, &dwOld) && nPartEnd - i > 1) {
+                for (ULONG n = i; n < nPartEnd; n++) {
+                    VirtualProtect(s_pPendingPages[n].pbPage, s_cbPage, s_pPendingPages[n].dwPerm, &dwOld);
+                }
+            }
+            i = nPartEnd;
+        }
+
+        // Flush the whole run with a single call.
+        if (fFlush) {
+            FlushInstructionCache(hProcess, pbRun, pbRunEnd - pbRun);
+        }
+    }
+    s_cPendingPages = 0;
+}
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -1576,6 +2117,13 @@ BOOL WINAPI DetourSetRetainRegions(_In_ BOOL fRetain)
     return fPrevious;
 }
 
+BOOL WINAPI DetourSetHotPatch(_In_ BOOL fHotPatch)
+{
+    BOOL fPrevious = s_fHotPatch;
+    s_fHotPatch = fHotPatch;
+    return fPrevious;
+}
+
 PVOID WINAPI DetourSetSystemRegionLowerBound(_In_ PVOID pSystemRegionLowerBound)
 {
     PVOID pPrevious = s_pSystemRegionLowerBound;
@@ -1583,11 +2131,62 @@ PVOID WINAPI DetourSetSystemRegionLowerBound(_In_ PVOID pSystemRegionLowerBound)
     return pPrevious;
 }
 
-PVOID WINAPI DetourSetSystemRegionUpperBound(_In_ PVOID pSystemRegionUpperBound)
-{
-    PVOID pPrevious = s_pSystemRegionUpperBound;
-    s_pSystemRegionUpperBound = pSystemRegionUpperBound;
-    return pPrevious;
+PVOID WINAPI DetourSetSystemRegionUpperBound(_In_ PVOID pSystemRegionUpperBound)
+{
+    PVOID pPrevious = s_pSystemRegionUpperBound;
+    s_pSystemRegionUpperBound = pSystemRegionUpperBound;
+    return pPrevious;
+}
+
+static void detour_note_thread_suspended()
+{
+    if (s_pPendingThreads == NULL) {
+        QueryPerformanceCounter(&s_liSuspendStart);
+    }
+}
+
+static void detour_resume_pending_threads()
+{
+    ULONG cThreads = 0;
+
+    // Resume any suspended threads.
+    for (DetourThread *t = s_pPendingThreads; t != NULL; t = t->pNext) {
+        // There is nothing we can do if this fails.
+        ResumeThread(t->hThread);
+        cThreads++;
+    }
+
+    // Record how long the threads were stopped for.
+    if (cThreads != 0) {
+        LARGE_INTEGER liNow;
+        LARGE_INTEGER liFrequency;
+        QueryPerformanceCounter(&liNow);
+        QueryPerformanceFrequency(&liFrequency);
+        s_nLastSuspendMicroseconds = (ULONGLONG)(liNow.QuadPart - s_liSuspendStart.QuadPart)
+            * 1000000 / (ULONGLONG)liFrequency.QuadPart;
+    }
+    else {
+        s_nLastSuspendMicroseconds = 0;
+    }
+    s_cLastSuspendThreads = cThreads;
+
+    // Only free the bookkeeping once every thread is running again.
+    for (DetourThread *t = s_pPendingThreads; t != NULL;) {
+        DetourThread *n = t->pNext;
+        if (t->fFromSnapshot) {
+            CloseHandle(t->hThread);
+        }
+        else {
+            delete t;
+        }
+        t = n;
+    }
+    s_pPendingThreads = NULL;
+
+    if (s_pPendingThreadBlock != NULL) {
+        delete[] s_pPendingThreadBlock;
+        s_pPendingThreadBlock = NULL;
+    }
 }
 
 LONG WINAPI DetourTransactionBegin()
@@ -1607,6 +2206,7 @@ _Benign_race_end_
     s_pPendingOperations = NULL;
     s_pPendingThreads = NULL;
     s_ppPendingError = NULL;
+    s_cPendingPages = 0;
 
     // Make sure the trampoline pages are writable.
     s_nPendingError = detour_writable_trampoline_regions();
@@ -1621,12 +2221,13 @@ LONG WINAPI DetourTransactionAbort()
     }
 
     // Restore all of the page permissions.
-    for (DetourOperation *o = s_pPendingOperations; o != NULL;) {
-        // We don't care if this fails, because the code is still accessible.
-        DWORD dwOld;
-        VirtualProtect(o->pbTarget, o->pTrampoline->cbRestore,
-                       o->dwPerm, &dwOld);
+    detour_restore_target_pages(FALSE);
 
+    // Resume the threads before anything is freed, so that no thread can be
+    // suspended while holding the heap lock we would need.
+    detour_resume_pending_threads();
+
+    for (DetourOperation *o = s_pPendingOperations; o != NULL;) {
         if (!o->fIsRemove) {
             if (o->pTrampoline) {
                 detour_free_trampoline(o->pTrampoline);
@@ -1643,16 +2244,6 @@ LONG WINAPI DetourTransactionAbort()
     // Make sure the trampoline pages are no longer writable.
     detour_runnable_trampoline_regions();
 
-    // Resume any suspended threads.
-    for (DetourThread *t = s_pPendingThreads; t != NULL;) {
-        // There is nothing we can do if this fails.
-        ResumeThread(t->hThread);
-
-        DetourThread *n = t->pNext;
-        delete t;
-        t = n;
-    }
-    s_pPendingThreads = NULL;
     s_nPendingThreadId = 0;
 
     return NO_ERROR;
@@ -1663,11 +2254,32 @@ LONG WINAPI DetourTransactionCommit()
     return DetourTransactionCommitEx(NULL);
 }
 
+// Finds where the nAlign'th moved instruction ends in the target.  obTarget
+// only has room for offsets up to 7, so on X86 and X64, where the moved code
+// is often longer, the end is found by decoding the saved target code again.
+static LONG detour_align_target_end(PDETOUR_TRAMPOLINE pTrampoline, LONG nAlign)
+{
+#if defined(DETOURS_X86) || defined(DETOURS_X64)
+    PBYTE pbSrc = pTrampoline->rbRestore;
+    for (LONG n = 0; n <= nAlign; n++) {
+        pbSrc = (PBYTE)DetourCopyInstruction(NULL, NULL, pbSrc, NULL, NULL);
+    }
+    return (LONG)(pbSrc - pTrampoline->rbRestore);
+#else
+    return pTrampoline->rAlign[nAlign].obTarget;
+#endif
+}
+
+// Unused rAlign entries are zero, and no moved instruction ends at offset 0,
+// so offset 0 maps to offset 0 and the unused entries are skipped.
 static BYTE detour_align_from_trampoline(PDETOUR_TRAMPOLINE pTrampoline, BYTE obTrampoline)
 {
+    if (obTrampoline == 0) {
+        return 0;
+    }
     for (LONG n = 0; n < ARRAYSIZE(pTrampoline->rAlign); n++) {
         if (pTrampoline->rAlign[n].obTrampoline == obTrampoline) {
-            return pTrampoline->rAlign[n].obTarget;
+            return (BYTE)detour_align_target_end(pTrampoline, n);
         }
     }
     return 0;
@@ -1675,8 +2287,12 @@ static BYTE detour_align_from_trampoline(PDETOUR_TRAMPOLINE pTrampoline, BYTE ob
 
 static LONG detour_align_from_target(PDETOUR_TRAMPOLINE pTrampoline, LONG obTarget)
 {
+    if (obTarget == 0) {
+        return 0;
+    }
     for (LONG n = 0; n < ARRAYSIZE(pTrampoline->rAlign); n++) {
-        if (pTrampoline->rAlign[n].obTarget == obTarget) {
+        if (pTrampoline->rAlign[n].obTrampoline != 0 &&
+            detour_align_target_end(pTrampoline, n) == obTarget) {
             return pTrampoline->rAlign[n].obTrampoline;
         }
     }
@@ -1708,6 +2324,12 @@ LONG WINAPI DetourTransactionCommitEx(_Out_opt_ PVOID **pppFailedPointer)
     // Insert or remove each of the detours.
     for (o = s_pPendingOperations; o != NULL; o = o->pNext) {
         if (o->fIsRemove) {
+#ifdef DETOURS_X86
+            if (o->fHotPatch) {
+                detour_hot_patch_detach(o->pbTarget, o->pTrampoline->rbRestore);
+            }
+            else
+#endif // DETOURS_X86
             CopyMemory(o->pbTarget,
                        o->pTrampoline->rbRestore,
                        o->pTrampoline->cbRestore);
@@ -1762,10 +2384,16 @@ LONG WINAPI DetourTransactionCommitEx(_Out_opt_ PVOID **pppFailedPointer)
 #endif // DETOURS_X64
 
 #ifdef DETOURS_X86
-            PBYTE pbCode = detour_gen_jmp_immediate(o->pbTarget, o->pTrampoline->pbDetour);
-            pbCode = detour_gen_brk(pbCode, o->pTrampoline->pbRemain);
-            *o->ppbPointer = o->pTrampoline->rbCode;
-            UNREFERENCED_PARAMETER(pbCode);
+            if (o->fHotPatch) {
+                detour_hot_patch_attach(o->pbTarget, o->pTrampoline->pbDetour);
+                *o->ppbPointer = o->pTrampoline->rbCode;
+            }
+            else {
+                PBYTE pbCode = detour_gen_jmp_immediate(o->pbTarget, o->pTrampoline->pbDetour);
+                pbCode = detour_gen_brk(pbCode, o->pTrampoline->pbRemain);
+                *o->ppbPointer = o->pTrampoline->rbCode;
+                UNREFERENCED_PARAMETER(pbCode);
+            }
 #endif // DETOURS_X86
 
 #ifdef DETOURS_ARM
@@ -1869,9 +2497,12 @@ typedef ULONG_PTR DETOURS_EIP_TYPE;
         if (GetThreadContext(t->hThread, &cxt)) {
             for (o = s_pPendingOperations; o != NULL; o = o->pNext) {
                 if (o->fIsRemove) {
-                    if (cxt.DETOURS_EIP >= (DETOURS_EIP_TYPE)(ULONG_PTR)o->pTrampoline &&
-                        cxt.DETOURS_EIP < (DETOURS_EIP_TYPE)((ULONG_PTR)o->pTrampoline
-                                                             + sizeof(o->pTrampoline))
+                    // A thread anywhere in the moved code, or about to jump
+                    // back to the rest of the target, goes back to the same
+                    // instruction in the target before the trampoline is freed.
+                    if (cxt.DETOURS_EIP >= (DETOURS_EIP_TYPE)(ULONG_PTR)o->pTrampoline->rbCode &&
+                        cxt.DETOURS_EIP <= (DETOURS_EIP_TYPE)((ULONG_PTR)o->pTrampoline->rbCode
+                                                              + o->pTrampoline->cbCode)
                        ) {
 
                         cxt.DETOURS_EIP = (DETOURS_EIP_TYPE)
@@ -1879,10 +2510,24 @@ typedef ULONG_PTR DETOURS_EIP_TYPE;
                              + detour_align_from_trampoline(o->pTrampoline,
                                                             (BYTE)(cxt.DETOURS_EIP
                                                                    - (DETOURS_EIP_TYPE)(ULONG_PTR)
-                                                                   o->pTrampoline)));
+                                                                   o->pTrampoline->rbCode)));
+
+                        SetThreadContext(t->hThread, &cxt);
+                    }
+#ifdef DETOURS_X86
+                    // A thread that took the "jmp $-5" must not run the
+                    // restored padding, which may be int 3s.
+                    if (o->fHotPatch &&
+                        cxt.DETOURS_EIP >= (DETOURS_EIP_TYPE)(ULONG_PTR)(o->pbTarget
+                                                                         - DETOUR_HOT_PATCH_PADDING) &&
+                        cxt.DETOURS_EIP < (DETOURS_EIP_TYPE)(ULONG_PTR)o->pbTarget
+                       ) {
+
+                        cxt.DETOURS_EIP = (DETOURS_EIP_TYPE)(ULONG_PTR)o->pbTarget;
 
                         SetThreadContext(t->hThread, &cxt);
                     }
+#endif // DETOURS_X86
                 }
                 else {
                     if (cxt.DETOURS_EIP >= (DETOURS_EIP_TYPE)(ULONG_PTR)o->pbTarget &&
@@ -1891,7 +2536,7 @@ typedef ULONG_PTR DETOURS_EIP_TYPE;
                        ) {
 
                         cxt.DETOURS_EIP = (DETOURS_EIP_TYPE)
-                            ((ULONG_PTR)o->pTrampoline
+                            ((ULONG_PTR)o->pTrampoline->rbCode
                              + detour_align_from_target(o->pTrampoline,
                                                         (BYTE)(cxt.DETOURS_EIP
                                                                - (DETOURS_EIP_TYPE)(ULONG_PTR)
@@ -1906,13 +2551,15 @@ typedef ULONG_PTR DETOURS_EIP_TYPE;
     }
 
     // Restore all of the page permissions and flush the icache.
-    HANDLE hProcess = GetCurrentProcess();
-    for (o = s_pPendingOperations; o != NULL;) {
-        // We don't care if this fails, because the code is still accessible.
-        DWORD dwOld;
-        VirtualProtect(o->pbTarget, o->pTrampoline->cbRestore, o->dwPerm, &dwOld);
-        FlushInstructionCache(hProcess, o->pbTarget, o->pTrampoline->cbRestore);
+    detour_restore_target_pages(TRUE);
+
+    // Resume the threads before anything is freed, so that no thread can be
+    // suspended while holding the heap lock we would need.  Threads were
+    // moved out of removed trampolines above and the targets no longer jump
+    // to them, so they can be freed while the threads run.
+    detour_resume_pending_threads();
 
+    for (o = s_pPendingOperations; o != NULL;) {
         if (o->fIsRemove && o->pTrampoline) {
             detour_free_trampoline(o->pTrampoline);
             o->pTrampoline = NULL;
@@ -1933,16 +2580,6 @@ typedef ULONG_PTR DETOURS_EIP_TYPE;
     // Make sure the trampoline pages are no longer writable.
     detour_runnable_trampoline_regions();
 
-    // Resume any suspended threads.
-    for (t = s_pPendingThreads; t != NULL;) {
-        // There is nothing we can do if this fails.
-        ResumeThread(t->hThread);
-
-        DetourThread *n = t->pNext;
-        delete t;
-        t = n;
-    }
-    s_pPendingThreads = NULL;
     s_nPendingThreadId = 0;
 
     if (pppFailedPointer != NULL) {
@@ -1980,6 +2617,7 @@ LONG WINAPI DetourUpdateThread(_In_ HANDLE hThread)
         return error;
     }
 
+    detour_note_thread_suspended();
     if (SuspendThread(hThread) == (DWORD)-1) {
         error = GetLastError();
         DETOUR_BREAK();
@@ -1987,12 +2625,347 @@ LONG WINAPI DetourUpdateThread(_In_ HANDLE hThread)
     }
 
     t->hThread = hThread;
+    t->fFromSnapshot = FALSE;
     t->pNext = s_pPendingThreads;
     s_pPendingThreads = t;
 
     return NO_ERROR;
 }
 
+LONG WINAPI DetourUpdateAllThreads()
+{
+    LONG error = NO_ERROR;
+
+    if (s_nPendingThreadId != (LONG)GetCurrentThreadId()) {
+        return ERROR_INVALID_OPERATION;
+    }
+
+    // If any of the pending operations failed, then we don't need to do this.
+    if (s_nPendingError != NO_ERROR) {
+        return s_nPendingError;
+    }
+
+    // Only one snapshot per transaction.
+    if (s_pPendingThreadBlock != NULL) {
+        return ERROR_INVALID_OPERATION;
+    }
+
+    // A transaction made only of hot-patch attaches, and of hot-patch detaches
+    // whose padding can be put back in a single store, changes each target
+    // with atomic stores, so there's nothing for other threads to trip on.
+    BOOL fAllHotPatch = (s_pPendingOperations != NULL);
+    for (DetourOperation *o = s_pPendingOperations; o != NULL; o = o->pNext) {
+        if (!o->fHotPatch ||
+            (o->fIsRemove &&
+             !detour_hot_patch_restores_running(o->pbTarget, o->pTrampoline->rbRestore))) {
+            fAllHotPatch = FALSE;
+            break;
+        }
+    }
+    if (fAllHotPatch) {
+        return NO_ERROR;
+    }
+
+    HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    if (hSnapshot == INVALID_HANDLE_VALUE) {
+        error = GetLastError();
+      fail:
+        s_nPendingError = error;
+        s_ppPendingError = NULL;
+        DETOUR_BREAK();
+        return error;
+    }
+
+    DWORD dwProcessId = GetCurrentProcessId();
+    DWORD dwThreadId = GetCurrentThreadId();
+
+    // Count the other threads of this process first, so that all of the
+    // bookkeeping is allocated before any thread is suspended.  A suspended
+    // thread may be holding the heap lock.
+    ULONG cThreads = 0;
+    THREADENTRY32 te;
+    te.dwSize = sizeof(te);
+    for (BOOL fMore = Thread32First(hSnapshot, &te); fMore; fMore = Thread32Next(hSnapshot, &te)) {
+        if (te.th32OwnerProcessID == dwProcessId && te.th32ThreadID != dwThreadId) {
+            cThreads++;
+        }
+    }
+
+    if (cThreads == 0) {
+        CloseHandle(hSnapshot);
+        return NO_ERROR;
+    }
+
+    s_pPendingThreadBlock = new NOTHROW DetourThread [cThreads];
+    if (s_pPendingThreadBlock == NULL) {
+        CloseHandle(hSnapshot);
+        error = ERROR_NOT_ENOUGH_MEMORY;
+        goto fail;
+    }
+
+    ULONG nThread = 0;
+    te.dwSize = sizeof(te);
+    for (BOOL fMore = Thread32First(hSnapshot, &te);
+         fMore && nThread < cThreads; fMore = Thread32Next(hSnapshot, &te)) {
+
+        if (te.th32OwnerProcessID != dwProcessId || te.th32ThreadID == dwThreadId) {
+            continue;
+        }
+
+        // Threads that exit between the snapshot and here are skipped.
+        HANDLE hThread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_SET_CONTEXT,
+                                    FALSE, te.th32ThreadID);
+        if (hThread == NULL) {
+            DETOUR_TRACE(("OpenThread(%lu) failed: %lu\n", te.th32ThreadID, GetLastError()));
+            continue;
+        }
+
+        detour_note_thread_suspended();
+        if (SuspendThread(hThread) == (DWORD)-1) {
+            DETOUR_TRACE(("SuspendThread(%lu) failed: %lu\n", te.th32ThreadID, GetLastError()));
+            CloseHandle(hThread);
+            continue;
+        }
+
+        DetourThread *t = &s_pPendingThreadBlock[nThread++];
+        t->hThread = hThread;
+        t->fFromSnapshot = TRUE;
+        t->pNext = s_pPendingThreads;
+        s_pPendingThreads = t;
+    }
+
+    CloseHandle(hSnapshot);
+    return NO_ERROR;
+}
+
+ULONGLONG WINAPI DetourGetLastSuspendDuration(_Out_opt_ PULONG pcThreads)
+{
+    if (pcThreads != NULL) {
+        *pcThreads = s_cLastSuspendThreads;
+    }
+    return s_nLastSuspendMicroseconds;
+}
+
+//////////////////////////////////////////////////////////// Function Analysis.
+//
+// Decodes the start of a function the same way DetourAttachEx does, without
+// allocating a trampoline or copying anything, so that targets can be
+// checked up front.  cbJump is the size of the jump that will be written over
+// the function, or 0 for the size DetourAttachEx uses.
+//
+// Instructions are decoded into a scratch buffer rather than a trampoline.
+// The scratch buffer is out of rel8 reach of any code, so lExtra is what an
+// instruction needs in a trampoline that its target is out of reach from,
+// and cbTrampoline, which only counts enlargements, is an upper bound on the
+// trampoline code.  A trampoline within rel8 reach of a target needs less.
+//
+static BOOL detour_analyze_code(_In_ PBYTE pbTarget,
+                                _In_ ULONG cbJump,
+                                _Out_writes_opt_(cMaxInstructions) PDETOUR_INSTRUCTION pInstructions,
+                                _In_ ULONG cMaxInstructions,
+                                _Out_ PDETOUR_FUNCTION_ANALYSIS pAnalysis)
+{
+    PBYTE pbSrc = pbTarget;
+    ULONG cbTarget = 0;
+    ULONG cbTrampoline = 0;
+    ULONG nAlign = 0;
+
+    if (cbJump == 0) {
+        cbJump = SIZE_OF_JMP;
+#ifdef DETOURS_ARM
+        // On ARM, we need an extra instruction when the function isn't 32-bit aligned.
+        if ((ULONG)pbTarget & 2) {
+            cbJump += 2;
+        }
+#endif
+    }
+
+    while (cbTarget < cbJump) {
+        PBYTE pbOp = pbSrc;
+        PVOID pTarget = DETOUR_INSTRUCTION_TARGET_NONE;
+        LONG lExtra = 0;
+
+        pbSrc = (PBYTE)DetourCopyInstruction(NULL, NULL, pbSrc, &pTarget, &lExtra);
+        if (pbSrc == NULL) {
+            return FALSE;
+        }
+        cbTrampoline += (ULONG)(pbSrc - pbOp) + (lExtra > 0 ? lExtra : 0);
+        cbTarget = (ULONG)(pbSrc - pbTarget);
+
+        if (nAlign < cMaxInstructions) {
+            PDETOUR_INSTRUCTION pInstruction = &pInstructions[nAlign];
+            pInstruction->obInstruction = (ULONG)(pbOp - pbTarget);
+            pInstruction->cbInstruction = (ULONG)(pbSrc - pbOp);
+            pInstruction->lExtra = lExtra;
+            pInstruction->pTarget = pTarget;
+            pInstruction->nFlags = 0;
+            if (pTarget == DETOUR_INSTRUCTION_TARGET_DYNAMIC) {
+                pInstruction->nFlags |= DETOUR_INSTRUCTION_FLAG_DYNAMIC;
+            }
+            else if (pTarget != DETOUR_INSTRUCTION_TARGET_NONE) {
+                pInstruction->nFlags |= DETOUR_INSTRUCTION_FLAG_TARGET;
+            }
+            if (lExtra > 0) {
+                pInstruction->nFlags |= DETOUR_INSTRUCTION_FLAG_ENLARGE;
+            }
+            else if (lExtra < 0) {
+                pInstruction->nFlags |= DETOUR_INSTRUCTION_FLAG_NOENLARGE;
+            }
+            if (detour_does_code_end_function(pbOp)) {
+                pInstruction->nFlags |= DETOUR_INSTRUCTION_FLAG_ENDS_FUNCTION;
+            }
+        }
+        nAlign++;
+
+        if (nAlign >= ARRAYSIZE(DETOUR_TRAMPOLINE::rAlign)) {
+            break;
+        }
+        if (detour_does_code_end_function(pbOp)) {
+            break;
+        }
+    }
+
+    // Consume, but don't duplicate padding if it is needed and available.
+    while (cbTarget < cbJump) {
+        LONG cFiller = detour_is_code_filler(pbSrc);
+        if (cFiller == 0) {
+            break;
+        }
+
+        pbSrc += cFiller;
+        cbTarget = (ULONG)(pbSrc - pbTarget);
+    }
+
+    pAnalysis->pCode = pbTarget;
+    pAnalysis->cInstructions = nAlign;
+    pAnalysis->cbTarget = cbTarget;
+    pAnalysis->cbTrampoline = cbTrampoline;
+    pAnalysis->fCanDetour = (cbTarget >= cbJump &&
+                             cbTarget <= sizeof(DETOUR_TRAMPOLINE::rbCode) - cbJump &&
+                             cbTrampoline <= sizeof(DETOUR_TRAMPOLINE::rbCode));
+    return TRUE;
+}
+
+BOOL WINAPI DetourAnalyzeFunction(_In_ PVOID pCode,
+                                  _In_ ULONG cbJump,
+                                  _Out_writes_opt_(cMaxInstructions) PDETOUR_INSTRUCTION pInstructions,
+                                  _In_ ULONG cMaxInstructions,
+                                  _Out_ PDETOUR_FUNCTION_ANALYSIS pAnalysis)
+{
+    if (pCode == NULL || pAnalysis == NULL || (pInstructions == NULL && cMaxInstructions != 0)) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    return detour_analyze_code((PBYTE)DetourCodeFromPointer(pCode, NULL),
+                               cbJump, pInstructions, cMaxInstructions, pAnalysis);
+}
+
+// Analyzing a function takes well under a microsecond, so only hand work to
+// the thread pool in chunks large enough to pay for the hand off.
+const ULONG DETOUR_ANALYZE_FUNCTIONS_PER_WORKER = 64;
+const ULONG DETOUR_ANALYZE_MAX_WORKERS = 8;
+
+struct DetourAnalyzeBatch
+{
+    PVOID *                     ppCode;
+    ULONG                       cFunctions;
+    ULONG                       cbJump;
+    PDETOUR_FUNCTION_ANALYSIS   pAnalyses;
+    volatile LONG               nNext;      // Next function to analyze.
+    volatile LONG               cWorkers;   // Pool workers still running.
+    volatile LONG               cFailed;
+    HANDLE                      hDone;      // Set when the last worker finishes.
+};
+
+static void detour_analyze_batch(DetourAnalyzeBatch *pBatch)
+{
+    for (;;) {
+        LONG n = InterlockedIncrement(&pBatch->nNext) - 1;
+        if (n >= (LONG)pBatch->cFunctions) {
+            break;
+        }
+
+        PDETOUR_FUNCTION_ANALYSIS pAnalysis = &pBatch->pAnalyses[n];
+        if (!DetourAnalyzeFunction(pBatch->ppCode[n], pBatch->cbJump, NULL, 0, pAnalysis)) {
+            ZeroMemory(pAnalysis, sizeof(*pAnalysis));
+            InterlockedIncrement(&pBatch->cFailed);
+        }
+    }
+}
+
+static DWORD WINAPI detour_analyze_worker(PVOID pvContext)
+{
+    DetourAnalyzeBatch *pBatch = (DetourAnalyzeBatch *)pvContext;
+
+    detour_analyze_batch(pBatch);
+    if (InterlockedDecrement(&pBatch->cWorkers) == 0) {
+        SetEvent(pBatch->hDone);
+    }
+    return 0;
+}
+
+// Analyzes many functions at once, spreading them over the system thread
+// pool when there are enough of them.  Nothing is changed, so this can be
+// used to check a large set of targets before starting a transaction.
+//
+BOOL WINAPI DetourAnalyzeFunctions(_In_reads_(cFunctions) PVOID *ppCode,
+                                   _In_ ULONG cFunctions,
+                                   _In_ ULONG cbJump,
+                                   _Out_writes_(cFunctions) PDETOUR_FUNCTION_ANALYSIS pAnalyses)
+{
+    if ((ppCode == NULL || pAnalyses == NULL) && cFunctions != 0) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    DetourAnalyzeBatch batch;
+    batch.ppCode = ppCode;
+    batch.cFunctions = cFunctions;
+    batch.cbJump = cbJump;
+    batch.pAnalyses = pAnalyses;
+    batch.nNext = 0;
+    batch.cWorkers = 0;
+    batch.cFailed = 0;
+    batch.hDone = NULL;
+
+    ULONG cWorkers = cFunctions / DETOUR_ANALYZE_FUNCTIONS_PER_WORKER;
+    if (cWorkers > DETOUR_ANALYZE_MAX_WORKERS) {
+        cWorkers = DETOUR_ANALYZE_MAX_WORKERS;
+    }
+    if (cWorkers > 1) {
+        batch.hDone = CreateEventW(NULL, TRUE, FALSE, NULL);
+    }
+
+    // The calling thread does its share too, so one less worker is queued,
+    // and whatever the pool doesn't pick up is still analyzed.
+    if (batch.hDone != NULL) {
+        batch.cWorkers = 1;
+        for (ULONG n = 1; n < cWorkers; n++) {
+            InterlockedIncrement(&batch.cWorkers);
+            if (!QueueUserWorkItem(detour_analyze_worker, &batch, WT_EXECUTEDEFAULT)) {
+                InterlockedDecrement(&batch.cWorkers);
+                break;
+            }
+        }
+    }
+
+    detour_analyze_batch(&batch);
+
+    if (batch.hDone != NULL) {
+        if (InterlockedDecrement(&batch.cWorkers) != 0) {
+            WaitForSingleObject(batch.hDone, INFINITE);
+        }
+        CloseHandle(batch.hDone);
+    }
+
+    if (batch.cFailed != 0) {
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+    return TRUE;
+}
+
 ///////////////////////////////////////////////////////////// Transacted APIs.
 //
 LONG WINAPI DetourAttach(_Inout_ PVOID *ppPointer,
@@ -2087,6 +3060,50 @@ LONG WINAPI DetourAttachEx(_Inout_ PVOID *ppPointer,
         *ppRealDetour = pDetour;
     }
 
+#ifdef DETOURS_X86
+    // A hot-patchable target doesn't need any of its code moved: the
+    // trampoline just skips the "mov edi,edi".  Assigned apart from its
+    // declaration, which the gotos to fail and stop below jump past.
+    BOOL fHotPatch;
+    fHotPatch = (s_fHotPatch && detour_is_hot_patchable(pbTarget));
+#endif // DETOURS_X86
+
+#if defined(DETOURS_X86) || defined(DETOURS_X64)
+    // Find the instructions to move, and reject targets that are too small,
+    // before allocating anything for them.  The copy below reuses this, so
+    // the analysis starts at pbTarget itself rather than skipping jumps again.
+    DETOUR_INSTRUCTION rInstructions[ARRAYSIZE(DETOUR_TRAMPOLINE::rAlign)];
+    DETOUR_FUNCTION_ANALYSIS analysis;
+    ZeroMemory(&analysis, sizeof(analysis));
+#ifdef DETOURS_X86
+    if (!fHotPatch)
+#endif
+    {
+        if (!detour_analyze_code(pbTarget, 0, rInstructions, ARRAYSIZE(rInstructions), &analysis) ||
+            analysis.cbTarget < SIZE_OF_JMP) {
+            // Too few instructions.
+            DETOUR_TRACE(("target too small: %lu bytes, %lu instructions\n",
+                          analysis.cbTarget, analysis.cInstructions));
+            error = ERROR_INVALID_BLOCK;
+            if (s_fIgnoreTooSmall) {
+                goto stop;
+            }
+            else {
+                DETOUR_BREAK();
+                goto fail;
+            }
+        }
+        if (!analysis.fCanDetour) {
+            // Too many instructions.
+            DETOUR_TRACE(("target too large: %lu bytes, %lu bytes of trampoline\n",
+                          analysis.cbTarget, analysis.cbTrampoline));
+            error = ERROR_INVALID_HANDLE;
+            DETOUR_BREAK();
+            goto fail;
+        }
+    }
+#endif
+
     o = new NOTHROW DetourOperation;
     if (o == NULL) {
         error = ERROR_NOT_ENOUGH_MEMORY;
@@ -2130,6 +3147,39 @@ LONG WINAPI DetourAttachEx(_Inout_ PVOID *ppPointer,
 
     memset(pTrampoline->rAlign, 0, sizeof(pTrampoline->rAlign));
 
+#ifdef DETOURS_X86
+    if (fHotPatch) {
+        pTrampoline->cbCode = 0;
+        // Only the entry is counted in cbRestore, the padding is saved after it.
+        pTrampoline->cbRestore = DETOUR_HOT_PATCH_ENTRY;
+        detour_hot_patch_save(pbTarget, pTrampoline->rbRestore);
+        pTrampoline->pbRemain = pbTarget + DETOUR_HOT_PATCH_ENTRY;
+        pTrampoline->pbDetour = (PBYTE)pDetour;
+
+        PBYTE pbCode = detour_gen_jmp_immediate(pTrampoline->rbCode, pTrampoline->pbRemain);
+        detour_gen_brk(pbCode, pTrampoline->rbCode + sizeof(pTrampoline->rbCode));
+
+        error = detour_writable_target_pages(pbTarget - DETOUR_HOT_PATCH_PADDING,
+                                             DETOUR_HOT_PATCH_SAVED);
+        if (error != NO_ERROR) {
+            DETOUR_BREAK();
+            goto fail;
+        }
+
+        DETOUR_TRACE(("detours: pbTarget=%p: hot patch\n", pbTarget));
+
+        o->fIsRemove = FALSE;
+        o->fHotPatch = TRUE;
+        o->ppbPointer = (PBYTE*)ppPointer;
+        o->pTrampoline = pTrampoline;
+        o->pbTarget = pbTarget;
+        o->pNext = s_pPendingOperations;
+        s_pPendingOperations = o;
+
+        return NO_ERROR;
+    }
+#endif // DETOURS_X86
+
     // Determine the number of movable target instructions.
     PBYTE pbSrc = pbTarget;
     PBYTE pbTrampoline = pTrampoline->rbCode;
@@ -2172,6 +3222,25 @@ LONG WINAPI DetourAttachEx(_Inout_ PVOID *ppPointer,
     }
 #endif
 
+#if defined(DETOURS_X86) || defined(DETOURS_X64)
+    // Copy the instructions the analysis found, it already counted the
+    // padding that can be consumed after them.
+    for (; nAlign < analysis.cInstructions; nAlign++) {
+        PBYTE pbOp = pbTarget + rInstructions[nAlign].obInstruction;
+        LONG lExtra = 0;
+
+        DETOUR_TRACE((" DetourCopyInstruction(%p,%p)\n",
+                      pbTrampoline, pbOp));
+        pbSrc = (PBYTE)
+            DetourCopyInstruction(pbTrampoline, (PVOID*)&pbPool, pbOp, NULL, &lExtra);
+        DETOUR_TRACE((" DetourCopyInstruction() = %p (%d bytes)\n",
+                      pbSrc, (int)(pbSrc - pbOp)));
+        pbTrampoline += (pbSrc - pbOp) + lExtra;
+        pTrampoline->rAlign[nAlign].obTarget = (LONG)(pbSrc - pbTarget);
+        pTrampoline->rAlign[nAlign].obTrampoline = pbTrampoline - pTrampoline->rbCode;
+    }
+    cbTarget = analysis.cbTarget;
+#else // DETOURS_X86 || DETOURS_X64
     while (cbTarget < cbJump) {
         PBYTE pbOp = pbSrc;
         LONG lExtra = 0;
@@ -2207,6 +3276,7 @@ LONG WINAPI DetourAttachEx(_Inout_ PVOID *ppPointer,
         pbSrc += cFiller;
         cbTarget = (LONG)(pbSrc - pbTarget);
     }
+#endif // !DETOURS_X86 && !DETOURS_X64
 
 #if DETOUR_DEBUG
     {
@@ -2323,9 +3393,8 @@ LONG WINAPI DetourAttachEx(_Inout_ PVOID *ppPointer,
 
     (void)pbTrampoline;
 
-    DWORD dwOld = 0;
-    if (!VirtualProtect(pbTarget, cbTarget, PAGE_EXECUTE_READWRITE, &dwOld)) {
-        error = GetLastError();
+    error = detour_writable_target_pages(pbTarget, cbTarget);
+    if (error != NO_ERROR) {
         DETOUR_BREAK();
         goto fail;
     }
@@ -2351,10 +3420,10 @@ LONG WINAPI DetourAttachEx(_Inout_ PVOID *ppPointer,
                   pTrampoline->rbCode[10], pTrampoline->rbCode[11]));
 
     o->fIsRemove = FALSE;
+    o->fHotPatch = FALSE;
     o->ppbPointer = (PBYTE*)ppPointer;
     o->pTrampoline = pTrampoline;
     o->pbTarget = pbTarget;
-    o->dwPerm = dwOld;
     o->pNext = s_pPendingOperations;
     s_pPendingOperations = o;
 
@@ -2481,10 +3550,22 @@ LONG WINAPI DetourDetach(_Inout_ PVOID *ppPointer,
         }
     }
 
-    DWORD dwOld = 0;
-    if (!VirtualProtect(pbTarget, cbTarget,
-                        PAGE_EXECUTE_READWRITE, &dwOld)) {
-        error = GetLastError();
+    // Every other x86 detour restores at least SIZE_OF_JMP bytes.
+    o->fHotPatch = FALSE;
+#ifdef DETOURS_X86
+    if (cbTarget == DETOUR_HOT_PATCH_ENTRY && pTrampoline->cbCode == 0) {
+        o->fHotPatch = TRUE;
+    }
+#endif // DETOURS_X86
+
+    if (o->fHotPatch) {
+        error = detour_writable_target_pages(pbTarget - DETOUR_HOT_PATCH_PADDING,
+                                             DETOUR_HOT_PATCH_SAVED);
+    }
+    else {
+        error = detour_writable_target_pages(pbTarget, cbTarget);
+    }
+    if (error != NO_ERROR) {
         DETOUR_BREAK();
         goto fail;
     }
@@ -2493,7 +3574,6 @@ LONG WINAPI DetourDetach(_Inout_ PVOID *ppPointer,
     o->ppbPointer = (PBYTE*)ppPointer;
     o->pTrampoline = pTrampoline;
     o->pbTarget = pbTarget;
-    o->dwPerm = dwOld;
     o->pNext = s_pPendingOperations;
     s_pPendingOperations = o;
 
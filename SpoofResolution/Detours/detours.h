@@ -379,6 +379,7 @@ extern "C" {
 
 extern const GUID DETOUR_EXE_RESTORE_GUID;
 extern const GUID DETOUR_EXE_HELPER_GUID;
+extern const GUID DETOUR_PAYLOAD_DIRECTORY_GUID;
 
 #define DETOUR_TRAMPOLINE_SIGNATURE             0x21727444  // Dtr!
 typedef struct _DETOUR_TRAMPOLINE DETOUR_TRAMPOLINE, *PDETOUR_TRAMPOLINE;
@@ -387,6 +388,32 @@ typedef struct _DETOUR_TRAMPOLINE DETOUR_TRAMPOLINE, *PDETOUR_TRAMPOLINE;
 #define DETOUR_MAX_SUPPORTED_IMAGE_SECTION_HEADERS      32
 #endif // !DETOUR_MAX_SUPPORTED_IMAGE_SECTION_HEADERS
 
+///////////////////////////////////////////////// Function Analysis Structures.
+//
+#define DETOUR_INSTRUCTION_FLAG_TARGET          0x1     // Has a relative target to relocate.
+#define DETOUR_INSTRUCTION_FLAG_DYNAMIC         0x2     // Target is only known at run time.
+#define DETOUR_INSTRUCTION_FLAG_ENLARGE         0x4     // Grows when copied to a trampoline.
+#define DETOUR_INSTRUCTION_FLAG_NOENLARGE       0x8     // Can't be enlarged to reach its target.
+#define DETOUR_INSTRUCTION_FLAG_ENDS_FUNCTION   0x10    // Return or unconditional jump.
+
+typedef struct _DETOUR_INSTRUCTION
+{
+    ULONG       obInstruction;      // Offset from the start of the code.
+    ULONG       cbInstruction;
+    LONG        lExtra;             // Extra bytes needed when copied.
+    ULONG       nFlags;             // DETOUR_INSTRUCTION_FLAG_*.
+    PVOID       pTarget;            // DETOUR_INSTRUCTION_TARGET_* or target address.
+} DETOUR_INSTRUCTION, *PDETOUR_INSTRUCTION;
+
+typedef struct _DETOUR_FUNCTION_ANALYSIS
+{
+    PVOID       pCode;              // Code after skipping import jumps.
+    ULONG       cInstructions;      // Instructions moved to the trampoline.
+    ULONG       cbTarget;           // Bytes of the function overwritten, filler included.
+    ULONG       cbTrampoline;       // Most bytes of trampoline code for the moved instructions.
+    BOOL        fCanDetour;         // The jump fits and the trampoline is large enough.
+} DETOUR_FUNCTION_ANALYSIS, *PDETOUR_FUNCTION_ANALYSIS;
+
 /////////////////////////////////////////////////////////// Binary Structures.
 //
 #pragma pack(push, 8)
@@ -422,6 +449,16 @@ typedef struct _DETOUR_SECTION_RECORD
     GUID        guid;
 } DETOUR_SECTION_RECORD, *PDETOUR_SECTION_RECORD;
 
+// When present, the first record of a section is a directory of the others.
+// Its GUID is DETOUR_PAYLOAD_DIRECTORY_GUID and its data is an array of
+// entries sorted by the bytes of their GUIDs.
+typedef struct _DETOUR_PAYLOAD_DIRECTORY_ENTRY
+{
+    GUID        guid;
+    DWORD       nOffset;    // Offset of the payload data from the section header.
+    DWORD       cbData;
+} DETOUR_PAYLOAD_DIRECTORY_ENTRY, *PDETOUR_PAYLOAD_DIRECTORY_ENTRY;
+
 typedef struct _DETOUR_CLR_HEADER
 {
     // Header versioning
@@ -562,6 +599,8 @@ LONG WINAPI DetourTransactionCommit(VOID);
 LONG WINAPI DetourTransactionCommitEx(_Out_opt_ PVOID **pppFailedPointer);
 
 LONG WINAPI DetourUpdateThread(_In_ HANDLE hThread);
+LONG WINAPI DetourUpdateAllThreads(VOID);
+ULONGLONG WINAPI DetourGetLastSuspendDuration(_Out_opt_ PULONG pcThreads);
 
 LONG WINAPI DetourAttach(_Inout_ PVOID *ppPointer,
                          _In_ PVOID pDetour);
@@ -577,6 +616,7 @@ LONG WINAPI DetourDetach(_Inout_ PVOID *ppPointer,
 
 BOOL WINAPI DetourSetIgnoreTooSmall(_In_ BOOL fIgnore);
 BOOL WINAPI DetourSetRetainRegions(_In_ BOOL fRetain);
+BOOL WINAPI DetourSetHotPatch(_In_ BOOL fHotPatch);
 PVOID WINAPI DetourSetSystemRegionLowerBound(_In_ PVOID pSystemRegionLowerBound);
 PVOID WINAPI DetourSetSystemRegionUpperBound(_In_ PVOID pSystemRegionUpperBound);
 
@@ -584,6 +624,10 @@ PVOID WINAPI DetourSetSystemRegionUpperBound(_In_ PVOID pSystemRegionUpperBound)
 //
 PVOID WINAPI DetourFindFunction(_In_ LPCSTR pszModule,
                                 _In_ LPCSTR pszFunction);
+ULONG WINAPI DetourFindFunctions(_In_ LPCSTR pszModule,
+                                 _In_reads_(cFunctions) LPCSTR *ppszFunctions,
+                                 _In_ ULONG cFunctions,
+                                 _Out_writes_(cFunctions) PVOID *ppvFunctions);
 PVOID WINAPI DetourCodeFromPointer(_In_ PVOID pPointer,
                                    _Out_opt_ PVOID *ppGlobals);
 PVOID WINAPI DetourCopyInstruction(_In_opt_ PVOID pDst,
@@ -593,10 +637,20 @@ PVOID WINAPI DetourCopyInstruction(_In_opt_ PVOID pDst,
                                    _Out_opt_ LONG *plExtra);
 BOOL WINAPI DetourSetCodeModule(_In_ HMODULE hModule,
                                 _In_ BOOL fLimitReferencesToModule);
+BOOL WINAPI DetourSetDecodeCache(_In_ BOOL fEnabled);
 PVOID WINAPI DetourAllocateRegionWithinJumpBounds(_In_ LPCVOID pbTarget,
                                                   _Out_ PDWORD pcbAllocatedSize);
 BOOL WINAPI DetourIsFunctionImported(_In_ PBYTE pbCode,
                                      _In_ PBYTE pbAddress);
+BOOL WINAPI DetourAnalyzeFunction(_In_ PVOID pCode,
+                                  _In_ ULONG cbJump,
+                                  _Out_writes_opt_(cMaxInstructions) PDETOUR_INSTRUCTION pInstructions,
+                                  _In_ ULONG cMaxInstructions,
+                                  _Out_ PDETOUR_FUNCTION_ANALYSIS pAnalysis);
+BOOL WINAPI DetourAnalyzeFunctions(_In_reads_(cFunctions) PVOID *ppCode,
+                                   _In_ ULONG cFunctions,
+                                   _In_ ULONG cbJump,
+                                   _Out_writes_(cFunctions) PDETOUR_FUNCTION_ANALYSIS pAnalyses);
 
 ///////////////////////////////////////////////////// Loaded Binary Functions.
 //
@@ -607,6 +661,8 @@ ULONG WINAPI DetourGetModuleSize(_In_opt_ HMODULE hModule);
 BOOL WINAPI DetourEnumerateExports(_In_ HMODULE hModule,
                                    _In_opt_ PVOID pContext,
                                    _In_ PF_DETOUR_ENUMERATE_EXPORT_CALLBACK pfExport);
+PVOID WINAPI DetourFindExportByName(_In_opt_ HMODULE hModule,
+                                    _In_ LPCSTR pszName);
 BOOL WINAPI DetourEnumerateImports(_In_opt_ HMODULE hModule,
                                    _In_opt_ PVOID pContext,
                                    _In_opt_ PF_DETOUR_IMPORT_FILE_CALLBACK pfImportFile,
@@ -849,6 +905,13 @@ PVOID WINAPI DetourCopyPayloadToProcessEx(_In_ HANDLE hProcess,
                                           _In_ REFGUID rguid,
                                           _In_reads_bytes_(cbData) LPCVOID pvData,
                                           _In_ DWORD cbData);
+_Success_(return != FALSE)
+BOOL WINAPI DetourCopyPayloadsToProcess(_In_ HANDLE hProcess,
+                                        _In_ DWORD cPayloads,
+                                        _In_reads_(cPayloads) const GUID *pGuids,
+                                        _In_reads_(cPayloads) LPCVOID *ppvData,
+                                        _In_reads_(cPayloads) const DWORD *pcbData,
+                                        _Out_writes_opt_(cPayloads) PVOID *ppvRemoteData);
 
 BOOL WINAPI DetourRestoreAfterWith(VOID);
 BOOL WINAPI DetourRestoreAfterWithEx(_In_reads_bytes_(cbData) PVOID pvData,
@@ -1186,6 +1249,8 @@ PVOID WINAPI DetourCopyInstruction##x(_In_opt_ PVOID pDst,              \
                                                                         \
 BOOL WINAPI DetourSetCodeModule##x(_In_ HMODULE hModule,                \
                                    _In_ BOOL fLimitReferencesToModule); \
+                                                                        \
+BOOL WINAPI DetourSetDecodeCache##x(_In_ BOOL fEnabled);                \
 
 DETOUR_OFFLINE_LIBRARY(X86)
 DETOUR_OFFLINE_LIBRARY(X64)
@@ -1215,10 +1280,214 @@ BOOL WINAPI DetourVirtualProtectSameExecute(_In_  PVOID pAddress,
 
 // Detours must depend only on kernel32.lib, so we cannot use IsEqualGUID
 BOOL WINAPI DetourAreSameGuid(_In_ REFGUID left, _In_ REFGUID right);
+
+// Binary searches a payload directory for rguid.
+inline PDETOUR_PAYLOAD_DIRECTORY_ENTRY
+detour_find_payload_directory_entry(_In_reads_(cEntries) PDETOUR_PAYLOAD_DIRECTORY_ENTRY pEntries,
+                                    _In_ DWORD cEntries,
+                                    _In_ REFGUID rguid)
+{
+    DWORD nLo = 0;
+    DWORD nHi = cEntries;
+    while (nLo < nHi) {
+        DWORD nMid = nLo + (nHi - nLo) / 2;
+        int nCmp = memcmp(&rguid, &pEntries[nMid].guid, sizeof(GUID));
+        if (nCmp < 0) {
+            nHi = nMid;
+        }
+        else if (nCmp > 0) {
+            nLo = nMid + 1;
+        }
+        else {
+            return &pEntries[nMid];
+        }
+    }
+    return NULL;
+}
 #ifdef __cplusplus
 }
 #endif // __cplusplus
 
+#ifdef __cplusplus
+//////////////////////////////////////////////////////////////////////////////
+//
+//  A bounds-checked view of the headers and data of a PE image (modules.cpp).
+//
+//  Attach views an image loaded in this process, AttachFile an image mapped
+//  or read as a file, where RVAs are translated through the section table,
+//  and AttachRemote an image loaded in another process, of which only the
+//  headers are copied and everything else is fetched with the read callback.
+//  The headers are validated once, with every offset checked against the
+//  bytes present before it is read; every RVA handed out afterward is checked
+//  against SizeOfImage.  Pointers returned by the view are into the local
+//  copy of the image, Base() is the image as its callers address it.  A
+//  loaded image can still be partially unmapped, so callers use the view
+//  within __try.
+//
+typedef BOOL (CALLBACK *PF_DETOUR_IMAGE_READ_REMOTE)(_In_opt_ PVOID pContext,
+                                                     _In_ LPCVOID pvRemote,
+                                                     _Out_writes_bytes_(cbData) PVOID pvLocal,
+                                                     _In_ SIZE_T cbData);
+
+class CDetourImageView
+{
+  public:
+    CDetourImageView();
+    ~CDetourImageView();
+
+    BOOL                    Attach(_In_opt_ HMODULE hModule);
+    BOOL                    AttachFile(_In_reads_bytes_(cbFile) PBYTE pbFile, _In_ SIZE_T cbFile);
+    BOOL                    AttachRemote(_In_ HMODULE hModule,
+                                         _In_ PF_DETOUR_IMAGE_READ_REMOTE pfRead,
+                                         _In_opt_ PVOID pContext);
+
+    PBYTE                   Base() const        { return m_pbBase; }
+    DWORD                   SizeOfImage() const { return m_cbImage; }
+    PIMAGE_DOS_HEADER       DosHeader() const   { return (PIMAGE_DOS_HEADER)m_pbData; }
+    PIMAGE_NT_HEADERS       NtHeader() const    { return m_pNtHeader; }
+
+    BOOL                    Contains(_In_ const VOID *pvData, _In_ SIZE_T cbData) const;
+    PBYTE                   RvaToPointer(_In_ DWORD nRva, _In_ SIZE_T cbData) const;
+    PCHAR                   RvaToString(_In_ DWORD nRva) const;
+    DWORD                   DirectoryRva(_In_ DWORD nDirectory, _Out_opt_ PDWORD pcbData) const;
+    PBYTE                   Directory(_In_ DWORD nDirectory, _Out_opt_ PDWORD pcbData) const;
+    PIMAGE_SECTION_HEADER   Sections(_Out_ PDWORD pcSections) const;
+    BOOL                    Read(_In_ DWORD nRva,
+                                 _Out_writes_bytes_(cbData) PVOID pvData,
+                                 _In_ SIZE_T cbData) const;
+
+  private:
+    CDetourImageView(const CDetourImageView&);
+    CDetourImageView& operator=(const CDetourImageView&);
+
+    VOID                    Reset();
+    BOOL                    AttachHeaders(_In_reads_bytes_(cbData) PBYTE pbData,
+                                          _In_ SIZE_T cbData,
+                                          _Out_ PSIZE_T pcbNeeded);
+    PBYTE                   RvaToLocal(_In_ DWORD nRva, _Out_ PSIZE_T pcbAvailable) const;
+
+    PBYTE                   m_pbBase;
+    DWORD                   m_cbImage;
+    PBYTE                   m_pbData;           // Local bytes of the image.
+    SIZE_T                  m_cbData;
+    PBYTE                   m_pbOwned;          // Header copy of a remote image.
+    BOOL                    m_fFileLayout;
+    PF_DETOUR_IMAGE_READ_REMOTE m_pfRead;
+    PVOID                   m_pvReadContext;
+    PIMAGE_NT_HEADERS       m_pNtHeader;
+    PIMAGE_DATA_DIRECTORY   m_pDirectories;
+    DWORD                   m_cDirectories;
+};
+#endif // __cplusplus
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  Hot patching of functions compiled with /hotpatch (detours.cpp, x86).
+//
+//  Such a function starts with a 2-byte "mov edi,edi" and is preceded by at
+//  least 5 bytes of nop or int 3 padding.  Attaching writes a jmp to the
+//  detour into the padding, then switches the entry to "jmp $-5" with one
+//  2-byte store.  Detaching puts the entry back with one 2-byte store, then
+//  the padding.  A thread may have taken the "jmp $-5" just before, so the
+//  padding is only restored while other threads run when it is all nops, so
+//  that such a thread runs on into the restored entry, and lies within one
+//  aligned qword, so that it is replaced by a single store.  Otherwise the
+//  threads are suspended and moved out of the padding first.  The saved bytes
+//  are the entry followed by the padding.  The helpers only move bytes, so
+//  they build for every architecture.
+//
+#define DETOUR_HOT_PATCH_ENTRY      2   // mov edi,edi
+#define DETOUR_HOT_PATCH_PADDING    5   // jmp +imm32
+#define DETOUR_HOT_PATCH_SAVED      (DETOUR_HOT_PATCH_ENTRY + DETOUR_HOT_PATCH_PADDING)
+
+inline BOOL detour_is_hot_patchable(_In_ PBYTE pbCode)
+{
+    // mov edi,edi in either encoding.
+    if ((pbCode[0] != 0x8B && pbCode[0] != 0x89) || pbCode[1] != 0xFF) {
+        return FALSE;
+    }
+    // The entry is switched with one InterlockedExchange16, which needs a
+    // 2-byte aligned address to be atomic, so anything else is detoured the
+    // normal way.
+    if (((ULONG_PTR)pbCode & 1) != 0) {
+        return FALSE;
+    }
+    // Don't read the padding across a page boundary we haven't checked.
+    if (((ULONG_PTR)pbCode & 0xfff) < DETOUR_HOT_PATCH_PADDING) {
+        return FALSE;
+    }
+    for (LONG n = 1; n <= DETOUR_HOT_PATCH_PADDING; n++) {
+        if (pbCode[-n] != 0x90 && pbCode[-n] != 0xcc) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+inline VOID detour_hot_patch_save(_In_ PBYTE pbCode,
+                                  _Out_writes_(DETOUR_HOT_PATCH_SAVED) PBYTE pbSaved)
+{
+    CopyMemory(pbSaved, pbCode, DETOUR_HOT_PATCH_ENTRY);
+    CopyMemory(pbSaved + DETOUR_HOT_PATCH_ENTRY,
+               pbCode - DETOUR_HOT_PATCH_PADDING,
+               DETOUR_HOT_PATCH_PADDING);
+}
+
+inline VOID detour_hot_patch_attach(_In_ PBYTE pbCode, _In_ PBYTE pbDetour)
+{
+    // No thread runs the padding, so the jmp can be written first.
+    PBYTE pbJmp = pbCode - DETOUR_HOT_PATCH_PADDING;
+    pbJmp[0] = 0xE9;    // jmp +imm32
+    *(UNALIGNED INT32 *)(pbJmp + 1) = (INT32)(pbDetour - pbCode);
+    InterlockedExchange16((SHORT volatile *)pbCode, (SHORT)0xF9EB);    // jmp $-5
+}
+
+// The aligned qword holding all of the padding, or NULL if it straddles two.
+inline LONGLONG volatile *detour_hot_patch_padding_qword(_In_ PBYTE pbCode)
+{
+    PBYTE pbQword = (PBYTE)((ULONG_PTR)(pbCode - DETOUR_HOT_PATCH_PADDING) & ~(ULONG_PTR)7);
+    if (pbQword + sizeof(LONGLONG) < pbCode) {
+        return NULL;
+    }
+    return (LONGLONG volatile *)pbQword;
+}
+
+inline BOOL detour_hot_patch_restores_running(_In_ PBYTE pbCode,
+                                              _In_reads_(DETOUR_HOT_PATCH_SAVED) PBYTE pbSaved)
+{
+    for (LONG n = 0; n < DETOUR_HOT_PATCH_PADDING; n++) {
+        if (pbSaved[DETOUR_HOT_PATCH_ENTRY + n] != 0x90) {
+            return FALSE;
+        }
+    }
+    return detour_hot_patch_padding_qword(pbCode) != NULL;
+}
+
+inline VOID detour_hot_patch_detach(_In_ PBYTE pbCode,
+                                    _In_reads_(DETOUR_HOT_PATCH_SAVED) PBYTE pbSaved)
+{
+    InterlockedExchange16((SHORT volatile *)pbCode, *(UNALIGNED SHORT *)pbSaved);
+
+    PBYTE pbPadding = pbCode - DETOUR_HOT_PATCH_PADDING;
+    LONGLONG volatile *pQword = detour_hot_patch_padding_qword(pbCode);
+    if (pQword == NULL) {
+        // Only reached with the other threads suspended.
+        CopyMemory(pbPadding, pbSaved + DETOUR_HOT_PATCH_ENTRY, DETOUR_HOT_PATCH_PADDING);
+        return;
+    }
+    // The rest of the qword may belong to the entry or to the code before it,
+    // so it is merged back unchanged.
+    LONGLONG nOld;
+    LONGLONG nNew;
+    do {
+        nOld = *pQword;
+        nNew = nOld;
+        CopyMemory((PBYTE)&nNew + (pbPadding - (PBYTE)pQword),
+                   pbSaved + DETOUR_HOT_PATCH_ENTRY,
+                   DETOUR_HOT_PATCH_PADDING);
+    } while (InterlockedCompareExchange64(pQword, nNew, nOld) != nOld);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 
 #define MM_ALLOCATION_GRANULARITY 0x10000
@@ -42,6 +42,7 @@
 
 #define DetourCopyInstruction   DetourCopyInstructionX86
 #define DetourSetCodeModule     DetourSetCodeModuleX86
+#define DetourSetDecodeCache    DetourSetDecodeCacheX86
 #define CDetourDis              CDetourDisX86
 #define DETOURS_X86
 
@@ -54,6 +55,7 @@
 
 #define DetourCopyInstruction   DetourCopyInstructionX64
 #define DetourSetCodeModule     DetourSetCodeModuleX64
+#define DetourSetDecodeCache    DetourSetDecodeCacheX64
 #define CDetourDis              CDetourDisX64
 #define DETOURS_X64
 
@@ -61,6 +63,7 @@
 
 #define DetourCopyInstruction   DetourCopyInstructionARM
 #define DetourSetCodeModule     DetourSetCodeModuleARM
+#define DetourSetDecodeCache    DetourSetDecodeCacheARM
 #define CDetourDis              CDetourDisARM
 #define DETOURS_ARM
 
@@ -68,6 +71,7 @@
 
 #define DetourCopyInstruction   DetourCopyInstructionARM64
 #define DetourSetCodeModule     DetourSetCodeModuleARM64
+#define DetourSetDecodeCache    DetourSetDecodeCacheARM64
 #define CDetourDis              CDetourDisARM64
 #define DETOURS_ARM64
 
@@ -75,6 +79,7 @@
 
 #define DetourCopyInstruction   DetourCopyInstructionIA64
 #define DetourSetCodeModule     DetourSetCodeModuleIA64
+#define DetourSetDecodeCache    DetourSetDecodeCacheIA64
 #define DETOURS_IA64
 
 #else
@@ -162,6 +167,7 @@ class CDetourDis
     PBYTE   CopyInstruction(PBYTE pbDst, PBYTE pbSrc);
     static BOOL SanityCheckSystem();
     static BOOL SetCodeModule(PBYTE pbBeg, PBYTE pbEnd, BOOL fLimitReferencesToModule);
+    static BOOL SetDecodeCache(BOOL fEnabled);
 
   public:
     struct COPYENTRY;
@@ -184,6 +190,34 @@ class CDetourDis
         NOTSIB      = 0x0fu,
     };
 
+    // nCopy handlers, indexes into s_rpfCopy.
+    enum {
+        COPY_Bytes,
+        COPY_BytesPrefix,
+        COPY_BytesSegment,
+        COPY_BytesRax,
+        COPY_BytesJump,
+        COPY_Invalid,
+        COPY_0F,
+        COPY_0F78,
+        COPY_0F00,
+        COPY_0FB8,
+        COPY_66,
+        COPY_67,
+        COPY_F2,
+        COPY_F3,
+        COPY_F6,
+        COPY_F7,
+        COPY_FF,
+        COPY_Vex2,
+        COPY_Vex3,
+        COPY_Evex,
+        COPY_Xop,
+        COPY_Count
+    };
+
+    // Packed into 4 bytes so that a whole opcode table fits in 1KB.  A member
+    // function pointer per entry took as much again or more.
     struct COPYENTRY
     {
         // Many of these fields are often ignored. See ENTRY_DataIgnored.
@@ -192,67 +226,68 @@ class CDetourDis
         ULONG       nModOffset      : 4;    // Offset to mod/rm byte (0=none)
         ULONG       nRelOffset      : 4;    // Offset to relative target.
         ULONG       nFlagBits       : 4;    // Flags for DYNAMIC, etc.
-        COPYFUNC    pfCopy;                 // Function pointer.
+        ULONG       nCopy           : 8;    // COPY_* handler.
     };
 
   protected:
-// These macros define common uses of nFixedSize, nFixedSize16, nModOffset, nRelOffset, nFlagBits, pfCopy.
+// These macros define common uses of nFixedSize, nFixedSize16, nModOffset, nRelOffset, nFlagBits, nCopy.
 #define ENTRY_DataIgnored           0, 0, 0, 0, 0,
-#define ENTRY_CopyBytes1            { 1, 1, 0, 0, 0, &CDetourDis::CopyBytes }
+#define ENTRY_CopyBytes1            { 1, 1, 0, 0, 0, COPY_Bytes }
 #ifdef DETOURS_X64
-#define ENTRY_CopyBytes1Address     { 9, 5, 0, 0, ADDRESS, &CDetourDis::CopyBytes }
+#define ENTRY_CopyBytes1Address     { 9, 5, 0, 0, ADDRESS, COPY_Bytes }
 #else
-#define ENTRY_CopyBytes1Address     { 5, 3, 0, 0, ADDRESS, &CDetourDis::CopyBytes }
+#define ENTRY_CopyBytes1Address     { 5, 3, 0, 0, ADDRESS, COPY_Bytes }
 #endif
-#define ENTRY_CopyBytes1Dynamic     { 1, 1, 0, 0, DYNAMIC, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes2            { 2, 2, 0, 0, 0, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes2Jump        { ENTRY_DataIgnored &CDetourDis::CopyBytesJump }
-#define ENTRY_CopyBytes2CantJump    { 2, 2, 0, 1, NOENLARGE, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes2Dynamic     { 2, 2, 0, 0, DYNAMIC, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes3            { 3, 3, 0, 0, 0, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes3Dynamic     { 3, 3, 0, 0, DYNAMIC, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes3Or5         { 5, 3, 0, 0, 0, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes3Or5Dynamic  { 5, 3, 0, 0, DYNAMIC, &CDetourDis::CopyBytes }// x86 only
+#define ENTRY_CopyBytes1Dynamic     { 1, 1, 0, 0, DYNAMIC, COPY_Bytes }
+#define ENTRY_CopyBytes2            { 2, 2, 0, 0, 0, COPY_Bytes }
+#define ENTRY_CopyBytes2Jump        { ENTRY_DataIgnored COPY_BytesJump }
+#define ENTRY_CopyBytes2CantJump    { 2, 2, 0, 1, NOENLARGE, COPY_Bytes }
+#define ENTRY_CopyBytes2Dynamic     { 2, 2, 0, 0, DYNAMIC, COPY_Bytes }
+#define ENTRY_CopyBytes3            { 3, 3, 0, 0, 0, COPY_Bytes }
+#define ENTRY_CopyBytes3Dynamic     { 3, 3, 0, 0, DYNAMIC, COPY_Bytes }
+#define ENTRY_CopyBytes3Or5         { 5, 3, 0, 0, 0, COPY_Bytes }
+#define ENTRY_CopyBytes3Or5Dynamic  { 5, 3, 0, 0, DYNAMIC, COPY_Bytes }// x86 only
 #ifdef DETOURS_X64
-#define ENTRY_CopyBytes3Or5Rax      { 5, 3, 0, 0, RAX, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes3Or5Target   { 5, 5, 0, 1, 0, &CDetourDis::CopyBytes }
+#define ENTRY_CopyBytes3Or5Rax      { 5, 3, 0, 0, RAX, COPY_Bytes }
+#define ENTRY_CopyBytes3Or5Target   { 5, 5, 0, 1, 0, COPY_Bytes }
 #else
-#define ENTRY_CopyBytes3Or5Rax      { 5, 3, 0, 0, 0, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes3Or5Target   { 5, 3, 0, 1, 0, &CDetourDis::CopyBytes }
+#define ENTRY_CopyBytes3Or5Rax      { 5, 3, 0, 0, 0, COPY_Bytes }
+#define ENTRY_CopyBytes3Or5Target   { 5, 3, 0, 1, 0, COPY_Bytes }
 #endif
-#define ENTRY_CopyBytes4            { 4, 4, 0, 0, 0, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes5            { 5, 5, 0, 0, 0, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes5Or7Dynamic  { 7, 5, 0, 0, DYNAMIC, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes7            { 7, 7, 0, 0, 0, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes2Mod         { 2, 2, 1, 0, 0, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes2ModDynamic  { 2, 2, 1, 0, DYNAMIC, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes2Mod1        { 3, 3, 1, 0, 0, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes2ModOperand  { 6, 4, 1, 0, 0, &CDetourDis::CopyBytes }
-#define ENTRY_CopyBytes3Mod         { 3, 3, 2, 0, 0, &CDetourDis::CopyBytes } // SSE3 0F 38 opcode modrm
-#define ENTRY_CopyBytes3Mod1        { 4, 4, 2, 0, 0, &CDetourDis::CopyBytes } // SSE3 0F 3A opcode modrm .. imm8
-#define ENTRY_CopyBytesPrefix       { ENTRY_DataIgnored &CDetourDis::CopyBytesPrefix }
-#define ENTRY_CopyBytesSegment      { ENTRY_DataIgnored &CDetourDis::CopyBytesSegment }
-#define ENTRY_CopyBytesRax          { ENTRY_DataIgnored &CDetourDis::CopyBytesRax }
-#define ENTRY_CopyF2                { ENTRY_DataIgnored &CDetourDis::CopyF2 }
-#define ENTRY_CopyF3                { ENTRY_DataIgnored &CDetourDis::CopyF3 } // 32bit x86 only
-#define ENTRY_Copy0F                { ENTRY_DataIgnored &CDetourDis::Copy0F }
-#define ENTRY_Copy0F78              { ENTRY_DataIgnored &CDetourDis::Copy0F78 }
-#define ENTRY_Copy0F00              { ENTRY_DataIgnored &CDetourDis::Copy0F00 } // 32bit x86 only
-#define ENTRY_Copy0FB8              { ENTRY_DataIgnored &CDetourDis::Copy0FB8 } // 32bit x86 only
-#define ENTRY_Copy66                { ENTRY_DataIgnored &CDetourDis::Copy66 }
-#define ENTRY_Copy67                { ENTRY_DataIgnored &CDetourDis::Copy67 }
-#define ENTRY_CopyF6                { ENTRY_DataIgnored &CDetourDis::CopyF6 }
-#define ENTRY_CopyF7                { ENTRY_DataIgnored &CDetourDis::CopyF7 }
-#define ENTRY_CopyFF                { ENTRY_DataIgnored &CDetourDis::CopyFF }
-#define ENTRY_CopyVex2              { ENTRY_DataIgnored &CDetourDis::CopyVex2 }
-#define ENTRY_CopyVex3              { ENTRY_DataIgnored &CDetourDis::CopyVex3 }
-#define ENTRY_CopyEvex              { ENTRY_DataIgnored &CDetourDis::CopyEvex } // 62, 3 byte payload, then normal with implied prefixes like vex
-#define ENTRY_CopyXop               { ENTRY_DataIgnored &CDetourDis::CopyXop }   // 0x8F ... POP /0 or AMD XOP
-#define ENTRY_CopyBytesXop          { 5, 5, 4, 0, 0, &CDetourDis::CopyBytes } // 0x8F xop1 xop2 opcode modrm
-#define ENTRY_CopyBytesXop1         { 6, 6, 4, 0, 0, &CDetourDis::CopyBytes } // 0x8F xop1 xop2 opcode modrm ... imm8
-#define ENTRY_CopyBytesXop4         { 9, 9, 4, 0, 0, &CDetourDis::CopyBytes } // 0x8F xop1 xop2 opcode modrm ... imm32
-#define ENTRY_Invalid               { ENTRY_DataIgnored &CDetourDis::Invalid }
-
+#define ENTRY_CopyBytes4            { 4, 4, 0, 0, 0, COPY_Bytes }
+#define ENTRY_CopyBytes5            { 5, 5, 0, 0, 0, COPY_Bytes }
+#define ENTRY_CopyBytes5Or7Dynamic  { 7, 5, 0, 0, DYNAMIC, COPY_Bytes }
+#define ENTRY_CopyBytes7            { 7, 7, 0, 0, 0, COPY_Bytes }
+#define ENTRY_CopyBytes2Mod         { 2, 2, 1, 0, 0, COPY_Bytes }
+#define ENTRY_CopyBytes2ModDynamic  { 2, 2, 1, 0, DYNAMIC, COPY_Bytes }
+#define ENTRY_CopyBytes2Mod1        { 3, 3, 1, 0, 0, COPY_Bytes }
+#define ENTRY_CopyBytes2ModOperand  { 6, 4, 1, 0, 0, COPY_Bytes }
+#define ENTRY_CopyBytes3Mod         { 3, 3, 2, 0, 0, COPY_Bytes } // SSE3 0F 38 opcode modrm
+#define ENTRY_CopyBytes3Mod1        { 4, 4, 2, 0, 0, COPY_Bytes } // SSE3 0F 3A opcode modrm .. imm8
+#define ENTRY_CopyBytesPrefix       { ENTRY_DataIgnored COPY_BytesPrefix }
+#define ENTRY_CopyBytesSegment      { ENTRY_DataIgnored COPY_BytesSegment }
+#define ENTRY_CopyBytesRax          { ENTRY_DataIgnored COPY_BytesRax }
+#define ENTRY_CopyF2                { ENTRY_DataIgnored COPY_F2 }
+#define ENTRY_CopyF3                { ENTRY_DataIgnored COPY_F3 } // 32bit x86 only
+#define ENTRY_Copy0F                { ENTRY_DataIgnored COPY_0F }
+#define ENTRY_Copy0F78              { ENTRY_DataIgnored COPY_0F78 }
+#define ENTRY_Copy0F00              { ENTRY_DataIgnored COPY_0F00 } // 32bit x86 only
+#define ENTRY_Copy0FB8              { ENTRY_DataIgnored COPY_0FB8 } // 32bit x86 only
+#define ENTRY_Copy66                { ENTRY_DataIgnored COPY_66 }
+#define ENTRY_Copy67                { ENTRY_DataIgnored COPY_67 }
+#define ENTRY_CopyF6                { ENTRY_DataIgnored COPY_F6 }
+#define ENTRY_CopyF7                { ENTRY_DataIgnored COPY_F7 }
+#define ENTRY_CopyFF                { ENTRY_DataIgnored COPY_FF }
+#define ENTRY_CopyVex2              { ENTRY_DataIgnored COPY_Vex2 }
+#define ENTRY_CopyVex3              { ENTRY_DataIgnored COPY_Vex3 }
+#define ENTRY_CopyEvex              { ENTRY_DataIgnored COPY_Evex } // 62, 3 byte payload, then normal with implied prefixes like vex
+#define ENTRY_CopyXop               { ENTRY_DataIgnored COPY_Xop }   // 0x8F ... POP /0 or AMD XOP
+#define ENTRY_CopyBytesXop          { 5, 5, 4, 0, 0, COPY_Bytes } // 0x8F xop1 xop2 opcode modrm
+#define ENTRY_CopyBytesXop1         { 6, 6, 4, 0, 0, COPY_Bytes } // 0x8F xop1 xop2 opcode modrm ... imm8
+#define ENTRY_CopyBytesXop4         { 9, 9, 4, 0, 0, COPY_Bytes } // 0x8F xop1 xop2 opcode modrm ... imm32
+#define ENTRY_Invalid               { ENTRY_DataIgnored COPY_Invalid }
+
+    PBYTE Copy(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc);
     PBYTE CopyBytes(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc);
     PBYTE CopyBytesPrefix(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc);
     PBYTE CopyBytesSegment(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc);
@@ -264,6 +299,41 @@ class CDetourDis
     PBYTE AdjustTarget(PBYTE pbDst, PBYTE pbSrc, UINT cbOp,
                        UINT cbTargetOffset, UINT cbTargetSize);
 
+  protected:
+    // Decode cache.
+    //
+    // Most instructions decode to a plain copy of their bytes plus at most
+    // one relative offset to adjust, which only depends on the bytes.  Such
+    // decodes are remembered by address and a hash of the instruction bytes
+    // so that analyzing the same code again, e.g. when detaching and
+    // attaching the same functions, just replays them.
+    enum {
+        DECODE_DYNAMIC      = 0x1u, // Target is DETOUR_INSTRUCTION_TARGET_DYNAMIC.
+        DECODE_NOENLARGE    = 0x2u, // Negate the extra bytes.
+        DECODE_DATA         = 0x4u, // Relative offset is a data target (x64 only).
+    };
+
+    struct DECODEENTRY
+    {
+        PBYTE       pbSrc;
+        ULONG       nHash;                  // Hash of the cbInstruction bytes at pbSrc.
+        BYTE        cbInstruction;
+        BYTE        cbTargetOffset;         // Offset to relative target (0=none).
+        BYTE        cbTargetSize;
+        BYTE        nDecodeFlags;
+    };
+
+    static ULONG HashInstruction(PBYTE pbSrc, UINT cbInstruction);
+    PBYTE ReplayInstruction(const DECODEENTRY& entry, PBYTE pbDst, PBYTE pbSrc);
+
+    static DECODEENTRY      s_rdeDecodeCache[256];
+    static LONG             s_nDecodeCacheLock;
+    static BOOL             s_fDecodeCache;
+
+    PBYTE               m_pbDecodeStart;    // pbSrc passed to CopyInstruction.
+    BOOL                m_bDecodeCacheable;
+    DECODEENTRY         m_deDecode;
+
   protected:
     PBYTE Copy0F(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc);
     PBYTE Copy0F00(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc); // x86 only sldt/0 str/1 lldt/2 ltr/3 err/4 verw/5 jmpe/6/dynamic invalid/7
@@ -286,6 +356,7 @@ class CDetourDis
   protected:
     static const COPYENTRY  s_rceCopyTable[];
     static const COPYENTRY  s_rceCopyTable0F[];
+    static const COPYFUNC   s_rpfCopy[];
     static const BYTE       s_rbModRm[256];
     static PBYTE            s_pbModuleBeg;
     static PBYTE            s_pbModuleEnd;
@@ -330,7 +401,9 @@ CDetourDis::CDetourDis(_Out_opt_ PBYTE *ppbTarget, _Out_opt_ LONG *plExtra) :
     m_bF2(FALSE),
     m_bF3(FALSE),
     m_bVex(FALSE),
-    m_bEvex(FALSE)
+    m_bEvex(FALSE),
+    m_pbDecodeStart(NULL),
+    m_bDecodeCacheable(FALSE)
 {
     m_ppbTarget = ppbTarget ? ppbTarget : &m_pbScratchTarget;
     m_plExtra = plExtra ? plExtra : &m_lScratchExtra;
@@ -339,6 +412,15 @@ CDetourDis::CDetourDis(_Out_opt_ PBYTE *ppbTarget, _Out_opt_ LONG *plExtra) :
     *m_plExtra = 0;
 }
 
+inline PBYTE CDetourDis::Copy(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc)
+{
+    // Most opcodes need no special handling, so call that directly.
+    if (pEntry->nCopy == COPY_Bytes) {
+        return CopyBytes(pEntry, pbDst, pbSrc);
+    }
+    return (this->*s_rpfCopy[pEntry->nCopy])(pEntry, pbDst, pbSrc);
+}
+
 PBYTE CDetourDis::CopyInstruction(PBYTE pbDst, PBYTE pbSrc)
 {
     // Configure scratch areas if real areas are not available.
@@ -351,11 +433,71 @@ PBYTE CDetourDis::CopyInstruction(PBYTE pbDst, PBYTE pbSrc)
         return NULL;
     }
 
+    // Replay the previous decode of these bytes if we have one.  If the
+    // cache is busy on another thread, just decode without it.
+    DECODEENTRY *pCacheEntry = &s_rdeDecodeCache[((ULONG_PTR)pbSrc ^ ((ULONG_PTR)pbSrc >> 8))
+                                                 % ARRAYSIZE(s_rdeDecodeCache)];
+    BOOL fLocked = (s_fDecodeCache &&
+                    InterlockedCompareExchange(&s_nDecodeCacheLock, 1, 0) == 0);
+    if (fLocked) {
+        if (pCacheEntry->pbSrc == pbSrc &&
+            pCacheEntry->nHash == HashInstruction(pbSrc, pCacheEntry->cbInstruction)) {
+
+            DECODEENTRY entry = *pCacheEntry;
+            InterlockedExchange(&s_nDecodeCacheLock, 0);
+            return ReplayInstruction(entry, pbDst, pbSrc);
+        }
+        InterlockedExchange(&s_nDecodeCacheLock, 0);
+    }
+
     // Figure out how big the instruction is, do the appropriate copy,
     // and figure out what the target of the instruction is if any.
     //
+    m_pbDecodeStart = pbSrc;
     REFCOPYENTRY pEntry = &s_rceCopyTable[pbSrc[0]];
-    return (this->*pEntry->pfCopy)(pEntry, pbDst, pbSrc);
+    PBYTE pbNext = Copy(pEntry, pbDst, pbSrc);
+
+    // Remember the decode if it can be replayed from the bytes alone.
+    if (m_bDecodeCacheable && fLocked &&
+        InterlockedCompareExchange(&s_nDecodeCacheLock, 1, 0) == 0) {
+
+        m_deDecode.pbSrc = pbSrc;
+        m_deDecode.nHash = HashInstruction(pbSrc, m_deDecode.cbInstruction);
+        *pCacheEntry = m_deDecode;
+        InterlockedExchange(&s_nDecodeCacheLock, 0);
+    }
+    return pbNext;
+}
+
+ULONG CDetourDis::HashInstruction(PBYTE pbSrc, UINT cbInstruction)
+{
+    // FNV-1a.
+    ULONG nHash = 2166136261u;
+    for (UINT n = 0; n < cbInstruction; n++) {
+        nHash = (nHash ^ pbSrc[n]) * 16777619u;
+    }
+    return nHash;
+}
+
+PBYTE CDetourDis::ReplayInstruction(const DECODEENTRY& entry, PBYTE pbDst, PBYTE pbSrc)
+{
+    // This mirrors the end of CopyBytes for the whole instruction.
+    CopyMemory(pbDst, pbSrc, entry.cbInstruction);
+
+    if (entry.cbTargetOffset) {
+        *m_ppbTarget = AdjustTarget(pbDst, pbSrc, entry.cbInstruction,
+                                    entry.cbTargetOffset, entry.cbTargetSize);
+        if (entry.nDecodeFlags & DECODE_DATA) {
+            *m_ppbTarget = NULL;
+        }
+    }
+    if (entry.nDecodeFlags & DECODE_NOENLARGE) {
+        *m_plExtra = -*m_plExtra;
+    }
+    if (entry.nDecodeFlags & DECODE_DYNAMIC) {
+        *m_ppbTarget = (PBYTE)DETOUR_INSTRUCTION_TARGET_DYNAMIC;
+    }
+    return pbSrc + entry.cbInstruction;
 }
 
 PBYTE CDetourDis::CopyBytes(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc)
@@ -436,6 +578,27 @@ PBYTE CDetourDis::CopyBytes(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc)
     if (nFlagBits & DYNAMIC) {
         *m_ppbTarget = (PBYTE)DETOUR_INSTRUCTION_TARGET_DYNAMIC;
     }
+
+    // Describe the whole instruction, prefixes included, for the decode cache.
+    if (m_pbDecodeStart != NULL) {
+        UINT nPrefix = (UINT)(pbSrc - m_pbDecodeStart);
+        m_deDecode.cbInstruction = (BYTE)(nPrefix + nBytes);
+        m_deDecode.cbTargetOffset = (BYTE)(nRelOffset ? nPrefix + nRelOffset : 0);
+        m_deDecode.cbTargetSize = (BYTE)cbTarget;
+        m_deDecode.nDecodeFlags = 0;
+#ifdef DETOURS_X64
+        if (nRelOffset && pEntry->nRelOffset == 0) {
+            m_deDecode.nDecodeFlags |= DECODE_DATA;
+        }
+#endif
+        if (nFlagBits & NOENLARGE) {
+            m_deDecode.nDecodeFlags |= DECODE_NOENLARGE;
+        }
+        if (nFlagBits & DYNAMIC) {
+            m_deDecode.nDecodeFlags |= DECODE_DYNAMIC;
+        }
+        m_bDecodeCacheable = TRUE;
+    }
     return pbSrc + nBytes;
 }
 
@@ -443,7 +606,7 @@ PBYTE CDetourDis::CopyBytesPrefix(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc)
 {
     pbDst[0] = pbSrc[0];
     pEntry = &s_rceCopyTable[pbSrc[1]];
-    return (this->*pEntry->pfCopy)(pEntry, pbDst + 1, pbSrc + 1);
+    return Copy(pEntry, pbDst + 1, pbSrc + 1);
 }
 
 PBYTE CDetourDis::CopyBytesSegment(REFCOPYENTRY, PBYTE pbDst, PBYTE pbSrc)
@@ -587,7 +750,7 @@ PBYTE CDetourDis::Copy0F(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc)
 {
     pbDst[0] = pbSrc[0];
     pEntry = &s_rceCopyTable0F[pbSrc[1]];
-    return (this->*pEntry->pfCopy)(pEntry, pbDst + 1, pbSrc + 1);
+    return Copy(pEntry, pbDst + 1, pbSrc + 1);
 }
 
 PBYTE CDetourDis::Copy0F78(REFCOPYENTRY, PBYTE pbDst, PBYTE pbSrc)
@@ -605,7 +768,7 @@ PBYTE CDetourDis::Copy0F78(REFCOPYENTRY, PBYTE pbDst, PBYTE pbSrc)
 
     REFCOPYENTRY const pEntry = ((m_bF2 || m_bOperandOverride) ? &extrq_insertq : &vmread);
 
-    return (this->*pEntry->pfCopy)(pEntry, pbDst, pbSrc);
+    return Copy(pEntry, pbDst, pbSrc);
 }
 
 PBYTE CDetourDis::Copy0F00(REFCOPYENTRY, PBYTE pbDst, PBYTE pbSrc)
@@ -617,7 +780,7 @@ PBYTE CDetourDis::Copy0F00(REFCOPYENTRY, PBYTE pbDst, PBYTE pbSrc)
     static const COPYENTRY jmpe = /* B8 */ ENTRY_CopyBytes2ModDynamic; // jmpe/6 x86-on-IA64 syscalls
 
     REFCOPYENTRY const pEntry = (((6 << 3) == ((7 << 3) & pbSrc[1])) ?  &jmpe : &other);
-    return (this->*pEntry->pfCopy)(pEntry, pbDst, pbSrc);
+    return Copy(pEntry, pbDst, pbSrc);
 }
 
 PBYTE CDetourDis::Copy0FB8(REFCOPYENTRY, PBYTE pbDst, PBYTE pbSrc)
@@ -627,7 +790,7 @@ PBYTE CDetourDis::Copy0FB8(REFCOPYENTRY, PBYTE pbDst, PBYTE pbSrc)
     static const COPYENTRY popcnt = /* B8 */ ENTRY_CopyBytes2Mod;
     static const COPYENTRY jmpe = /* B8 */ ENTRY_CopyBytes3Or5Dynamic; // jmpe x86-on-IA64 syscalls
     REFCOPYENTRY const pEntry = m_bF3 ? &popcnt : &jmpe;
-    return (this->*pEntry->pfCopy)(pEntry, pbDst, pbSrc);
+    return Copy(pEntry, pbDst, pbSrc);
 }
 
 PBYTE CDetourDis::Copy66(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc)
@@ -661,7 +824,7 @@ PBYTE CDetourDis::CopyF6(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc)
     // TEST BYTE /0
     if (0x00 == (0x38 & pbSrc[1])) {    // reg(bits 543) of ModR/M == 0
         static const COPYENTRY ce = /* f6 */ ENTRY_CopyBytes2Mod1;
-        return (this->*ce.pfCopy)(&ce, pbDst, pbSrc);
+        return Copy(&ce, pbDst, pbSrc);
     }
     // DIV /6
     // IDIV /7
@@ -671,7 +834,7 @@ PBYTE CDetourDis::CopyF6(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc)
     // NOT /2
 
     static const COPYENTRY ce = /* f6 */ ENTRY_CopyBytes2Mod;
-    return (this->*ce.pfCopy)(&ce, pbDst, pbSrc);
+    return Copy(&ce, pbDst, pbSrc);
 }
 
 PBYTE CDetourDis::CopyF7(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc)
@@ -681,7 +844,7 @@ PBYTE CDetourDis::CopyF7(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc)
     // TEST WORD /0
     if (0x00 == (0x38 & pbSrc[1])) {    // reg(bits 543) of ModR/M == 0
         static const COPYENTRY ce = /* f7 */ ENTRY_CopyBytes2ModOperand;
-        return (this->*ce.pfCopy)(&ce, pbDst, pbSrc);
+        return Copy(&ce, pbDst, pbSrc);
     }
 
     // DIV /6
@@ -691,7 +854,7 @@ PBYTE CDetourDis::CopyF7(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc)
     // NEG /3
     // NOT /2
     static const COPYENTRY ce = /* f7 */ ENTRY_CopyBytes2Mod;
-    return (this->*ce.pfCopy)(&ce, pbDst, pbSrc);
+    return Copy(&ce, pbDst, pbSrc);
 }
 
 PBYTE CDetourDis::CopyFF(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc)
@@ -706,7 +869,11 @@ PBYTE CDetourDis::CopyFF(REFCOPYENTRY pEntry, PBYTE pbDst, PBYTE pbSrc)
     (void)pEntry;
 
     static const COPYENTRY ce = /* ff */ ENTRY_CopyBytes2Mod;
-    PBYTE pbOut = (this->*ce.pfCopy)(&ce, pbDst, pbSrc);
+    PBYTE pbOut = Copy(&ce, pbDst, pbSrc);
+
+    // The target of an indirect CALL or JMP is read from memory, so this
+    // decode can't be replayed from the instruction bytes.
+    m_bDecodeCacheable = FALSE;
 
     BYTE const b1 = pbSrc[1];
 
@@ -766,7 +933,7 @@ PBYTE CDetourDis::CopyVexEvexCommon(BYTE m, PBYTE pbDst, PBYTE pbSrc, BYTE p, BY
     switch (m | fp16) {
     default: return Invalid(&ceInvalid, pbDst, pbSrc);
     case 1:  pEntry = &s_rceCopyTable0F[pbSrc[0]];
-             return (this->*pEntry->pfCopy)(pEntry, pbDst, pbSrc);
+             return Copy(pEntry, pbDst, pbSrc);
     case 5:  // fallthrough
     case 6:  // fallthrough
     case 2:  return CopyBytes(&ceF38, pbDst, pbSrc);
@@ -791,7 +958,7 @@ PBYTE CDetourDis::CopyVex3(REFCOPYENTRY, PBYTE pbDst, PBYTE pbSrc)
     const static COPYENTRY ceLES = /* C4 */ ENTRY_CopyBytes2Mod;
     if ((pbSrc[1] & 0xC0) != 0xC0) {
         REFCOPYENTRY pEntry = &ceLES;
-        return (this->*pEntry->pfCopy)(pEntry, pbDst, pbSrc);
+        return Copy(pEntry, pbDst, pbSrc);
     }
 #endif
     pbDst[0] = pbSrc[0];
@@ -836,7 +1003,7 @@ PBYTE CDetourDis::CopyVex2(REFCOPYENTRY, PBYTE pbDst, PBYTE pbSrc)
     const static COPYENTRY ceLDS = /* C5 */ ENTRY_CopyBytes2Mod;
     if ((pbSrc[1] & 0xC0) != 0xC0) {
         REFCOPYENTRY pEntry = &ceLDS;
-        return (this->*pEntry->pfCopy)(pEntry, pbDst, pbSrc);
+        return Copy(pEntry, pbDst, pbSrc);
     }
 #endif
     pbDst[0] = pbSrc[0];
@@ -923,6 +1090,9 @@ pp is like VEX but only instructions with 0 are defined
 PBYTE CDetourDis::s_pbModuleBeg = NULL;
 PBYTE CDetourDis::s_pbModuleEnd = (PBYTE)~(ULONG_PTR)0;
 BOOL CDetourDis::s_fLimitReferencesToModule = FALSE;
+CDetourDis::DECODEENTRY CDetourDis::s_rdeDecodeCache[256];
+LONG CDetourDis::s_nDecodeCacheLock = 0;
+BOOL CDetourDis::s_fDecodeCache = TRUE;
 
 BOOL CDetourDis::SetCodeModule(PBYTE pbBeg, PBYTE pbEnd, BOOL fLimitReferencesToModule)
 {
@@ -937,6 +1107,22 @@ BOOL CDetourDis::SetCodeModule(PBYTE pbBeg, PBYTE pbEnd, BOOL fLimitReferencesTo
     return TRUE;
 }
 
+BOOL CDetourDis::SetDecodeCache(BOOL fEnabled)
+{
+    BOOL fPrevious = s_fDecodeCache;
+    s_fDecodeCache = fEnabled;
+
+    // Disabling the cache also empties it, once no decode is using it.
+    if (!fEnabled) {
+        while (InterlockedCompareExchange(&s_nDecodeCacheLock, 1, 0) != 0) {
+            YieldProcessor();
+        }
+        ZeroMemory(s_rdeDecodeCache, sizeof(s_rdeDecodeCache));
+        InterlockedExchange(&s_nDecodeCacheLock, 0);
+    }
+    return fPrevious;
+}
+
 ///////////////////////////////////////////////////////// Disassembler Tables.
 //
 const BYTE CDetourDis::s_rbModRm[256] = {
@@ -1599,10 +1785,37 @@ const CDetourDis::COPYENTRY CDetourDis::s_rceCopyTable0F[] =
     /* FF */ ENTRY_Invalid,                            // _FF
 };
 
+const CDetourDis::COPYFUNC CDetourDis::s_rpfCopy[] =
+{
+    /* COPY_Bytes        */ &CDetourDis::CopyBytes,
+    /* COPY_BytesPrefix  */ &CDetourDis::CopyBytesPrefix,
+    /* COPY_BytesSegment */ &CDetourDis::CopyBytesSegment,
+    /* COPY_BytesRax     */ &CDetourDis::CopyBytesRax,
+    /* COPY_BytesJump    */ &CDetourDis::CopyBytesJump,
+    /* COPY_Invalid      */ &CDetourDis::Invalid,
+    /* COPY_0F           */ &CDetourDis::Copy0F,
+    /* COPY_0F78         */ &CDetourDis::Copy0F78,
+    /* COPY_0F00         */ &CDetourDis::Copy0F00,
+    /* COPY_0FB8         */ &CDetourDis::Copy0FB8,
+    /* COPY_66           */ &CDetourDis::Copy66,
+    /* COPY_67           */ &CDetourDis::Copy67,
+    /* COPY_F2           */ &CDetourDis::CopyF2,
+    /* COPY_F3           */ &CDetourDis::CopyF3,
+    /* COPY_F6           */ &CDetourDis::CopyF6,
+    /* COPY_F7           */ &CDetourDis::CopyF7,
+    /* COPY_FF           */ &CDetourDis::CopyFF,
+    /* COPY_Vex2         */ &CDetourDis::CopyVex2,
+    /* COPY_Vex3         */ &CDetourDis::CopyVex3,
+    /* COPY_Evex         */ &CDetourDis::CopyEvex,
+    /* COPY_Xop          */ &CDetourDis::CopyXop,
+};
+
 BOOL CDetourDis::SanityCheckSystem()
 {
     C_ASSERT(ARRAYSIZE(CDetourDis::s_rceCopyTable) == 256);
     C_ASSERT(ARRAYSIZE(CDetourDis::s_rceCopyTable0F) == 256);
+    C_ASSERT(ARRAYSIZE(CDetourDis::s_rpfCopy) == COPY_Count);
+    C_ASSERT(sizeof(CDetourDis::COPYENTRY) == 4);
     return TRUE;
 }
 #endif // defined(DETOURS_X64) || defined(DETOURS_X86)
@@ -4302,5 +4515,17 @@ BOOL WINAPI DetourSetCodeModule(_In_ HMODULE hModule,
 #endif
 }
 
+BOOL WINAPI DetourSetDecodeCache(_In_ BOOL fEnabled)
+{
+#if defined(DETOURS_X64) || defined(DETOURS_X86)
+    return CDetourDis::SetDecodeCache(fEnabled);
+#elif defined(DETOURS_ARM) || defined(DETOURS_ARM64) || defined(DETOURS_IA64)
+    (void)fEnabled;
+    return FALSE;
+#else
+#error unknown architecture (x86, x64, arm, arm64, ia64)
+#endif
+}
+
 //
 ///////////////////////////////////////////////////////////////// End of File.
@@ -12,6 +12,7 @@
 // #define DETOUR_DEBUG 1
 #define DETOURS_INTERNAL
 #include "detours.h"
+#include <stdlib.h>
 
 #if DETOURS_VERSION != 0x4c0c1   // 0xMAJORcMINORcPATCH
 #error detours.h version mismatch
@@ -26,6 +27,10 @@ const GUID DETOUR_EXE_RESTORE_GUID = {
     0xbda26f34, 0xbc82, 0x4829,
     { 0x9e, 0x64, 0x74, 0x2c, 0x4, 0xc8, 0x4f, 0xa0 } };
 
+const GUID DETOUR_PAYLOAD_DIRECTORY_GUID = { /* 5c3d8e4a-1f27-4b96-a0d3-7e6b2c9f41d8 */
+    0x5c3d8e4a, 0x1f27, 0x4b96,
+    { 0xa0, 0xd3, 0x7e, 0x6b, 0x2c, 0x9f, 0x41, 0xd8 } };
+
 //////////////////////////////////////////////////////////////////////////////
 //
 PDETOUR_SYM_INFO DetourLoadImageHlp(VOID)
@@ -139,6 +144,154 @@ PDETOUR_SYM_INFO DetourLoadImageHlp(VOID)
     return pSymInfo;
 }
 
+//////////////////////////////////////////////////// Function Address Cache.
+//
+//  Resolved functions are cached by module base and name, so hooking a large
+//  API set doesn't repeat the symbol engine work for every lookup.  Each
+//  entry also records the module's time stamp and size, so that an entry
+//  left behind by an unloaded module isn't returned for a new module loaded
+//  at the same base.
+//
+struct DETOUR_FUNCTION_CACHE_ENTRY
+{
+    DETOUR_FUNCTION_CACHE_ENTRY *   pNext;
+    HMODULE                         hModule;
+    DWORD                           nTimeDateStamp;
+    DWORD                           cbImage;
+    ULONG                           nHash;
+    PVOID                           pvFunction;
+    CHAR                            szName[1];  // Allocated to fit.
+};
+
+#define DETOUR_FUNCTION_CACHE_BUCKETS   256
+
+static DETOUR_FUNCTION_CACHE_ENTRY *    s_rpFunctionCache[DETOUR_FUNCTION_CACHE_BUCKETS];
+static LONG                             s_nFunctionCacheLock = 0;
+
+static ULONG detour_hash_function_name(_In_ LPCSTR pszName)
+{
+    // FNV-1a.
+    ULONG nHash = 2166136261u;
+    for (; *pszName; pszName++) {
+        nHash = (nHash ^ (BYTE)*pszName) * 16777619u;
+    }
+    return nHash;
+}
+
+static void detour_lock_function_cache()
+{
+    while (InterlockedCompareExchange(&s_nFunctionCacheLock, 1, 0) != 0) {
+        Sleep(0);
+    }
+}
+
+static void detour_unlock_function_cache()
+{
+    InterlockedExchange(&s_nFunctionCacheLock, 0);
+}
+
+// Reads the identity of a loaded module, or returns FALSE.
+static BOOL detour_get_module_identity(_In_ HMODULE hModule,
+                                       _Out_ PDWORD pnTimeDateStamp,
+                                       _Out_ PDWORD pcbImage)
+{
+    *pnTimeDateStamp = 0;
+    *pcbImage = 0;
+
+    __try {
+        CDetourImageView view;
+        if (!view.Attach(hModule)) {
+            return FALSE;
+        }
+        *pnTimeDateStamp = view.NtHeader()->FileHeader.TimeDateStamp;
+        *pcbImage = view.SizeOfImage();
+        return TRUE;
+    }
+    __except(GetExceptionCode() == EXCEPTION_ACCESS_VIOLATION ?
+             EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+        return FALSE;
+    }
+}
+
+static PVOID detour_find_cached_function(_In_ HMODULE hModule,
+                                         _In_ DWORD nTimeDateStamp,
+                                         _In_ DWORD cbImage,
+                                         _In_ LPCSTR pszName,
+                                         _In_ ULONG nHash)
+{
+    PVOID pvFunction = NULL;
+
+    detour_lock_function_cache();
+    for (DETOUR_FUNCTION_CACHE_ENTRY *pEntry
+             = s_rpFunctionCache[nHash % DETOUR_FUNCTION_CACHE_BUCKETS];
+         pEntry != NULL; pEntry = pEntry->pNext) {
+
+        if (pEntry->nHash == nHash &&
+            pEntry->hModule == hModule &&
+            strcmp(pEntry->szName, pszName) == 0) {
+
+            if (pEntry->nTimeDateStamp == nTimeDateStamp && pEntry->cbImage == cbImage) {
+                pvFunction = pEntry->pvFunction;
+            }
+            break;
+        }
+    }
+    detour_unlock_function_cache();
+
+    return pvFunction;
+}
+
+static void detour_cache_function(_In_ HMODULE hModule,
+                                  _In_ DWORD nTimeDateStamp,
+                                  _In_ DWORD cbImage,
+                                  _In_ LPCSTR pszName,
+                                  _In_ ULONG nHash,
+                                  _In_ PVOID pvFunction)
+{
+    SIZE_T cchName = strlen(pszName);
+
+    // Allocate before taking the lock; if we lose a race, the entry is
+    // simply updated and this one is dropped.
+    PBYTE pbEntry = new NOTHROW BYTE [sizeof(DETOUR_FUNCTION_CACHE_ENTRY) + cchName];
+    if (pbEntry == NULL) {
+        return;
+    }
+
+    detour_lock_function_cache();
+    DETOUR_FUNCTION_CACHE_ENTRY **ppBucket
+        = &s_rpFunctionCache[nHash % DETOUR_FUNCTION_CACHE_BUCKETS];
+    for (DETOUR_FUNCTION_CACHE_ENTRY *pEntry = *ppBucket; pEntry != NULL; pEntry = pEntry->pNext) {
+        if (pEntry->nHash == nHash &&
+            pEntry->hModule == hModule &&
+            strcmp(pEntry->szName, pszName) == 0) {
+
+            pEntry->nTimeDateStamp = nTimeDateStamp;
+            pEntry->cbImage = cbImage;
+            pEntry->pvFunction = pvFunction;
+            detour_unlock_function_cache();
+            delete[] pbEntry;
+            return;
+        }
+    }
+
+    DETOUR_FUNCTION_CACHE_ENTRY *pEntry = (DETOUR_FUNCTION_CACHE_ENTRY *)pbEntry;
+    pEntry->hModule = hModule;
+    pEntry->nTimeDateStamp = nTimeDateStamp;
+    pEntry->cbImage = cbImage;
+    pEntry->nHash = nHash;
+    pEntry->pvFunction = pvFunction;
+    CopyMemory(pEntry->szName, pszName, cchName + 1);
+    pEntry->pNext = *ppBucket;
+    *ppBucket = pEntry;
+    detour_unlock_function_cache();
+}
+
+static PVOID detour_find_function_uncached(_In_ HMODULE hModule,
+                                           _In_ LPCSTR pszModule,
+                                           _In_ LPCSTR pszFunction);
+static PIMAGE_EXPORT_DIRECTORY detour_get_export_directory(_In_ const CDetourImageView& view,
+                                                           _Out_ PDWORD pcbExportDir);
+
 PVOID WINAPI DetourFindFunction(_In_ LPCSTR pszModule,
                                 _In_ LPCSTR pszFunction)
 {
@@ -147,14 +300,203 @@ PVOID WINAPI DetourFindFunction(_In_ LPCSTR pszModule,
         return NULL;
     }
 
-    /////////////////////////////////////////////// First, try GetProcAddress.
-    //
 #pragma prefast(suppress:28752, "We don't do the unicode conversion for LoadLibraryExA.")
     HMODULE hModule = LoadLibraryExA(pszModule, NULL, 0);
     if (hModule == NULL) {
         return NULL;
     }
 
+    DWORD nTimeDateStamp = 0;
+    DWORD cbImage = 0;
+    BOOL fCacheable = detour_get_module_identity(hModule, &nTimeDateStamp, &cbImage);
+    ULONG nHash = detour_hash_function_name(pszFunction);
+
+    if (fCacheable) {
+        PVOID pvFunction = detour_find_cached_function(hModule, nTimeDateStamp, cbImage,
+                                                       pszFunction, nHash);
+        if (pvFunction != NULL) {
+            SetLastError(NO_ERROR);
+            return pvFunction;
+        }
+    }
+
+    PVOID pvFunction = detour_find_function_uncached(hModule, pszModule, pszFunction);
+    if (pvFunction != NULL && fCacheable) {
+        detour_cache_function(hModule, nTimeDateStamp, cbImage, pszFunction, nHash, pvFunction);
+    }
+    return pvFunction;
+}
+
+// Sort record for DetourFindFunctions.
+struct DETOUR_FIND_FUNCTION_REQUEST
+{
+    LPCSTR  pszName;
+    ULONG   nIndex;
+};
+
+static int __cdecl detour_compare_find_requests(const void *pvLeft, const void *pvRight)
+{
+    return strcmp(((const DETOUR_FIND_FUNCTION_REQUEST *)pvLeft)->pszName,
+                  ((const DETOUR_FIND_FUNCTION_REQUEST *)pvRight)->pszName);
+}
+
+// Resolves sorted requests against the sorted export name table in a
+// single merge pass.  Forwarders and missing names are left as NULL.
+static void detour_merge_find_exports(_In_ HMODULE hModule,
+                                      _In_reads_(cRequests) DETOUR_FIND_FUNCTION_REQUEST *pRequests,
+                                      _In_ ULONG cRequests,
+                                      _Inout_updates_(cRequests) PVOID *ppvFunctions)
+{
+    __try {
+        CDetourImageView view;
+        if (!view.Attach(hModule)) {
+            return;
+        }
+
+        DWORD cbExportDir = 0;
+        PIMAGE_EXPORT_DIRECTORY pExportDir = detour_get_export_directory(view, &cbExportDir);
+        if (pExportDir == NULL) {
+            return;
+        }
+
+        PBYTE pExportDirEnd = (PBYTE)pExportDir + cbExportDir;
+        DWORD cFunctions = pExportDir->NumberOfFunctions;
+        DWORD cNames = pExportDir->NumberOfNames;
+        PDWORD pdwFunctions = (PDWORD)view.RvaToPointer(pExportDir->AddressOfFunctions,
+                                                        (SIZE_T)cFunctions * sizeof(DWORD));
+        PDWORD pdwNames = (PDWORD)view.RvaToPointer(pExportDir->AddressOfNames,
+                                                    (SIZE_T)cNames * sizeof(DWORD));
+        PWORD pwOrdinals = (PWORD)view.RvaToPointer(pExportDir->AddressOfNameOrdinals,
+                                                    (SIZE_T)cNames * sizeof(WORD));
+        if (pdwFunctions == NULL || pdwNames == NULL || pwOrdinals == NULL) {
+            return;
+        }
+
+        ULONG nRequest = 0;
+        DWORD nName = 0;
+        while (nRequest < cRequests && nName < cNames) {
+            PCHAR pszExport = view.RvaToString(pdwNames[nName]);
+            if (pszExport == NULL) {
+                nName++;
+                continue;
+            }
+
+            int nCmp = strcmp(pRequests[nRequest].pszName, pszExport);
+            if (nCmp < 0) {
+                nRequest++;
+            }
+            else if (nCmp > 0) {
+                nName++;
+            }
+            else {
+                WORD nFunc = pwOrdinals[nName];
+                PBYTE pbCode = (nFunc < cFunctions)
+                    ? view.RvaToPointer(pdwFunctions[nFunc], 1) : NULL;
+
+                if (pbCode > (PBYTE)pExportDir && pbCode < pExportDirEnd) {
+                    pbCode = NULL;
+                }
+                // Duplicate requests for the same name all match this export.
+                ppvFunctions[pRequests[nRequest].nIndex] = pbCode;
+                nRequest++;
+            }
+        }
+    }
+    __except(GetExceptionCode() == EXCEPTION_ACCESS_VIOLATION ?
+             EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+        return;
+    }
+}
+
+ULONG WINAPI DetourFindFunctions(_In_ LPCSTR pszModule,
+                                 _In_reads_(cFunctions) LPCSTR *ppszFunctions,
+                                 _In_ ULONG cFunctions,
+                                 _Out_writes_(cFunctions) PVOID *ppvFunctions)
+{
+    if (ppszFunctions == NULL || ppvFunctions == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+    for (ULONG n = 0; n < cFunctions; n++) {
+        ppvFunctions[n] = NULL;
+        if (ppszFunctions[n] == NULL) {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return 0;
+        }
+    }
+
+#pragma prefast(suppress:28752, "We don't do the unicode conversion for LoadLibraryExA.")
+    HMODULE hModule = LoadLibraryExA(pszModule, NULL, 0);
+    if (hModule == NULL) {
+        return 0;
+    }
+
+    DWORD nTimeDateStamp = 0;
+    DWORD cbImage = 0;
+    BOOL fCacheable = detour_get_module_identity(hModule, &nTimeDateStamp, &cbImage);
+
+    // Collect the names that aren't cached yet.
+    DETOUR_FIND_FUNCTION_REQUEST *pRequests = new NOTHROW DETOUR_FIND_FUNCTION_REQUEST [cFunctions];
+    ULONG cRequests = 0;
+    for (ULONG n = 0; n < cFunctions; n++) {
+        if (fCacheable) {
+            ppvFunctions[n] = detour_find_cached_function(hModule, nTimeDateStamp, cbImage,
+                                                          ppszFunctions[n],
+                                                          detour_hash_function_name(ppszFunctions[n]));
+        }
+        if (ppvFunctions[n] == NULL && pRequests != NULL) {
+            pRequests[cRequests].pszName = ppszFunctions[n];
+            pRequests[cRequests].nIndex = n;
+            cRequests++;
+        }
+    }
+
+    // Resolve the rest against the export table in one pass.  Anything
+    // still missing (forwarders, symbols) then takes the slow path.
+    if (cRequests > 0) {
+        qsort(pRequests, cRequests, sizeof(pRequests[0]), detour_compare_find_requests);
+        detour_merge_find_exports(hModule, pRequests, cRequests, ppvFunctions);
+    }
+    for (ULONG n = 0; n < cRequests; n++) {
+        ULONG nIndex = pRequests[n].nIndex;
+        if (ppvFunctions[nIndex] == NULL) {
+            ppvFunctions[nIndex] = detour_find_function_uncached(hModule, pszModule,
+                                                                 ppszFunctions[nIndex]);
+        }
+        if (ppvFunctions[nIndex] != NULL && fCacheable) {
+            detour_cache_function(hModule, nTimeDateStamp, cbImage, ppszFunctions[nIndex],
+                                  detour_hash_function_name(ppszFunctions[nIndex]),
+                                  ppvFunctions[nIndex]);
+        }
+    }
+    if (pRequests != NULL) {
+        delete[] pRequests;
+    }
+    else {
+        for (ULONG n = 0; n < cFunctions; n++) {
+            if (ppvFunctions[n] == NULL) {
+                ppvFunctions[n] = detour_find_function_uncached(hModule, pszModule,
+                                                                ppszFunctions[n]);
+            }
+        }
+    }
+
+    ULONG cFound = 0;
+    for (ULONG n = 0; n < cFunctions; n++) {
+        if (ppvFunctions[n] != NULL) {
+            cFound++;
+        }
+    }
+    SetLastError(cFound == cFunctions ? NO_ERROR : ERROR_PROC_NOT_FOUND);
+    return cFound;
+}
+
+static PVOID detour_find_function_uncached(_In_ HMODULE hModule,
+                                           _In_ LPCSTR pszModule,
+                                           _In_ LPCSTR pszFunction)
+{
+    /////////////////////////////////////////////// First, try GetProcAddress.
+    //
     PBYTE pbCode = (PBYTE)GetProcAddress(hModule, pszFunction);
     if (pbCode) {
         return pbCode;
@@ -294,48 +636,435 @@ HMODULE WINAPI DetourEnumerateModules(_In_opt_ HMODULE hModuleLast)
     return NULL;
 }
 
-PVOID WINAPI DetourGetEntryPoint(_In_opt_ HMODULE hModule)
+//////////////////////////////////////////////////////////////////////////////
+//
+//  CDetourImageView, declared in detours.h.
+//
+#define DETOUR_IMAGE_VIEW_HEADER_READ   0x1000
+#define DETOUR_IMAGE_VIEW_HEADER_LIMIT  MM_ALLOCATION_GRANULARITY
+
+CDetourImageView::CDetourImageView()
+    : m_pbBase(NULL),
+      m_cbImage(0),
+      m_pbData(NULL),
+      m_cbData(0),
+      m_pbOwned(NULL),
+      m_fFileLayout(FALSE),
+      m_pfRead(NULL),
+      m_pvReadContext(NULL),
+      m_pNtHeader(NULL),
+      m_pDirectories(NULL),
+      m_cDirectories(0)
+{
+}
+
+CDetourImageView::~CDetourImageView()
+{
+    Reset();
+}
+
+VOID CDetourImageView::Reset()
+{
+    delete[] m_pbOwned;
+    m_pbBase = NULL;
+    m_cbImage = 0;
+    m_pbData = NULL;
+    m_cbData = 0;
+    m_pbOwned = NULL;
+    m_fFileLayout = FALSE;
+    m_pfRead = NULL;
+    m_pvReadContext = NULL;
+    m_pNtHeader = NULL;
+    m_pDirectories = NULL;
+    m_cDirectories = 0;
+}
+
+// Validates the DOS and NT headers in the cbData local bytes at pbData and
+// records them.  *pcbNeeded is set to the size of the headers and section
+// table as far as the bytes present tell, so that a caller reading a remote
+// image can tell a short read from a bad image.
+BOOL CDetourImageView::AttachHeaders(_In_reads_bytes_(cbData) PBYTE pbData,
+                                     _In_ SIZE_T cbData,
+                                     _Out_ PSIZE_T pcbNeeded)
 {
-    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)hModule;
+    *pcbNeeded = sizeof(IMAGE_DOS_HEADER);
+    if (cbData < sizeof(IMAGE_DOS_HEADER)) {
+        SetLastError(ERROR_BAD_EXE_FORMAT);
+        return FALSE;
+    }
+
+    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)pbData;
+    if (pDosHeader->e_magic != IMAGE_DOS_SIGNATURE ||
+        pDosHeader->e_lfanew < (LONG)sizeof(IMAGE_DOS_HEADER)) {
+        SetLastError(ERROR_BAD_EXE_FORMAT);
+        return FALSE;
+    }
+
+    SIZE_T obOptional = (SIZE_T)pDosHeader->e_lfanew + FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader);
+    *pcbNeeded = obOptional;
+    if (cbData < obOptional) {
+        SetLastError(ERROR_BAD_EXE_FORMAT);
+        return FALSE;
+    }
+
+    PIMAGE_NT_HEADERS pNtHeader = (PIMAGE_NT_HEADERS)(pbData + pDosHeader->e_lfanew);
+    if (pNtHeader->Signature != IMAGE_NT_SIGNATURE) {
+        SetLastError(ERROR_INVALID_EXE_SIGNATURE);
+        return FALSE;
+    }
+
+    DWORD cbOptional = pNtHeader->FileHeader.SizeOfOptionalHeader;
+    *pcbNeeded = obOptional + cbOptional
+        + pNtHeader->FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER);
+    if (cbOptional < FIELD_OFFSET(IMAGE_OPTIONAL_HEADER32, DataDirectory)) {
+        SetLastError(ERROR_EXE_MARKED_INVALID);
+        return FALSE;
+    }
+    if (cbData - obOptional < cbOptional) {
+        SetLastError(ERROR_BAD_EXE_FORMAT);
+        return FALSE;
+    }
+
+    // SizeOfImage is at the same offset in both optional headers; the data
+    // directories are not.
+    PIMAGE_DATA_DIRECTORY pDirectories = NULL;
+    DWORD cDirectories = 0;
+    DWORD cbFixed = 0;
+    if (pNtHeader->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
+        PIMAGE_NT_HEADERS32 pNtHeader32 = (PIMAGE_NT_HEADERS32)pNtHeader;
+        pDirectories = pNtHeader32->OptionalHeader.DataDirectory;
+        cDirectories = pNtHeader32->OptionalHeader.NumberOfRvaAndSizes;
+        cbFixed = FIELD_OFFSET(IMAGE_OPTIONAL_HEADER32, DataDirectory);
+    }
+    else if (pNtHeader->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
+        PIMAGE_NT_HEADERS64 pNtHeader64 = (PIMAGE_NT_HEADERS64)pNtHeader;
+        pDirectories = pNtHeader64->OptionalHeader.DataDirectory;
+        cDirectories = pNtHeader64->OptionalHeader.NumberOfRvaAndSizes;
+        cbFixed = FIELD_OFFSET(IMAGE_OPTIONAL_HEADER64, DataDirectory);
+    }
+    else {
+        SetLastError(ERROR_EXE_MARKED_INVALID);
+        return FALSE;
+    }
+
+    // Only trust the directories that fit in the optional header.
+    if (cbOptional < cbFixed) {
+        SetLastError(ERROR_EXE_MARKED_INVALID);
+        return FALSE;
+    }
+    DWORD cFit = (cbOptional - cbFixed) / sizeof(IMAGE_DATA_DIRECTORY);
+    if (cDirectories > cFit) {
+        cDirectories = cFit;
+    }
+    if (cDirectories > IMAGE_NUMBEROF_DIRECTORY_ENTRIES) {
+        cDirectories = IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+    }
+
+    m_pbData = pbData;
+    m_cbData = cbData;
+    m_cbImage = pNtHeader->OptionalHeader.SizeOfImage;
+    m_pNtHeader = pNtHeader;
+    m_pDirectories = pDirectories;
+    m_cDirectories = cDirectories;
+    return TRUE;
+}
+
+BOOL CDetourImageView::Attach(_In_opt_ HMODULE hModule)
+{
+    Reset();
+
+    PBYTE pbModule = (PBYTE)hModule;
     if (hModule == NULL) {
-        pDosHeader = (PIMAGE_DOS_HEADER)GetModuleHandleW(NULL);
+        pbModule = (PBYTE)GetModuleHandleW(NULL);
     }
 
-    __try {
+    // The size of a loaded image is only known once its headers are read, so
+    // they are validated against the largest size and checked against
+    // SizeOfImage after.
+    SIZE_T cbNeeded;
 #pragma warning(suppress:6011) // GetModuleHandleW(NULL) never returns NULL.
-        if (pDosHeader->e_magic != IMAGE_DOS_SIGNATURE) {
-            SetLastError(ERROR_BAD_EXE_FORMAT);
-            return NULL;
+    if (!AttachHeaders(pbModule, MAXDWORD, &cbNeeded)) {
+        Reset();
+        return FALSE;
+    }
+
+    m_pbBase = pbModule;
+    if (m_cbImage == 0) {
+        // Payload blocks copied by older versions of DetourCopyPayloadToProcess
+        // leave SizeOfImage zero, so bound them by their allocation instead.
+        MEMORY_BASIC_INFORMATION mbi;
+        ZeroMemory(&mbi, sizeof(mbi));
+        if (VirtualQuery(pbModule, &mbi, sizeof(mbi)) > 0 && mbi.RegionSize <= MAXDWORD) {
+            m_cbImage = (DWORD)mbi.RegionSize;
         }
+    }
+    m_cbData = m_cbImage;
 
-        PIMAGE_NT_HEADERS pNtHeader = (PIMAGE_NT_HEADERS)((PBYTE)pDosHeader +
-                                                          pDosHeader->e_lfanew);
-        if (pNtHeader->Signature != IMAGE_NT_SIGNATURE) {
-            SetLastError(ERROR_INVALID_EXE_SIGNATURE);
-            return NULL;
+    if (!Contains(m_pNtHeader, FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader)
+                  + m_pNtHeader->FileHeader.SizeOfOptionalHeader)) {
+        Reset();
+        SetLastError(ERROR_EXE_MARKED_INVALID);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL CDetourImageView::AttachFile(_In_reads_bytes_(cbFile) PBYTE pbFile, _In_ SIZE_T cbFile)
+{
+    Reset();
+
+    if (pbFile == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    SIZE_T cbNeeded;
+    if (!AttachHeaders(pbFile, cbFile, &cbNeeded)) {
+        Reset();
+        return FALSE;
+    }
+    m_pbBase = pbFile;
+    m_fFileLayout = TRUE;
+    return TRUE;
+}
+
+BOOL CDetourImageView::AttachRemote(_In_ HMODULE hModule,
+                                    _In_ PF_DETOUR_IMAGE_READ_REMOTE pfRead,
+                                    _In_opt_ PVOID pContext)
+{
+    Reset();
+    if (hModule == NULL || pfRead == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    // Copy the first page, which holds the headers of nearly every image, and
+    // read again only if the headers and section table run past it.  The
+    // copy always covers the largest NT headers so that callers can copy them
+    // out whole.
+    SIZE_T cbRead = DETOUR_IMAGE_VIEW_HEADER_READ;
+    for (;;) {
+        m_pbOwned = new NOTHROW BYTE [cbRead];
+        if (m_pbOwned == NULL) {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return FALSE;
         }
-        if (pNtHeader->FileHeader.SizeOfOptionalHeader == 0) {
-            SetLastError(ERROR_EXE_MARKED_INVALID);
-            return NULL;
+        if (!pfRead(pContext, hModule, m_pbOwned, cbRead)) {
+            DETOUR_TRACE(("ReadProcessMemory(headers@%p..%p) failed: %lu\n",
+                          hModule, (PBYTE)hModule + cbRead, GetLastError()));
+            Reset();
+            return FALSE;
         }
 
-        PDETOUR_CLR_HEADER pClrHeader = NULL;
-        if (pNtHeader->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
-            if (((PIMAGE_NT_HEADERS32)pNtHeader)->CLR_DIRECTORY.VirtualAddress != 0 &&
-                ((PIMAGE_NT_HEADERS32)pNtHeader)->CLR_DIRECTORY.Size != 0) {
-                pClrHeader = (PDETOUR_CLR_HEADER)
-                    (((PBYTE)pDosHeader)
-                     + ((PIMAGE_NT_HEADERS32)pNtHeader)->CLR_DIRECTORY.VirtualAddress);
+        SIZE_T cbNeeded = 0;
+        BOOL fValid = AttachHeaders(m_pbOwned, cbRead, &cbNeeded);
+        if (fValid) {
+            SIZE_T cbNtHeaders = (SIZE_T)DosHeader()->e_lfanew + sizeof(IMAGE_NT_HEADERS64);
+            if (cbNeeded < cbNtHeaders) {
+                cbNeeded = cbNtHeaders;
             }
         }
-        else if (pNtHeader->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
-            if (((PIMAGE_NT_HEADERS64)pNtHeader)->CLR_DIRECTORY.VirtualAddress != 0 &&
-                ((PIMAGE_NT_HEADERS64)pNtHeader)->CLR_DIRECTORY.Size != 0) {
-                pClrHeader = (PDETOUR_CLR_HEADER)
-                    (((PBYTE)pDosHeader)
-                     + ((PIMAGE_NT_HEADERS64)pNtHeader)->CLR_DIRECTORY.VirtualAddress);
+        if (cbNeeded <= cbRead) {
+            if (!fValid) {
+                Reset();
+                return FALSE;
             }
+            break;
+        }
+
+        // Only the first read can be short; a second one is sized to fit.
+        DWORD dwError = GetLastError();
+        BOOL fRetry = (cbRead == DETOUR_IMAGE_VIEW_HEADER_READ &&
+                       cbNeeded <= DETOUR_IMAGE_VIEW_HEADER_LIMIT);
+        Reset();
+        if (!fRetry) {
+            SetLastError(fValid ? ERROR_EXE_MARKED_INVALID : dwError);
+            return FALSE;
+        }
+        cbRead = cbNeeded;
+    }
+
+    m_pbBase = (PBYTE)hModule;
+    m_pfRead = pfRead;
+    m_pvReadContext = pContext;
+    if (!Contains(m_pNtHeader, FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader)
+                  + m_pNtHeader->FileHeader.SizeOfOptionalHeader)) {
+        Reset();
+        SetLastError(ERROR_EXE_MARKED_INVALID);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Returns the local bytes holding nRva and how many follow it, or NULL when
+// the RVA is not present locally: beyond the headers of a remote image, or
+// in the uninitialized tail of a section of a file.
+PBYTE CDetourImageView::RvaToLocal(_In_ DWORD nRva, _Out_ PSIZE_T pcbAvailable) const
+{
+    *pcbAvailable = 0;
+    if (!m_fFileLayout) {
+        if (nRva >= m_cbData) {
+            return NULL;
+        }
+        *pcbAvailable = m_cbData - nRva;
+        return m_pbData + nRva;
+    }
+
+    // The headers are at the same offsets in the file and the image.
+    SIZE_T cbHeaders = m_pNtHeader->OptionalHeader.SizeOfHeaders;
+    if (cbHeaders > m_cbData) {
+        cbHeaders = m_cbData;
+    }
+    if (nRva < cbHeaders) {
+        *pcbAvailable = cbHeaders - nRva;
+        return m_pbData + nRva;
+    }
+
+    DWORD cSections;
+    PIMAGE_SECTION_HEADER pSections = Sections(&cSections);
+    for (DWORD n = 0; n < cSections; n++) {
+        DWORD obSection = nRva - pSections[n].VirtualAddress;
+        if (nRva < pSections[n].VirtualAddress ||
+            obSection >= pSections[n].SizeOfRawData ||
+            pSections[n].PointerToRawData > m_cbData ||
+            obSection >= m_cbData - pSections[n].PointerToRawData) {
+            continue;
         }
+        SIZE_T cbAvailable = pSections[n].SizeOfRawData - obSection;
+        if (cbAvailable > m_cbData - pSections[n].PointerToRawData - obSection) {
+            cbAvailable = m_cbData - pSections[n].PointerToRawData - obSection;
+        }
+        *pcbAvailable = cbAvailable;
+        return m_pbData + pSections[n].PointerToRawData + obSection;
+    }
+    return NULL;
+}
+
+BOOL CDetourImageView::Contains(_In_ const VOID *pvData, _In_ SIZE_T cbData) const
+{
+    PBYTE pbData = (PBYTE)pvData;
+    if (m_pbData == NULL || pbData < m_pbData || pbData > m_pbData + m_cbData) {
+        return FALSE;
+    }
+    return cbData <= (SIZE_T)(m_pbData + m_cbData - pbData);
+}
+
+PBYTE CDetourImageView::RvaToPointer(_In_ DWORD nRva, _In_ SIZE_T cbData) const
+{
+    if (nRva == 0 || nRva > m_cbImage || cbData > m_cbImage - nRva) {
+        return NULL;
+    }
+
+    SIZE_T cbAvailable;
+    PBYTE pbData = RvaToLocal(nRva, &cbAvailable);
+    if (pbData == NULL || cbData > cbAvailable) {
+        return NULL;
+    }
+    return pbData;
+}
+
+PCHAR CDetourImageView::RvaToString(_In_ DWORD nRva) const
+{
+    if (nRva == 0 || nRva >= m_cbImage) {
+        return NULL;
+    }
+
+    SIZE_T cbAvailable;
+    PBYTE pbString = RvaToLocal(nRva, &cbAvailable);
+    if (pbString == NULL || memchr(pbString, 0, cbAvailable) == NULL) {
+        return NULL;
+    }
+    return (PCHAR)pbString;
+}
+
+DWORD CDetourImageView::DirectoryRva(_In_ DWORD nDirectory, _Out_opt_ PDWORD pcbData) const
+{
+    if (pcbData != NULL) {
+        *pcbData = 0;
+    }
+    if (nDirectory >= m_cDirectories || m_pDirectories[nDirectory].Size == 0) {
+        return 0;
+    }
+
+    DWORD nRva = m_pDirectories[nDirectory].VirtualAddress;
+    DWORD cbData = m_pDirectories[nDirectory].Size;
+    if (nRva == 0 || nRva > m_cbImage || cbData > m_cbImage - nRva) {
+        return 0;
+    }
+    if (pcbData != NULL) {
+        *pcbData = cbData;
+    }
+    return nRva;
+}
+
+PBYTE CDetourImageView::Directory(_In_ DWORD nDirectory, _Out_opt_ PDWORD pcbData) const
+{
+    DWORD cbData;
+    DWORD nRva = DirectoryRva(nDirectory, &cbData);
+    PBYTE pbData = (nRva != 0) ? RvaToPointer(nRva, cbData) : NULL;
+
+    if (pcbData != NULL) {
+        *pcbData = (pbData != NULL) ? cbData : 0;
+    }
+    return pbData;
+}
+
+PIMAGE_SECTION_HEADER CDetourImageView::Sections(_Out_ PDWORD pcSections) const
+{
+    *pcSections = 0;
+    if (m_pNtHeader == NULL) {
+        return NULL;
+    }
+
+    PIMAGE_SECTION_HEADER pSectionHeaders
+        = (PIMAGE_SECTION_HEADER)((PBYTE)m_pNtHeader
+                                  + sizeof(m_pNtHeader->Signature)
+                                  + sizeof(m_pNtHeader->FileHeader)
+                                  + m_pNtHeader->FileHeader.SizeOfOptionalHeader);
+    DWORD cSections = m_pNtHeader->FileHeader.NumberOfSections;
+
+    if (!Contains(pSectionHeaders, cSections * sizeof(IMAGE_SECTION_HEADER))) {
+        return NULL;
+    }
+    *pcSections = cSections;
+    return pSectionHeaders;
+}
+
+// Copies cbData bytes of the image at nRva.  Bytes of a remote image are read
+// from the target, so they include any write staged by the reader.
+BOOL CDetourImageView::Read(_In_ DWORD nRva,
+                            _Out_writes_bytes_(cbData) PVOID pvData,
+                            _In_ SIZE_T cbData) const
+{
+    if (m_pbData == NULL || nRva > m_cbImage || cbData > m_cbImage - nRva) {
+        SetLastError(ERROR_INVALID_ADDRESS);
+        return FALSE;
+    }
+    if (m_pfRead != NULL) {
+        return m_pfRead(m_pvReadContext, m_pbBase + nRva, pvData, cbData);
+    }
+
+    SIZE_T cbAvailable;
+    PBYTE pbData = RvaToLocal(nRva, &cbAvailable);
+    if (pbData == NULL || cbData > cbAvailable) {
+        SetLastError(ERROR_INVALID_ADDRESS);
+        return FALSE;
+    }
+    CopyMemory(pvData, pbData, cbData);
+    return TRUE;
+}
+
+PVOID WINAPI DetourGetEntryPoint(_In_opt_ HMODULE hModule)
+{
+    __try {
+        CDetourImageView view;
+        if (!view.Attach(hModule)) {
+            return NULL;
+        }
+
+        DWORD cbClrHeader = 0;
+        PDETOUR_CLR_HEADER pClrHeader = (PDETOUR_CLR_HEADER)
+            view.Directory(IMAGE_DIRECTORY_ENTRY_COM_DESCRIPTOR, &cbClrHeader);
 
         if (pClrHeader != NULL) {
             // For MSIL assemblies, we want to use the _Cor entry points.
@@ -353,12 +1082,15 @@ PVOID WINAPI DetourGetEntryPoint(_In_opt_ HMODULE hModule)
 
         // Pure resource DLLs have neither an entry point nor CLR information
         // so handle them by returning NULL (LastError is NO_ERROR)
-        if (pNtHeader->OptionalHeader.AddressOfEntryPoint == 0) {
+        if (view.NtHeader()->OptionalHeader.AddressOfEntryPoint == 0) {
             return NULL;
         }
 
-        return ((PBYTE)pDosHeader) +
-            pNtHeader->OptionalHeader.AddressOfEntryPoint;
+        PBYTE pbEntry = view.RvaToPointer(view.NtHeader()->OptionalHeader.AddressOfEntryPoint, 1);
+        if (pbEntry == NULL) {
+            SetLastError(ERROR_EXE_MARKED_INVALID);
+        }
+        return pbEntry;
     }
     __except(GetExceptionCode() == EXCEPTION_ACCESS_VIOLATION ?
              EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
@@ -369,31 +1101,14 @@ PVOID WINAPI DetourGetEntryPoint(_In_opt_ HMODULE hModule)
 
 ULONG WINAPI DetourGetModuleSize(_In_opt_ HMODULE hModule)
 {
-    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)hModule;
-    if (hModule == NULL) {
-        pDosHeader = (PIMAGE_DOS_HEADER)GetModuleHandleW(NULL);
-    }
-
     __try {
-#pragma warning(suppress:6011) // GetModuleHandleW(NULL) never returns NULL.
-        if (pDosHeader->e_magic != IMAGE_DOS_SIGNATURE) {
-            SetLastError(ERROR_BAD_EXE_FORMAT);
-            return NULL;
-        }
-
-        PIMAGE_NT_HEADERS pNtHeader = (PIMAGE_NT_HEADERS)((PBYTE)pDosHeader +
-                                                          pDosHeader->e_lfanew);
-        if (pNtHeader->Signature != IMAGE_NT_SIGNATURE) {
-            SetLastError(ERROR_INVALID_EXE_SIGNATURE);
-            return NULL;
-        }
-        if (pNtHeader->FileHeader.SizeOfOptionalHeader == 0) {
-            SetLastError(ERROR_EXE_MARKED_INVALID);
+        CDetourImageView view;
+        if (!view.Attach(hModule)) {
             return NULL;
         }
         SetLastError(NO_ERROR);
 
-        return (pNtHeader->OptionalHeader.SizeOfImage);
+        return view.SizeOfImage();
     }
     __except(GetExceptionCode() == EXCEPTION_ACCESS_VIOLATION ?
              EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
@@ -422,25 +1137,18 @@ HMODULE WINAPI DetourGetContainingModule(_In_ PVOID pvAddr)
             return NULL;
         }
 
-        PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)mbi.AllocationBase;
-        if (pDosHeader->e_magic != IMAGE_DOS_SIGNATURE) {
+        if (mbi.AllocationBase == NULL) {
             SetLastError(ERROR_BAD_EXE_FORMAT);
             return NULL;
         }
 
-        PIMAGE_NT_HEADERS pNtHeader = (PIMAGE_NT_HEADERS)((PBYTE)pDosHeader +
-                                                          pDosHeader->e_lfanew);
-        if (pNtHeader->Signature != IMAGE_NT_SIGNATURE) {
-            SetLastError(ERROR_INVALID_EXE_SIGNATURE);
-            return NULL;
-        }
-        if (pNtHeader->FileHeader.SizeOfOptionalHeader == 0) {
-            SetLastError(ERROR_EXE_MARKED_INVALID);
+        CDetourImageView view;
+        if (!view.Attach((HMODULE)mbi.AllocationBase)) {
             return NULL;
         }
         SetLastError(NO_ERROR);
 
-        return (HMODULE)pDosHeader;
+        return (HMODULE)view.Base();
     }
     __except(GetExceptionCode() == EXCEPTION_ACCESS_VIOLATION ?
              EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
@@ -449,15 +1157,23 @@ HMODULE WINAPI DetourGetContainingModule(_In_ PVOID pvAddr)
     }
 }
 
-
-static inline PBYTE RvaAdjust(_Pre_notnull_ PIMAGE_DOS_HEADER pDosHeader, _In_ DWORD raddr)
+// Returns the export directory of a loaded image and its size, or NULL.
+static PIMAGE_EXPORT_DIRECTORY detour_get_export_directory(_In_ const CDetourImageView& view,
+                                                           _Out_ PDWORD pcbExportDir)
 {
-    if (raddr != NULL) {
-        return ((PBYTE)pDosHeader) + raddr;
+    PIMAGE_EXPORT_DIRECTORY pExportDir = (PIMAGE_EXPORT_DIRECTORY)
+        view.Directory(IMAGE_DIRECTORY_ENTRY_EXPORT, pcbExportDir);
+
+    if (pExportDir == NULL || *pcbExportDir < sizeof(IMAGE_EXPORT_DIRECTORY)) {
+        SetLastError(ERROR_EXE_MARKED_INVALID);
+        return NULL;
     }
-    return NULL;
+    return pExportDir;
 }
 
+// Exports with at most this many functions are indexed on the stack.
+#define DETOUR_EXPORT_STACK_INDEX   512
+
 BOOL WINAPI DetourEnumerateExports(_In_ HMODULE hModule,
                                    _In_opt_ PVOID pContext,
                                    _In_ PF_DETOUR_ENUMERATE_EXPORT_CALLBACK pfExport)
@@ -467,49 +1183,59 @@ BOOL WINAPI DetourEnumerateExports(_In_ HMODULE hModule,
         return FALSE;
     }
 
-    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)hModule;
-    if (hModule == NULL) {
-        pDosHeader = (PIMAGE_DOS_HEADER)GetModuleHandleW(NULL);
-    }
+    // Name index + 1 of each function, or 0 if the function has no name.
+    DWORD rnStackIndex[DETOUR_EXPORT_STACK_INDEX];
+    PDWORD pnNameIndex = NULL;
 
     __try {
-#pragma warning(suppress:6011) // GetModuleHandleW(NULL) never returns NULL.
-        if (pDosHeader->e_magic != IMAGE_DOS_SIGNATURE) {
-            SetLastError(ERROR_BAD_EXE_FORMAT);
-            return NULL;
-        }
-
-        PIMAGE_NT_HEADERS pNtHeader = (PIMAGE_NT_HEADERS)((PBYTE)pDosHeader +
-                                                          pDosHeader->e_lfanew);
-        if (pNtHeader->Signature != IMAGE_NT_SIGNATURE) {
-            SetLastError(ERROR_INVALID_EXE_SIGNATURE);
+        CDetourImageView view;
+        if (!view.Attach(hModule)) {
             return FALSE;
         }
-        if (pNtHeader->FileHeader.SizeOfOptionalHeader == 0) {
-            SetLastError(ERROR_EXE_MARKED_INVALID);
+
+        DWORD cbExportDir = 0;
+        PIMAGE_EXPORT_DIRECTORY pExportDir = detour_get_export_directory(view, &cbExportDir);
+        if (pExportDir == NULL) {
             return FALSE;
         }
 
-        PIMAGE_EXPORT_DIRECTORY pExportDir
-            = (PIMAGE_EXPORT_DIRECTORY)
-            RvaAdjust(pDosHeader,
-                      pNtHeader->OptionalHeader
-                      .DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress);
+        PBYTE pExportDirEnd = (PBYTE)pExportDir + cbExportDir;
+        DWORD cFunctions = pExportDir->NumberOfFunctions;
+        DWORD cNames = pExportDir->NumberOfNames;
+        PDWORD pdwFunctions = (PDWORD)view.RvaToPointer(pExportDir->AddressOfFunctions,
+                                                        (SIZE_T)cFunctions * sizeof(DWORD));
+        PDWORD pdwNames = (PDWORD)view.RvaToPointer(pExportDir->AddressOfNames,
+                                                    (SIZE_T)cNames * sizeof(DWORD));
+        PWORD pwOrdinals = (PWORD)view.RvaToPointer(pExportDir->AddressOfNameOrdinals,
+                                                    (SIZE_T)cNames * sizeof(WORD));
+        if (pdwNames == NULL || pwOrdinals == NULL) {
+            cNames = 0;
+        }
 
-        if (pExportDir == NULL) {
-            SetLastError(ERROR_EXE_MARKED_INVALID);
-            return FALSE;
+        // Invert the name ordinal table once rather than scanning it for
+        // every function.
+        if (cFunctions <= ARRAYSIZE(rnStackIndex)) {
+            pnNameIndex = rnStackIndex;
         }
+        else {
+            pnNameIndex = new NOTHROW DWORD [cFunctions];
+            if (pnNameIndex == NULL) {
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                return FALSE;
+            }
+        }
+        ZeroMemory(pnNameIndex, cFunctions * sizeof(DWORD));
 
-        PBYTE pExportDirEnd = (PBYTE)pExportDir + pNtHeader->OptionalHeader
-            .DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].Size;
-        PDWORD pdwFunctions = (PDWORD)RvaAdjust(pDosHeader, pExportDir->AddressOfFunctions);
-        PDWORD pdwNames = (PDWORD)RvaAdjust(pDosHeader, pExportDir->AddressOfNames);
-        PWORD pwOrdinals = (PWORD)RvaAdjust(pDosHeader, pExportDir->AddressOfNameOrdinals);
+        for (DWORD n = 0; n < cNames; n++) {
+            // If several names share an ordinal, the first one wins.
+            if (pwOrdinals[n] < cFunctions && pnNameIndex[pwOrdinals[n]] == 0) {
+                pnNameIndex[pwOrdinals[n]] = n + 1;
+            }
+        }
 
-        for (DWORD nFunc = 0; nFunc < pExportDir->NumberOfFunctions; nFunc++) {
+        for (DWORD nFunc = 0; nFunc < cFunctions; nFunc++) {
             PBYTE pbCode = (pdwFunctions != NULL)
-                ? (PBYTE)RvaAdjust(pDosHeader, pdwFunctions[nFunc]) : NULL;
+                ? view.RvaToPointer(pdwFunctions[nFunc], 1) : NULL;
             PCHAR pszName = NULL;
 
             // if the pointer is in the export region, then it is a forwarder.
@@ -517,12 +1243,8 @@ BOOL WINAPI DetourEnumerateExports(_In_ HMODULE hModule,
                 pbCode = NULL;
             }
 
-            for (DWORD n = 0; n < pExportDir->NumberOfNames; n++) {
-                if (pwOrdinals[n] == nFunc) {
-                    pszName = (pdwNames != NULL)
-                        ? (PCHAR)RvaAdjust(pDosHeader, pdwNames[n]) : NULL;
-                    break;
-                }
+            if (pnNameIndex[nFunc] != 0) {
+                pszName = view.RvaToString(pdwNames[pnNameIndex[nFunc] - 1]);
             }
             ULONG nOrdinal = pExportDir->Base + nFunc;
 
@@ -530,67 +1252,134 @@ BOOL WINAPI DetourEnumerateExports(_In_ HMODULE hModule,
                 break;
             }
         }
+
+        if (pnNameIndex != rnStackIndex) {
+            delete[] pnNameIndex;
+        }
         SetLastError(NO_ERROR);
         return TRUE;
     }
     __except(GetExceptionCode() == EXCEPTION_ACCESS_VIOLATION ?
              EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+        if (pnNameIndex != NULL && pnNameIndex != rnStackIndex) {
+            delete[] pnNameIndex;
+        }
         SetLastError(ERROR_EXE_MARKED_INVALID);
         return NULL;
     }
 }
 
-BOOL WINAPI DetourEnumerateImportsEx(_In_opt_ HMODULE hModule,
-                                     _In_opt_ PVOID pContext,
-                                     _In_opt_ PF_DETOUR_IMPORT_FILE_CALLBACK pfImportFile,
-                                     _In_opt_ PF_DETOUR_IMPORT_FUNC_CALLBACK_EX pfImportFunc)
+PVOID WINAPI DetourFindExportByName(_In_opt_ HMODULE hModule,
+                                    _In_ LPCSTR pszName)
 {
-    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)hModule;
-    if (hModule == NULL) {
-        pDosHeader = (PIMAGE_DOS_HEADER)GetModuleHandleW(NULL);
+    if (pszName == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
     }
 
     __try {
-#pragma warning(suppress:6011) // GetModuleHandleW(NULL) never returns NULL.
-        if (pDosHeader->e_magic != IMAGE_DOS_SIGNATURE) {
-            SetLastError(ERROR_BAD_EXE_FORMAT);
-            return FALSE;
+        CDetourImageView view;
+        if (!view.Attach(hModule)) {
+            return NULL;
         }
 
-        PIMAGE_NT_HEADERS pNtHeader = (PIMAGE_NT_HEADERS)((PBYTE)pDosHeader +
-                                                          pDosHeader->e_lfanew);
-        if (pNtHeader->Signature != IMAGE_NT_SIGNATURE) {
-            SetLastError(ERROR_INVALID_EXE_SIGNATURE);
-            return FALSE;
+        DWORD cbExportDir = 0;
+        PIMAGE_EXPORT_DIRECTORY pExportDir = detour_get_export_directory(view, &cbExportDir);
+        if (pExportDir == NULL) {
+            return NULL;
         }
-        if (pNtHeader->FileHeader.SizeOfOptionalHeader == 0) {
-            SetLastError(ERROR_EXE_MARKED_INVALID);
+
+        PBYTE pExportDirEnd = (PBYTE)pExportDir + cbExportDir;
+        DWORD cFunctions = pExportDir->NumberOfFunctions;
+        DWORD cNames = pExportDir->NumberOfNames;
+        PDWORD pdwFunctions = (PDWORD)view.RvaToPointer(pExportDir->AddressOfFunctions,
+                                                        (SIZE_T)cFunctions * sizeof(DWORD));
+        PDWORD pdwNames = (PDWORD)view.RvaToPointer(pExportDir->AddressOfNames,
+                                                    (SIZE_T)cNames * sizeof(DWORD));
+        PWORD pwOrdinals = (PWORD)view.RvaToPointer(pExportDir->AddressOfNameOrdinals,
+                                                    (SIZE_T)cNames * sizeof(WORD));
+
+        if (pdwFunctions == NULL || pdwNames == NULL || pwOrdinals == NULL) {
+            SetLastError(ERROR_PROC_NOT_FOUND);
+            return NULL;
+        }
+
+        // The name pointer table is sorted lexically, so binary search it.
+        DWORD nLo = 0;
+        DWORD nHi = cNames;
+        while (nLo < nHi) {
+            DWORD nMid = nLo + (nHi - nLo) / 2;
+            PCHAR pszMid = view.RvaToString(pdwNames[nMid]);
+            int nCmp = (pszMid != NULL) ? strcmp(pszName, pszMid) : 1;
+            if (nCmp < 0) {
+                nHi = nMid;
+            }
+            else if (nCmp > 0) {
+                nLo = nMid + 1;
+            }
+            else {
+                WORD nFunc = pwOrdinals[nMid];
+                if (nFunc >= cFunctions) {
+                    break;
+                }
+
+                PBYTE pbCode = view.RvaToPointer(pdwFunctions[nFunc], 1);
+
+                // Forwarders aren't resolved; use GetProcAddress for those.
+                if (pbCode == NULL ||
+                    (pbCode > (PBYTE)pExportDir && pbCode < pExportDirEnd)) {
+                    break;
+                }
+
+                SetLastError(NO_ERROR);
+                return pbCode;
+            }
+        }
+        SetLastError(ERROR_PROC_NOT_FOUND);
+        return NULL;
+    }
+    __except(GetExceptionCode() == EXCEPTION_ACCESS_VIOLATION ?
+             EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+        SetLastError(ERROR_EXE_MARKED_INVALID);
+        return NULL;
+    }
+}
+
+BOOL WINAPI DetourEnumerateImportsEx(_In_opt_ HMODULE hModule,
+                                     _In_opt_ PVOID pContext,
+                                     _In_opt_ PF_DETOUR_IMPORT_FILE_CALLBACK pfImportFile,
+                                     _In_opt_ PF_DETOUR_IMPORT_FUNC_CALLBACK_EX pfImportFunc)
+{
+    __try {
+        CDetourImageView view;
+        if (!view.Attach(hModule)) {
             return FALSE;
         }
 
         PIMAGE_IMPORT_DESCRIPTOR iidp
-            = (PIMAGE_IMPORT_DESCRIPTOR)
-            RvaAdjust(pDosHeader,
-                      pNtHeader->OptionalHeader
-                      .DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress);
+            = (PIMAGE_IMPORT_DESCRIPTOR)view.Directory(IMAGE_DIRECTORY_ENTRY_IMPORT, NULL);
 
         if (iidp == NULL) {
             SetLastError(ERROR_EXE_MARKED_INVALID);
             return FALSE;
         }
 
-        for (; iidp->OriginalFirstThunk != 0; iidp++) {
+        for (; view.Contains(iidp, sizeof(*iidp)) && iidp->OriginalFirstThunk != 0; iidp++) {
 
-            PCSTR pszName = (PCHAR)RvaAdjust(pDosHeader, iidp->Name);
+            PCSTR pszName = view.RvaToString(iidp->Name);
             if (pszName == NULL) {
                 SetLastError(ERROR_EXE_MARKED_INVALID);
                 return FALSE;
             }
 
             PIMAGE_THUNK_DATA pThunks = (PIMAGE_THUNK_DATA)
-                RvaAdjust(pDosHeader, iidp->OriginalFirstThunk);
+                view.RvaToPointer(iidp->OriginalFirstThunk, sizeof(IMAGE_THUNK_DATA));
             PVOID * pAddrs = (PVOID *)
-                RvaAdjust(pDosHeader, iidp->FirstThunk);
+                view.RvaToPointer(iidp->FirstThunk, sizeof(PVOID));
+            if (pAddrs == NULL) {
+                SetLastError(ERROR_EXE_MARKED_INVALID);
+                return FALSE;
+            }
 
             HMODULE hFile = DetourGetContainingModule(pAddrs[0]);
 
@@ -602,7 +1391,9 @@ BOOL WINAPI DetourEnumerateImportsEx(_In_opt_ HMODULE hModule,
 
             DWORD nNames = 0;
             if (pThunks) {
-                for (; pThunks[nNames].u1.Ordinal; nNames++) {
+                for (; view.Contains(&pThunks[nNames], sizeof(pThunks[nNames])) &&
+                         view.Contains(&pAddrs[nNames], sizeof(pAddrs[nNames])) &&
+                         pThunks[nNames].u1.Ordinal; nNames++) {
                     DWORD nOrdinal = 0;
                     PCSTR pszFunc = NULL;
 
@@ -610,8 +1401,7 @@ BOOL WINAPI DetourEnumerateImportsEx(_In_opt_ HMODULE hModule,
                         nOrdinal = (DWORD)IMAGE_ORDINAL(pThunks[nNames].u1.Ordinal);
                     }
                     else {
-                        pszFunc = (PCSTR)RvaAdjust(pDosHeader,
-                                                   (DWORD)pThunks[nNames].u1.AddressOfData + 2);
+                        pszFunc = view.RvaToString((DWORD)pThunks[nNames].u1.AddressOfData + 2);
                     }
 
                     if (pfImportFunc != NULL) {
@@ -684,46 +1474,29 @@ BOOL WINAPI DetourEnumerateImports(_In_opt_ HMODULE hModule,
 
 static PDETOUR_LOADED_BINARY WINAPI GetPayloadSectionFromModule(HMODULE hModule)
 {
-    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)hModule;
-    if (hModule == NULL) {
-        pDosHeader = (PIMAGE_DOS_HEADER)GetModuleHandleW(NULL);
-    }
-
     __try {
-#pragma warning(suppress:6011) // GetModuleHandleW(NULL) never returns NULL.
-        if (pDosHeader->e_magic != IMAGE_DOS_SIGNATURE) {
-            SetLastError(ERROR_BAD_EXE_FORMAT);
+        CDetourImageView view;
+        if (!view.Attach(hModule)) {
             return NULL;
         }
 
-        PIMAGE_NT_HEADERS pNtHeader = (PIMAGE_NT_HEADERS)((PBYTE)pDosHeader +
-                                                          pDosHeader->e_lfanew);
-        if (pNtHeader->Signature != IMAGE_NT_SIGNATURE) {
-            SetLastError(ERROR_INVALID_EXE_SIGNATURE);
-            return NULL;
-        }
-        if (pNtHeader->FileHeader.SizeOfOptionalHeader == 0) {
-            SetLastError(ERROR_EXE_MARKED_INVALID);
-            return NULL;
-        }
-
-        PIMAGE_SECTION_HEADER pSectionHeaders
-            = (PIMAGE_SECTION_HEADER)((PBYTE)pNtHeader
-                                      + sizeof(pNtHeader->Signature)
-                                      + sizeof(pNtHeader->FileHeader)
-                                      + pNtHeader->FileHeader.SizeOfOptionalHeader);
+        DWORD cSections = 0;
+        PIMAGE_SECTION_HEADER pSectionHeaders = view.Sections(&cSections);
 
-        for (DWORD n = 0; n < pNtHeader->FileHeader.NumberOfSections; n++) {
-            if (strcmp((PCHAR)pSectionHeaders[n].Name, ".detour") == 0) {
+        for (DWORD n = 0; n < cSections; n++) {
+            if (strncmp((PCHAR)pSectionHeaders[n].Name, ".detour",
+                        sizeof(pSectionHeaders[n].Name)) == 0) {
                 if (pSectionHeaders[n].VirtualAddress == 0 ||
                     pSectionHeaders[n].SizeOfRawData == 0) {
 
                     break;
                 }
 
-                PBYTE pbData = (PBYTE)pDosHeader + pSectionHeaders[n].VirtualAddress;
-                DETOUR_SECTION_HEADER *pHeader = (DETOUR_SECTION_HEADER *)pbData;
-                if (pHeader->cbHeaderSize < sizeof(DETOUR_SECTION_HEADER) ||
+                DETOUR_SECTION_HEADER *pHeader = (DETOUR_SECTION_HEADER *)
+                    view.RvaToPointer(pSectionHeaders[n].VirtualAddress,
+                                      sizeof(DETOUR_SECTION_HEADER));
+                if (pHeader == NULL ||
+                    pHeader->cbHeaderSize < sizeof(DETOUR_SECTION_HEADER) ||
                     pHeader->nSignature != DETOUR_SECTION_HEADER_SIGNATURE) {
 
                     break;
@@ -802,9 +1575,46 @@ PVOID WINAPI DetourFindPayload(_In_opt_ HMODULE hModule,
         PBYTE pbBeg = ((PBYTE)pHeader) + pHeader->nDataOffset;
         PBYTE pbEnd = ((PBYTE)pHeader) + pHeader->cbDataSize;
 
-        for (pbData = pbBeg; pbData < pbEnd;) {
+        // A directory in the first record is authoritative.  Its size is checked
+        // against the section before its entries are counted; a directory
+        // that does not fit is ignored in favor of the linear walk.
+        DETOUR_SECTION_RECORD *pFirst = (DETOUR_SECTION_RECORD *)pbBeg;
+        if (pbBeg + sizeof(*pFirst) <= pbEnd &&
+            pFirst->cbBytes >= sizeof(*pFirst) &&
+            pFirst->cbBytes <= (DWORD)(pbEnd - pbBeg) &&
+            DetourAreSameGuid(pFirst->guid, DETOUR_PAYLOAD_DIRECTORY_GUID) &&
+            !DetourAreSameGuid(rguid, DETOUR_PAYLOAD_DIRECTORY_GUID)) {
+
+            PDETOUR_PAYLOAD_DIRECTORY_ENTRY pEntry = detour_find_payload_directory_entry(
+                (PDETOUR_PAYLOAD_DIRECTORY_ENTRY)(pFirst + 1),
+                (pFirst->cbBytes - sizeof(*pFirst)) / sizeof(DETOUR_PAYLOAD_DIRECTORY_ENTRY),
+                rguid);
+
+            if (pEntry != NULL &&
+                pEntry->nOffset >= pHeader->nDataOffset &&
+                pEntry->nOffset <= pHeader->cbDataSize &&
+                pEntry->cbData <= pHeader->cbDataSize - pEntry->nOffset) {
+
+                if (pcbData) {
+                    *pcbData = pEntry->cbData;
+                }
+                SetLastError(NO_ERROR);
+                return (PBYTE)pHeader + pEntry->nOffset;
+            }
+            SetLastError(ERROR_INVALID_HANDLE);
+            return NULL;
+        }
+
+        for (pbData = pbBeg; pbData + sizeof(DETOUR_SECTION_RECORD) <= pbEnd;) {
             DETOUR_SECTION_RECORD *pSection = (DETOUR_SECTION_RECORD *)pbData;
 
+            // A record that does not fit ends the walk, rather than looping
+            // on it or stepping past the section.
+            if (pSection->cbBytes < sizeof(*pSection) ||
+                pSection->cbBytes > (DWORD)(pbEnd - pbData)) {
+                break;
+            }
+
             if (DetourAreSameGuid(pSection->guid, rguid)) {
                 if (pcbData) {
                     *pcbData = pSection->cbBytes - sizeof(*pSection);
@@ -825,20 +1635,113 @@ PVOID WINAPI DetourFindPayload(_In_opt_ HMODULE hModule,
     }
 }
 
+//////////////////////////////////////////////////////// Found Payload Cache.
+//
+//  DetourFindPayloadEx walks every module in the process, so the payloads it
+//  finds are remembered.  A cached payload is checked against the record in
+//  front of it before it is returned, and entries for a payload are dropped
+//  by DetourFreePayload.
+//
+struct DETOUR_PAYLOAD_CACHE_ENTRY
+{
+    GUID        guid;
+    PBYTE       pbData;
+    DWORD       cbData;
+};
+
+#define DETOUR_PAYLOAD_CACHE_SIZE   16
+
+static DETOUR_PAYLOAD_CACHE_ENTRY   s_rPayloadCache[DETOUR_PAYLOAD_CACHE_SIZE];
+static LONG                         s_nPayloadCacheNext = 0;
+static LONG                         s_nPayloadCacheLock = 0;
+
+static void detour_lock_payload_cache()
+{
+    while (InterlockedCompareExchange(&s_nPayloadCacheLock, 1, 0) != 0) {
+        Sleep(0);
+    }
+}
+
+static void detour_unlock_payload_cache()
+{
+    InterlockedExchange(&s_nPayloadCacheLock, 0);
+}
+
+// Returns TRUE if pbData still looks like the payload rguid.
+static BOOL detour_is_payload_valid(_In_ PBYTE pbData, _In_ REFGUID rguid)
+{
+    __try {
+        // Payloads are preceded by their record, with or without a directory.
+        DETOUR_SECTION_RECORD *pRecord = (DETOUR_SECTION_RECORD *)pbData - 1;
+        return DetourAreSameGuid(pRecord->guid, rguid);
+    }
+    __except(GetExceptionCode() == EXCEPTION_ACCESS_VIOLATION ?
+             EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+        return FALSE;
+    }
+}
+
 _Writable_bytes_(*pcbData)
 _Readable_bytes_(*pcbData)
 _Success_(return != NULL)
 PVOID WINAPI DetourFindPayloadEx(_In_ REFGUID rguid,
                                  _Out_opt_ DWORD *pcbData)
 {
+    PBYTE pbCached = NULL;
+    DWORD cbCached = 0;
+
+    detour_lock_payload_cache();
+    for (LONG n = 0; n < DETOUR_PAYLOAD_CACHE_SIZE; n++) {
+        if (s_rPayloadCache[n].pbData != NULL &&
+            DetourAreSameGuid(s_rPayloadCache[n].guid, rguid)) {
+            pbCached = s_rPayloadCache[n].pbData;
+            cbCached = s_rPayloadCache[n].cbData;
+            break;
+        }
+    }
+    detour_unlock_payload_cache();
+
+    if (pbCached != NULL && detour_is_payload_valid(pbCached, rguid)) {
+        if (pcbData) {
+            *pcbData = cbCached;
+        }
+        SetLastError(NO_ERROR);
+        return pbCached;
+    }
+
     for (HMODULE hMod = NULL; (hMod = DetourEnumerateModules(hMod)) != NULL;) {
         PVOID pvData;
+        DWORD cbData = 0;
 
-        pvData = DetourFindPayload(hMod, rguid, pcbData);
+        pvData = DetourFindPayload(hMod, rguid, &cbData);
         if (pvData != NULL) {
+            detour_lock_payload_cache();
+            LONG nSlot = -1;
+            for (LONG n = 0; n < DETOUR_PAYLOAD_CACHE_SIZE; n++) {
+                if (DetourAreSameGuid(s_rPayloadCache[n].guid, rguid)) {
+                    nSlot = n;
+                    break;
+                }
+            }
+            if (nSlot < 0) {
+                nSlot = s_nPayloadCacheNext;
+                s_nPayloadCacheNext = (s_nPayloadCacheNext + 1) % DETOUR_PAYLOAD_CACHE_SIZE;
+            }
+            s_rPayloadCache[nSlot].guid = rguid;
+            s_rPayloadCache[nSlot].pbData = (PBYTE)pvData;
+            s_rPayloadCache[nSlot].cbData = cbData;
+            detour_unlock_payload_cache();
+
+            if (pcbData) {
+                *pcbData = cbData;
+            }
+            SetLastError(NO_ERROR);
             return pvData;
         }
     }
+    if (pcbData) {
+        *pcbData = 0;
+    }
     SetLastError(ERROR_MOD_NOT_FOUND);
     return NULL;
 }
@@ -851,6 +1754,17 @@ BOOL WINAPI DetourFreePayload(_In_ PVOID pvData)
     HMODULE hModule = DetourGetContainingModule(pvData);
     DETOUR_ASSERT(hModule != NULL);
     if (hModule != NULL) {
+        // Forget any cached payloads in the block being released.
+        ULONG cbModule = DetourGetModuleSize(hModule);
+        detour_lock_payload_cache();
+        for (LONG n = 0; n < DETOUR_PAYLOAD_CACHE_SIZE; n++) {
+            if (s_rPayloadCache[n].pbData >= (PBYTE)hModule &&
+                s_rPayloadCache[n].pbData < (PBYTE)hModule + cbModule) {
+                ZeroMemory(&s_rPayloadCache[n], sizeof(s_rPayloadCache[n]));
+            }
+        }
+        detour_unlock_payload_cache();
+
         fSucceeded = VirtualFree(hModule, 0, MEM_RELEASE);
         DETOUR_ASSERT(fSucceeded);
         if (fSucceeded) {
@@ -14,29 +14,79 @@
 #error detours.h version mismatch
 #endif
 
+// BuildImports32 aka BuildImports64
+static BOOL BUILD_IMPORTS_XX(const DETOUR_IMPORT_LAYOUT& layout,
+                             DWORD obBase,
+                             __in_ecount(nDlls) LPCSTR *plpDlls,
+                             DWORD nDlls,
+                             _Out_writes_bytes_(layout.cbTotal) PBYTE pbNew)
+// Fill in everything in the block except the old descriptors.  obBase is the
+// RVA the block will be written at.
+{
+    PIMAGE_IMPORT_DESCRIPTOR piid = (PIMAGE_IMPORT_DESCRIPTOR)pbNew;
+    IMAGE_THUNK_DATAXX *pOriginalThunks = (IMAGE_THUNK_DATAXX *)(pbNew + layout.obOriginalThunks);
+    IMAGE_THUNK_DATAXX *pFirstThunks = (IMAGE_THUNK_DATAXX *)(pbNew + layout.obFirstThunks);
+    DWORD obName = layout.obNames;
+
+    ZeroMemory(pbNew, layout.cbTotal);
+
+    for (DWORD n = 0; n < nDlls; n++) {
+        HRESULT hrRet = StringCchCopyA((char*)pbNew + obName, layout.cbTotal - obName, plpDlls[n]);
+        if (FAILED(hrRet)) {
+            DETOUR_TRACE(("StringCchCopyA failed: %08lx\n", hrRet));
+            return FALSE;
+        }
+
+        // After copying the string, we patch up the size "??" bits if any.
+        hrRet = ReplaceOptionalSizeA((char*)pbNew + obName,
+                                     layout.cbTotal - obName,
+                                     DETOURS_STRINGIFY(DETOURS_BITS_XX));
+        if (FAILED(hrRet)) {
+            DETOUR_TRACE(("ReplaceOptionalSizeA failed: %08lx\n", hrRet));
+            return FALSE;
+        }
+
+        // Each DLL gets an import of ordinal 1 and a terminator in both the
+        // import name table and the import address table.
+        pOriginalThunks[2 * n].u1.Ordinal = IMAGE_ORDINAL_FLAG_XX + 1;
+        pOriginalThunks[2 * n + 1].u1.Ordinal = 0;
+        pFirstThunks[2 * n].u1.Ordinal = IMAGE_ORDINAL_FLAG_XX + 1;
+        pFirstThunks[2 * n + 1].u1.Ordinal = 0;
+
+        piid[n].OriginalFirstThunk = obBase + layout.obOriginalThunks +
+            sizeof(IMAGE_THUNK_DATAXX) * (2 * n);
+        piid[n].TimeDateStamp = 0;
+        piid[n].ForwarderChain = 0;
+        piid[n].Name = obBase + obName;
+        piid[n].FirstThunk = obBase + layout.obFirstThunks +
+            sizeof(IMAGE_THUNK_DATAXX) * (2 * n);
+
+        obName += PadToDword((DWORD)strlen(plpDlls[n]) + 1);
+    }
+    _Analysis_assume_(obName <= layout.cbTotal);
+    return TRUE;
+}
+
 // UpdateImports32 aka UpdateImports64
-static BOOL UPDATE_IMPORTS_XX(HANDLE hProcess,
+static BOOL UPDATE_IMPORTS_XX(CDetourRemoteSession& session,
                               HMODULE hModule,
                               __in_ecount(nDlls) LPCSTR *plpDlls,
                               DWORD nDlls)
 {
     BOOL fSucceeded = FALSE;
-    DWORD cbNew = 0;
+    DETOUR_IMPORT_LAYOUT layout;
 
     BYTE * pbNew = NULL;
     DWORD i;
-    SIZE_T cbRead;
-    DWORD n;
 
     PBYTE pbModule = (PBYTE)hModule;
 
-    IMAGE_DOS_HEADER idh;
-    ZeroMemory(&idh, sizeof(idh));
-    if (!ReadProcessMemory(hProcess, pbModule, &idh, sizeof(idh), &cbRead)
-        || cbRead < sizeof(idh)) {
+    // The headers are read once through the session, so they include what
+    // UpdateFrom32To64 may have staged, and validated by the view.
+    CDetourImageView view;
+    if (!view.AttachRemote(hModule, detour_read_session, &session)) {
 
-        DETOUR_TRACE(("ReadProcessMemory(idh@%p..%p) failed: %lu\n",
-                      pbModule, pbModule + sizeof(idh), GetLastError()));
+        DETOUR_TRACE(("Reading the headers of %p failed: %lu\n", pbModule, GetLastError()));
 
       finish:
         if (pbNew != NULL) {
@@ -46,48 +96,37 @@ static BOOL UPDATE_IMPORTS_XX(HANDLE hProcess,
         return fSucceeded;
     }
 
-    IMAGE_NT_HEADERS_XX inh;
-    ZeroMemory(&inh, sizeof(inh));
-
-    if (!ReadProcessMemory(hProcess, pbModule + idh.e_lfanew, &inh, sizeof(inh), &cbRead)
-        || cbRead < sizeof(inh)) {
-        DETOUR_TRACE(("ReadProcessMemory(inh@%p..%p) failed: %lu\n",
-                      pbModule + idh.e_lfanew,
-                      pbModule + idh.e_lfanew + sizeof(inh),
-                      GetLastError()));
+    if (view.NtHeader()->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR_MAGIC_XX) {
+        DETOUR_TRACE(("Wrong size image (%04x != %04x).\n",
+                      view.NtHeader()->OptionalHeader.Magic, IMAGE_NT_OPTIONAL_HDR_MAGIC_XX));
+        SetLastError(ERROR_INVALID_BLOCK);
         goto finish;
     }
 
-    if (inh.OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR_MAGIC_XX) {
-        DETOUR_TRACE(("Wrong size image (%04x != %04x).\n",
-                      inh.OptionalHeader.Magic, IMAGE_NT_OPTIONAL_HDR_MAGIC_XX));
-        SetLastError(ERROR_INVALID_BLOCK);
+    IMAGE_DOS_HEADER idh;
+    CopyMemory(&idh, view.DosHeader(), sizeof(idh));
+
+    IMAGE_NT_HEADERS_XX inh;
+    if (!view.Contains(view.NtHeader(), sizeof(inh))) {
+        SetLastError(ERROR_EXE_MARKED_INVALID);
         goto finish;
     }
+    CopyMemory(&inh, view.NtHeader(), sizeof(inh));
 
     // Zero out the bound table so loader doesn't use it instead of our new table.
     inh.BOUND_DIRECTORY.VirtualAddress = 0;
     inh.BOUND_DIRECTORY.Size = 0;
 
     // Find the size of the mapped file.
-    DWORD dwSec = idh.e_lfanew +
-        FIELD_OFFSET(IMAGE_NT_HEADERS_XX, OptionalHeader) +
-        inh.FileHeader.SizeOfOptionalHeader;
-
-    for (i = 0; i < inh.FileHeader.NumberOfSections; i++) {
-        IMAGE_SECTION_HEADER ish;
-        ZeroMemory(&ish, sizeof(ish));
-
-        if (!ReadProcessMemory(hProcess, pbModule + dwSec + sizeof(ish) * i, &ish,
-                               sizeof(ish), &cbRead)
-            || cbRead < sizeof(ish)) {
-
-            DETOUR_TRACE(("ReadProcessMemory(ish@%p..%p) failed: %lu\n",
-                          pbModule + dwSec + sizeof(ish) * i,
-                          pbModule + dwSec + sizeof(ish) * (i + 1),
-                          GetLastError()));
-            goto finish;
-        }
+    DWORD cSections;
+    PIMAGE_SECTION_HEADER pSections = view.Sections(&cSections);
+    if (pSections == NULL) {
+        SetLastError(ERROR_EXE_MARKED_INVALID);
+        goto finish;
+    }
+
+    for (i = 0; i < cSections; i++) {
+        IMAGE_SECTION_HEADER ish = pSections[i];
 
         DETOUR_TRACE(("ish[%lu] : va=%08lx sr=%lu\n", i, ish.VirtualAddress, ish.SizeOfRawData));
         
@@ -112,11 +151,11 @@ static BOOL UPDATE_IMPORTS_XX(HANDLE hProcess,
         // because the load information of the original PE header has been saved and will be restored. 
         // The change here is just for the following code to work normally
 
-        PIMAGE_IMPORT_DESCRIPTOR pImageImport = (PIMAGE_IMPORT_DESCRIPTOR)(pbModule + inh.IMPORT_DIRECTORY.VirtualAddress);
+        DWORD nImageImport = inh.IMPORT_DIRECTORY.VirtualAddress;
 
         do {
             IMAGE_IMPORT_DESCRIPTOR ImageImport;
-            if (!ReadProcessMemory(hProcess, pImageImport, &ImageImport, sizeof(ImageImport), NULL)) {
+            if (!view.Read(nImageImport, &ImageImport, sizeof(ImageImport))) {
                 DETOUR_TRACE(("ReadProcessMemory failed: %lu\n", GetLastError()));
                 goto finish;
             }
@@ -124,7 +163,7 @@ static BOOL UPDATE_IMPORTS_XX(HANDLE hProcess,
             if (!ImageImport.Name) {
                 break;
             }
-            ++pImageImport;
+            nImageImport += sizeof(IMAGE_IMPORT_DESCRIPTOR);
         } while (TRUE);
 
         DWORD dwLastError = GetLastError();
@@ -140,50 +179,21 @@ static BOOL UPDATE_IMPORTS_XX(HANDLE hProcess,
                   pbModule + inh.IMPORT_DIRECTORY.VirtualAddress +
                   inh.IMPORT_DIRECTORY.Size));
 
-    // Calculate new import directory size.  Note that since inh is from another
-    // process, inh could have been corrupted. We need to protect against
-    // integer overflow in allocation calculations.
+    // Plan the new import directory.  Note that since inh is from another
+    // process, inh could have been corrupted, PlanImportLayout protects
+    // against integer overflow in the allocation calculations.
     DWORD nOldDlls = inh.IMPORT_DIRECTORY.Size / sizeof(IMAGE_IMPORT_DESCRIPTOR);
-    DWORD obRem;
-    if (DWordMult(sizeof(IMAGE_IMPORT_DESCRIPTOR), nDlls, &obRem) != S_OK) {
-        DETOUR_TRACE(("too many new DLLs.\n"));
-        goto finish;
-    }
-    DWORD obOld;
-    if (DWordAdd(obRem, sizeof(IMAGE_IMPORT_DESCRIPTOR) * nOldDlls, &obOld) != S_OK) {
-        DETOUR_TRACE(("DLL entries overflow.\n"));
-        goto finish;
+    if (inh.IMPORT_DIRECTORY.VirtualAddress == 0) {
+        nOldDlls = 0;
     }
-    DWORD obTab = PadToDwordPtr(obOld);
-    // Check for integer overflow.
-    if (obTab < obOld) {
-        DETOUR_TRACE(("DLL entries padding overflow.\n"));
+    if (!PlanImportLayout(sizeof(IMAGE_THUNK_DATAXX), nOldDlls, plpDlls, nDlls, layout)) {
         goto finish;
     }
-    DWORD stSize;
-    if (DWordMult(sizeof(DWORD_XX) * 4, nDlls, &stSize) != S_OK) {
-        DETOUR_TRACE(("String table overflow.\n"));
-        goto finish;
-    }
-    DWORD obDll;
-    if (DWordAdd(obTab, stSize, &obDll) != S_OK) {
-        DETOUR_TRACE(("Import table size overflow\n"));
-        goto finish;
-    }
-    DWORD obStr = obDll;
-    cbNew = obStr;
-    for (n = 0; n < nDlls; n++) {
-        if (DWordAdd(cbNew, PadToDword((DWORD)strlen(plpDlls[n]) + 1), &cbNew) != S_OK) {
-            DETOUR_TRACE(("Overflow adding string table entry\n"));
-            goto finish;
-        }
-    }
-    pbNew = new BYTE [cbNew];
+    pbNew = new NOTHROW BYTE [layout.cbTotal];
     if (pbNew == NULL) {
-        DETOUR_TRACE(("new BYTE [cbNew] failed.\n"));
+        DETOUR_TRACE(("new BYTE [cbTotal] failed.\n"));
         goto finish;
     }
-    ZeroMemory(pbNew, cbNew);
 
     PBYTE pbBase = pbModule;
     PBYTE pbNext = pbBase
@@ -196,87 +206,30 @@ static BOOL UPDATE_IMPORTS_XX(HANDLE hProcess,
     }
     DETOUR_TRACE(("pbBase = %p\n", pbBase));
 
-    PBYTE pbNewIid = FindAndAllocateNearBase(hProcess, pbModule, pbBase, cbNew);
+    PBYTE pbNewIid = FindAndAllocateNearBase(session.Process(), pbModule, pbBase, layout.cbTotal);
     if (pbNewIid == NULL) {
         DETOUR_TRACE(("FindAndAllocateNearBase failed.\n"));
         goto finish;
     }
 
-    PIMAGE_IMPORT_DESCRIPTOR piid = (PIMAGE_IMPORT_DESCRIPTOR)pbNew;
-    IMAGE_THUNK_DATAXX *pt = NULL;
-
     DWORD obBase = (DWORD)(pbNewIid - pbModule);
-    DWORD dwProtect = 0;
-
-    if (inh.IMPORT_DIRECTORY.VirtualAddress != 0) {
-        // Read the old import directory if it exists.
-        DETOUR_TRACE(("IMPORT_DIRECTORY perms=%lx\n", dwProtect));
 
-        if (!ReadProcessMemory(hProcess,
-                               pbModule + inh.IMPORT_DIRECTORY.VirtualAddress,
-                               &piid[nDlls],
-                               nOldDlls * sizeof(IMAGE_IMPORT_DESCRIPTOR), &cbRead)
-            || cbRead < nOldDlls * sizeof(IMAGE_IMPORT_DESCRIPTOR)) {
-
-            DETOUR_TRACE(("ReadProcessMemory(imports) failed: %lu\n", GetLastError()));
-            goto finish;
-        }
+    if (!BUILD_IMPORTS_XX(layout, obBase, plpDlls, nDlls, pbNew)) {
+        goto finish;
     }
 
-    for (n = 0; n < nDlls; n++) {
-        HRESULT hrRet = StringCchCopyA((char*)pbNew + obStr, cbNew - obStr, plpDlls[n]);
-        if (FAILED(hrRet)) {
-            DETOUR_TRACE(("StringCchCopyA failed: %08lx\n", hrRet));
-            goto finish;
-        }
+    if (nOldDlls != 0) {
+        // Copy the old import directory in behind the new descriptors.
+        if (!view.Read(inh.IMPORT_DIRECTORY.VirtualAddress,
+                       pbNew + sizeof(IMAGE_IMPORT_DESCRIPTOR) * nDlls,
+                       nOldDlls * sizeof(IMAGE_IMPORT_DESCRIPTOR))) {
 
-        // After copying the string, we patch up the size "??" bits if any.
-        hrRet = ReplaceOptionalSizeA((char*)pbNew + obStr,
-                                     cbNew - obStr,
-                                     DETOURS_STRINGIFY(DETOURS_BITS_XX));
-        if (FAILED(hrRet)) {
-            DETOUR_TRACE(("ReplaceOptionalSizeA failed: %08lx\n", hrRet));
+            DETOUR_TRACE(("ReadProcessMemory(imports) failed: %lu\n", GetLastError()));
             goto finish;
         }
-
-        DWORD nOffset = obTab + (sizeof(IMAGE_THUNK_DATAXX) * (4 * n));
-        piid[n].OriginalFirstThunk = obBase + nOffset;
-      
-        // We need 2 thunks for the import table and 2 thunks for the IAT.
-        // One for an ordinal import and one to mark the end of the list.
-        pt = ((IMAGE_THUNK_DATAXX*)(pbNew + nOffset));
-        pt[0].u1.Ordinal = IMAGE_ORDINAL_FLAG_XX + 1;
-        pt[1].u1.Ordinal = 0;
-
-        nOffset = obTab + (sizeof(IMAGE_THUNK_DATAXX) * ((4 * n) + 2));
-        piid[n].FirstThunk = obBase + nOffset;
-        pt = ((IMAGE_THUNK_DATAXX*)(pbNew + nOffset));
-        pt[0].u1.Ordinal = IMAGE_ORDINAL_FLAG_XX + 1;
-        pt[1].u1.Ordinal = 0;
-        piid[n].TimeDateStamp = 0;
-        piid[n].ForwarderChain = 0;
-        piid[n].Name = obBase + obStr;
-
-        obStr += PadToDword((DWORD)strlen(plpDlls[n]) + 1);
     }
-    _Analysis_assume_(obStr <= cbNew);
-
-#if 0
-    for (i = 0; i < nDlls + nOldDlls; i++) {
-        DETOUR_TRACE(("%8d. Look=%08x Time=%08x Fore=%08x Name=%08x Addr=%08x\n",
-                      i,
-                      piid[i].OriginalFirstThunk,
-                      piid[i].TimeDateStamp,
-                      piid[i].ForwarderChain,
-                      piid[i].Name,
-                      piid[i].FirstThunk));
-        if (piid[i].OriginalFirstThunk == 0 && piid[i].FirstThunk == 0) {
-            break;
-        }
-    }
-#endif
 
-    if (!WriteProcessMemory(hProcess, pbNewIid, pbNew, obStr, NULL)) {
+    if (!session.WriteUncached(pbNewIid, pbNew, layout.cbTotal)) {
         DETOUR_TRACE(("WriteProcessMemory(iid) failed: %lu\n", GetLastError()));
         goto finish;
     }
@@ -284,7 +237,7 @@ static BOOL UPDATE_IMPORTS_XX(HANDLE hProcess,
     DETOUR_TRACE(("obBaseBef = %08lx..%08lx\n",
                   inh.IMPORT_DIRECTORY.VirtualAddress,
                   inh.IMPORT_DIRECTORY.VirtualAddress + inh.IMPORT_DIRECTORY.Size));
-    DETOUR_TRACE(("obBaseAft = %08lx..%08lx\n", obBase, obBase + obStr));
+    DETOUR_TRACE(("obBaseAft = %08lx..%08lx\n", obBase, obBase + layout.cbTotal));
 
     // In this case the file didn't have an import directory in first place,
     // so we couldn't fix the missing IAT above. We still need to explicitly
@@ -292,29 +245,26 @@ static BOOL UPDATE_IMPORTS_XX(HANDLE hProcess,
     //
     if (inh.IAT_DIRECTORY.VirtualAddress == 0) {
         inh.IAT_DIRECTORY.VirtualAddress = obBase;
-        inh.IAT_DIRECTORY.Size = cbNew;
+        inh.IAT_DIRECTORY.Size = layout.cbTotal;
     }
 
     inh.IMPORT_DIRECTORY.VirtualAddress = obBase;
-    inh.IMPORT_DIRECTORY.Size = cbNew;
+    inh.IMPORT_DIRECTORY.Size = layout.cbTotal;
 
     /////////////////////// Update the NT header for the new import directory.
     //
-    if (!DetourVirtualProtectSameExecuteEx(hProcess, pbModule, inh.OptionalHeader.SizeOfHeaders,
-                                           PAGE_EXECUTE_READWRITE, &dwProtect)) {
-        DETOUR_TRACE(("VirtualProtectEx(inh) write failed: %lu\n", GetLastError()));
-        goto finish;
-    }
-
+    // The header writes are staged in the session and reach the target when
+    // the caller flushes it.
+    //
     inh.OptionalHeader.CheckSum = 0;
 
-    if (!WriteProcessMemory(hProcess, pbModule, &idh, sizeof(idh), NULL)) {
+    if (!session.Write(pbModule, &idh, sizeof(idh))) {
         DETOUR_TRACE(("WriteProcessMemory(idh) failed: %lu\n", GetLastError()));
         goto finish;
     }
     DETOUR_TRACE(("WriteProcessMemory(idh:%p..%p)\n", pbModule, pbModule + sizeof(idh)));
 
-    if (!WriteProcessMemory(hProcess, pbModule + idh.e_lfanew, &inh, sizeof(inh), NULL)) {
+    if (!session.Write(pbModule + idh.e_lfanew, &inh, sizeof(inh))) {
         DETOUR_TRACE(("WriteProcessMemory(inh) failed: %lu\n", GetLastError()));
         goto finish;
     }
@@ -322,12 +272,6 @@ static BOOL UPDATE_IMPORTS_XX(HANDLE hProcess,
                   pbModule + idh.e_lfanew,
                   pbModule + idh.e_lfanew + sizeof(inh)));
 
-    if (!VirtualProtectEx(hProcess, pbModule, inh.OptionalHeader.SizeOfHeaders,
-                          dwProtect, &dwProtect)) {
-        DETOUR_TRACE(("VirtualProtectEx(idh) restore failed: %lu\n", GetLastError()));
-        goto finish;
-    }
-
     fSucceeded = TRUE;
     goto finish;
 }
@@ -0,0 +1,40 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// State machine tracking the staged initialization of the Spoof Resolution DLL
+// Note: DllMain only attaches the detoured functions that are needed right away and leaves them passing calls straight
+//   through to the real functions, the rest of the initialization is done on a separate thread (or synchronously in
+//   DllMain if the ini file asks for it) and then moves the state out of pending exactly once, the release store that
+//   does so publishes everything the initialization wrote to the detoured functions that see the state as ready
+
+// States of the initialization
+enum InitializationState : uint32_t
+{
+  InitializationPending,
+  InitializationReady,
+  InitializationFailed
+};
+
+// CompleteInitialization function
+inline bool CompleteInitialization(std::atomic<InitializationState>& state, bool succeeded)
+{
+  // Move the state from pending to ready or failed, this fails if the initialization was already completed
+  InitializationState expected = InitializationPending;
+  return state.compare_exchange_strong(expected, succeeded ? InitializationReady : InitializationFailed,
+    std::memory_order_release, std::memory_order_relaxed);
+}
+
+// IsInitializationReady function
+inline bool IsInitializationReady(const std::atomic<InitializationState>& state)
+{
+  // Check if the detoured functions can use what the initialization set up
+  // Note: the acquire load pairs with the release in CompleteInitialization
+  return state.load(std::memory_order_acquire) == InitializationReady;
+}
+
+// IsInitializationPending function
+inline bool IsInitializationPending(const std::atomic<InitializationState>& state)
+{
+  return state.load(std::memory_order_acquire) == InitializationPending;
+}
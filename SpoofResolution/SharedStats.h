@@ -0,0 +1,249 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <windows.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Layout of the named shared memory block that the Spoof Resolution DLL publishes its live statistics into and that the
+//   spoofresmon utility reads them from
+// Note: the block is written by a single publisher thread in the DLL and protected by a sequence lock so that readers
+//   never block the DLL, the sequence is odd while the block is being written and readers retry until they see the
+//   same even sequence before and after copying the block
+// Note: on Windows the block is a named file mapping and elsewhere it is a POSIX shared memory object, both with the
+//   same layout, see SpoofResStatsSection
+
+// Name of the shared memory block formatted with the id of the process the DLL is loaded into
+#define SPOOFRES_STATS_NAME_FORMAT L"Local\\SpoofResolution.Stats.%lu"
+#define SPOOFRES_STATS_POSIX_NAME_FORMAT "/SpoofResolution.Stats.%lu"
+
+// Version of the layout which must be incremented whenever the layout changes
+#define SPOOFRES_STATS_VERSION 3
+
+// Detoured functions that statistics are kept for
+enum SpoofResStatsApi : uint32_t
+{
+  SpoofResStatsGetSystemMetrics,
+  SpoofResStatsGetDeviceCaps,
+  SpoofResStatsEnumDisplaySettingsA,
+  SpoofResStatsEnumDisplaySettingsW,
+  SpoofResStatsEnumDisplaySettingsExA,
+  SpoofResStatsEnumDisplaySettingsExW,
+  SpoofResStatsApiCount
+};
+inline const wchar_t* const SpoofResStatsApiNames[SpoofResStatsApiCount] = {
+  L"GetSystemMetrics",
+  L"GetDeviceCaps",
+  L"EnumDisplaySettingsA",
+  L"EnumDisplaySettingsW",
+  L"EnumDisplaySettingsExA",
+  L"EnumDisplaySettingsExW"
+};
+
+// Counters kept for each detoured function
+// Note: times are in performance counter ticks, see SpoofResStats::ticksPerSecond
+struct SpoofResStatsApiCounters
+{
+  uint64_t calls;
+  uint64_t spoofHits;
+  uint64_t spoofMisses;
+  uint64_t realCallTicks; // Time spent in the real Windows API function
+  uint64_t hookTicks;     // Time spent in the detoured function excluding the real Windows API function
+};
+
+// Shared memory block
+struct SpoofResStats
+{
+  uint32_t version;
+  uint32_t size;
+  volatile LONG sequence;
+  uint32_t reserved;
+  uint64_t ticksPerSecond;
+  uint64_t publishCount;
+  uint64_t logQueueDepth;     // Log entries waiting to be written to the log file
+  uint64_t logEntriesWritten; // Log entries written to the log file
+  uint64_t callerCacheHits;   // Caller module lookups answered by the range the calling thread found last
+  uint64_t callerCacheMisses; // Caller module lookups that had to search the module index
+  SpoofResStatsApiCounters apis[SpoofResStatsApiCount];
+};
+
+// WriteSpoofResStats function
+inline void WriteSpoofResStats(SpoofResStats* shared, const SpoofResStats& values)
+{
+  // Mark the block as being written, copy everything after the header, and mark the block as written
+  InterlockedIncrement(&shared->sequence);
+  MemoryBarrier();
+  memcpy(&shared->ticksPerSecond, &values.ticksPerSecond, sizeof(SpoofResStats) - offsetof(SpoofResStats,
+    ticksPerSecond));
+  MemoryBarrier();
+  InterlockedIncrement(&shared->sequence);
+}
+
+// ReadSpoofResStats function
+inline bool ReadSpoofResStats(const SpoofResStats* shared, SpoofResStats& snapshot)
+{
+  // Check if the block was published with a different layout
+  if (shared->version != SPOOFRES_STATS_VERSION || shared->size != sizeof(SpoofResStats))
+    return false;
+
+  // Copy the block until we get a copy that was not written to while we were copying it
+  for (int attempt = 0; attempt < 1000; attempt++)
+  {
+    LONG sequence = shared->sequence;
+    if (sequence & 1)
+    {
+      YieldProcessor();
+      continue;
+    }
+    MemoryBarrier();
+    memcpy(&snapshot, shared, sizeof(SpoofResStats));
+    MemoryBarrier();
+    if (shared->sequence == sequence)
+      return true;
+  }
+
+  return false;
+}
+
+// GetSpoofResStatsName function
+inline std::wstring GetSpoofResStatsName(DWORD processId)
+{
+  wchar_t name[64];
+  swprintf(name, std::size(name), SPOOFRES_STATS_NAME_FORMAT, (unsigned long)processId);
+  return name;
+}
+
+// GetSpoofResStatsPosixName function
+inline std::string GetSpoofResStatsPosixName(DWORD processId)
+{
+  char name[64];
+  snprintf(name, sizeof(name), SPOOFRES_STATS_POSIX_NAME_FORMAT, (unsigned long)processId);
+  return name;
+}
+
+// Shared memory block that a process publishes its statistics into or that they are read from
+// Note: on Windows the block exists for as long as any process has it mapped, a POSIX shared memory object exists until
+//   it is unlinked so the publisher unlinks it when the block is closed, readers that still have it mapped keep reading
+//   the last published statistics either way
+class SpoofResStatsSection
+{
+public:
+  SpoofResStatsSection() = default;
+  SpoofResStatsSection(const SpoofResStatsSection&) = delete;
+  SpoofResStatsSection& operator=(const SpoofResStatsSection&) = delete;
+  ~SpoofResStatsSection()
+  {
+    Close();
+  }
+
+  // Create function
+  // Note: the block is zeroed and its header is initialized, only the process the block is named after may create it
+  SpoofResStats* Create(DWORD processId, uint64_t ticksPerSecond)
+  {
+    Close();
+#ifdef _WIN32
+    // Create and map the named file mapping
+    mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(SpoofResStats),
+      GetSpoofResStatsName(processId).c_str());
+    if (mapping == NULL)
+      return nullptr;
+    stats = (SpoofResStats*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(SpoofResStats));
+#else
+    // Create the object with read and write permission for its owner only
+    // Note: an object that is left over from a process with the same id that did not exit cleanly is replaced, no
+    //   running process can own it since process ids are unique
+    std::string newName = GetSpoofResStatsPosixName(processId);
+    shm_unlink(newName.c_str());
+    int descriptor = shm_open(newName.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (descriptor < 0)
+      return nullptr;
+    void* view = ftruncate(descriptor, sizeof(SpoofResStats)) == 0 ?
+      mmap(nullptr, sizeof(SpoofResStats), PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0) : MAP_FAILED;
+    close(descriptor);
+    name = std::move(newName);
+    stats = view != MAP_FAILED ? (SpoofResStats*)view : nullptr;
+#endif
+    if (stats == nullptr)
+    {
+      Close();
+
+      return nullptr;
+    }
+
+    // Initialize the block
+    memset(stats, 0, sizeof(SpoofResStats));
+    stats->ticksPerSecond = ticksPerSecond;
+    stats->size = sizeof(SpoofResStats);
+    stats->version = SPOOFRES_STATS_VERSION;
+
+    return stats;
+  }
+
+  // Open function
+  // Note: the block is mapped read only, ReadSpoofResStats checks its layout
+  const SpoofResStats* Open(DWORD processId)
+  {
+    Close();
+#ifdef _WIN32
+    // Open and map the named file mapping
+    mapping = OpenFileMapping(FILE_MAP_READ, FALSE, GetSpoofResStatsName(processId).c_str());
+    if (mapping == NULL)
+      return nullptr;
+    stats = (SpoofResStats*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(SpoofResStats));
+#else
+    // Open the object and check that it is large enough to be mapped before mapping it
+    // Note: mapping past the end of the object would fault on the first read instead of failing here
+    int descriptor = shm_open(GetSpoofResStatsPosixName(processId).c_str(), O_RDONLY, 0);
+    if (descriptor < 0)
+      return nullptr;
+    struct stat status;
+    void* view = fstat(descriptor, &status) == 0 && (size_t)status.st_size >= sizeof(SpoofResStats) ?
+      mmap(nullptr, sizeof(SpoofResStats), PROT_READ, MAP_SHARED, descriptor, 0) : MAP_FAILED;
+    close(descriptor);
+    stats = view != MAP_FAILED ? (SpoofResStats*)view : nullptr;
+#endif
+    if (stats == nullptr)
+      Close();
+
+    return stats;
+  }
+
+  // Close function
+  void Close()
+  {
+#ifdef _WIN32
+    if (stats != nullptr)
+      UnmapViewOfFile(stats);
+    if (mapping != NULL)
+    {
+      CloseHandle(mapping);
+      mapping = NULL;
+    }
+#else
+    if (stats != nullptr)
+      munmap(stats, sizeof(SpoofResStats));
+    if (!name.empty())
+    {
+      shm_unlink(name.c_str());
+      name.clear();
+    }
+#endif
+    stats = nullptr;
+  }
+
+private:
+  SpoofResStats* stats = nullptr;
+#ifdef _WIN32
+  HANDLE mapping = NULL;
+#else
+  std::string name; // Name of the object that this process created and unlinks when it is closed
+#endif
+};
@@ -0,0 +1,523 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cwctype>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <windows.h>
+#include <SimpleIni/SimpleIni.h>
+
+// Structure that the settings and resolution information in the spoofres.ini file are compiled into, and the binary
+//   payload format that a launcher uses to hand a compiled config to the Spoof Resolution DLL
+// Note: the launcher copies the payload into the process with DetourCopyPayloadToProcessEx and the DLL finds it with
+//   DetourFindPayloadEx, so the DLL does not have to locate, read, or parse the ini file while the application or game
+//   is starting, the DLL only falls back to the ini file when there is no payload
+// Note: when the SharedConfig key is enabled the DLL also publishes the payload into a named shared memory section
+//   keyed by a hash of the ini file contents, so that other processes using the same ini file map the section instead
+//   of parsing the ini file, see SpoofConfigShared.h
+
+// GUID that the payload is copied into the process under {6f1c2a94-3b8e-4d57-9a0c-e25b7d41f368}
+inline const GUID SpoofConfigPayloadGuid = { 0x6f1c2a94, 0x3b8e, 0x4d57,
+  { 0x9a, 0x0c, 0xe2, 0x5b, 0x7d, 0x41, 0xf3, 0x68 } };
+
+// Version of the payload layout which must be incremented whenever the layout changes
+#define SPOOFRES_CONFIG_PAYLOAD_VERSION 2
+
+// Compiled config
+// Note: the config is never modified after it is published so the detoured functions can read it without any locks
+struct SpoofConfig
+{
+  struct EDSSection
+  {
+    std::wstring device;
+    bool anyDevice;
+    DWORD mode;
+    bool anyMode;
+    std::unique_ptr<DWORD> width;
+    std::unique_ptr<DWORD> height;
+    std::unique_ptr<DWORD> bitsPerPixel;
+    std::unique_ptr<DWORD> frequency;
+    std::unique_ptr<DWORD> flags;
+    std::unique_ptr<POINTL> position;
+    std::unique_ptr<DWORD> orientation;
+    uint64_t callers = 0; // Bit per caller module the section is limited to, or 0 for any caller
+  };
+  bool logging = false;
+  bool tracing = false;
+  bool statistics = false;
+  bool startupReport = false;
+  bool synchronousInitialization = false;
+  bool sharedConfig = false;
+  std::unique_ptr<std::wstring> logFile;
+  std::unique_ptr<std::wstring> traceFile;
+  bool gsmSection = false; // Whether the GetSystemMetrics function is detoured
+  bool gdcSection = false; // Whether the GetDeviceCaps function is detoured
+  bool edsSection = false; // Whether the EnumDisplaySettings functions are detoured
+  std::unique_ptr<int> gsmWidth;
+  std::unique_ptr<int> gsmHeight;
+  std::unique_ptr<int> gdcWidth;
+  std::unique_ptr<int> gdcHeight;
+  std::unique_ptr<int> gdcBitsPerPixel;
+  std::unique_ptr<int> gdcFrequency;
+  std::vector<EDSSection> edsSections;
+  std::vector<std::wstring> callerModules; // File names of the modules that sections can be limited to
+  uint64_t gsmCallers = 0;                 // Bit per caller module the GSM section is limited to, or 0 for any caller
+  uint64_t gdcCallers = 0;                 // Bit per caller module the GDC section is limited to, or 0 for any caller
+};
+
+// Flags kept in the payload header
+enum SpoofConfigPayloadFlags : uint32_t
+{
+  SpoofConfigPayloadLogging = 0x01,
+  SpoofConfigPayloadTracing = 0x02,
+  SpoofConfigPayloadStatistics = 0x04,
+  SpoofConfigPayloadStartupReport = 0x08,
+  SpoofConfigPayloadSynchronousInitialization = 0x10,
+  SpoofConfigPayloadDetourGSM = 0x20,
+  SpoofConfigPayloadDetourGDC = 0x40,
+  SpoofConfigPayloadDetourEDS = 0x80,
+  SpoofConfigPayloadSharedConfig = 0x100
+};
+
+// Length of a string that is not present in the payload
+#define SPOOFRES_CONFIG_PAYLOAD_NO_STRING 0xFFFFFFFF
+
+// Payload header
+// Note: the header is followed by the EDS sections and then by the UTF-16 characters of the log file path, the trace
+//   file path, the device of each EDS section, and the caller module file names separated by commas in that order
+//   without any terminators
+struct SpoofConfigPayloadHeader
+{
+  uint32_t version;
+  uint32_t size;            // Size of the whole payload in bytes
+  uint32_t flags;
+  uint32_t present;         // Bit per value below that is present in the config
+  int32_t values[6];        // GSM Width and Height followed by GDC Width, Height, BitsPerPixel, and Frequency
+  uint32_t logFileLength;   // Length of the log file path in characters
+  uint32_t traceFileLength; // Length of the trace file path in characters
+  uint32_t edsSectionCount;
+  uint32_t callerModulesLength; // Length of the caller module file names in characters
+  uint64_t gsmCallers;
+  uint64_t gdcCallers;
+};
+
+// Payload EDS section
+struct SpoofConfigPayloadEDSSection
+{
+  uint32_t present;         // Bit per value below that is present in the config with the any mode flag in bit 31
+  uint32_t mode;
+  uint32_t values[5];       // Width, Height, BitsPerPixel, Frequency, and Flags
+  int32_t positionX;        // Present in bit 5
+  int32_t positionY;
+  uint32_t orientation;     // Present in bit 6
+  uint32_t deviceLength;    // Length of the device in characters
+  uint32_t reserved;
+  uint64_t callers;
+};
+
+// IsSpoofConfigKeyEnabled function
+inline bool IsSpoofConfigKeyEnabled(const CSimpleIni& ini, const wchar_t* section, const wchar_t* key)
+{
+  // Check if the key is set to On, Yes, or True using case insensitive comparisons
+  const wchar_t* value = ini.GetValue(section, key);
+  if (value == nullptr)
+    return false;
+  auto equals = [&](const wchar_t* match)
+    {
+      return std::ranges::equal(std::wstring_view(value), std::wstring_view(match),
+        [](wchar_t a, wchar_t b)
+        {
+          return std::towlower(a) == std::towlower(b);
+        });
+    };
+  return equals(L"On") || equals(L"Yes") || equals(L"True");
+}
+
+// CompileSpoofConfigCallers function
+inline uint64_t CompileSpoofConfigCallers(const CSimpleIni& ini, const wchar_t* section, SpoofConfig& config)
+{
+  // Loop through the comma separated module file names in the Callers key of the section
+  // Note: every different module file name gets its own bit using case insensitive comparisons so a config can limit
+  //   its sections to at most 64 different modules
+  std::wstring_view callers = ini.GetValue(section, L"Callers", L"");
+  uint64_t mask = 0;
+  while (!callers.empty())
+  {
+    // Take the next module file name off the list, trim it, and remove any folders from it
+    size_t separator = callers.find(L',');
+    std::wstring_view name = callers.substr(0, separator);
+    callers = separator == std::wstring_view::npos ? std::wstring_view() : callers.substr(separator + 1);
+    size_t first = name.find_first_not_of(L" \t");
+    if (first == std::wstring_view::npos)
+      continue;
+    name = name.substr(first, name.find_last_not_of(L" \t") + 1 - first);
+    size_t folder = name.find_last_of(L"\\/");
+    if (folder != std::wstring_view::npos)
+      name = name.substr(folder + 1);
+    if (name.empty())
+      continue;
+
+    // Find the bit of the module file name and add it if it is not in the config yet
+    std::wstring module(name);
+    size_t bit = std::ranges::find_if(config.callerModules,
+      [&](const std::wstring& callerModule)
+      {
+        return _wcsicmp(callerModule.c_str(), module.c_str()) == 0;
+      }) - config.callerModules.begin();
+    if (bit == config.callerModules.size())
+    {
+      if (bit == 64)
+        throw std::out_of_range("Too many caller modules");
+      config.callerModules.push_back(std::move(module));
+    }
+    mask |= 1ull << bit;
+  }
+
+  return mask;
+}
+
+// CompileSpoofConfig function
+inline bool CompileSpoofConfig(const CSimpleIni& ini, SpoofConfig& config)
+{
+  // Load the settings
+  config.logging = IsSpoofConfigKeyEnabled(ini, L"SpoofResolution", L"Logging");
+  config.tracing = IsSpoofConfigKeyEnabled(ini, L"SpoofResolution", L"Tracing");
+  config.statistics = IsSpoofConfigKeyEnabled(ini, L"SpoofResolution", L"Statistics");
+  config.startupReport = IsSpoofConfigKeyEnabled(ini, L"SpoofResolution", L"StartupReport");
+  const wchar_t* initialization = ini.GetValue(L"SpoofResolution", L"Initialization", L"");
+  config.synchronousInitialization = _wcsicmp(initialization, L"Synchronous") == 0;
+  config.sharedConfig = IsSpoofConfigKeyEnabled(ini, L"SpoofResolution", L"SharedConfig");
+  if (ini.KeyExists(L"SpoofResolution", L"LogFile"))
+    config.logFile = std::make_unique<std::wstring>(ini.GetValue(L"SpoofResolution", L"LogFile"));
+  if (ini.KeyExists(L"SpoofResolution", L"TraceFile"))
+    config.traceFile = std::make_unique<std::wstring>(ini.GetValue(L"SpoofResolution", L"TraceFile"));
+
+  // Check which functions need to be detoured
+  // Note: the functions are detoured whenever their sections exist even if the resolution information in them can not
+  //   be loaded, they then pass calls straight through to the real functions
+  std::list<CSimpleIni::Entry> sections;
+  ini.GetAllSections(sections);
+  config.gsmSection = ini.SectionExists(L"GSM");
+  config.gdcSection = ini.SectionExists(L"GDC");
+  config.edsSection = std::ranges::any_of(sections,
+    [](const CSimpleIni::Entry& entry)
+    {
+      return _wcsnicmp(entry.pItem, L"EDS|", 4) == 0;
+    });
+
+  // Load the resolution information
+  // Note: all of the values are converted here once instead of every time a detoured function is called
+  try
+  {
+    // Load the GSM and GDC sections
+    config.gsmCallers = CompileSpoofConfigCallers(ini, L"GSM", config);
+    config.gdcCallers = CompileSpoofConfigCallers(ini, L"GDC", config);
+    if (ini.KeyExists(L"GSM", L"Width"))
+      config.gsmWidth = std::make_unique<int>(std::stoi(ini.GetValue(L"GSM", L"Width")));
+    if (ini.KeyExists(L"GSM", L"Height"))
+      config.gsmHeight = std::make_unique<int>(std::stoi(ini.GetValue(L"GSM", L"Height")));
+    if (ini.KeyExists(L"GDC", L"Width"))
+      config.gdcWidth = std::make_unique<int>(std::stoi(ini.GetValue(L"GDC", L"Width")));
+    if (ini.KeyExists(L"GDC", L"Height"))
+      config.gdcHeight = std::make_unique<int>(std::stoi(ini.GetValue(L"GDC", L"Height")));
+    if (ini.KeyExists(L"GDC", L"BitsPerPixel"))
+      config.gdcBitsPerPixel = std::make_unique<int>(std::stoi(ini.GetValue(L"GDC", L"BitsPerPixel")));
+    if (ini.KeyExists(L"GDC", L"Frequency"))
+      config.gdcFrequency = std::make_unique<int>(std::stoi(ini.GetValue(L"GDC", L"Frequency")));
+
+    // Loop through the sections that start with EDS| using case insensitive comparisons
+    for (const CSimpleIni::Entry& entry : sections)
+    {
+      // Check if this section does not have the EDS|Device|Mode format
+      std::wstring name = entry.pItem;
+      size_t separator = name.rfind(L'|');
+      if (name.size() < 4 || _wcsnicmp(name.c_str(), L"EDS|", 4) != 0 || separator == 3)
+        continue;
+
+      // Load the device and mode and skip sections with a mode that can never be matched
+      SpoofConfig::EDSSection section = {};
+      section.device = name.substr(4, separator - 4);
+      section.anyDevice = section.device == L"*";
+      std::wstring mode = name.substr(separator + 1);
+      if (mode == L"*")
+        section.anyMode = true;
+      else if (_wcsicmp(mode.c_str(), L"Current") == 0)
+        section.mode = ENUM_CURRENT_SETTINGS;
+      else if (_wcsicmp(mode.c_str(), L"Registry") == 0)
+        section.mode = ENUM_REGISTRY_SETTINGS;
+      else if (!mode.empty() && std::ranges::all_of(mode, [](wchar_t c) { return c >= L'0' && c <= L'9'; }))
+        section.mode = std::stoul(mode);
+      else
+        continue;
+
+      // Load the resolution information
+      if (ini.KeyExists(entry.pItem, L"Width"))
+        section.width = std::make_unique<DWORD>(std::stoul(ini.GetValue(entry.pItem, L"Width")));
+      if (ini.KeyExists(entry.pItem, L"Height"))
+        section.height = std::make_unique<DWORD>(std::stoul(ini.GetValue(entry.pItem, L"Height")));
+      if (ini.KeyExists(entry.pItem, L"BitsPerPixel"))
+        section.bitsPerPixel = std::make_unique<DWORD>(std::stoul(ini.GetValue(entry.pItem, L"BitsPerPixel")));
+      if (ini.KeyExists(entry.pItem, L"Frequency"))
+        section.frequency = std::make_unique<DWORD>(std::stoul(ini.GetValue(entry.pItem, L"Frequency")));
+      if (ini.KeyExists(entry.pItem, L"Flags"))
+        section.flags = std::make_unique<DWORD>(std::stoul(ini.GetValue(entry.pItem, L"Flags")));
+      if (ini.KeyExists(entry.pItem, L"PositionX") && ini.KeyExists(entry.pItem, L"PositionY"))
+      {
+        section.position = std::make_unique<POINTL>();
+        section.position->x = std::stoul(ini.GetValue(entry.pItem, L"PositionX"));
+        section.position->y = std::stoul(ini.GetValue(entry.pItem, L"PositionY"));
+      }
+      if (ini.KeyExists(entry.pItem, L"Orientation"))
+        section.orientation = std::make_unique<DWORD>(std::stoul(ini.GetValue(entry.pItem, L"Orientation")));
+      section.callers = CompileSpoofConfigCallers(ini, entry.pItem, config);
+      config.edsSections.push_back(std::move(section));
+    }
+  }
+  catch (const std::logic_error&)
+  {
+    // Discard any resolution information that was loaded but keep the settings
+    // Note: std::stoi and std::stoul throw std::invalid_argument and std::out_of_range which are both logic errors
+    config.gsmWidth.reset();
+    config.gsmHeight.reset();
+    config.gdcWidth.reset();
+    config.gdcHeight.reset();
+    config.gdcBitsPerPixel.reset();
+    config.gdcFrequency.reset();
+    config.edsSections.clear();
+    config.callerModules.clear();
+    config.gsmCallers = 0;
+    config.gdcCallers = 0;
+
+    return false;
+  }
+
+  return true;
+}
+
+// SerializeSpoofConfig function
+inline std::vector<uint8_t> SerializeSpoofConfig(const SpoofConfig& config)
+{
+  // Fill in the header
+  SpoofConfigPayloadHeader header = {};
+  header.version = SPOOFRES_CONFIG_PAYLOAD_VERSION;
+  header.flags = (config.logging ? SpoofConfigPayloadLogging : 0) | (config.tracing ? SpoofConfigPayloadTracing : 0) |
+    (config.statistics ? SpoofConfigPayloadStatistics : 0) |
+    (config.startupReport ? SpoofConfigPayloadStartupReport : 0) |
+    (config.synchronousInitialization ? SpoofConfigPayloadSynchronousInitialization : 0) |
+    (config.gsmSection ? SpoofConfigPayloadDetourGSM : 0) | (config.gdcSection ? SpoofConfigPayloadDetourGDC : 0) |
+    (config.edsSection ? SpoofConfigPayloadDetourEDS : 0) |
+    (config.sharedConfig ? SpoofConfigPayloadSharedConfig : 0);
+  const int* values[] = { config.gsmWidth.get(), config.gsmHeight.get(), config.gdcWidth.get(), config.gdcHeight.get(),
+    config.gdcBitsPerPixel.get(), config.gdcFrequency.get() };
+  for (uint32_t value = 0; value < std::size(values); value++)
+  {
+    if (values[value] == nullptr)
+      continue;
+    header.present |= 1 << value;
+    header.values[value] = *values[value];
+  }
+
+  // Fill in the strings as UTF-16 characters
+  std::vector<uint16_t> characters;
+  auto appendString = [&](const std::wstring* string) -> uint32_t
+    {
+      if (string == nullptr)
+        return SPOOFRES_CONFIG_PAYLOAD_NO_STRING;
+      for (wchar_t c : *string)
+        characters.push_back((uint16_t)c);
+      return (uint32_t)string->size();
+    };
+  header.logFileLength = appendString(config.logFile.get());
+  header.traceFileLength = appendString(config.traceFile.get());
+
+  // Fill in the EDS sections
+  std::vector<SpoofConfigPayloadEDSSection> sections;
+  for (const SpoofConfig::EDSSection& section : config.edsSections)
+  {
+    SpoofConfigPayloadEDSSection payloadSection = {};
+    payloadSection.present = section.anyMode ? 0x80000000 : 0;
+    payloadSection.mode = section.mode;
+    const DWORD* sectionValues[] = { section.width.get(), section.height.get(), section.bitsPerPixel.get(),
+      section.frequency.get(), section.flags.get() };
+    for (uint32_t value = 0; value < std::size(sectionValues); value++)
+    {
+      if (sectionValues[value] == nullptr)
+        continue;
+      payloadSection.present |= 1 << value;
+      payloadSection.values[value] = *sectionValues[value];
+    }
+    if (section.position != nullptr)
+    {
+      payloadSection.present |= 1 << 5;
+      payloadSection.positionX = section.position->x;
+      payloadSection.positionY = section.position->y;
+    }
+    if (section.orientation != nullptr)
+    {
+      payloadSection.present |= 1 << 6;
+      payloadSection.orientation = *section.orientation;
+    }
+    payloadSection.deviceLength = appendString(&section.device);
+    payloadSection.callers = section.callers;
+    sections.push_back(payloadSection);
+  }
+  header.edsSectionCount = (uint32_t)sections.size();
+
+  // Fill in the caller modules
+  std::wstring callerModules;
+  for (const std::wstring& callerModule : config.callerModules)
+    callerModules += (callerModules.empty() ? L"" : L",") + callerModule;
+  header.callerModulesLength = appendString(&callerModules);
+  header.gsmCallers = config.gsmCallers;
+  header.gdcCallers = config.gdcCallers;
+
+  // Lay out the payload
+  size_t sectionsSize = sections.size() * sizeof(SpoofConfigPayloadEDSSection);
+  size_t charactersSize = characters.size() * sizeof(uint16_t);
+  header.size = (uint32_t)(sizeof(header) + sectionsSize + charactersSize);
+  std::vector<uint8_t> payload(header.size);
+  memcpy(payload.data(), &header, sizeof(header));
+  if (sectionsSize != 0)
+    memcpy(payload.data() + sizeof(header), sections.data(), sectionsSize);
+  if (charactersSize != 0)
+    memcpy(payload.data() + sizeof(header) + sectionsSize, characters.data(), charactersSize);
+
+  return payload;
+}
+
+// ReadSpoofConfigPayloadHeader function
+inline bool ReadSpoofConfigPayloadHeader(const void* payload, size_t size, SpoofConfigPayloadHeader& header)
+{
+  // Check if the payload is too small or was written with a different layout
+  if (payload == nullptr || size < sizeof(SpoofConfigPayloadHeader))
+    return false;
+  memcpy(&header, payload, sizeof(header));
+  return header.version == SPOOFRES_CONFIG_PAYLOAD_VERSION && header.size == size;
+}
+
+// DeserializeSpoofConfig function
+inline std::unique_ptr<SpoofConfig> DeserializeSpoofConfig(const void* payload, size_t size)
+{
+  // Check if the payload does not have a valid header or the EDS sections do not fit in it
+  // Note: the payload was written by another process so every length in it is checked before it is used
+  SpoofConfigPayloadHeader header;
+  if (!ReadSpoofConfigPayloadHeader(payload, size, header) ||
+    header.edsSectionCount > (size - sizeof(header)) / sizeof(SpoofConfigPayloadEDSSection))
+    return nullptr;
+  const uint8_t* bytes = (const uint8_t*)payload;
+  size_t charactersOffset = sizeof(header) + header.edsSectionCount * sizeof(SpoofConfigPayloadEDSSection);
+  if ((size - charactersOffset) % sizeof(uint16_t) != 0)
+    return nullptr;
+  size_t charactersLeft = (size - charactersOffset) / sizeof(uint16_t);
+  const uint8_t* nextCharacter = bytes + charactersOffset;
+  auto readString = [&](uint32_t length, std::wstring& string) -> bool
+    {
+      if (length > charactersLeft)
+        return false;
+      string.resize(length);
+      for (uint32_t i = 0; i < length; i++)
+      {
+        uint16_t c;
+        memcpy(&c, nextCharacter, sizeof(c));
+        string[i] = (wchar_t)c;
+        nextCharacter += sizeof(c);
+      }
+      charactersLeft -= length;
+      return true;
+    };
+
+  // Load the settings
+  std::unique_ptr<SpoofConfig> config = std::make_unique<SpoofConfig>();
+  config->logging = (header.flags & SpoofConfigPayloadLogging) != 0;
+  config->tracing = (header.flags & SpoofConfigPayloadTracing) != 0;
+  config->statistics = (header.flags & SpoofConfigPayloadStatistics) != 0;
+  config->startupReport = (header.flags & SpoofConfigPayloadStartupReport) != 0;
+  config->synchronousInitialization = (header.flags & SpoofConfigPayloadSynchronousInitialization) != 0;
+  config->gsmSection = (header.flags & SpoofConfigPayloadDetourGSM) != 0;
+  config->gdcSection = (header.flags & SpoofConfigPayloadDetourGDC) != 0;
+  config->edsSection = (header.flags & SpoofConfigPayloadDetourEDS) != 0;
+  config->sharedConfig = (header.flags & SpoofConfigPayloadSharedConfig) != 0;
+  if (header.logFileLength != SPOOFRES_CONFIG_PAYLOAD_NO_STRING)
+  {
+    config->logFile = std::make_unique<std::wstring>();
+    if (!readString(header.logFileLength, *config->logFile))
+      return nullptr;
+  }
+  if (header.traceFileLength != SPOOFRES_CONFIG_PAYLOAD_NO_STRING)
+  {
+    config->traceFile = std::make_unique<std::wstring>();
+    if (!readString(header.traceFileLength, *config->traceFile))
+      return nullptr;
+  }
+
+  // Load the GSM and GDC values
+  std::unique_ptr<int>* values[] = { &config->gsmWidth, &config->gsmHeight, &config->gdcWidth, &config->gdcHeight,
+    &config->gdcBitsPerPixel, &config->gdcFrequency };
+  for (uint32_t value = 0; value < std::size(values); value++)
+    if (header.present & (1 << value))
+      *values[value] = std::make_unique<int>(header.values[value]);
+
+  // Load the EDS sections
+  config->edsSections.reserve(header.edsSectionCount);
+  for (uint32_t index = 0; index < header.edsSectionCount; index++)
+  {
+    SpoofConfigPayloadEDSSection payloadSection;
+    memcpy(&payloadSection, bytes + sizeof(header) + index * sizeof(payloadSection), sizeof(payloadSection));
+    SpoofConfig::EDSSection section = {};
+    if (!readString(payloadSection.deviceLength, section.device))
+      return nullptr;
+    section.anyDevice = section.device == L"*";
+    section.anyMode = (payloadSection.present & 0x80000000) != 0;
+    section.mode = payloadSection.mode;
+    std::unique_ptr<DWORD>* sectionValues[] = { &section.width, &section.height, &section.bitsPerPixel,
+      &section.frequency, &section.flags };
+    for (uint32_t value = 0; value < std::size(sectionValues); value++)
+      if (payloadSection.present & (1 << value))
+        *sectionValues[value] = std::make_unique<DWORD>(payloadSection.values[value]);
+    if (payloadSection.present & (1 << 5))
+    {
+      section.position = std::make_unique<POINTL>();
+      section.position->x = payloadSection.positionX;
+      section.position->y = payloadSection.positionY;
+    }
+    if (payloadSection.present & (1 << 6))
+      section.orientation = std::make_unique<DWORD>(payloadSection.orientation);
+    section.callers = payloadSection.callers;
+    config->edsSections.push_back(std::move(section));
+  }
+
+  // Load the caller modules
+  std::wstring callerModules;
+  if (!readString(header.callerModulesLength, callerModules))
+    return nullptr;
+  for (size_t begin = 0; begin < callerModules.size();)
+  {
+    size_t end = callerModules.find(L',', begin);
+    if (end == std::wstring::npos)
+      end = callerModules.size();
+    config->callerModules.push_back(callerModules.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  config->gsmCallers = header.gsmCallers;
+  config->gdcCallers = header.gdcCallers;
+
+  // Check if there are characters left over that no string accounts for or any section is limited to a caller module
+  //   that is not in the payload
+  if (charactersLeft != 0 || config->callerModules.size() > 64)
+    return nullptr;
+  uint64_t unknownCallers = config->callerModules.size() == 64 ? 0 : ~0ull << config->callerModules.size();
+  if ((config->gsmCallers & unknownCallers) != 0 || (config->gdcCallers & unknownCallers) != 0 ||
+    std::ranges::any_of(config->edsSections,
+      [&](const SpoofConfig::EDSSection& section)
+      {
+        return (section.callers & unknownCallers) != 0;
+      }))
+    return nullptr;
+
+  return config;
+}
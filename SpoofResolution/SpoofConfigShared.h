@@ -0,0 +1,312 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include <windows.h>
+#ifdef _WIN32
+#include <sddl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <SpoofConfig.h>
+
+// Shared memory section that the Spoof Resolution DLL publishes a compiled config into when the SharedConfig key is
+//   enabled, so that other processes using the same ini file map the section instead of parsing the ini file
+// Note: the section is named after its layout version, the payload layout version, and a hash of the ini file contents
+//   so that processes built with different layouts never map each other's sections, and readers validate the header
+//   before handing the payload to DeserializeSpoofConfig, which validates the payload itself
+// Note: only the publisher can write to the section, on Windows it is a named file mapping whose DACL only grants read
+//   access and elsewhere it is a POSIX shared memory object created with read permission for its owner only, in both
+//   cases the publisher keeps the write access it was created with and readers map the section read only
+
+// Value of the magic field of the header 'SRCS'
+#define SPOOFRES_CONFIG_SHARED_MAGIC 0x53435253
+
+// Version of the section layout which must be incremented whenever the header changes
+#define SPOOFRES_CONFIG_SHARED_VERSION 1
+
+// Name of the section formatted with the section layout version, the payload layout version, and the hash of the ini
+//   file contents the payload was compiled from
+// Note: POSIX shared memory objects are not scoped to a session so their name also has the id of the user
+#define SPOOFRES_CONFIG_SHARED_NAME_FORMAT L"Local\\SpoofResolution.Config.%u.%u.%016llx"
+#define SPOOFRES_CONFIG_SHARED_POSIX_NAME_FORMAT "/SpoofResolution.Config.%u.%u.%016llx.%u"
+
+// Security descriptor of the section on Windows formatted with the SID of the user
+// Note: the ACE for the owner rights SID keeps the owner from granting itself more access through WRITE_DAC
+#define SPOOFRES_CONFIG_SHARED_SDDL_FORMAT L"D:P(A;;GR;;;OW)(A;;GR;;;%s)"
+
+// Header at the start of the section which is followed by the payload
+// Note: the publisher sets ready once the payload has been written, readers that see a section that is not ready yet
+//   parse the ini file themselves
+struct SpoofConfigSharedHeader
+{
+  uint32_t magic;
+  uint32_t version;       // Section layout version
+  uint32_t headerSize;    // Size of this header in bytes
+  uint32_t payloadSize;   // Size of the payload that follows the header in bytes
+  uint64_t iniHash;       // Hash of the ini file contents the payload was compiled from
+  uint64_t iniSize;       // Size of the ini file contents in bytes
+  volatile LONG ready;
+  uint32_t reserved;
+};
+
+// HashSpoofConfigIni function
+inline uint64_t HashSpoofConfigIni(const void* data, size_t size)
+{
+  // Hash the ini file contents with 64-bit FNV-1a
+  const uint8_t* bytes = (const uint8_t*)data;
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ bytes[i]) * 0x100000001b3;
+  return hash;
+}
+
+// GetSpoofConfigSharedName function
+inline std::wstring GetSpoofConfigSharedName(uint64_t iniHash)
+{
+  wchar_t name[64];
+  swprintf(name, std::size(name), SPOOFRES_CONFIG_SHARED_NAME_FORMAT, SPOOFRES_CONFIG_SHARED_VERSION,
+    SPOOFRES_CONFIG_PAYLOAD_VERSION, (unsigned long long)iniHash);
+  return name;
+}
+
+// GetSpoofConfigSharedPosixName function
+inline std::string GetSpoofConfigSharedPosixName(uint64_t iniHash, uint32_t userId)
+{
+  char name[80];
+  snprintf(name, std::size(name), SPOOFRES_CONFIG_SHARED_POSIX_NAME_FORMAT, SPOOFRES_CONFIG_SHARED_VERSION,
+    SPOOFRES_CONFIG_PAYLOAD_VERSION, (unsigned long long)iniHash, userId);
+  return name;
+}
+
+// WriteSpoofConfigShared function
+inline bool WriteSpoofConfigShared(void* section, size_t sectionSize, uint64_t iniHash, uint64_t iniSize,
+  const std::vector<uint8_t>& payload)
+{
+  // Write the header and the payload and then mark the section as ready
+  // Note: the barrier makes sure that readers that see ready also see the whole header and payload
+  if (section == nullptr || sectionSize < sizeof(SpoofConfigSharedHeader) ||
+    payload.size() > sectionSize - sizeof(SpoofConfigSharedHeader) || payload.size() > UINT32_MAX)
+    return false;
+  SpoofConfigSharedHeader* header = (SpoofConfigSharedHeader*)section;
+  header->magic = SPOOFRES_CONFIG_SHARED_MAGIC;
+  header->version = SPOOFRES_CONFIG_SHARED_VERSION;
+  header->headerSize = sizeof(SpoofConfigSharedHeader);
+  header->payloadSize = (uint32_t)payload.size();
+  header->iniHash = iniHash;
+  header->iniSize = iniSize;
+  header->reserved = 0;
+  if (!payload.empty())
+    memcpy(header + 1, payload.data(), payload.size());
+  MemoryBarrier();
+  InterlockedExchange(&header->ready, 1);
+  return true;
+}
+
+// ReadSpoofConfigShared function
+inline const void* ReadSpoofConfigShared(const void* section, size_t sectionSize, uint64_t iniHash, uint64_t iniSize,
+  size_t& payloadSize)
+{
+  // Check if the section is too small, is not ready yet, was written with a different layout, or was compiled from
+  //   different ini file contents
+  // Note: the payload itself is validated by DeserializeSpoofConfig
+  const SpoofConfigSharedHeader* header = (const SpoofConfigSharedHeader*)section;
+  if (section == nullptr || sectionSize < sizeof(SpoofConfigSharedHeader) || header->ready == 0)
+    return nullptr;
+  MemoryBarrier();
+  if (header->magic != SPOOFRES_CONFIG_SHARED_MAGIC || header->version != SPOOFRES_CONFIG_SHARED_VERSION ||
+    header->headerSize != sizeof(SpoofConfigSharedHeader) || header->iniHash != iniHash ||
+    header->iniSize != iniSize || header->payloadSize > sectionSize - sizeof(SpoofConfigSharedHeader))
+    return nullptr;
+  payloadSize = header->payloadSize;
+  return header + 1;
+}
+
+// Section a compiled config was published into or loaded from
+// Note: on Windows the section exists for as long as any process has it open so the mapping is kept open until the
+//   section is closed, a POSIX shared memory object exists until it is unlinked so the publisher unlinks it when the
+//   section is closed and readers do not keep anything open
+class SpoofConfigSharedSection
+{
+public:
+  SpoofConfigSharedSection() = default;
+  SpoofConfigSharedSection(const SpoofConfigSharedSection&) = delete;
+  SpoofConfigSharedSection& operator=(const SpoofConfigSharedSection&) = delete;
+  ~SpoofConfigSharedSection()
+  {
+    Close();
+  }
+
+  // Publish function
+  // Note: this fails if the section already exists since another process is then publishing the same config
+  bool Publish(uint64_t iniHash, uint64_t iniSize, const std::vector<uint8_t>& payload)
+  {
+    Close();
+    size_t size = sizeof(SpoofConfigSharedHeader) + payload.size();
+#ifdef _WIN32
+    // Create the section with a DACL that only grants read access
+    // Note: the handle returned for a new section still has the access it was created with
+    PSECURITY_DESCRIPTOR descriptor = CreateSecurityDescriptor();
+    if (descriptor == nullptr)
+      return false;
+    SECURITY_ATTRIBUTES attributes = { sizeof(attributes), descriptor, FALSE };
+    HANDLE newMapping = CreateFileMapping(INVALID_HANDLE_VALUE, &attributes, PAGE_READWRITE, 0, (DWORD)size,
+      GetSpoofConfigSharedName(iniHash).c_str());
+    DWORD error = GetLastError();
+    LocalFree(descriptor);
+    if (newMapping == NULL)
+      return false;
+    if (error == ERROR_ALREADY_EXISTS)
+    {
+      CloseHandle(newMapping);
+
+      return false;
+    }
+
+    // Write the payload and mark the section as ready
+    void* section = MapViewOfFile(newMapping, FILE_MAP_WRITE, 0, 0, size);
+    bool written = WriteSpoofConfigShared(section, size, iniHash, iniSize, payload);
+    if (section != nullptr)
+      UnmapViewOfFile(section);
+    if (!written)
+    {
+      CloseHandle(newMapping);
+
+      return false;
+    }
+    mapping = newMapping;
+#else
+    // Create the object with read permission for its owner only
+    // Note: the descriptor returned for a new object still has the access it was opened with
+    std::string newName = GetSpoofConfigSharedPosixName(iniHash, geteuid());
+    int descriptor = shm_open(newName.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR);
+    if (descriptor < 0)
+      return false;
+
+    // Write the payload and mark the object as ready
+    void* section = ftruncate(descriptor, (off_t)size) == 0 ?
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0) : MAP_FAILED;
+    close(descriptor);
+    bool written = section != MAP_FAILED && WriteSpoofConfigShared(section, size, iniHash, iniSize, payload);
+    if (section != MAP_FAILED)
+      munmap(section, size);
+    if (!written)
+    {
+      shm_unlink(newName.c_str());
+
+      return false;
+    }
+    name = std::move(newName);
+#endif
+
+    return true;
+  }
+
+  // Load function
+  std::unique_ptr<SpoofConfig> Load(uint64_t iniHash, uint64_t iniSize)
+  {
+    Close();
+    std::unique_ptr<SpoofConfig> config;
+#ifdef _WIN32
+    // Open the section read only and map all of it
+    // Note: the size of the section is not known up front so the whole section is mapped and its size is queried
+    HANDLE openedMapping = OpenFileMapping(FILE_MAP_READ, FALSE, GetSpoofConfigSharedName(iniHash).c_str());
+    if (openedMapping == NULL)
+      return nullptr;
+    const void* section = MapViewOfFile(openedMapping, FILE_MAP_READ, 0, 0, 0);
+    MEMORY_BASIC_INFORMATION information;
+    size_t sectionSize = section != nullptr && VirtualQuery(section, &information, sizeof(information)) != 0 ?
+      information.RegionSize : 0;
+#else
+    // Open the object read only and check that it was created by a publisher running as the same user, which never
+    //   gives write permission to anyone
+    int descriptor = shm_open(GetSpoofConfigSharedPosixName(iniHash, geteuid()).c_str(), O_RDONLY, 0);
+    if (descriptor < 0)
+      return nullptr;
+    struct stat status;
+    size_t sectionSize = fstat(descriptor, &status) == 0 && status.st_uid == geteuid() &&
+      (status.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) == 0 ? (size_t)status.st_size : 0;
+    void* section = sectionSize >= sizeof(SpoofConfigSharedHeader) ?
+      mmap(nullptr, sectionSize, PROT_READ, MAP_SHARED, descriptor, 0) : MAP_FAILED;
+    close(descriptor);
+    if (section == MAP_FAILED)
+      return nullptr;
+#endif
+
+    // Load the config from the section
+    size_t payloadSize = 0;
+    const void* payload = ReadSpoofConfigShared(section, sectionSize, iniHash, iniSize, payloadSize);
+    if (payload != nullptr)
+      config = DeserializeSpoofConfig(payload, payloadSize);
+#ifdef _WIN32
+    if (section != nullptr)
+      UnmapViewOfFile(section);
+    if (config == nullptr)
+      CloseHandle(openedMapping);
+    else
+      mapping = openedMapping;
+#else
+    munmap(section, sectionSize);
+#endif
+
+    return config;
+  }
+
+  // Close function
+  void Close()
+  {
+#ifdef _WIN32
+    if (mapping != NULL)
+    {
+      CloseHandle(mapping);
+      mapping = NULL;
+    }
+#else
+    if (!name.empty())
+    {
+      shm_unlink(name.c_str());
+      name.clear();
+    }
+#endif
+  }
+
+private:
+#ifdef _WIN32
+  // CreateSecurityDescriptor function
+  static PSECURITY_DESCRIPTOR CreateSecurityDescriptor()
+  {
+    // Get the SID of the user this process runs as and format it into the security descriptor
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token))
+      return nullptr;
+    DWORD size = 0;
+    GetTokenInformation(token, TokenUser, nullptr, 0, &size);
+    std::vector<uint8_t> user(size);
+    LPWSTR sid = nullptr;
+    bool found = size != 0 && GetTokenInformation(token, TokenUser, user.data(), size, &size) &&
+      ConvertSidToStringSidW(((PTOKEN_USER)user.data())->User.Sid, &sid);
+    CloseHandle(token);
+    if (!found)
+      return nullptr;
+    wchar_t sddl[256];
+    swprintf_s(sddl, SPOOFRES_CONFIG_SHARED_SDDL_FORMAT, sid);
+    LocalFree(sid);
+    PSECURITY_DESCRIPTOR descriptor = nullptr;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl, SDDL_REVISION_1, &descriptor, nullptr))
+      return nullptr;
+    return descriptor;
+  }
+
+  HANDLE mapping = NULL;
+#else
+  std::string name; // Name of the object that this process published and unlinks when it is closed
+#endif
+};
@@ -0,0 +1,223 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <windows.h>
+
+// Manifest parsing and scheduling of the spoofreslaunch utility, which starts every application or game listed in a
+//   manifest file with the Spoof Resolution DLL concurrently on a pool of worker threads
+// Note: the processes are created, handed the compiled config, and resumed through a LaunchBackend so that everything
+//   here is independent of Detours, spoofreslaunch uses a backend built on the Detours process functions and the tests
+//   use a fake one
+
+// Launch of a single command line
+// Note: times are in performance counter ticks
+struct LaunchTarget
+{
+  std::wstring commandLine;
+  DWORD processId = 0;
+  DWORD error = ERROR_SUCCESS;
+  const wchar_t* failedStep = nullptr;
+  LONGLONG waitTicks = 0;    // Time between starting the worker threads and a worker thread picking up the launch
+  LONGLONG createTicks = 0;  // Time spent creating the suspended process and updating its imports
+  LONGLONG payloadTicks = 0; // Time spent copying the compiled config into the process
+  LONGLONG resumeTicks = 0;  // Time spent resuming the process
+  LONGLONG totalTicks = 0;   // Time from a worker thread picking up the launch until the process was resumed
+};
+
+// What is shared by every launch
+// Note: the shared data is not modified once the worker threads are started so they can read it without any locks
+struct LaunchShared
+{
+  std::vector<uint8_t> configPayload;
+  LARGE_INTEGER start = {};
+};
+
+// Process functions the launches are made through
+// Note: the functions are called concurrently from every worker thread and report failures through SetLastError like
+//   the Windows functions they stand for
+class LaunchBackend
+{
+public:
+  virtual ~LaunchBackend() = default;
+
+  // Create the process suspended with the DLL added to its imports
+  virtual bool Create(const std::wstring& commandLine, PROCESS_INFORMATION& processInfo) = 0;
+
+  // Copy the compiled config into the suspended process
+  virtual bool CopyPayload(const PROCESS_INFORMATION& processInfo, const std::vector<uint8_t>& payload) = 0;
+
+  // Resume the main thread of the process
+  virtual bool Resume(const PROCESS_INFORMATION& processInfo) = 0;
+
+  // Terminate a process that could not be fully prepared
+  virtual void Terminate(const PROCESS_INFORMATION& processInfo) = 0;
+
+  // Close the handles of the process and its main thread
+  virtual void Close(const PROCESS_INFORMATION& processInfo) = 0;
+};
+
+// Latency of the launches that succeeded
+// Note: times are in performance counter ticks and are all 0 when no launch succeeded
+struct LaunchSummary
+{
+  size_t launched = 0;
+  LONGLONG minTicks = 0;
+  LONGLONG medianTicks = 0;
+  LONGLONG averageTicks = 0;
+  LONGLONG maxTicks = 0;
+};
+
+// ParseLaunchManifest function
+inline std::vector<LaunchTarget> ParseLaunchManifest(const std::string& bytes)
+{
+  // Convert the manifest file to wide characters
+  // Note: the manifest file is UTF-8 unless it starts with a UTF-16 byte order mark, the UTF-16 code units are copied
+  //   as they are which keeps them unchanged where wchar_t is UTF-16
+  std::wstring text;
+  if (bytes.size() >= 2 && (uint8_t)bytes[0] == 0xFF && (uint8_t)bytes[1] == 0xFE)
+  {
+    text.resize((bytes.size() - 2) / sizeof(uint16_t));
+    for (size_t i = 0; i < text.size(); i++)
+    {
+      uint16_t c;
+      memcpy(&c, bytes.data() + 2 + i * sizeof(c), sizeof(c));
+      text[i] = (wchar_t)c;
+    }
+  }
+  else
+  {
+    size_t offset = bytes.compare(0, 3, "\xEF\xBB\xBF") == 0 ? 3 : 0;
+    int length = bytes.size() == offset ? 0 :
+      MultiByteToWideChar(CP_UTF8, 0, bytes.data() + offset, (int)(bytes.size() - offset), nullptr, 0);
+    text.resize(length);
+    if (length > 0)
+      MultiByteToWideChar(CP_UTF8, 0, bytes.data() + offset, (int)(bytes.size() - offset), &text[0], length);
+  }
+
+  // Add a launch for each command line ignoring blank lines and comments
+  std::vector<LaunchTarget> targets;
+  for (size_t begin = 0; begin < text.size();)
+  {
+    size_t end = text.find(L'\n', begin);
+    if (end == std::wstring::npos)
+      end = text.size();
+    std::wstring line = text.substr(begin, end - begin);
+    begin = end + 1;
+    line.erase(line.find_last_not_of(L" \t\r") + 1);
+    line.erase(0, line.find_first_not_of(L" \t"));
+    if (line.empty() || line[0] == L';')
+      continue;
+    LaunchTarget target;
+    target.commandLine = std::move(line);
+    targets.push_back(std::move(target));
+  }
+
+  return targets;
+}
+
+// LaunchProcess function
+inline void LaunchProcess(LaunchBackend& backend, const LaunchShared& shared, LaunchTarget& target)
+{
+  LARGE_INTEGER begin, created, copied, resumed;
+  QueryPerformanceCounter(&begin);
+  target.waitTicks = begin.QuadPart - shared.start.QuadPart;
+
+  // Create the process suspended with the DLL added to its imports
+  PROCESS_INFORMATION processInfo = {};
+  if (!backend.Create(target.commandLine, processInfo))
+  {
+    target.error = GetLastError();
+    target.failedStep = L"create";
+    return;
+  }
+  QueryPerformanceCounter(&created);
+  target.processId = processInfo.dwProcessId;
+  target.createTicks = created.QuadPart - begin.QuadPart;
+
+  // Copy the compiled config into the process and resume it
+  // Note: a process that could not be fully prepared is terminated rather than left suspended
+  copied = created;
+  if (!shared.configPayload.empty() && !backend.CopyPayload(processInfo, shared.configPayload))
+  {
+    target.error = GetLastError();
+    target.failedStep = L"copy payload";
+  }
+  else
+  {
+    QueryPerformanceCounter(&copied);
+    target.payloadTicks = copied.QuadPart - created.QuadPart;
+    if (!backend.Resume(processInfo))
+    {
+      target.error = GetLastError();
+      target.failedStep = L"resume";
+    }
+  }
+  if (target.failedStep != nullptr)
+    backend.Terminate(processInfo);
+  QueryPerformanceCounter(&resumed);
+  target.resumeTicks = target.failedStep == nullptr ? resumed.QuadPart - copied.QuadPart : 0;
+  target.totalTicks = resumed.QuadPart - begin.QuadPart;
+
+  backend.Close(processInfo);
+}
+
+// GetLaunchThreadCount function
+inline unsigned long GetLaunchThreadCount(unsigned long threadCount, size_t targetCount)
+{
+  // Use no more worker threads than there are launches but at least one
+  // Note: hardware_concurrency returns 0 when the number of processors is unknown, which callers pass on as is
+  if (threadCount > targetCount)
+    threadCount = (unsigned long)targetCount;
+  return threadCount == 0 ? 1 : threadCount;
+}
+
+// RunLaunches function
+inline void RunLaunches(LaunchBackend& backend, LaunchShared& shared, std::vector<LaunchTarget>& targets,
+  unsigned long threadCount)
+{
+  // Start the worker threads, each launching the next target that no other worker thread has picked up until there
+  //   are none left, and wait for all of them to finish
+  std::atomic<size_t> next = 0;
+  auto worker = [&]()
+    {
+      for (size_t index = next++; index < targets.size(); index = next++)
+        LaunchProcess(backend, shared, targets[index]);
+    };
+  std::vector<std::thread> workers;
+  QueryPerformanceCounter(&shared.start);
+  for (unsigned long i = GetLaunchThreadCount(threadCount, targets.size()); i != 0; i--)
+    workers.emplace_back(worker);
+  for (std::thread& thread : workers)
+    thread.join();
+}
+
+// SummarizeLaunches function
+inline LaunchSummary SummarizeLaunches(const std::vector<LaunchTarget>& targets)
+{
+  // Sort the total times of the launches that succeeded
+  std::vector<LONGLONG> launchedTicks;
+  for (const LaunchTarget& target : targets)
+    if (target.failedStep == nullptr)
+      launchedTicks.push_back(target.totalTicks);
+  LaunchSummary summary;
+  summary.launched = launchedTicks.size();
+  if (launchedTicks.empty())
+    return summary;
+  std::sort(launchedTicks.begin(), launchedTicks.end());
+
+  LONGLONG sumTicks = 0;
+  for (LONGLONG ticks : launchedTicks)
+    sumTicks += ticks;
+  summary.minTicks = launchedTicks.front();
+  summary.medianTicks = launchedTicks[launchedTicks.size() / 2];
+  summary.averageTicks = sumTicks / (LONGLONG)launchedTicks.size();
+  summary.maxTicks = launchedTicks.back();
+
+  return summary;
+}
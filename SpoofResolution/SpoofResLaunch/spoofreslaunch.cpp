@@ -0,0 +1,218 @@
+#include <cstdio>
+#include <cstring>
+#include <cwchar>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+#include <windows.h>
+#include <Detours/detours.h>
+#include <SpoofConfig.h>
+#include <SpoofLaunch.h>
+
+// Spoof Resolution Launcher
+// Starts every application or game listed in a manifest file with the Spoof Resolution DLL, launching them
+//   concurrently on a pool of worker threads, and displays how long each launch took
+// Usage: spoofreslaunch.exe [/d:spoofres.dll] [/t:threads] manifest.txt
+// Note: the manifest file contains one command line per line and blank lines and lines starting with ; are ignored,
+//   the DLL path is resolved and the spoofres.ini file next to the DLL is compiled once and the same compiled config
+//   is copied into every process, so the DLL does not have to read the ini file in each process
+// Note: the manifest parsing and the scheduling of the launches are in SpoofLaunch.h, this file only adds the Detours
+//   process functions and the console output
+
+// LoadManifest function
+static bool LoadManifest(const wchar_t* path, std::vector<LaunchTarget>& targets)
+{
+  // Read the whole manifest file and add a launch for each command line in it
+  std::ifstream file(std::filesystem::path(path), std::ios::binary);
+  if (!file)
+    return false;
+  std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  targets = ParseLaunchManifest(bytes);
+
+  return true;
+}
+
+// LoadConfigPayload function
+static bool LoadConfigPayload(const std::wstring& dllPath, std::vector<uint8_t>& configPayload)
+{
+  // Replace the file name of the DLL with spoofres.ini
+  std::filesystem::path path(dllPath);
+  path.replace_filename(L"spoofres.ini");
+
+  // Check if the ini file does not exist
+  // Note: the DLL will show its own error message for the missing ini file so the processes are still launched
+  if (!std::filesystem::exists(path))
+  {
+    fwprintf(stderr, L"Warning: failed to locate %s file, launching without a compiled config\n", path.c_str());
+    return true;
+  }
+
+  // Open and compile the ini file
+  CSimpleIni iniFile;
+  iniFile.SetUnicode();
+  if (iniFile.LoadFile(path.c_str()) < 0)
+  {
+    fwprintf(stderr, L"Failed to open %s file\n", path.c_str());
+    return false;
+  }
+  SpoofConfig config;
+  if (!CompileSpoofConfig(iniFile, config))
+  {
+    fwprintf(stderr, L"Failed to load resolution information from %s file\n", path.c_str());
+    return false;
+  }
+  configPayload = SerializeSpoofConfig(config);
+
+  return true;
+}
+
+// Process functions built on Detours
+class DetoursLaunchBackend : public LaunchBackend
+{
+public:
+  explicit DetoursLaunchBackend(std::string dllPath) : dllPath(std::move(dllPath))
+  {
+  }
+
+  bool Create(const std::wstring& commandLine, PROCESS_INFORMATION& processInfo) override
+  {
+    // Note: CreateProcessW may modify the command line so it is given a copy
+    std::vector<wchar_t> commandLineCopy(commandLine.begin(), commandLine.end());
+    commandLineCopy.push_back(L'\0');
+    STARTUPINFOW startupInfo = {};
+    startupInfo.cb = sizeof(startupInfo);
+    return DetourCreateProcessWithDllExW(NULL, commandLineCopy.data(), NULL, NULL, FALSE,
+      CREATE_DEFAULT_ERROR_MODE | CREATE_SUSPENDED, NULL, NULL, &startupInfo, &processInfo, dllPath.c_str(), NULL);
+  }
+
+  bool CopyPayload(const PROCESS_INFORMATION& processInfo, const std::vector<uint8_t>& payload) override
+  {
+    return DetourCopyPayloadToProcess(processInfo.hProcess, SpoofConfigPayloadGuid, payload.data(),
+      (DWORD)payload.size());
+  }
+
+  bool Resume(const PROCESS_INFORMATION& processInfo) override
+  {
+    return ResumeThread(processInfo.hThread) != (DWORD)-1;
+  }
+
+  void Terminate(const PROCESS_INFORMATION& processInfo) override
+  {
+    TerminateProcess(processInfo.hProcess, ~0u);
+  }
+
+  void Close(const PROCESS_INFORMATION& processInfo) override
+  {
+    CloseHandle(processInfo.hThread);
+    CloseHandle(processInfo.hProcess);
+  }
+
+private:
+  std::string dllPath; // ANSI path that Detours adds to the imports of each process
+};
+
+// wmain function
+int wmain(int argc, wchar_t* argv[])
+{
+  // Load the options and the manifest file path
+  const wchar_t* dllPath = L"spoofres.dll";
+  const wchar_t* manifestPath = nullptr;
+  unsigned long threadCount = std::thread::hardware_concurrency();
+  bool validArguments = true;
+  for (int i = 1; i < argc && validArguments; i++)
+  {
+    wchar_t* end;
+    if (_wcsnicmp(argv[i], L"/d:", 3) == 0 && argv[i][3] != L'\0')
+      dllPath = argv[i] + 3;
+    else if (_wcsnicmp(argv[i], L"/t:", 3) == 0)
+      validArguments = (threadCount = wcstoul(argv[i] + 3, &end, 10)) != 0 && *end == L'\0';
+    else if (argv[i][0] != L'/' && manifestPath == nullptr)
+      manifestPath = argv[i];
+    else
+      validArguments = false;
+  }
+  if (!validArguments || manifestPath == nullptr)
+  {
+    fwprintf(stderr, L"Usage: spoofreslaunch.exe [/d:spoofres.dll] [/t:threads] manifest.txt\n");
+    return 1;
+  }
+
+  // Load the command lines to launch
+  std::vector<LaunchTarget> targets;
+  if (!LoadManifest(manifestPath, targets))
+  {
+    fwprintf(stderr, L"Failed to open %s file\n", manifestPath);
+    return 1;
+  }
+  if (targets.empty())
+  {
+    fwprintf(stderr, L"No command lines found in %s file\n", manifestPath);
+    return 1;
+  }
+
+  // Resolve the full path to the DLL and compile its ini file once for all of the launches
+  // Note: Detours adds the DLL to the imports of each process by its ANSI path
+  std::error_code error;
+  std::wstring fullDllPath = std::filesystem::absolute(dllPath, error).wstring();
+  if (error || !std::filesystem::exists(fullDllPath))
+  {
+    fwprintf(stderr, L"Failed to locate %s file\n", dllPath);
+    return 1;
+  }
+  int length = WideCharToMultiByte(CP_ACP, 0, fullDllPath.c_str(), -1, nullptr, 0, nullptr, nullptr);
+  std::string ansiDllPath(length > 0 ? length - 1 : 0, '\0');
+  if (length <= 1 || WideCharToMultiByte(CP_ACP, 0, fullDllPath.c_str(), -1, &ansiDllPath[0], length, nullptr,
+    nullptr) == 0)
+  {
+    fwprintf(stderr, L"Failed to convert %s path\n", fullDllPath.c_str());
+    return 1;
+  }
+  LaunchShared shared;
+  if (!LoadConfigPayload(fullDllPath, shared.configPayload))
+    return 1;
+
+  // Launch all of the processes on the worker threads
+  DetoursLaunchBackend backend(std::move(ansiDllPath));
+  wprintf(L"Launching %zu process(es) on %lu thread(s) with %s\n", targets.size(),
+    GetLaunchThreadCount(threadCount, targets.size()), fullDllPath.c_str());
+  RunLaunches(backend, shared, targets, threadCount);
+  LARGE_INTEGER finish;
+  QueryPerformanceCounter(&finish);
+
+  // Display how long each launch took in manifest order
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  double ticksPerMillisecond = frequency.QuadPart / 1000.0;
+  wprintf(L"  %-5s %8s %10s %10s %10s %10s %10s  %s\n", L"#", L"PID", L"Wait ms", L"Create ms", L"Payload ms",
+    L"Resume ms", L"Total ms", L"Command Line");
+  for (size_t i = 0; i < targets.size(); i++)
+  {
+    const LaunchTarget& target = targets[i];
+    if (target.failedStep != nullptr)
+    {
+      wprintf(L"  %-5zu %8lu failed to %s (error %lu)  %s\n", i + 1, target.processId, target.failedStep,
+        target.error, target.commandLine.c_str());
+      continue;
+    }
+    wprintf(L"  %-5zu %8lu %10.2f %10.2f %10.2f %10.2f %10.2f  %s\n", i + 1, target.processId,
+      target.waitTicks / ticksPerMillisecond, target.createTicks / ticksPerMillisecond,
+      target.payloadTicks / ticksPerMillisecond, target.resumeTicks / ticksPerMillisecond,
+      target.totalTicks / ticksPerMillisecond, target.commandLine.c_str());
+  }
+
+  // Display the summary
+  LaunchSummary summary = SummarizeLaunches(targets);
+  wprintf(L"Launched %zu of %zu process(es) in %.2f ms\n", summary.launched, targets.size(),
+    (finish.QuadPart - shared.start.QuadPart) / ticksPerMillisecond);
+  if (summary.launched != 0)
+  {
+    wprintf(L"Launch latency: %.2f ms min, %.2f ms median, %.2f ms average, %.2f ms max\n",
+      summary.minTicks / ticksPerMillisecond, summary.medianTicks / ticksPerMillisecond,
+      summary.averageTicks / ticksPerMillisecond, summary.maxTicks / ticksPerMillisecond);
+  }
+
+  return summary.launched == targets.size() ? 0 : 1;
+}
\ No newline at end of file
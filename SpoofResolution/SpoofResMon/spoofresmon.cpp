@@ -0,0 +1,198 @@
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <cwchar>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <windows.h>
+#ifdef _WIN32
+#include <tlhelp32.h>
+#else
+#include <dirent.h>
+#endif
+#include <SharedStats.h>
+
+// Spoof Resolution Monitor
+// Displays the live statistics published by Spoof Resolution DLLs that have the Statistics key in the spoofres.ini file
+//   set to On/Yes/True, along with the change since the previous display, once per second
+// Usage: spoofresmon.exe [pid ...]
+// Note: if no process ids are given all running processes are checked for published statistics
+// Note: the monitor also builds on Linux, where it reads the POSIX shared memory objects of the same layout
+
+// Define the structure used to track each monitored process
+// Note: the section is heap allocated so that the process can be moved into the map while the section stays put
+struct MonitoredProcess
+{
+  std::unique_ptr<SpoofResStatsSection> section = std::make_unique<SpoofResStatsSection>();
+  const SpoofResStats* stats = nullptr;
+  SpoofResStats previous = {};
+  bool hasPrevious = false;
+};
+
+// FindProcesses function
+static std::vector<DWORD> FindProcesses()
+{
+  // Get the ids of all running processes
+  std::vector<DWORD> processIds;
+#ifdef _WIN32
+  HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+  if (snapshot == INVALID_HANDLE_VALUE)
+    return processIds;
+  PROCESSENTRY32W entry;
+  entry.dwSize = sizeof(entry);
+  for (BOOL found = Process32FirstW(snapshot, &entry); found; found = Process32NextW(snapshot, &entry))
+    processIds.push_back(entry.th32ProcessID);
+  CloseHandle(snapshot);
+#else
+  DIR* directory = opendir("/proc");
+  if (directory == nullptr)
+    return processIds;
+  while (dirent* entry = readdir(directory))
+  {
+    char* end;
+    unsigned long processId = strtoul(entry->d_name, &end, 10);
+    if (*end == '\0' && processId != 0)
+      processIds.push_back((DWORD)processId);
+  }
+  closedir(directory);
+#endif
+
+  return processIds;
+}
+
+// GetLocalTimeText function
+static std::wstring GetLocalTimeText()
+{
+  wchar_t text[16];
+#ifdef _WIN32
+  SYSTEMTIME localTime;
+  GetLocalTime(&localTime);
+  swprintf_s(text, L"%02u:%02u:%02u", localTime.wHour, localTime.wMinute, localTime.wSecond);
+#else
+  time_t now = time(nullptr);
+  tm localTime;
+  localtime_r(&now, &localTime);
+  swprintf(text, std::size(text), L"%02d:%02d:%02d", localTime.tm_hour, localTime.tm_min, localTime.tm_sec);
+#endif
+  return text;
+}
+
+// DisplayProcessStats function
+static void DisplayProcessStats(DWORD processId, MonitoredProcess& process)
+{
+  // Read a consistent copy of the statistics
+  SpoofResStats current;
+  if (!ReadSpoofResStats(process.stats, current))
+  {
+    wprintf(L"Process %lu: statistics unavailable (layout version %u, expected version %u)\n",
+      (unsigned long)processId,
+      process.stats->version, SPOOFRES_STATS_VERSION);
+    return;
+  }
+
+  // Display the statistics for each detoured function along with the change since the previous display
+  // Note: average times are in microseconds and per second values are based on the change since the previous display
+  wprintf(L"Process %lu\n", (unsigned long)processId);
+  wprintf(L"  %-24ls %12ls %10ls %12ls %12ls %8ls %12ls %12ls\n", L"Function", L"Calls", L"Calls/s", L"Spoof Hits",
+    L"Spoof Misses", L"Hit %", L"Avg Real us", L"Avg Hook us");
+  double ticksPerMicrosecond = current.ticksPerSecond / 1000000.0;
+  uint64_t totalHookTicks = 0;
+  uint64_t totalHookTicksChange = 0;
+  for (uint32_t api = 0; api < SpoofResStatsApiCount; api++)
+  {
+    const SpoofResStatsApiCounters& counters = current.apis[api];
+    uint64_t callsChange = process.hasPrevious ? counters.calls - process.previous.apis[api].calls : 0;
+    totalHookTicks += counters.hookTicks;
+    totalHookTicksChange += process.hasPrevious ? counters.hookTicks - process.previous.apis[api].hookTicks : 0;
+    wprintf(L"  %-24ls %12llu %10llu %12llu %12llu %7.1f%% %12.2f %12.2f\n", SpoofResStatsApiNames[api],
+      counters.calls, callsChange, counters.spoofHits, counters.spoofMisses,
+      counters.calls != 0 ? 100.0 * counters.spoofHits / counters.calls : 0.0,
+      counters.calls != 0 ? counters.realCallTicks / ticksPerMicrosecond / counters.calls : 0.0,
+      counters.calls != 0 ? counters.hookTicks / ticksPerMicrosecond / counters.calls : 0.0);
+  }
+  wprintf(L"  Time spent in hooks: %.3f ms total, %.3f ms in the last second\n",
+    totalHookTicks / ticksPerMicrosecond / 1000.0, totalHookTicksChange / ticksPerMicrosecond / 1000.0);
+  wprintf(L"  Log entries: %llu waiting to be written, %llu written, %llu written in the last second\n",
+    current.logQueueDepth, current.logEntriesWritten,
+    process.hasPrevious ? current.logEntriesWritten - process.previous.logEntriesWritten : 0);
+  uint64_t callerLookups = current.callerCacheHits + current.callerCacheMisses;
+  wprintf(L"  Caller module cache: %llu hits, %llu misses, %.1f%% hit rate\n", current.callerCacheHits,
+    current.callerCacheMisses, callerLookups != 0 ? 100.0 * current.callerCacheHits / callerLookups : 0.0);
+
+  // Remember the statistics for the next display
+  process.previous = current;
+  process.hasPrevious = true;
+}
+
+// wmain function
+int wmain(int argc, wchar_t* argv[])
+{
+  // Load the process ids to monitor
+  std::vector<DWORD> requestedProcessIds;
+  for (int i = 1; i < argc; i++)
+  {
+    wchar_t* end;
+    DWORD processId = wcstoul(argv[i], &end, 10);
+    if (*end != L'\0' || processId == 0)
+    {
+      fwprintf(stderr, L"Usage: spoofresmon.exe [pid ...]\n");
+      return 1;
+    }
+    requestedProcessIds.push_back(processId);
+  }
+
+  // Display the statistics once per second
+  std::map<DWORD, MonitoredProcess> processes;
+  while (true)
+  {
+    // Open the shared memory blocks of any processes we are not monitoring yet
+    std::vector<DWORD> processIds = requestedProcessIds.empty() ? FindProcesses() : requestedProcessIds;
+    for (DWORD processId : processIds)
+    {
+      if (processes.find(processId) != processes.end())
+        continue;
+      MonitoredProcess process;
+      process.stats = process.section->Open(processId);
+      if (process.stats != nullptr)
+        processes.emplace(processId, std::move(process));
+    }
+
+    // Display the statistics for each process and stop monitoring processes that have exited
+    // Note: a process that has exited still has a valid shared memory block while we have it mapped so we check if the
+    //   publisher is still updating it
+    wprintf(L"\n%ls - %zu process(es) publishing statistics\n", GetLocalTimeText().c_str(), processes.size());
+    for (auto iterator = processes.begin(); iterator != processes.end();)
+    {
+      MonitoredProcess& process = iterator->second;
+      if (process.hasPrevious && process.stats->publishCount == process.previous.publishCount)
+      {
+        wprintf(L"Process %lu: no longer publishing statistics\n", (unsigned long)iterator->first);
+        iterator = processes.erase(iterator);
+        continue;
+      }
+      DisplayProcessStats(iterator->first, process);
+      iterator++;
+    }
+
+    Sleep(1000);
+  }
+
+  return 0;
+}
+
+#ifndef _WIN32
+// main function
+// Note: process ids are plain digits so the arguments are widened character by character for wmain
+int main(int argc, char* argv[])
+{
+  std::vector<std::wstring> arguments;
+  for (int i = 0; i < argc; i++)
+    arguments.emplace_back(argv[i], argv[i] + strlen(argv[i]));
+  std::vector<wchar_t*> pointers;
+  for (std::wstring& argument : arguments)
+    pointers.push_back(argument.data());
+  return wmain(argc, pointers.data());
+}
+#endif
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstddef>
+#include <cwchar>
+#include <windows.h>
+
+// Timing of the phases of DllMain's DLL_PROCESS_ATTACH handling and the startup report composed from them
+// Note: all of these phases run under the loader lock so they delay the start of the application or game, the timings
+//   are recorded into fixed arrays and only reported once all of the phases have finished, the phases are recorded one
+//   after the other by DllMain and then the initialization thread so the timings do not need any locks
+
+// Phases of the startup that are timed
+enum StartupPhase
+{
+  StartupPhaseRestoreAfterWith,
+  StartupPhaseLoadConfigPayload,
+  StartupPhaseLoadIniFile,
+  StartupPhaseLoadSharedConfig,
+  StartupPhaseLoadSpoofConfig,
+  StartupPhaseLoadLogFile,
+  StartupPhaseLoadTraceFile,
+  StartupPhaseLoadStatistics,
+  StartupPhaseLoadCallerModules,
+  StartupPhaseDetourAttach,
+  StartupPhaseTransactionCommit,
+  StartupPhaseTotal,
+  StartupPhaseCount
+};
+inline const wchar_t* const StartupPhaseNames[StartupPhaseCount] = {
+  L"DetourRestoreAfterWith",
+  L"LoadConfigPayload",
+  L"LoadIniFile",
+  L"LoadSharedConfig",
+  L"LoadSpoofConfig",
+  L"LoadLogFile",
+  L"LoadTraceFile",
+  L"LoadStatistics",
+  L"LoadCallerModules",
+  L"DetourAttach",
+  L"DetourTransactionCommit",
+  L"Total"
+};
+
+// Timings of the startup phases
+// Note: times are in performance counter ticks
+struct StartupTimings
+{
+  LONGLONG ticks[StartupPhaseCount] = {};
+  bool recorded[StartupPhaseCount] = {};
+
+  // Record function
+  // Note: a phase can be recorded more than once, ie: DetourAttach is recorded once per detoured function group, and
+  //   its times are added up
+  void Record(StartupPhase phase, LONGLONG phaseTicks)
+  {
+    ticks[phase] += phaseTicks;
+    recorded[phase] = true;
+  }
+};
+
+// FormatStartupReport function
+// Note: composes the breakdown of the phases that were recorded in milliseconds and as a percentage of the total into
+//   details and returns its length, a phase that does not fit is left out along with every phase after it
+// Note: std::format adds a significant amount of additional code into the DLL so instead we are using stdio functions
+//   to compose the report
+inline size_t FormatStartupReport(const StartupTimings& timings, LONGLONG frequency, wchar_t* details, size_t size)
+{
+  if (size == 0)
+    return 0;
+  details[0] = L'\0';
+  LONGLONG total = timings.ticks[StartupPhaseTotal];
+  size_t length = 0;
+  for (int phase = 0; phase < StartupPhaseCount; phase++)
+  {
+    if (!timings.recorded[phase])
+      continue;
+    int written = swprintf(details + length, size - length, L"%ls%ls = %.3f ms (%.1f%%)", length == 0 ? L"" : L", ",
+      StartupPhaseNames[phase], timings.ticks[phase] * 1000.0 / frequency,
+      total != 0 ? timings.ticks[phase] * 100.0 / total : 0.0);
+    if (written < 0 || (size_t)written >= size - length)
+    {
+      details[length] = L'\0';
+      break;
+    }
+    length += written;
+  }
+
+  return length;
+}
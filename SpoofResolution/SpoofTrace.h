@@ -0,0 +1,268 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <windows.h>
+
+// Recording of detour activity and its export as Chrome trace event JSON, which Perfetto and chrome://tracing open
+// Note: events are recorded into fixed size per thread chunks taken from a pool that is allocated when tracing is
+//   enabled, so the detoured functions never allocate memory or take a lock, a full chunk is pushed onto a lock free
+//   list that the trace writer thread takes it off again to serialize its events and hand it back to the pool
+// Note: when the pool runs out because the trace writer thread falls behind, events are dropped and counted instead
+//   of growing the pool, and the count is written into the trace file
+
+// Number of chunks in the pool and events in a chunk
+#define SPOOFRES_TRACE_CHUNK_COUNT 64
+#define SPOOFRES_TRACE_CHUNK_EVENTS 1024
+
+// Event recorded by a detoured function
+// Note: the name and category are string literals, the phase is 'X' for a duration slice or 'i' for an instant event,
+//   and the times are in performance counter ticks
+struct TraceEvent
+{
+  const char* name;
+  const char* category;
+  char phase;
+  DWORD threadId;
+  LONGLONG start;
+  LONGLONG end;
+};
+
+// Chunk of events recorded by a single thread
+// Note: a chunk is owned by the thread that took it from the pool until it pushes the chunk onto the list of full
+//   chunks, the count is published after each event is written so that the events below it can be read at any time
+struct alignas(MEMORY_ALLOCATION_ALIGNMENT) TraceChunk
+{
+  SLIST_ENTRY entry;
+  std::atomic<size_t> count = 0;
+  std::atomic<bool> writing = false;
+  TraceEvent events[SPOOFRES_TRACE_CHUNK_EVENTS];
+};
+
+// Pool of chunks that threads record events into
+class TraceBuffer
+{
+public:
+  TraceBuffer()
+  {
+    InitializeSListHead(&freeChunks);
+    InitializeSListHead(&fullChunks);
+  }
+  TraceBuffer(const TraceBuffer&) = delete;
+  TraceBuffer& operator=(const TraceBuffer&) = delete;
+
+  // Initialize function
+  bool Initialize(size_t count = SPOOFRES_TRACE_CHUNK_COUNT)
+  {
+    chunks.reset(new (std::nothrow) TraceChunk[count]);
+    if (chunks == nullptr)
+      return false;
+    chunkCount = count;
+    for (size_t i = 0; i < count; i++)
+      InterlockedPushEntrySList(&freeChunks, &chunks[i].entry);
+    return true;
+  }
+
+  // Enable function
+  void Enable()
+  {
+    enabled = chunks != nullptr;
+  }
+
+  // Disable function
+  // Note: events that are being recorded when tracing is disabled are either finished before the chunks are drained
+  //   or not recorded at all, see Drain
+  void Disable()
+  {
+    enabled = false;
+  }
+
+  // IsEnabled function
+  bool IsEnabled() const
+  {
+    return enabled.load(std::memory_order_relaxed);
+  }
+
+  // GetDroppedEvents function
+  uint64_t GetDroppedEvents() const
+  {
+    return droppedEvents.load(std::memory_order_relaxed);
+  }
+
+  // Record function
+  // Note: threadChunk is the calling thread's own chunk pointer, which is replaced when the chunk is full
+  bool Record(TraceChunk*& threadChunk, const TraceEvent& event)
+  {
+    // Check if tracing is disabled
+    if (!enabled)
+      return false;
+
+    // Check if this thread does not have a chunk yet or if its chunk is full, hand the full chunk to the trace writer
+    //   thread, and take a new chunk from the pool
+    TraceChunk* chunk = threadChunk;
+    if (chunk == nullptr || chunk->count.load(std::memory_order_relaxed) == std::size(chunk->events))
+    {
+      if (chunk != nullptr)
+        InterlockedPushEntrySList(&fullChunks, &chunk->entry);
+      PSLIST_ENTRY freeEntry = InterlockedPopEntrySList(&freeChunks);
+      chunk = freeEntry != NULL ? CONTAINING_RECORD(freeEntry, TraceChunk, entry) : nullptr;
+      threadChunk = chunk;
+      if (chunk == nullptr)
+      {
+        droppedEvents.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    }
+
+    // Mark the chunk as being written to and check again if tracing is disabled
+    // Note: Drain disables tracing before it waits for the chunks to stop being written to, and both sides use
+    //   sequentially consistent operations, so either we see tracing disabled here or Drain waits for us
+    chunk->writing.store(true);
+    if (!enabled)
+    {
+      chunk->writing.store(false, std::memory_order_release);
+      return false;
+    }
+
+    // Add the event to the chunk
+    size_t index = chunk->count.load(std::memory_order_relaxed);
+    chunk->events[index] = event;
+    chunk->count.store(index + 1, std::memory_order_release);
+    chunk->writing.store(false, std::memory_order_release);
+    return true;
+  }
+
+  // Release function
+  // Note: called by a thread that exits so that its chunk is serialized and goes back to the pool
+  void Release(TraceChunk*& threadChunk)
+  {
+    if (threadChunk == nullptr)
+      return;
+    InterlockedPushEntrySList(threadChunk->count.load(std::memory_order_relaxed) != 0 ? &fullChunks : &freeChunks,
+      &threadChunk->entry);
+    threadChunk = nullptr;
+  }
+
+  // Flush function
+  // Note: hands every event of the full chunks to write and puts the chunks back into the pool, this is only called
+  //   by one thread at a time
+  template <typename Write>
+  size_t Flush(Write write)
+  {
+    size_t flushed = 0;
+    PSLIST_ENTRY entries = InterlockedFlushSList(&fullChunks);
+    while (entries != NULL)
+    {
+      TraceChunk* chunk = CONTAINING_RECORD(entries, TraceChunk, entry);
+      entries = entries->Next;
+      flushed += WriteEvents(*chunk, write);
+      InterlockedPushEntrySList(&freeChunks, &chunk->entry);
+    }
+    return flushed;
+  }
+
+  // Drain function
+  // Note: disables tracing and hands every event that is left to write, including the events in the chunks that
+  //   threads are still recording into, this is called once when the trace file is written and never at the same
+  //   time as Flush
+  template <typename Write>
+  size_t Drain(Write write)
+  {
+    Disable();
+    size_t drained = Flush(write);
+    for (size_t i = 0; i < chunkCount; i++)
+    {
+      // Wait for up to 100ms for any event that is being added to the chunk and skip the chunk if it is still being
+      //   written to after that
+      // Note: this can only happen if the owning thread was terminated in the middle of adding an event
+      TraceChunk& chunk = chunks[i];
+      for (int attempt = 0; chunk.writing.load() && attempt < 100; attempt++)
+        Sleep(1);
+      if (!chunk.writing.load(std::memory_order_acquire))
+        drained += WriteEvents(chunk, write);
+    }
+    return drained;
+  }
+
+private:
+  // WriteEvents function
+  template <typename Write>
+  static size_t WriteEvents(TraceChunk& chunk, Write& write)
+  {
+    size_t count = chunk.count.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; i++)
+      write(chunk.events[i]);
+    chunk.count.store(0, std::memory_order_relaxed);
+    return count;
+  }
+
+  std::unique_ptr<TraceChunk[]> chunks;
+  size_t chunkCount = 0;
+  SLIST_HEADER freeChunks;
+  SLIST_HEADER fullChunks;
+  std::atomic<bool> enabled = false;
+  std::atomic<uint64_t> droppedEvents = 0;
+};
+
+// Clock and process the timestamps and ids of a trace file are written with
+struct TraceClock
+{
+  DWORD processId;
+  LONGLONG start;     // Performance counter when tracing was enabled
+  LONGLONG frequency; // Performance counter ticks per second
+};
+
+// WriteTraceString function
+inline void WriteTraceString(FILE* file, const char* text)
+{
+  // Write the text as a JSON string, escaping quotes, backslashes, and control characters
+  fputc('"', file);
+  for (const unsigned char* character = (const unsigned char*)text; *character != 0; character++)
+  {
+    if (*character == '"' || *character == '\\')
+      fprintf(file, "\\%c", *character);
+    else if (*character < 0x20)
+      fprintf(file, "\\u%04x", *character);
+    else
+      fputc(*character, file);
+  }
+  fputc('"', file);
+}
+
+// WriteTraceBegin function
+inline void WriteTraceBegin(FILE* file)
+{
+  fprintf(file, "{\"traceEvents\":[");
+}
+
+// WriteTraceEvent function
+// Note: timestamps are written in microseconds since tracing was enabled, first is whether this is the first event of
+//   the trace file
+inline void WriteTraceEvent(FILE* file, const TraceEvent& event, const TraceClock& clock, bool first)
+{
+  // Note: std::format adds a significant amount of additional code into the DLL so instead we are using stdio
+  //   functions to compose the JSON
+  double start = (double)(event.start - clock.start) * 1000000.0 / clock.frequency;
+  double duration = (double)(event.end - event.start) * 1000000.0 / clock.frequency;
+  fprintf(file, "%s\n{\"name\":", first ? "" : ",");
+  WriteTraceString(file, event.name);
+  fprintf(file, ",\"cat\":");
+  WriteTraceString(file, event.category);
+  if (event.phase == 'X')
+    fprintf(file, ",\"ph\":\"X\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}", (unsigned long)clock.processId,
+      (unsigned long)event.threadId, start, duration);
+  else
+    fprintf(file, ",\"ph\":\"i\",\"s\":\"t\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f}", (unsigned long)clock.processId,
+      (unsigned long)event.threadId, start);
+}
+
+// WriteTraceEnd function
+inline void WriteTraceEnd(FILE* file, uint64_t droppedEvents)
+{
+  fprintf(file, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":%llu}}\n",
+    (unsigned long long)droppedEvents);
+}
@@ -1,12 +1,23 @@
+#include <atomic>
 #include <filesystem>
+#include <intrin.h>
 #include <fstream>
+#include <iterator>
 #include <mutex>
+#include <sstream>
 #include <windows.h>
 #if defined(VERSION_DLL_VERSION) || defined(WINHTTP_DLL_VERSION)
 #include <QuickDllProxy/DllProxy.h>
 #endif
 #include <Detours/detours.h>
 #include <SimpleIni/SimpleIni.h>
+#include <CallerModuleIndex.h>
+#include <InitializationState.h>
+#include <SharedStats.h>
+#include <SpoofConfig.h>
+#include <SpoofConfigShared.h>
+#include <SpoofStartup.h>
+#include <SpoofTrace.h>
 
 // HandleException function used to display any Quick DLL Proxy errors
 #if defined(VERSION_DLL_VERSION) || defined (WINHTTP_DLL_VERSION)
@@ -67,10 +78,8 @@ void HandleException(DllProxy::ErrorCode code)
 #endif
 
 // Define and/or declare needed global variables
-std::unique_ptr<CSimpleIni> gIniFile = std::unique_ptr<CSimpleIni>(nullptr);
-std::mutex gIniFileLock;
+std::unique_ptr<std::string> gIniContents = std::unique_ptr<std::string>(nullptr);
 std::shared_ptr<std::wofstream> gLogFile = std::shared_ptr<std::wofstream>(nullptr);
-std::mutex gLogFileLock;
 static int(WINAPI* WindowsGetSystemMetrics)(int nIndex) = GetSystemMetrics;
 static int(WINAPI* WindowsGetDeviceCaps)(HDC hdc, int index) = GetDeviceCaps;
 static BOOL(WINAPI* WindowsEnumDisplaySettingsA)(LPCSTR lpszDeviceName, DWORD iModeNum, DEVMODEA* lpDevMode) =
@@ -89,73 +98,391 @@ struct {
   bool EnumDisplaySettingsExA : 1 = false;
   bool EnumDisplaySettingsExW : 1 = false;
 } gDetouredFunctions;
+thread_local bool gThreadInDetouredFunction = false;
+
+// Define the global variable that points to the compiled config
+// Note: the config is never modified after it is published so the detoured functions can read it without any locks
+std::atomic<const SpoofConfig*> gConfig = nullptr;
+
+// Define the global variable that keeps the shared memory section holding the compiled config open
+// Note: the section exists for as long as any process has it open, so every process that publishes or uses it keeps
+//   it open until it exits so that later processes can still find it
+SpoofConfigSharedSection gSharedConfig;
+
+// Define the structures and global variables used when checking which module called a detoured function
+// Note: the address ranges of the loaded modules are kept in an array sorted by base address that is rebuilt by the
+//   next detoured function call after a module is loaded or unloaded, and each thread remembers the range it found
+//   last since calls tend to come from the same module over and over
+// Note: lookups never take a lock, a lookup that searches an array counts itself as a reader for as long as it does,
+//   and an array that was replaced is only freed once no lookup is searching any array, so the replaced arrays that
+//   are kept are bounded by the module loads and unloads that happen while lookups are searching
+// Note: DLL_PROCESS_DETACH publishes the released index in place of the last one so that a lookup still running in a
+//   detoured function finds no caller instead of building a new index
+struct CallerModuleIndex
+{
+  LONG generation;
+  std::vector<CallerModuleRange> ranges;
+};
+typedef VOID(CALLBACK* DllNotificationFunction)(ULONG reason, const void* data, PVOID context);
+typedef LONG(NTAPI* LdrRegisterDllNotificationFunction)(ULONG flags, DllNotificationFunction function, PVOID context,
+  PVOID* cookie);
+typedef LONG(NTAPI* LdrUnregisterDllNotificationFunction)(PVOID cookie);
+std::atomic<const CallerModuleIndex*> gCallerModuleIndex = nullptr;
+const CallerModuleIndex gReleasedCallerModuleIndex = {};
+std::atomic<LONG> gCallerModuleIndexReaders = 0;
+std::vector<const CallerModuleIndex*> gRetiredCallerModuleIndexes;
+std::mutex gRetiredCallerModuleIndexesLock;
+std::atomic<LONG> gCallerModuleGeneration = 0;
+PVOID gDllNotificationCookie = NULL;
+thread_local CallerModuleRange gThreadCallerRange = {};
+thread_local LONG gThreadCallerGeneration = -1;
+
+// Define the structure and global variables used when writing to the log file
+// Note: log entries are formatted on the calling thread and pushed onto a lock free list, and a separate thread takes
+//   all of them off the list at once and writes them to the log file so that the detoured functions never wait on each
+//   other or on the disk
+struct LogEntry
+{
+  SLIST_ENTRY entry;
+  size_t length;
+  wchar_t text[1];
+};
+SLIST_HEADER gLogQueue;
+std::atomic<bool> gLogEnabled = false;
+std::mutex gLogFileLock;
+std::atomic<uint64_t> gLogQueueDepth = 0;
+std::atomic<uint64_t> gLogEntriesWritten = 0;
+
+// Define the global variables used when exporting detour activity as Chrome trace event JSON
+// Note: the detoured functions record events into per thread chunks from a fixed pool, see SpoofTrace.h, a separate
+//   thread serializes the full chunks into the trace file and the rest of the events are serialized when the DLL is
+//   detached
+// Note: the trace writer thread keeps a reference to this DLL so the DLL is only detached when the process exits, by
+//   which time every other thread has been terminated and the pool can be freed
+FILE* gTraceFile = NULL;
+std::mutex gTraceFileLock;
+TraceClock gTraceClock;
+TraceBuffer gTraceBuffer;
+bool gTraceFirstEvent = true;
+thread_local TraceChunk* gThreadTraceChunk = nullptr;
+
+// Define the global variables used when publishing live statistics into shared memory
+// Note: the detoured functions only update the atomic counters below and a separate thread publishes them into the
+//   shared memory block so that the sequence lock protecting the block only ever has a single writer
+struct
+{
+  std::atomic<uint64_t> calls;
+  std::atomic<uint64_t> spoofHits;
+  std::atomic<uint64_t> realCallTicks;
+  std::atomic<uint64_t> hookTicks;
+} gStatsCounters[SpoofResStatsApiCount];
+std::atomic<uint64_t> gStatsCallerCacheHits = 0;
+std::atomic<uint64_t> gStatsCallerCacheMisses = 0;
+std::atomic<bool> gStatsEnabled = false;
+SpoofResStatsSection gStatsSection;
+SpoofResStats* gStats = nullptr;
+
+// Define the global variables used when timing the phases of DllMain's DLL_PROCESS_ATTACH handling, see SpoofStartup.h
+StartupTimings gStartupTimings;
+LONGLONG gStartupStart = 0;
+
+// Define the global variable that tracks initialization, which is done on a separate thread unless the ini file asks
+//   for it to be done synchronously in DllMain
+// Note: the detoured functions pass calls straight through to the real functions until initialization is ready, which
+//   also guarantees that they never see the ini and log files while they are being loaded
+std::atomic<InitializationState> gInitializationState = InitializationPending;
+
+// GetHookTimestamp function
+static LONGLONG GetHookTimestamp()
+{
+  // Check if both tracing and statistics are disabled
+  if (!gTraceBuffer.IsEnabled() && !gStatsEnabled)
+    return 0;
 
-// SpoofGSMResolution function
-static int SpoofGSMResolution(int realFuncRetValue, int index)
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return counter.QuadPart;
+}
+
+// RecordTraceEvent function
+static void RecordTraceEvent(const char* name, const char* category, char phase, LONGLONG start, LONGLONG end)
 {
-  // Check if we do not have a valid ini file
-  gIniFileLock.lock();
-  if (gIniFile == nullptr)
+  // Check if tracing is disabled
+  if (!gTraceBuffer.IsEnabled())
+    return;
+
+  // Add the event to this thread's chunk
+  gTraceBuffer.Record(gThreadTraceChunk, { name, category, phase, GetCurrentThreadId(), start, end });
+}
+
+// RecordHookCall function
+static void RecordHookCall(SpoofResStatsApi api, const char* name, LONGLONG start, LONGLONG realCallEnd, LONGLONG end)
+{
+  // Update the statistics
+  if (gStatsEnabled)
   {
-    gIniFileLock.unlock();
-    return realFuncRetValue;
+    gStatsCounters[api].calls.fetch_add(1, std::memory_order_relaxed);
+    gStatsCounters[api].realCallTicks.fetch_add(realCallEnd - start, std::memory_order_relaxed);
+    gStatsCounters[api].hookTicks.fetch_add(end - realCallEnd, std::memory_order_relaxed);
+  }
+
+  // Record a slice for the whole detoured call split into the real call and spoof phases
+  RecordTraceEvent(name, "hook", 'X', start, end);
+  RecordTraceEvent("Real call", "real", 'X', start, realCallEnd);
+  RecordTraceEvent("Spoof", "spoof", 'X', realCallEnd, end);
+}
+
+// RecordSpoofHit function
+static void RecordSpoofHit(SpoofResStatsApi api)
+{
+  // Update the statistics
+  if (gStatsEnabled)
+    gStatsCounters[api].spoofHits.fetch_add(1, std::memory_order_relaxed);
+}
+
+// RecordTraceInstant function
+static void RecordTraceInstant(const char* name, const char* category)
+{
+  LONGLONG timestamp = GetHookTimestamp();
+  RecordTraceEvent(name, category, 'i', timestamp, timestamp);
+}
+
+// BeginLogEntry function
+static std::wostringstream* BeginLogEntry()
+{
+  // Check if logging is disabled
+  if (!gLogEnabled)
+    return nullptr;
+
+  // Clear and return this thread's log entry stream
+  thread_local std::wostringstream stream;
+  stream.str(std::wstring());
+  stream.clear();
+  return &stream;
+}
+
+// EndLogEntry function
+static void EndLogEntry(std::wostringstream& stream)
+{
+  // Copy the text of the log entry into a new list entry
+  std::wstring_view text = stream.view();
+  LogEntry* entry = (LogEntry*)_aligned_malloc(offsetof(LogEntry, text) + text.size() * sizeof(wchar_t) +
+    sizeof(wchar_t), MEMORY_ALLOCATION_ALIGNMENT);
+  if (entry == nullptr)
+    return;
+  entry->length = text.size();
+  wmemcpy(entry->text, text.data(), text.size());
+
+  // Push the list entry onto the log queue
+  gLogQueueDepth.fetch_add(1, std::memory_order_relaxed);
+  InterlockedPushEntrySList(&gLogQueue, &entry->entry);
+}
+
+// WriteLogEntries function
+static void WriteLogEntries()
+{
+  // Take all of the entries off the log queue and reverse them since the queue returns the newest entry first
+  SLIST_ENTRY* entries = InterlockedFlushSList(&gLogQueue);
+  SLIST_ENTRY* orderedEntries = NULL;
+  while (entries != NULL)
+  {
+    SLIST_ENTRY* next = entries->Next;
+    entries->Next = orderedEntries;
+    orderedEntries = entries;
+    entries = next;
   }
-  gIniFileLock.unlock();
 
-  // Load the resolution information from the ini file
-  // Note: we load all of the reolution information from the ini file before assigning any of it to the passed in
-  //   pointers to avoid partially spoofing the resolution information if an exception is thrown during loading
-  std::unique_ptr<int> spoofedValue = std::unique_ptr<int>(nullptr);
-  try
+  // Write the entries to the log file and free them
+  uint64_t count = 0;
+  while (orderedEntries != NULL)
   {
-    std::lock_guard<std::mutex> iniFileLock(gIniFileLock);
-    if (index == SM_CXSCREEN && gIniFile->KeyExists(L"GSM", L"Width"))
-      spoofedValue = std::make_unique<int>(std::stoi(gIniFile->GetValue(L"GSM", L"Width")));
-    else if (index == SM_CYSCREEN && gIniFile->KeyExists(L"GSM", L"Height"))
-      spoofedValue = std::make_unique<int>(std::stoi(gIniFile->GetValue(L"GSM", L"Height")));
+    LogEntry* entry = CONTAINING_RECORD(orderedEntries, LogEntry, entry);
+    orderedEntries = orderedEntries->Next;
+    if (gLogFile != nullptr && !gLogFile->fail())
+      gLogFile->write(entry->text, entry->length);
+    _aligned_free(entry);
+    count++;
   }
-  catch (std::invalid_argument)
+  if (count != 0 && gLogFile != nullptr && !gLogFile->fail())
+    gLogFile->flush();
+  gLogQueueDepth.fetch_sub(count, std::memory_order_relaxed);
+  gLogEntriesWritten.fetch_add(count, std::memory_order_relaxed);
+}
+
+// LogWriterThread function
+static DWORD WINAPI LogWriterThread(LPVOID parameter)
+{
+  // Write the queued log entries to the log file ten times per second
+  // Note: this thread keeps a reference to this DLL so it never has to be stopped, it ends when the process exits, and
+  //   it holds the log file lock while writing so that DllMain knows if it was terminated in the middle of a write
+  while (true)
   {
-    // Show an error message and reset the ini file
-    MessageBox(NULL, L"Failed to load resolution information from spoofres.ini file", L"Spoof Resolution",
-      MB_OK | MB_ICONERROR);
-    std::lock_guard<std::mutex> iniFileLock(gIniFileLock);
-    gIniFile->Reset();
-    gIniFile.reset();
+    Sleep(100);
+    std::lock_guard<std::mutex> logFileLock(gLogFileLock);
+    WriteLogEntries();
+  }
 
-    return realFuncRetValue;
+  return 0;
+}
+
+// DllNotification function
+static VOID CALLBACK DllNotification(ULONG reason, const void* data, PVOID context)
+{
+  // Mark the caller module index as out of date whenever a module is loaded or unloaded
+  // Note: this is called under the loader lock so the index is only rebuilt by the next detoured function call
+  gCallerModuleGeneration.fetch_add(1, std::memory_order_release);
+}
+
+// IsNewerCallerModuleGeneration function
+static bool IsNewerCallerModuleGeneration(LONG generation, LONG than)
+{
+  // Compare the generations through their difference so that the comparison still holds once the counter wraps
+  return (LONG)((ULONG)generation - (ULONG)than) > 0;
+}
+
+// FreeRetiredCallerModuleIndexes function
+static void FreeRetiredCallerModuleIndexes()
+{
+  // Free the replaced indexes if no lookup is searching any index
+  // Note: a lookup counts itself as a reader before it loads the index, so once the count is seen to be 0 after an
+  //   index was replaced every later lookup can only load the index that replaced it
+  std::lock_guard<std::mutex> lock(gRetiredCallerModuleIndexesLock);
+  if (gCallerModuleIndexReaders.load() != 0)
+    return;
+  for (const CallerModuleIndex* index : gRetiredCallerModuleIndexes)
+    delete index;
+  gRetiredCallerModuleIndexes.clear();
+}
+
+// BuildCallerModuleIndex function
+static void BuildCallerModuleIndex(const SpoofConfig* config, LONG generation)
+{
+  // Add the address range of every loaded module along with which caller modules in the config it is
+  // Note: GetModuleFileName takes the loader lock, which is held while DllNotification runs, so the snapshot is taken
+  //   without holding any lock and several threads may take one for the same generation at the same time
+  std::unique_ptr<CallerModuleIndex> index = std::make_unique<CallerModuleIndex>();
+  index->generation = generation;
+  for (HMODULE module = DetourEnumerateModules(NULL); module != NULL; module = DetourEnumerateModules(module))
+  {
+    wchar_t path[MAX_PATH];
+    ULONG size = DetourGetModuleSize(module);
+    if (size == 0 || GetModuleFileName(module, path, MAX_PATH) == 0)
+      continue;
+    const wchar_t* fileName = wcsrchr(path, std::filesystem::path::preferred_separator);
+    fileName = fileName != NULL ? fileName + 1 : path;
+    CallerModuleRange range = { (ULONG_PTR)module, (ULONG_PTR)module + size, 0 };
+    for (size_t bit = 0; bit < config->callerModules.size(); bit++)
+      if (_wcsicmp(fileName, config->callerModules[bit].c_str()) == 0)
+        range.callers |= 1ull << bit;
+    index->ranges.push_back(range);
   }
-  catch (std::out_of_range)
+  std::ranges::sort(index->ranges, {}, &CallerModuleRange::base);
+
+  // Publish the index unless another thread already published one for this generation or a later one, in which case
+  //   the snapshot is simply dropped
+  const CallerModuleIndex* current = gCallerModuleIndex.load();
+  do
   {
-    // Show an error message and reset the ini file
-    MessageBox(NULL, L"Failed to load resolution information from spoofres.ini file", L"Spoof Resolution",
-      MB_OK | MB_ICONERROR);
-    std::lock_guard<std::mutex> iniFileLock(gIniFileLock);
-    gIniFile->Reset();
-    gIniFile.reset();
+    if (current == &gReleasedCallerModuleIndex ||
+      (current != nullptr && !IsNewerCallerModuleGeneration(generation, current->generation)))
+      return;
+  } while (!gCallerModuleIndex.compare_exchange_weak(current, index.get()));
+  index.release();
 
-    return realFuncRetValue;
+  // Retire the index that was replaced and free it once no lookup can still be searching it
+  if (current != nullptr)
+  {
+    std::lock_guard<std::mutex> lock(gRetiredCallerModuleIndexesLock);
+    gRetiredCallerModuleIndexes.push_back(current);
+  }
+  FreeRetiredCallerModuleIndexes();
+}
+
+// GetCallerModules function
+static uint64_t GetCallerModules(const SpoofConfig* config, const void* returnAddress)
+{
+  // Check if the address is in the range this thread found last and no module was loaded or unloaded since
+  LONG generation = gCallerModuleGeneration.load(std::memory_order_acquire);
+  ULONG_PTR address = (ULONG_PTR)returnAddress;
+  if (gThreadCallerGeneration == generation && IsInCallerModuleRange(gThreadCallerRange, address))
+  {
+    if (gStatsEnabled)
+      gStatsCallerCacheHits.fetch_add(1, std::memory_order_relaxed);
+    return gThreadCallerRange.callers;
+  }
+  if (gStatsEnabled)
+    gStatsCallerCacheMisses.fetch_add(1, std::memory_order_relaxed);
+
+  // Rebuild the index if a module was loaded or unloaded since it was built
+  // Note: the index is not searched while it is rebuilt so that this thread does not keep the index it replaces alive
+  gCallerModuleIndexReaders.fetch_add(1);
+  const CallerModuleIndex* index = gCallerModuleIndex.load();
+  if (index == nullptr ||
+    (index != &gReleasedCallerModuleIndex && IsNewerCallerModuleGeneration(generation, index->generation)))
+  {
+    gCallerModuleIndexReaders.fetch_sub(1);
+    BuildCallerModuleIndex(config, generation);
+    gCallerModuleIndexReaders.fetch_add(1);
+    index = gCallerModuleIndex.load();
+  }
+
+  // Find the range of the address and remember it for the next lookup on this thread
+  uint64_t callers = 0;
+  const CallerModuleRange* range = FindCallerModuleRange(index->ranges.data(), index->ranges.size(), address);
+  if (range != nullptr)
+  {
+    gThreadCallerRange = *range;
+    gThreadCallerGeneration = index->generation;
+    callers = range->callers;
   }
+  gCallerModuleIndexReaders.fetch_sub(1);
+
+  return callers;
+}
+
+// IsSpoofedCaller function
+static bool IsSpoofedCaller(const SpoofConfig* config, uint64_t callers, const void* returnAddress)
+{
+  // Check if the section is not limited to any caller modules or if the caller is one of them
+  return callers == 0 || (GetCallerModules(config, returnAddress) & callers) != 0;
+}
+
+// SpoofGSMResolution function
+static int SpoofGSMResolution(int realFuncRetValue, int index, const void* returnAddress)
+{
+  // Check if we do not have a valid config
+  const SpoofConfig* config = gConfig.load(std::memory_order_acquire);
+  if (config == nullptr)
+    return realFuncRetValue;
+
+  // Get the resolution information from the config
+  const int* spoofedValue = nullptr;
+  if (index == SM_CXSCREEN)
+    spoofedValue = config->gsmWidth.get();
+  else if (index == SM_CYSCREEN)
+    spoofedValue = config->gsmHeight.get();
 
-  // Check if we do not have a spoofed value
-  if (spoofedValue == nullptr)
+  // Check if we do not have a spoofed value or if the section is limited to other caller modules
+  if (spoofedValue == nullptr || !IsSpoofedCaller(config, config->gsmCallers, returnAddress))
     return realFuncRetValue;
 
+  // Record the spoof hit
+  RecordSpoofHit(SpoofResStatsGetSystemMetrics);
+
   // Write to the log file
-  gLogFileLock.lock();
-  if (gLogFile != nullptr && !gLogFile->fail())
+  if (std::wostringstream* logEntry = BeginLogEntry())
   {
     std::time_t time = std::time(NULL);
     std::tm localtime;
     localtime_s(&localtime, &time);
-    *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
+    *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
       L" - Spoofed GetSystemMetrics resolution for index ";
     if (index == SM_CXSCREEN)
-      *gLogFile << L"SM_CXSCREEN with the following details: Width = " << *spoofedValue << std::endl;
+      *logEntry << L"SM_CXSCREEN with the following details: Width = " << *spoofedValue << std::endl;
     else // if (index == SM_CYSCREEN)
-      *gLogFile << L"SM_CYSCREEN with the following details: Height = " << *spoofedValue << std::endl;
+      *logEntry << L"SM_CYSCREEN with the following details: Height = " << *spoofedValue << std::endl;
+    EndLogEntry(*logEntry);
   }
-  gLogFileLock.unlock();
 
   return *spoofedValue;
 }
@@ -163,100 +490,83 @@ static int SpoofGSMResolution(int realFuncRetValue, int index)
 // DetouredGetSystemMetrics function
 int WINAPI DetouredGetSystemMetrics(int nIndex)
 {
+  // Check if initialization has not finished or if this thread is already inside a detoured function and pass the
+  //   call straight through to the real GetSystemMetrics function
+  if (!IsInitializationReady(gInitializationState) || gThreadInDetouredFunction)
+    return WindowsGetSystemMetrics(nIndex);
+  gThreadInDetouredFunction = true;
+
   // Call the real GetSystemMetrics function
+  LONGLONG callStart = GetHookTimestamp();
   int value = WindowsGetSystemMetrics(nIndex);
+  LONGLONG realCallEnd = GetHookTimestamp();
 
   // Write to the log file
-  gLogFileLock.lock();
-  if (gLogFile != nullptr && !gLogFile->fail())
+  if (std::wostringstream* logEntry = BeginLogEntry())
   {
     std::time_t time = std::time(NULL);
     std::tm localtime;
     localtime_s(&localtime, &time);
-    *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
+    *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
       L" - Detoured GetSystemMetrics function called with the following parameters: nIndex = " << nIndex << std::endl;
+    EndLogEntry(*logEntry);
   }
-  gLogFileLock.unlock();
 
   // Spoof the resolution
-  value = SpoofGSMResolution(value, nIndex);
+  value = SpoofGSMResolution(value, nIndex, _ReturnAddress());
+
+  // Record the trace events
+  RecordHookCall(SpoofResStatsGetSystemMetrics, "GetSystemMetrics", callStart, realCallEnd, GetHookTimestamp());
+
+  // Leave the detoured function
+  gThreadInDetouredFunction = false;
 
   return value;
 }
 
 // SpoofGDCResolution function
-static int SpoofGDCResolution(int realFuncRetValue, int index)
+static int SpoofGDCResolution(int realFuncRetValue, int index, const void* returnAddress)
 {
-  // Check if we do not have a valid ini file
-  gIniFileLock.lock();
-  if (gIniFile == nullptr)
-  {
-    gIniFileLock.unlock();
-    return realFuncRetValue;
-  }
-  gIniFileLock.unlock();
-
-  // Load the resolution information from the ini file
-  // Note: we load all of the reolution information from the ini file before assigning any of it to the passed in
-  //   pointers to avoid partially spoofing the resolution information if an exception is thrown during loading
-  std::unique_ptr<int> spoofedValue = std::unique_ptr<int>(nullptr);
-  try
-  {
-    std::lock_guard<std::mutex> iniFileLock(gIniFileLock);
-    if (index == HORZRES && gIniFile->KeyExists(L"GDC", L"Width"))
-      spoofedValue = std::make_unique<int>(std::stoi(gIniFile->GetValue(L"GDC", L"Width")));
-    else if (index == VERTRES && gIniFile->KeyExists(L"GDC", L"Height"))
-      spoofedValue = std::make_unique<int>(std::stoi(gIniFile->GetValue(L"GDC", L"Height")));
-    else if (index == BITSPIXEL && gIniFile->KeyExists(L"GDC", L"BitsPerPixel"))
-      spoofedValue = std::make_unique<int>(std::stoi(gIniFile->GetValue(L"GDC", L"BitsPerPixel")));
-    else if (index == VREFRESH && gIniFile->KeyExists(L"GDC", L"Frequency"))
-      spoofedValue = std::make_unique<int>(std::stoi(gIniFile->GetValue(L"GDC", L"Frequency")));
-  }
-  catch (std::invalid_argument)
-  {
-    // Show an error message and reset the ini file
-    MessageBox(NULL, L"Failed to load resolution information from spoofres.ini file", L"Spoof Resolution",
-      MB_OK | MB_ICONERROR);
-    std::lock_guard<std::mutex> iniFileLock(gIniFileLock);
-    gIniFile->Reset();
-    gIniFile.reset();
-
+  // Check if we do not have a valid config
+  const SpoofConfig* config = gConfig.load(std::memory_order_acquire);
+  if (config == nullptr)
     return realFuncRetValue;
-  }
-  catch (std::out_of_range)
-  {
-    // Show an error message and reset the ini file
-    MessageBox(NULL, L"Failed to load resolution information from spoofres.ini file", L"Spoof Resolution",
-      MB_OK | MB_ICONERROR);
-    std::lock_guard<std::mutex> iniFileLock(gIniFileLock);
-    gIniFile->Reset();
-    gIniFile.reset();
 
+  // Get the resolution information from the config
+  const int* spoofedValue = nullptr;
+  if (index == HORZRES)
+    spoofedValue = config->gdcWidth.get();
+  else if (index == VERTRES)
+    spoofedValue = config->gdcHeight.get();
+  else if (index == BITSPIXEL)
+    spoofedValue = config->gdcBitsPerPixel.get();
+  else if (index == VREFRESH)
+    spoofedValue = config->gdcFrequency.get();
+
+  // Check if we do not have a spoofed value or if the section is limited to other caller modules
+  if (spoofedValue == nullptr || !IsSpoofedCaller(config, config->gdcCallers, returnAddress))
     return realFuncRetValue;
-  }
 
-  // Check if we do not have a spoofed value
-  if (spoofedValue == nullptr)
-    return realFuncRetValue;
+  // Record the spoof hit
+  RecordSpoofHit(SpoofResStatsGetDeviceCaps);
 
   // Write to the log file
-  gLogFileLock.lock();
-  if (gLogFile != nullptr && !gLogFile->fail())
+  if (std::wostringstream* logEntry = BeginLogEntry())
   {
     std::time_t time = std::time(NULL);
     std::tm localtime;
     localtime_s(&localtime, &time);
-    *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") << L" - Spoofed GetDeviceCaps resolution for index ";
+    *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") << L" - Spoofed GetDeviceCaps resolution for index ";
     if (index == HORZRES)
-      *gLogFile << L"HORZRES with the following details: Width = " << *spoofedValue << std::endl;
+      *logEntry << L"HORZRES with the following details: Width = " << *spoofedValue << std::endl;
     else if (index == VERTRES)
-      *gLogFile << L"VERTRES with the following details: Height = " << *spoofedValue << std::endl;
+      *logEntry << L"VERTRES with the following details: Height = " << *spoofedValue << std::endl;
     else if (index == BITSPIXEL)
-      *gLogFile << L"BITSPIXEL with the following details: Bits Per Pixel = " << *spoofedValue << std::endl;
+      *logEntry << L"BITSPIXEL with the following details: Bits Per Pixel = " << *spoofedValue << std::endl;
     else // if (index == VREFRESH)
-      *gLogFile << L"VREFRESH with the following details: Frequency = " << *spoofedValue << std::endl;
-  }  
-  gLogFileLock.unlock();
+      *logEntry << L"VREFRESH with the following details: Frequency = " << *spoofedValue << std::endl;
+    EndLogEntry(*logEntry);
+  }
 
   return *spoofedValue;
 }
@@ -264,135 +574,91 @@ static int SpoofGDCResolution(int realFuncRetValue, int index)
 // DetouredGetDeviceCaps function
 int WINAPI DetouredGetDeviceCaps(HDC hdc, int index)
 {
+  // Check if initialization has not finished or if this thread is already inside a detoured function and pass the
+  //   call straight through to the real GetDeviceCaps function
+  if (!IsInitializationReady(gInitializationState) || gThreadInDetouredFunction)
+    return WindowsGetDeviceCaps(hdc, index);
+  gThreadInDetouredFunction = true;
+
   // Call the real GetDeviceCaps function
+  LONGLONG callStart = GetHookTimestamp();
   int value = WindowsGetDeviceCaps(hdc, index);
+  LONGLONG realCallEnd = GetHookTimestamp();
 
   // Write to the log file
-  gLogFileLock.lock();
-  if (gLogFile != nullptr && !gLogFile->fail())
+  if (std::wostringstream* logEntry = BeginLogEntry())
   {
     std::time_t time = std::time(NULL);
     std::tm localtime;
     localtime_s(&localtime, &time);
-    *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
+    *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
       L" - Detoured GetDeviceCaps function called with the following parameters: index = " << index << std::endl;
+    EndLogEntry(*logEntry);
   }
-  gLogFileLock.unlock();
-
 
   // Spoof the resolution
-  value = SpoofGDCResolution(value, index);
+  value = SpoofGDCResolution(value, index, _ReturnAddress());
+
+  // Record the trace events
+  RecordHookCall(SpoofResStatsGetDeviceCaps, "GetDeviceCaps", callStart, realCallEnd, GetHookTimestamp());
+
+  // Leave the detoured function
+  gThreadInDetouredFunction = false;
 
   return value;
 }
 
-// SpoofEDSResolution function
-static BOOL SpoofEDSResolution(BOOL realFuncRetValue, LPCWSTR deviceName, DWORD modeNumber, DWORD* fields, DWORD* width,
-  DWORD* height, DWORD* bitsPerPixel, DWORD* frequency, DWORD* flags, POINTL* position, DWORD* orientation)
+// FindEDSSection function
+static const SpoofConfig::EDSSection* FindEDSSection(const SpoofConfig* config, LPCWSTR deviceName, DWORD modeNumber,
+  BOOL realFuncRetValue, const void* returnAddress)
 {
-  // Check if we do not have a valid ini file
-  gIniFileLock.lock();
-  if (gIniFile == nullptr)
+  // Loop through the section patterns in order of precedence, ie: the exact device and mode, any device and the exact
+  //   mode, and only if the real function succeeded the exact device and any mode, and any device and any mode
+  static constexpr struct
   {
-    gIniFileLock.unlock();
-    return realFuncRetValue;
-  }
-  gIniFileLock.unlock();
-
-  // Load the resolution information from the ini file
-  // Note: we load all of the reolution information from the ini file before assigning any of it to the passed in
-  //   pointers to avoid partially spoofing the resolution information if an exception is thrown during loading
-  std::unique_ptr<DWORD> spoofedWidth = std::unique_ptr<DWORD>(nullptr);
-  std::unique_ptr<DWORD> spoofedHeight = std::unique_ptr<DWORD>(nullptr);
-  std::unique_ptr<DWORD> spoofedBitsPerPixel = std::unique_ptr<DWORD>(nullptr);
-  std::unique_ptr<DWORD> spoofedFrequency = std::unique_ptr<DWORD>(nullptr);
-  std::unique_ptr<DWORD> spoofedFlags = std::unique_ptr<DWORD>(nullptr);
-  std::unique_ptr<POINTL> spoofedPosition = std::unique_ptr<POINTL>(nullptr);
-  std::unique_ptr<DWORD> spoofedOrientation = std::unique_ptr<DWORD>(nullptr);
-  try
-  {
-    // Figure out the matching sections
-    std::vector<std::wstring> sections;
-    if (modeNumber == ENUM_CURRENT_SETTINGS)
-    {
-      sections.push_back(std::wstring(L"EDS|") + (deviceName != NULL ? deviceName : L"NULL") +
-        std::wstring(L"|Current"));
-      sections.push_back(std::wstring(L"EDS|*|Current"));
-    }
-    else if (modeNumber == ENUM_REGISTRY_SETTINGS)
-    {
-      sections.push_back(std::wstring(L"EDS|") + (deviceName != NULL ? deviceName : L"NULL") +
-        std::wstring(L"|Registry"));
-      sections.push_back(std::wstring(L"EDS|*|Registry"));
-    }
-    else
-    {
-      sections.push_back(std::wstring(L"EDS|") + (deviceName != NULL ? deviceName : L"NULL") + std::wstring(L"|") +
-        std::to_wstring(modeNumber));
-      sections.push_back(std::wstring(L"EDS|*|") + std::to_wstring(modeNumber));
-    }
-    if (realFuncRetValue)
-    {
-      sections.push_back(std::wstring(L"EDS|") + (deviceName != NULL ? deviceName : L"NULL") + std::wstring(L"|*"));
-      sections.push_back(std::wstring(L"EDS|*|*"));
-    }
-
-    // Loop through the matching sections
-    std::lock_guard<std::mutex> iniFileLock(gIniFileLock);
-    for (std::wstring section : sections)
+    bool anyDevice;
+    bool anyMode;
+  } patterns[] = { { false, false }, { true, false }, { false, true }, { true, true } };
+  for (int pattern = 0; pattern < (realFuncRetValue ? 4 : 2); pattern++)
+  {
+    // Loop through the sections and check if this section matches using a case insensitive comparison for the device
+    // Note: sections limited to other caller modules are skipped so that a less specific section can still match
+    for (const SpoofConfig::EDSSection& section : config->edsSections)
     {
-      // Check if this section exists
-      if (gIniFile->SectionExists(section.c_str()))
-      {
-        // Check if the passed in pointers are valid and if the keys exist and load the resolution information
-        if (width != NULL && gIniFile->KeyExists(section.c_str(), L"Width"))
-          spoofedWidth = std::make_unique<DWORD>(std::stoul(gIniFile->GetValue(section.c_str(), L"Width")));
-        if (height != NULL && gIniFile->KeyExists(section.c_str(), L"Height"))
-          spoofedHeight = std::make_unique<DWORD>(std::stoul(gIniFile->GetValue(section.c_str(), L"Height")));
-        if (bitsPerPixel != NULL && gIniFile->KeyExists(section.c_str(), L"BitsPerPixel"))
-          spoofedBitsPerPixel = std::make_unique<DWORD>(std::stoul(gIniFile->GetValue(section.c_str(),
-            L"BitsPerPixel")));
-        if (frequency != NULL && gIniFile->KeyExists(section.c_str(), L"Frequency"))
-          spoofedFrequency = std::make_unique<DWORD>(std::stoul(gIniFile->GetValue(section.c_str(), L"Frequency")));
-        if (flags != NULL && gIniFile->KeyExists(section.c_str(), L"Flags"))
-          spoofedFlags = std::make_unique<DWORD>(std::stoul(gIniFile->GetValue(section.c_str(), L"Flags")));
-        if (position != NULL && gIniFile->KeyExists(section.c_str(), L"PositionX") &&
-            gIniFile->KeyExists(section.c_str(), L"PositionY"))
-        {
-          spoofedPosition = std::make_unique<POINTL>();
-          spoofedPosition->x = std::stoul(gIniFile->GetValue(section.c_str(), L"PositionX"));
-          spoofedPosition->y = std::stoul(gIniFile->GetValue(section.c_str(), L"PositionY"));
-        }
-        if (orientation != NULL && gIniFile->KeyExists(section.c_str(), L"Orientation"))
-          spoofedOrientation = std::make_unique<DWORD>(std::stoul(gIniFile->GetValue(section.c_str(), L"Orientation")));
-
-        // Stop looping
-        break;
-      }
+      if (section.anyDevice == patterns[pattern].anyDevice && section.anyMode == patterns[pattern].anyMode &&
+          (section.anyDevice || _wcsicmp(section.device.c_str(), deviceName != NULL ? deviceName : L"NULL") == 0) &&
+          (section.anyMode || section.mode == modeNumber) && IsSpoofedCaller(config, section.callers, returnAddress))
+        return &section;
     }
   }
-  catch (std::invalid_argument)
-  {
-    // Show an error message and reset the ini file
-    MessageBox(NULL, L"Failed to load resolution information from spoofres.ini file", L"Spoof Resolution",
-      MB_OK | MB_ICONERROR);
-    std::lock_guard<std::mutex> iniFileLock(gIniFileLock);
-    gIniFile->Reset();
-    gIniFile.reset();
 
+  return nullptr;
+}
+
+// SpoofEDSResolution function
+static BOOL SpoofEDSResolution(SpoofResStatsApi api, BOOL realFuncRetValue, LPCWSTR deviceName, DWORD modeNumber,
+  DWORD* fields, DWORD* width, DWORD* height, DWORD* bitsPerPixel, DWORD* frequency, DWORD* flags, POINTL* position,
+  DWORD* orientation, const void* returnAddress)
+{
+  // Check if we do not have a valid config
+  const SpoofConfig* config = gConfig.load(std::memory_order_acquire);
+  if (config == nullptr)
     return realFuncRetValue;
-  }
-  catch (std::out_of_range)
-  {
-    // Show an error message and reset the ini file pointer
-    MessageBox(NULL, L"Failed to load resolution information from spoofres.ini file", L"Spoof Resolution",
-      MB_OK | MB_ICONERROR);
-    std::lock_guard<std::mutex> iniFileLock(gIniFileLock);
-    gIniFile->Reset();
-    gIniFile.reset();
 
+  // Find the matching section in the config
+  const SpoofConfig::EDSSection* section = FindEDSSection(config, deviceName, modeNumber, realFuncRetValue,
+    returnAddress);
+  if (section == nullptr)
     return realFuncRetValue;
-  }
+
+  // Get the resolution information from the section for the passed in pointers that are valid
+  const DWORD* spoofedWidth = width != NULL ? section->width.get() : nullptr;
+  const DWORD* spoofedHeight = height != NULL ? section->height.get() : nullptr;
+  const DWORD* spoofedBitsPerPixel = bitsPerPixel != NULL ? section->bitsPerPixel.get() : nullptr;
+  const DWORD* spoofedFrequency = frequency != NULL ? section->frequency.get() : nullptr;
+  const DWORD* spoofedFlags = flags != NULL ? section->flags.get() : nullptr;
+  const POINTL* spoofedPosition = position != NULL ? section->position.get() : nullptr;
+  const DWORD* spoofedOrientation = orientation != NULL ? section->orientation.get() : nullptr;
 
   // Check if we do not have any spoofed values
   if (spoofedWidth == nullptr && spoofedHeight == nullptr && spoofedBitsPerPixel == nullptr &&
@@ -400,59 +666,61 @@ static BOOL SpoofEDSResolution(BOOL realFuncRetValue, LPCWSTR deviceName, DWORD
       spoofedOrientation == nullptr)
     return realFuncRetValue;
 
+  // Record the spoof hit
+  RecordSpoofHit(api);
+
   // Write to the log file
-  gLogFileLock.lock();
-  if (gLogFile != nullptr && !gLogFile->fail())
+  if (std::wostringstream* logEntry = BeginLogEntry())
   {
     std::time_t time = std::time(NULL);
     std::tm localtime;
     localtime_s(&localtime, &time);
-    *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
+    *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
       L" - Spoofed EnumDisplaySettings resolution for device " << (deviceName != NULL ? deviceName : L"NULL") <<
       L" and mode number " << (modeNumber == ENUM_CURRENT_SETTINGS ? L"ENUM_CURRENT_SETTINGS" :
       (modeNumber == ENUM_REGISTRY_SETTINGS ? L"ENUM_REGISTRY_SETTINGS" : std::to_wstring(modeNumber))) <<
       L" with the following details: ";
     if (spoofedWidth != nullptr)
-      *gLogFile << L"Width = " << *spoofedWidth;
+      *logEntry << L"Width = " << *spoofedWidth;
     if (spoofedWidth != nullptr && (spoofedHeight != nullptr || spoofedBitsPerPixel != nullptr ||
         spoofedFrequency != nullptr || spoofedFlags != nullptr || spoofedPosition != nullptr ||
         spoofedOrientation != nullptr))
-      *gLogFile << L", ";
+      *logEntry << L", ";
     if (spoofedHeight != nullptr)
-      *gLogFile << L"Height = " << *spoofedHeight;
+      *logEntry << L"Height = " << *spoofedHeight;
     if ((spoofedWidth != nullptr || spoofedHeight != nullptr) && (spoofedBitsPerPixel != nullptr ||
         spoofedFrequency != nullptr || spoofedFlags != nullptr || spoofedPosition != nullptr ||
         spoofedOrientation != nullptr))
-      *gLogFile << L", ";
+      *logEntry << L", ";
     if (spoofedBitsPerPixel != nullptr)
-      *gLogFile << L"Bits Per Pixel = " << *spoofedBitsPerPixel;
+      *logEntry << L"Bits Per Pixel = " << *spoofedBitsPerPixel;
     if ((spoofedWidth != nullptr || spoofedHeight != nullptr || spoofedBitsPerPixel != nullptr) &&
         (spoofedFrequency != nullptr || spoofedFlags != nullptr || spoofedPosition != nullptr ||
         spoofedOrientation != nullptr))
-      *gLogFile << L", ";
+      *logEntry << L", ";
     if (spoofedFrequency != nullptr)
-      *gLogFile << L"Frequency = " << *spoofedFrequency;
+      *logEntry << L"Frequency = " << *spoofedFrequency;
     if ((spoofedWidth != nullptr || spoofedHeight != nullptr || spoofedBitsPerPixel != nullptr ||
         spoofedFrequency != nullptr) && (spoofedFlags != nullptr || spoofedPosition != nullptr ||
         spoofedOrientation != nullptr))
-      *gLogFile << L", ";
+      *logEntry << L", ";
     if (spoofedFlags != nullptr)
-      *gLogFile << L"Flags = " << *spoofedFlags;
+      *logEntry << L"Flags = " << *spoofedFlags;
     if ((spoofedWidth != nullptr || spoofedHeight != nullptr || spoofedBitsPerPixel != nullptr ||
         spoofedFrequency != nullptr || spoofedFlags != nullptr) && (spoofedPosition != nullptr ||
         spoofedOrientation != nullptr))
-      *gLogFile << L", ";
+      *logEntry << L", ";
     if (spoofedPosition != nullptr)
-      *gLogFile << L"Position X = " << spoofedPosition->x << ", Position Y = " << spoofedPosition->y;
+      *logEntry << L"Position X = " << spoofedPosition->x << ", Position Y = " << spoofedPosition->y;
     if ((spoofedWidth != nullptr || spoofedHeight != nullptr || spoofedBitsPerPixel != nullptr ||
         spoofedFrequency != nullptr || spoofedFlags != nullptr || spoofedPosition != nullptr) &&
         (spoofedOrientation != nullptr))
-      *gLogFile << L", ";
+      *logEntry << L", ";
     if (spoofedOrientation != nullptr)
-      *gLogFile << L"Orientation = " << *spoofedOrientation;
-    *gLogFile << std::endl;
+      *logEntry << L"Orientation = " << *spoofedOrientation;
+    *logEntry << std::endl;
+    EndLogEntry(*logEntry);
   }
-  gLogFileLock.unlock();
 
   // Spoof the resolution information
   if (spoofedWidth != nullptr)
@@ -498,8 +766,16 @@ static BOOL SpoofEDSResolution(BOOL realFuncRetValue, LPCWSTR deviceName, DWORD
 // DetouredEnumDisplaySettingsA function
 BOOL WINAPI DetouredEnumDisplaySettingsA(LPCSTR lpszDeviceName, DWORD iModeNum, DEVMODEA* lpDevMode)
 {
+  // Check if initialization has not finished or if this thread is already inside a detoured function and pass the
+  //   call straight through to the real EnumDisplaySettingsA function
+  if (!IsInitializationReady(gInitializationState) || gThreadInDetouredFunction)
+    return WindowsEnumDisplaySettingsA(lpszDeviceName, iModeNum, lpDevMode);
+  gThreadInDetouredFunction = true;
+
   // Call the real EnumDisplaySettingsA function
+  LONGLONG callStart = GetHookTimestamp();
   BOOL success = WindowsEnumDisplaySettingsA(lpszDeviceName, iModeNum, lpDevMode);
+  LONGLONG realCallEnd = GetHookTimestamp();
 
   // Convert the device name to a wide character string
   std::unique_ptr<std::wstring> deviceName = std::unique_ptr<std::wstring>(nullptr);
@@ -512,24 +788,30 @@ BOOL WINAPI DetouredEnumDisplaySettingsA(LPCSTR lpszDeviceName, DWORD iModeNum,
   }
 
   // Write to the log file
-  gLogFileLock.lock();
-  if (gLogFile != nullptr && !gLogFile->fail())
+  if (std::wostringstream* logEntry = BeginLogEntry())
   {
     std::time_t time = std::time(NULL);
     std::tm localtime;
     localtime_s(&localtime, &time);
-    *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
+    *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
       L" - Detoured EnumDisplaySettingsA function called with the following parameters: lpszDeviceName = " <<
       (deviceName != nullptr ? *deviceName : L"NULL") << L", iModeNum = " <<
       (iModeNum == ENUM_CURRENT_SETTINGS ? L"ENUM_CURRENT_SETTINGS" :
       (iModeNum == ENUM_REGISTRY_SETTINGS ? L"ENUM_REGISTRY_SETTINGS" : std::to_wstring(iModeNum))) << std::endl;
+    EndLogEntry(*logEntry);
   }
-  gLogFileLock.unlock();
 
   // Spoof the resolution
-  success = SpoofEDSResolution(success, (deviceName != nullptr ? deviceName->c_str() : NULL), iModeNum,
-    &lpDevMode->dmFields, &lpDevMode->dmPelsWidth, &lpDevMode->dmPelsHeight, &lpDevMode->dmBitsPerPel,
-    &lpDevMode->dmDisplayFrequency, &lpDevMode->dmDisplayFlags, NULL, NULL);
+  success = SpoofEDSResolution(SpoofResStatsEnumDisplaySettingsA, success,
+    (deviceName != nullptr ? deviceName->c_str() : NULL), iModeNum, &lpDevMode->dmFields, &lpDevMode->dmPelsWidth,
+    &lpDevMode->dmPelsHeight, &lpDevMode->dmBitsPerPel, &lpDevMode->dmDisplayFrequency, &lpDevMode->dmDisplayFlags,
+    NULL, NULL, _ReturnAddress());
+
+  // Record the trace events
+  RecordHookCall(SpoofResStatsEnumDisplaySettingsA, "EnumDisplaySettingsA", callStart, realCallEnd, GetHookTimestamp());
+
+  // Leave the detoured function
+  gThreadInDetouredFunction = false;
 
   return success;
 }
@@ -537,28 +819,41 @@ BOOL WINAPI DetouredEnumDisplaySettingsA(LPCSTR lpszDeviceName, DWORD iModeNum,
 // DetouredEnumDisplaySettingsW function
 BOOL WINAPI DetouredEnumDisplaySettingsW(LPCWSTR lpszDeviceName, DWORD iModeNum, DEVMODEW* lpDevMode)
 {
+  // Check if initialization has not finished or if this thread is already inside a detoured function and pass the
+  //   call straight through to the real EnumDisplaySettingsW function
+  if (!IsInitializationReady(gInitializationState) || gThreadInDetouredFunction)
+    return WindowsEnumDisplaySettingsW(lpszDeviceName, iModeNum, lpDevMode);
+  gThreadInDetouredFunction = true;
+
   // Call the real EnumDisplaySettingsW function
+  LONGLONG callStart = GetHookTimestamp();
   BOOL success = WindowsEnumDisplaySettingsW(lpszDeviceName, iModeNum, lpDevMode);
+  LONGLONG realCallEnd = GetHookTimestamp();
 
   // Write to the log file
-  gLogFileLock.lock();
-  if (gLogFile != nullptr && !gLogFile->fail())
+  if (std::wostringstream* logEntry = BeginLogEntry())
   {
     std::time_t time = std::time(NULL);
     std::tm localtime;
     localtime_s(&localtime, &time);
-    *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
+    *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
       L" - Detoured EnumDisplaySettingsW function called with the following parameters: lpszDeviceName = " <<
       (lpszDeviceName != NULL ? lpszDeviceName : L"NULL") << L", iModeNum = " <<
       (iModeNum == ENUM_CURRENT_SETTINGS ? L"ENUM_CURRENT_SETTINGS" :
       (iModeNum == ENUM_REGISTRY_SETTINGS ? L"ENUM_REGISTRY_SETTINGS" : std::to_wstring(iModeNum))) << std::endl;
+    EndLogEntry(*logEntry);
   }
-  gLogFileLock.unlock();
 
   // Spoof the resolution
-  success = SpoofEDSResolution(success, lpszDeviceName, iModeNum, &lpDevMode->dmFields, &lpDevMode->dmPelsWidth,
-    &lpDevMode->dmPelsHeight, &lpDevMode->dmBitsPerPel, &lpDevMode->dmDisplayFrequency, &lpDevMode->dmDisplayFlags,
-    NULL, NULL);
+  success = SpoofEDSResolution(SpoofResStatsEnumDisplaySettingsW, success, lpszDeviceName, iModeNum,
+    &lpDevMode->dmFields, &lpDevMode->dmPelsWidth, &lpDevMode->dmPelsHeight, &lpDevMode->dmBitsPerPel,
+    &lpDevMode->dmDisplayFrequency, &lpDevMode->dmDisplayFlags, NULL, NULL, _ReturnAddress());
+
+  // Record the trace events
+  RecordHookCall(SpoofResStatsEnumDisplaySettingsW, "EnumDisplaySettingsW", callStart, realCallEnd, GetHookTimestamp());
+
+  // Leave the detoured function
+  gThreadInDetouredFunction = false;
 
   return success;
 }
@@ -566,8 +861,16 @@ BOOL WINAPI DetouredEnumDisplaySettingsW(LPCWSTR lpszDeviceName, DWORD iModeNum,
 // DetouredEnumDisplaySettingsExA function
 BOOL WINAPI DetouredEnumDisplaySettingsExA(LPCSTR lpszDeviceName, DWORD iModeNum, DEVMODEA* lpDevMode, DWORD dwFlags)
 {
+  // Check if initialization has not finished or if this thread is already inside a detoured function and pass the
+  //   call straight through to the real EnumDisplaySettingsExA function
+  if (!IsInitializationReady(gInitializationState) || gThreadInDetouredFunction)
+    return WindowsEnumDisplaySettingsExA(lpszDeviceName, iModeNum, lpDevMode, dwFlags);
+  gThreadInDetouredFunction = true;
+
   // Call the real EnumDisplaySettingsExA function
+  LONGLONG callStart = GetHookTimestamp();
   BOOL success = WindowsEnumDisplaySettingsExA(lpszDeviceName, iModeNum, lpDevMode, dwFlags);
+  LONGLONG realCallEnd = GetHookTimestamp();
 
   // Convert the device name to a wide character string
   std::unique_ptr<std::wstring> deviceName = std::unique_ptr<std::wstring>(nullptr);
@@ -580,25 +883,31 @@ BOOL WINAPI DetouredEnumDisplaySettingsExA(LPCSTR lpszDeviceName, DWORD iModeNum
   }
 
   // Write to the log file
-  gLogFileLock.lock();
-  if (gLogFile != nullptr && !gLogFile->fail())
+  if (std::wostringstream* logEntry = BeginLogEntry())
   {
     std::time_t time = std::time(NULL);
     std::tm localtime;
     localtime_s(&localtime, &time);
-    *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
+    *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
       L" - Detoured EnumDisplaySettingsExA function called with the following parameters: lpszDeviceName = " <<
       (deviceName != nullptr ? *deviceName : L"NULL") << L", iModeNum = " <<
       (iModeNum == ENUM_CURRENT_SETTINGS ? L"ENUM_CURRENT_SETTINGS" :
       (iModeNum == ENUM_REGISTRY_SETTINGS ? L"ENUM_REGISTRY_SETTINGS" : std::to_wstring(iModeNum))) << std::endl;
+    EndLogEntry(*logEntry);
   }
-  gLogFileLock.unlock();
 
   // Spoof the resolution
-  success = SpoofEDSResolution(success, (deviceName != nullptr ? deviceName->c_str() : NULL), iModeNum,
-    &lpDevMode->dmFields, &lpDevMode->dmPelsWidth, &lpDevMode->dmPelsHeight, &lpDevMode->dmBitsPerPel,
-    &lpDevMode->dmDisplayFrequency, &lpDevMode->dmDisplayFlags, &lpDevMode->dmPosition,
-    &lpDevMode->dmDisplayOrientation);
+  success = SpoofEDSResolution(SpoofResStatsEnumDisplaySettingsExA, success,
+    (deviceName != nullptr ? deviceName->c_str() : NULL), iModeNum, &lpDevMode->dmFields, &lpDevMode->dmPelsWidth,
+    &lpDevMode->dmPelsHeight, &lpDevMode->dmBitsPerPel, &lpDevMode->dmDisplayFrequency, &lpDevMode->dmDisplayFlags,
+    &lpDevMode->dmPosition, &lpDevMode->dmDisplayOrientation, _ReturnAddress());
+
+  // Record the trace events
+  RecordHookCall(SpoofResStatsEnumDisplaySettingsExA, "EnumDisplaySettingsExA", callStart, realCallEnd,
+    GetHookTimestamp());
+
+  // Leave the detoured function
+  gThreadInDetouredFunction = false;
 
   return success;
 }
@@ -606,28 +915,43 @@ BOOL WINAPI DetouredEnumDisplaySettingsExA(LPCSTR lpszDeviceName, DWORD iModeNum
 // DetouredEnumDisplaySettingsExW function
 BOOL WINAPI DetouredEnumDisplaySettingsExW(LPCWSTR lpszDeviceName, DWORD iModeNum, DEVMODEW* lpDevMode, DWORD dwFlags)
 {
+  // Check if initialization has not finished or if this thread is already inside a detoured function and pass the
+  //   call straight through to the real EnumDisplaySettingsExW function
+  if (!IsInitializationReady(gInitializationState) || gThreadInDetouredFunction)
+    return WindowsEnumDisplaySettingsExW(lpszDeviceName, iModeNum, lpDevMode, dwFlags);
+  gThreadInDetouredFunction = true;
+
   // Call the real EnumDisplaySettingsExW function
+  LONGLONG callStart = GetHookTimestamp();
   BOOL success = WindowsEnumDisplaySettingsExW(lpszDeviceName, iModeNum, lpDevMode, dwFlags);
+  LONGLONG realCallEnd = GetHookTimestamp();
 
   // Write to the log file
-  gLogFileLock.lock();
-  if (gLogFile != nullptr && !gLogFile->fail())
+  if (std::wostringstream* logEntry = BeginLogEntry())
   {
     std::time_t time = std::time(NULL);
     std::tm localtime;
     localtime_s(&localtime, &time);
-    *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
+    *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
       L" - Detoured EnumDisplaySettingsExW function called with the following parameters: lpszDeviceName = " <<
       (lpszDeviceName != NULL ? lpszDeviceName : L"NULL") << L", iModeNum = " <<
       (iModeNum == ENUM_CURRENT_SETTINGS ? L"ENUM_CURRENT_SETTINGS" :
       (iModeNum == ENUM_REGISTRY_SETTINGS ? L"ENUM_REGISTRY_SETTINGS" : std::to_wstring(iModeNum))) << std::endl;
+    EndLogEntry(*logEntry);
   }
-  gLogFileLock.unlock();
 
   // Spoof the resolution
-  success = SpoofEDSResolution(success, lpszDeviceName, iModeNum, &lpDevMode->dmFields, &lpDevMode->dmPelsWidth,
-    &lpDevMode->dmPelsHeight, &lpDevMode->dmBitsPerPel, &lpDevMode->dmDisplayFrequency, &lpDevMode->dmDisplayFlags,
-    &lpDevMode->dmPosition, &lpDevMode->dmDisplayOrientation);
+  success = SpoofEDSResolution(SpoofResStatsEnumDisplaySettingsExW, success, lpszDeviceName, iModeNum,
+    &lpDevMode->dmFields, &lpDevMode->dmPelsWidth, &lpDevMode->dmPelsHeight, &lpDevMode->dmBitsPerPel,
+    &lpDevMode->dmDisplayFrequency, &lpDevMode->dmDisplayFlags, &lpDevMode->dmPosition,
+    &lpDevMode->dmDisplayOrientation, _ReturnAddress());
+
+  // Record the trace events
+  RecordHookCall(SpoofResStatsEnumDisplaySettingsExW, "EnumDisplaySettingsExW", callStart, realCallEnd,
+    GetHookTimestamp());
+
+  // Leave the detoured function
+  gThreadInDetouredFunction = false;
 
   return success;
 }
@@ -658,59 +982,138 @@ static void LoadIniFile(HMODULE module)
     return;
   }
 
-  // Open the ini file
-  gIniFile = std::make_unique<CSimpleIni>();
-  gIniFile->SetUnicode();
-  if (gIniFile->LoadFile(path.c_str()) < 0)
+  // Read the ini file
+  // Note: the contents are only parsed once we know that no other process has published a config compiled from them
+  std::ifstream file(std::filesystem::path(path), std::ifstream::binary);
+  if (!file.fail())
+    gIniContents = std::make_unique<std::string>(std::istreambuf_iterator<char>(file),
+      std::istreambuf_iterator<char>());
+  if (file.fail() || file.bad())
   {
-    // Show an error message and reset the ini file
+    // Show an error message and reset the ini file contents
     // Note: std::format adds a significant amount of additional code into the DLL so instead we are using stdio
     //   functions to compose the messages
     wchar_t message[256];
     swprintf_s(message, L"Failed to open %s file", path.c_str());
     MessageBox(NULL, message, L"Spoof Resolution", MB_OK | MB_ICONERROR);
-    gIniFile->Reset();
-    gIniFile.reset();
+    gIniContents.reset();
 
     return;
   }
 }
 
-// LoadLogFile function
-static void LoadLogFile(HMODULE module)
+// LoadSharedConfig function
+static bool LoadSharedConfig()
 {
   // Check if we do not have a valid ini file
-  if (gIniFile == nullptr)
+  if (gIniContents == nullptr)
+    return false;
+
+  // Load the config from the shared memory section published by another process for the same ini file contents
+  // Note: the section is mapped read only and its header and payload are validated before the config is used
+  uint64_t hash = HashSpoofConfigIni(gIniContents->data(), gIniContents->size());
+  std::unique_ptr<SpoofConfig> config = gSharedConfig.Load(hash, gIniContents->size());
+
+  // Check if the section does not exist or can not be used yet and parse the ini file instead
+  if (config == nullptr)
+    return false;
+
+  // Publish the config and release the ini file contents since they do not need to be parsed
+  gConfig.store(config.release(), std::memory_order_release);
+  gIniContents.reset();
+
+  return true;
+}
+
+// PublishSharedConfig function
+static void PublishSharedConfig(const SpoofConfig& config)
+{
+  // Create the shared memory section for the ini file contents, write the payload, and mark the section as ready
+  // Note: if the section already exists another process is publishing the same config so there is nothing to do, and
+  //   failing to publish is not reported since other processes then simply parse the ini file themselves
+  uint64_t hash = HashSpoofConfigIni(gIniContents->data(), gIniContents->size());
+  gSharedConfig.Publish(hash, gIniContents->size(), SerializeSpoofConfig(config));
+}
+
+// LoadConfigPayload function
+static bool LoadConfigPayload()
+{
+  // Check if the launcher did not copy a compiled config into this process
+  DWORD size = 0;
+  PVOID payload = DetourFindPayloadEx(SpoofConfigPayloadGuid, &size);
+  if (payload == NULL)
+    return false;
+
+  // Load the config from the payload
+  std::unique_ptr<SpoofConfig> config = DeserializeSpoofConfig(payload, size);
+  if (config == nullptr)
+  {
+    // Show an error message
+    MessageBox(NULL, L"Failed to load resolution information from launcher, using spoofres.ini file instead",
+      L"Spoof Resolution", MB_OK | MB_ICONERROR);
+
+    return false;
+  }
+
+  // Publish the config
+  gConfig.store(config.release(), std::memory_order_release);
+
+  return true;
+}
+
+// LoadSpoofConfig function
+static void LoadSpoofConfig()
+{
+  // Check if we do not have a valid ini file or another process already published the config
+  if (gIniContents == nullptr)
     return;
 
-  // Check if we do not have a logging key in the ini file
-  if (!gIniFile->KeyExists(L"SpoofResolution", L"Logging"))
+  // Parse the ini file
+  CSimpleIni iniFile;
+  iniFile.SetUnicode();
+  if (iniFile.LoadData(*gIniContents) < 0)
+  {
+    // Show an error message and reset the ini file contents
+    MessageBox(NULL, L"Failed to parse spoofres.ini file", L"Spoof Resolution", MB_OK | MB_ICONERROR);
+    gIniContents.reset();
+
     return;
+  }
 
-  // Check if the logging key is not set to On, Yes, or True using case insensitive comparisons
-  std::wstring logging = gIniFile->GetValue(L"SpoofResolution", L"Logging");
-  if (!std::ranges::equal(logging, std::wstring(L"On"),
-      [](wchar_t a, wchar_t b)
-      {
-        return std::tolower(a) == std::tolower(b);
-      }) && !std::ranges::equal(logging, std::wstring(L"Yes"),
-      [](wchar_t a, wchar_t b)
-      {
-        return std::tolower(a) == std::tolower(b);
-      }) && !std::ranges::equal(logging, std::wstring(L"True"),
-      [](wchar_t a, wchar_t b)
-      {
-        return std::tolower(a) == std::tolower(b);
-      }))
+  // Compile the settings and resolution information from the ini file into a config
+  std::unique_ptr<SpoofConfig> config = std::make_unique<SpoofConfig>();
+  if (!CompileSpoofConfig(iniFile, *config))
+  {
+    // Show an error message
+    // Note: the config is still published without the resolution information so that the settings are used and the
+    //   detoured functions pass calls straight through to the real functions
+    MessageBox(NULL, L"Failed to load resolution information from spoofres.ini file", L"Spoof Resolution",
+      MB_OK | MB_ICONERROR);
+  }
+
+  // Publish the config into shared memory for other processes using the same ini file if enabled
+  if (config->sharedConfig)
+    PublishSharedConfig(*config);
+
+  // Publish the config and release the ini file contents since everything in them has been compiled
+  gConfig.store(config.release(), std::memory_order_release);
+  gIniContents.reset();
+}
+
+// LoadLogFile function
+static void LoadLogFile(HMODULE module)
+{
+  // Check if we do not have a valid config or logging is not enabled in it
+  const SpoofConfig* config = gConfig.load(std::memory_order_acquire);
+  if (config == nullptr || !config->logging)
     return;
 
-  // Check if we have a LogFile key in the ini file and load the log file path otherwise use the DLL file path as the
-  //   log file path base
+  // Check if we have a log file path in the config otherwise use the DLL file path as the log file path base
   std::wstring path;
-  if (gIniFile->KeyExists(L"SpoofResolution", L"LogFile"))
+  if (config->logFile != nullptr)
   {
-    path = gIniFile->GetValue(L"SpoofResolution", L"LogFile");
-  }  
+    path = *config->logFile;
+  }
   else
   {
     // Get the full path to this DLL
@@ -746,137 +1149,649 @@ static void LoadLogFile(HMODULE module)
 
   // Enable UTF-8 support using an empty locale with the codecvt facet from the en_US.UTF-8 locale
   gLogFile->imbue(std::locale(std::locale::empty(), new std::codecvt_byname<wchar_t, char, std::mbstate_t>("en_US.UTF-8")));
+
+  // Take a reference to this DLL for the log writer thread and start it
+  // Note: the thread does not start running until DllMain returns and the loader lock is released
+  InitializeSListHead(&gLogQueue);
+  HMODULE writerModule;
+  HANDLE thread = NULL;
+  if (GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)&LogWriterThread, &writerModule))
+  {
+    thread = CreateThread(NULL, 0, LogWriterThread, NULL, 0, NULL);
+    if (thread == NULL)
+      FreeLibrary(writerModule);
+  }
+  if (thread == NULL)
+  {
+    // Show an error message and reset the log file
+    MessageBox(NULL, L"Failed to start log file writer thread", L"Spoof Resolution", MB_OK | MB_ICONERROR);
+    gLogFile->close();
+    gLogFile.reset();
+
+    return;
+  }
+  CloseHandle(thread);
+
+  // Enable logging
+  gLogEnabled = true;
 }
 
-// DllMain function
-BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserved)
+// WriteTraceFileEvent function
+static void WriteTraceFileEvent(const TraceEvent& event)
 {
-  // Switch based on the reason for this function call
-  switch (ul_reason_for_call)
+  WriteTraceEvent(gTraceFile, event, gTraceClock, gTraceFirstEvent);
+  gTraceFirstEvent = false;
+}
+
+// TraceWriterThread function
+static DWORD WINAPI TraceWriterThread(LPVOID parameter)
+{
+  // Write the events of the full chunks to the trace file ten times per second and hand the chunks back to the pool
+  // Note: this thread keeps a reference to this DLL so it never has to be stopped, it ends when the process exits, and
+  //   it holds the trace file lock while writing so that DllMain knows if it was terminated in the middle of a write
+  while (true)
   {
-  case DLL_PROCESS_ATTACH:
-    #if not defined(VERSOIN_DLL_VERSION) && not defined (WINHTTP_DLL_VERSION)
-    // Restore the in memory import table after we are loaded by withdll.exe
-    DetourRestoreAfterWith();
-    #endif
+    Sleep(100);
+    std::lock_guard<std::mutex> traceFileLock(gTraceFileLock);
+    if (gTraceFile != NULL && gTraceBuffer.Flush(WriteTraceFileEvent) != 0)
+      fflush(gTraceFile);
+  }
+
+  return 0;
+}
+
+// LoadTraceFile function
+static void LoadTraceFile(HMODULE module)
+{
+  // Check if we do not have a valid config or tracing is not enabled in it
+  const SpoofConfig* config = gConfig.load(std::memory_order_acquire);
+  if (config == nullptr || !config->tracing)
+    return;
+
+  // Check if we have a trace file path in the config otherwise use the DLL file path as the trace file path base
+  std::wstring path;
+  if (config->traceFile != nullptr)
+  {
+    path = *config->traceFile;
+  }
+  else
+  {
+    // Get the full path to this DLL
+    path = std::wstring(MAX_PATH, 0);
+    if (GetModuleFileName(module, &path[0], MAX_PATH) == 0)
+    {
+      // Show an error message
+      MessageBox(NULL, L"Failed to get path to Spoof Resolution DLL file", L"Spoof Resolution", MB_OK | MB_ICONERROR);
+
+      return;
+    }
+
+    // Remove the file name from the path and replace it with spoofres.trace.json
+    path.erase(path.rfind(std::filesystem::path::preferred_separator) + 1);
+    path += L"spoofres.trace.json";
+  }
+
+  // Open the trace file
+  // Note: the trace file is opened now so that any errors are reported at startup, the events are written to it by the
+  //   trace writer thread as the chunks fill up and the file is completed when the DLL is detached
+  if (_wfopen_s(&gTraceFile, path.c_str(), L"w") != 0)
+  {
+    // Show an error message
+    // Note: std::format adds a significant amount of additional code into the DLL so instead we are using stdio
+    //   functions to compose the messages
+    wchar_t message[256];
+    swprintf_s(message, L"Failed to open %s file", path.c_str());
+    MessageBox(NULL, message, L"Spoof Resolution", MB_OK | MB_ICONERROR);
+    gTraceFile = NULL;
+
+    return;
+  }
+
+  // Allocate the pool of chunks the events are recorded into
+  if (!gTraceBuffer.Initialize())
+  {
+    // Show an error message and close the trace file
+    MessageBox(NULL, L"Failed to allocate trace event buffer", L"Spoof Resolution", MB_OK | MB_ICONERROR);
+    fclose(gTraceFile);
+    gTraceFile = NULL;
+
+    return;
+  }
+
+  // Take a reference to this DLL for the trace writer thread and start it
+  // Note: the thread does not start running until DllMain returns and the loader lock is released
+  HMODULE writerModule;
+  HANDLE thread = NULL;
+  if (GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)&TraceWriterThread, &writerModule))
+  {
+    thread = CreateThread(NULL, 0, TraceWriterThread, NULL, 0, NULL);
+    if (thread == NULL)
+      FreeLibrary(writerModule);
+  }
+  if (thread == NULL)
+  {
+    // Show an error message and close the trace file
+    MessageBox(NULL, L"Failed to start trace file writer thread", L"Spoof Resolution", MB_OK | MB_ICONERROR);
+    fclose(gTraceFile);
+    gTraceFile = NULL;
+
+    return;
+  }
+  CloseHandle(thread);
+
+  // Enable tracing
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER start;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&start);
+  gTraceClock = { GetCurrentProcessId(), start.QuadPart, frequency.QuadPart };
+  WriteTraceBegin(gTraceFile);
+  gTraceBuffer.Enable();
+}
+
+// WriteTraceFile function
+static void WriteTraceFile()
+{
+  // Check if we do not have a valid trace file
+  if (gTraceFile == NULL)
+    return;
+
+  // Write all of the events that are left and complete the trace file
+  // Note: the trace writer thread has already been terminated by now and if that happened in the middle of a write the
+  //   trace file lock is never released so we leave the trace file as is
+  gTraceBuffer.Disable();
+  if (!gTraceFileLock.try_lock())
+    return;
+  gTraceBuffer.Drain(WriteTraceFileEvent);
+  WriteTraceEnd(gTraceFile, gTraceBuffer.GetDroppedEvents());
+  fclose(gTraceFile);
+  gTraceFile = NULL;
+  gTraceFileLock.unlock();
+}
+
+// PublishStatsThread function
+static DWORD WINAPI PublishStatsThread(LPVOID parameter)
+{
+  // Copy the counters into the shared memory block four times per second
+  // Note: this thread keeps a reference to this DLL so it never has to be stopped, it ends when the process exits
+  SpoofResStats values = *gStats;
+  while (true)
+  {
+    Sleep(250);
+    for (uint32_t api = 0; api < SpoofResStatsApiCount; api++)
+    {
+      values.apis[api].calls = gStatsCounters[api].calls.load(std::memory_order_relaxed);
+      values.apis[api].spoofHits = gStatsCounters[api].spoofHits.load(std::memory_order_relaxed);
+      values.apis[api].spoofMisses = values.apis[api].calls - std::min(values.apis[api].spoofHits,
+        values.apis[api].calls);
+      values.apis[api].realCallTicks = gStatsCounters[api].realCallTicks.load(std::memory_order_relaxed);
+      values.apis[api].hookTicks = gStatsCounters[api].hookTicks.load(std::memory_order_relaxed);
+    }
+    values.logQueueDepth = gLogQueueDepth.load(std::memory_order_relaxed);
+    values.logEntriesWritten = gLogEntriesWritten.load(std::memory_order_relaxed);
+    values.callerCacheHits = gStatsCallerCacheHits.load(std::memory_order_relaxed);
+    values.callerCacheMisses = gStatsCallerCacheMisses.load(std::memory_order_relaxed);
+    values.publishCount++;
+    WriteSpoofResStats(gStats, values);
+  }
+
+  return 0;
+}
+
+// LoadStatistics function
+static void LoadStatistics()
+{
+  // Check if we do not have a valid config or statistics are not enabled in it
+  const SpoofConfig* config = gConfig.load(std::memory_order_acquire);
+  if (config == nullptr || !config->statistics)
+    return;
+
+  // Create and initialize the shared memory block named after this process
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  gStats = gStatsSection.Create(GetCurrentProcessId(), frequency.QuadPart);
+  if (gStats == nullptr)
+  {
+    // Show an error message
+    MessageBox(NULL, L"Failed to create shared memory block for statistics", L"Spoof Resolution",
+      MB_OK | MB_ICONERROR);
+
+    return;
+  }
+
+  // Take a reference to this DLL for the publisher thread and start it
+  // Note: the thread does not start running until DllMain returns and the loader lock is released
+  HMODULE module;
+  if (!GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)&PublishStatsThread, &module))
+    return;
+  HANDLE thread = CreateThread(NULL, 0, PublishStatsThread, NULL, 0, NULL);
+  if (thread == NULL)
+  {
+    FreeLibrary(module);
+    return;
+  }
+  CloseHandle(thread);
+
+  // Enable statistics
+  gStatsEnabled = true;
+}
+
+// LoadCallerModules function
+static void LoadCallerModules()
+{
+  // Check if we do not have a valid config or none of its sections are limited to caller modules
+  const SpoofConfig* config = gConfig.load(std::memory_order_acquire);
+  if (config == nullptr || config->callerModules.empty())
+    return;
+
+  // Register for module load and unload notifications so that the caller module index is rebuilt when they change
+  // Note: the index itself is only built by the first detoured function call that needs it
+  LdrRegisterDllNotificationFunction registerDllNotification = (LdrRegisterDllNotificationFunction)GetProcAddress(
+    GetModuleHandle(L"ntdll.dll"), "LdrRegisterDllNotification");
+  if (registerDllNotification == NULL ||
+      registerDllNotification(0, DllNotification, NULL, &gDllNotificationCookie) != 0)
+  {
+    // Show an error message
+    gDllNotificationCookie = NULL;
+    MessageBox(NULL, L"Failed to register for module load notifications, Callers keys will only match modules that "
+      "were loaded before the first spoofed call", L"Spoof Resolution", MB_OK | MB_ICONERROR);
+  }
+}
+
+// GetStartupTimestamp function
+static LONGLONG GetStartupTimestamp()
+{
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return counter.QuadPart;
+}
+
+// RecordStartupPhase function
+static void RecordStartupPhase(StartupPhase phase, LONGLONG start)
+{
+  // Add the time since the passed in start time to the phase
+  gStartupTimings.Record(phase, GetStartupTimestamp() - start);
+}
+
+// WriteStartupReport function
+static void WriteStartupReport()
+{
+  // Check if we do not have a valid config or the startup report is not enabled in it
+  const SpoofConfig* config = gConfig.load(std::memory_order_acquire);
+  if (config == nullptr || !config->startupReport)
+    return;
+
+  // Compose the breakdown of the phases that were recorded in milliseconds and as a percentage of the total
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  wchar_t details[1024];
+  FormatStartupReport(gStartupTimings, frequency.QuadPart, details, std::size(details));
+
+  // Write to the log file
+  if (std::wostringstream* logEntry = BeginLogEntry())
+  {
+    std::time_t time = std::time(NULL);
+    std::tm localtime;
+    localtime_s(&localtime, &time);
+    *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
+      L" - DllMain startup phases took the following times: " << details << std::endl;
+    EndLogEntry(*logEntry);
+  }
+
+  // Write to the debugger output
+  OutputDebugString(L"Spoof Resolution - DllMain startup phases took the following times: ");
+  OutputDebugString(details);
+  OutputDebugString(L"\n");
+}
+
+// Initialize function
+// Note: inDllMain is whether this is called by DllMain under the loader lock instead of the initialization thread
+static bool Initialize(HMODULE module, bool inDllMain)
+{
+  // Define needed variables
+  LONGLONG phaseStart;
 
+  // Load the config compiled by the launcher
+  phaseStart = GetStartupTimestamp();
+  bool configPayload = LoadConfigPayload();
+  RecordStartupPhase(StartupPhaseLoadConfigPayload, phaseStart);
+
+  // Check if the launcher did not hand over a config
+  if (!configPayload)
+  {
     // Load the ini file
-    LoadIniFile(hModule);
+    phaseStart = GetStartupTimestamp();
+    LoadIniFile(module);
+    RecordStartupPhase(StartupPhaseLoadIniFile, phaseStart);
+
+    // Load the config published by another process for the same ini file
+    phaseStart = GetStartupTimestamp();
+    bool sharedConfig = LoadSharedConfig();
+    RecordStartupPhase(StartupPhaseLoadSharedConfig, phaseStart);
+
+    // Compile the settings and resolution information from the ini file if no other process published them
+    if (!sharedConfig)
+    {
+      phaseStart = GetStartupTimestamp();
+      LoadSpoofConfig();
+      RecordStartupPhase(StartupPhaseLoadSpoofConfig, phaseStart);
+    }
+  }
+
+  // Load the log file
+  phaseStart = GetStartupTimestamp();
+  LoadLogFile(module);
+  RecordStartupPhase(StartupPhaseLoadLogFile, phaseStart);
+
+  // Load the trace file
+  phaseStart = GetStartupTimestamp();
+  LoadTraceFile(module);
+  RecordStartupPhase(StartupPhaseLoadTraceFile, phaseStart);
+  RecordTraceInstant("DllMain attach", "dllmain");
+
+  // Load the statistics shared memory block
+  phaseStart = GetStartupTimestamp();
+  LoadStatistics();
+  RecordStartupPhase(StartupPhaseLoadStatistics, phaseStart);
+
+  // Register for module notifications if any sections are limited to caller modules
+  phaseStart = GetStartupTimestamp();
+  LoadCallerModules();
+  RecordStartupPhase(StartupPhaseLoadCallerModules, phaseStart);
+
+  // Write to the log file
+  if (std::wostringstream* logEntry = BeginLogEntry())
+  {
+    std::time_t time = std::time(NULL);
+    std::tm localtime;
+    localtime_s(&localtime, &time);
+    *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
+      L" - DllMain function called with the following parameters: ul_reason_for_call = DLL_PROCESS_ATTACH" <<
+      std::endl;
+    EndLogEntry(*logEntry);
+  }
 
-    // Load the log file
-    LoadLogFile(hModule);
+  // Check if we do not have a valid config
+  const SpoofConfig* config = gConfig.load(std::memory_order_acquire);
+  if (config == nullptr)
+    return false;
+
+  // Start the detour process
+  DetourTransactionBegin();
+
+  // Check if there is a GSM section in the config
+  if (config->gsmSection)
+  {
+    // Detour the GetSystemMetrics function unless DllMain already detoured it
+    if (!gDetouredFunctions.GetSystemMetrics)
+    {
+      phaseStart = GetStartupTimestamp();
+      DetourAttach(&(PVOID&)WindowsGetSystemMetrics, DetouredGetSystemMetrics);
+      gDetouredFunctions.GetSystemMetrics = true;
+      RecordStartupPhase(StartupPhaseDetourAttach, phaseStart);
+    }
 
     // Write to the log file
-    if (gLogFile != nullptr && !gLogFile->fail())
+    if (std::wostringstream* logEntry = BeginLogEntry())
     {
       std::time_t time = std::time(NULL);
       std::tm localtime;
       localtime_s(&localtime, &time);
-      *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
-        L" - DllMain function called with the following parameters: ul_reason_for_call = DLL_PROCESS_ATTACH" <<
+      *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") << L" - Detouring GetSystemMetrics function" <<
         std::endl;
+      EndLogEntry(*logEntry);
     }
+  }
+
+  // Otherwise check if DllMain already detoured the GetSystemMetrics function and remove the detour
+  else if (gDetouredFunctions.GetSystemMetrics)
+  {
+    DetourDetach(&(PVOID&)WindowsGetSystemMetrics, DetouredGetSystemMetrics);
+    gDetouredFunctions.GetSystemMetrics = false;
+  }
 
-    // Check if we have a valid ini file
-    if (gIniFile != nullptr)
+  // Check if there is a GDC section in the config
+  if (config->gdcSection)
+  {
+    // Detour the GetDeviceCaps function
+    phaseStart = GetStartupTimestamp();
+    DetourAttach(&(PVOID&)WindowsGetDeviceCaps, DetouredGetDeviceCaps);
+    gDetouredFunctions.GetDeviceCaps = true;
+    RecordStartupPhase(StartupPhaseDetourAttach, phaseStart);
+
+    // Write to the log file
+    if (std::wostringstream* logEntry = BeginLogEntry())
     {
-      // Start the detour process
-      DetourTransactionBegin();
-      DetourUpdateThread(GetCurrentThread());
+      std::time_t time = std::time(NULL);
+      std::tm localtime;
+      localtime_s(&localtime, &time);
+      *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") << L" - Detouring GetDeviceCaps function" <<
+        std::endl;
+      EndLogEntry(*logEntry);
+    }
+  }
 
-      // Check if there is a GSM section in the ini file
-      if (gIniFile->SectionExists(L"GSM"))
-      {
-        // Detour the GetSystemMetrics function
-        DetourAttach(&(PVOID&)WindowsGetSystemMetrics, DetouredGetSystemMetrics);
-        gDetouredFunctions.GetSystemMetrics = true;
+  // Check if there are any EDS| sections in the config
+  if (config->edsSection)
+  {
+    // Detour the EnumDisplaySettings functions
+    phaseStart = GetStartupTimestamp();
+    DetourAttach(&(PVOID&)WindowsEnumDisplaySettingsA, DetouredEnumDisplaySettingsA);
+    gDetouredFunctions.EnumDisplaySettingsA = true;
+    DetourAttach(&(PVOID&)WindowsEnumDisplaySettingsW, DetouredEnumDisplaySettingsW);
+    gDetouredFunctions.EnumDisplaySettingsW = true;
+    DetourAttach(&(PVOID&)WindowsEnumDisplaySettingsExA, DetouredEnumDisplaySettingsExA);
+    gDetouredFunctions.EnumDisplaySettingsExA = true;
+    DetourAttach(&(PVOID&)WindowsEnumDisplaySettingsExW, DetouredEnumDisplaySettingsExW);
+    gDetouredFunctions.EnumDisplaySettingsExW = true;
+    RecordStartupPhase(StartupPhaseDetourAttach, phaseStart);
 
-        // Write to the log file
-        if (gLogFile != nullptr && !gLogFile->fail())
-        {
-          std::time_t time = std::time(NULL);
-          std::tm localtime;
-          localtime_s(&localtime, &time);
-          *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") << L" - Detouring GetSystemMetrics function" <<
-            std::endl;
-        }
-      }
+    // Write to the log file
+    if (std::wostringstream* logEntry = BeginLogEntry())
+    {
+      std::time_t time = std::time(NULL);
+      std::tm localtime;
+      localtime_s(&localtime, &time);
+      *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
+        L" - Detouring EnumDisplaySettings functions" << std::endl;
+      EndLogEntry(*logEntry);
+    }
+  }
 
-      // Check if there is a GDC section in the ini file
-      if (gIniFile->SectionExists(L"GDC"))
-      {
-        // Detour the GetDeviceCaps function
-        DetourAttach(&(PVOID&)WindowsGetDeviceCaps, DetouredGetDeviceCaps);
-        gDetouredFunctions.GetDeviceCaps = true;
+  // Finish the detour process
+  // Note: the other threads are suspended after the functions are attached so that they are stopped for as short a
+  //   time as possible, but not under the loader lock where a thread that is suspended while holding a lock the commit
+  //   needs would hang the process, see DllMain
+  phaseStart = GetStartupTimestamp();
+  if (!inDllMain)
+    DetourUpdateAllThreads();
+  DetourTransactionCommit();
+  RecordStartupPhase(StartupPhaseTransactionCommit, phaseStart);
+  RecordTraceInstant("DetourTransactionCommit", "detours");
+
+  // Write how long the other threads were suspended for to the log file
+  if (std::wostringstream* logEntry = BeginLogEntry())
+  {
+    ULONG suspendedThreads = 0;
+    ULONGLONG suspendedMicroseconds = DetourGetLastSuspendDuration(&suspendedThreads);
+    std::time_t time = std::time(NULL);
+    std::tm localtime;
+    localtime_s(&localtime, &time);
+    *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") << L" - Suspended " << suspendedThreads <<
+      L" threads for " << suspendedMicroseconds << L" us while committing the detours" << std::endl;
+    EndLogEntry(*logEntry);
+  }
 
-        // Write to the log file
-        if (gLogFile != nullptr && !gLogFile->fail())
-        {
-          std::time_t time = std::time(NULL);
-          std::tm localtime;
-          localtime_s(&localtime, &time);
-          *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") << L" - Detouring GetDeviceCaps function" <<
-            std::endl;
-        }
-      }
+  return true;
+}
 
-      // Get all of the sections in the ini file
-      std::list<CSimpleIni::Entry> sections;
-      gIniFile->GetAllSections(sections);
+// InitializeThread function
+static DWORD WINAPI InitializeThread(LPVOID parameter)
+{
+  // Initialize and switch the detoured functions from passing calls straight through to spoofing
+  HMODULE module = (HMODULE)parameter;
+  CompleteInitialization(gInitializationState, Initialize(module, false));
 
-      // Check if there are any sections that start with EDS| using case insensitive comparisons
-      if (std::ranges::find_if(sections,
-        [&](CSimpleIni::Entry& entry)
-        {
-          std::wstring match = std::wstring(L"EDS|");
-          return std::ranges::mismatch(std::wstring(entry.pItem), match,
-            [](wchar_t a, wchar_t b)
-            {
-              return std::tolower(a) == std::tolower(b);
-            }).in2 == match.end();
-        }) != sections.end())
+  // Finish timing the startup phases and write the startup report
+  RecordStartupPhase(StartupPhaseTotal, gStartupStart);
+  WriteStartupReport();
+
+  // Release the reference to this DLL taken by DllMain and end this thread
+  FreeLibraryAndExitThread(module, 0);
+
+  return 0;
+}
+
+// StartupReportThread function
+static DWORD WINAPI StartupReportThread(LPVOID parameter)
+{
+  // Write the startup report, release the reference to this DLL taken by DllMain, and end this thread
+  WriteStartupReport();
+  FreeLibraryAndExitThread((HMODULE)parameter, 0);
+
+  return 0;
+}
+
+// IsSynchronousInitialization function
+static bool IsSynchronousInitialization(HMODULE module)
+{
+  // Check if the launcher copied a compiled config into this process and use its initialization setting
+  // Note: only the header is read here, the rest of the payload is loaded by Initialize
+  DWORD size = 0;
+  SpoofConfigPayloadHeader header;
+  PVOID payload = DetourFindPayloadEx(SpoofConfigPayloadGuid, &size);
+  if (payload != NULL && ReadSpoofConfigPayloadHeader(payload, size, header))
+    return (header.flags & SpoofConfigPayloadSynchronousInitialization) != 0;
+
+  // Get the full path to this DLL and replace the file name with spoofres.ini
+  // Note: if the path can not be determined we initialize synchronously so that LoadIniFile reports the error
+  wchar_t path[MAX_PATH];
+  DWORD length = GetModuleFileName(module, path, MAX_PATH);
+  if (length == 0 || length == MAX_PATH)
+    return true;
+  wchar_t* fileName = wcsrchr(path, std::filesystem::path::preferred_separator);
+  if (fileName == NULL || wcscpy_s(fileName + 1, MAX_PATH - (fileName + 1 - path), L"spoofres.ini") != 0)
+    return true;
+
+  // Check if the initialization key in the ini file is set to Synchronous using a case insensitive comparison
+  // Note: this runs under the loader lock so the Windows API profile function is used instead of parsing the whole ini
+  //   file with SimpleIni
+  wchar_t value[16];
+  GetPrivateProfileString(L"SpoofResolution", L"Initialization", L"", value, (DWORD)std::size(value), path);
+  return _wcsicmp(value, L"Synchronous") == 0;
+}
+
+// DllMain function
+BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserved)
+{
+  // Switch based on the reason for this function call
+  switch (ul_reason_for_call)
+  {
+  case DLL_PROCESS_ATTACH:
+  {
+    // Start timing the startup phases
+    gStartupStart = GetStartupTimestamp();
+    LONGLONG phaseStart = gStartupStart;
+
+    #if not defined(VERSOIN_DLL_VERSION) && not defined (WINHTTP_DLL_VERSION)
+    // Restore the in memory import table after we are loaded by withdll.exe
+    DetourRestoreAfterWith();
+    RecordStartupPhase(StartupPhaseRestoreAfterWith, phaseStart);
+    #endif
+
+    // Detour the system functions through their hot patch point when they have one
+    // Note: this is off by default in Detours since it patches the 5 bytes of padding before the function too, they are
+    //   put back on detach and the functions detoured here are all exported by system DLLs built to be hot patched
+    // Note: the transactions made by DllMain never suspend the other threads since DllMain holds the loader lock, a
+    //   hot patch is made with atomic stores that running threads cannot trip on, and DllMain runs before the
+    //   application or game has started any threads of its own when the DLL is loaded by withdll.exe or as a proxy
+    DetourSetHotPatch(TRUE);
+
+    // Check if the ini file asks for synchronous initialization
+    // Note: this is needed for applications or games that query the resolution before the initialization thread has
+    //   finished, ie: on their very first frame, at the cost of delaying the loading of other DLLs
+    if (!IsSynchronousInitialization(hModule))
+    {
+      // Detour the GetSystemMetrics function right away since it is usually the first function queried
+      // Note: the detoured functions pass calls straight through to the real functions until the initialization thread
+      //   has finished
+      phaseStart = GetStartupTimestamp();
+      DetourTransactionBegin();
+      DetourAttach(&(PVOID&)WindowsGetSystemMetrics, DetouredGetSystemMetrics);
+      gDetouredFunctions.GetSystemMetrics = true;
+      RecordStartupPhase(StartupPhaseDetourAttach, phaseStart);
+      phaseStart = GetStartupTimestamp();
+      DetourTransactionCommit();
+      RecordStartupPhase(StartupPhaseTransactionCommit, phaseStart);
+
+      // Take a reference to this DLL for the initialization thread and start it
+      // Note: the thread does not start running until DllMain returns and the loader lock is released, and it does the
+      //   ini file parsing, log file creation, and remaining detouring outside of the loader lock
+      HMODULE module;
+      if (GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)&InitializeThread, &module))
       {
-        // Detour the EnumDisplaySettings functions
-        DetourAttach(&(PVOID&)WindowsEnumDisplaySettingsA, DetouredEnumDisplaySettingsA);
-        gDetouredFunctions.EnumDisplaySettingsA = true;
-        DetourAttach(&(PVOID&)WindowsEnumDisplaySettingsW, DetouredEnumDisplaySettingsW);
-        gDetouredFunctions.EnumDisplaySettingsW = true;
-        DetourAttach(&(PVOID&)WindowsEnumDisplaySettingsExA, DetouredEnumDisplaySettingsExA);
-        gDetouredFunctions.EnumDisplaySettingsExA = true;
-        DetourAttach(&(PVOID&)WindowsEnumDisplaySettingsExW, DetouredEnumDisplaySettingsExW);
-        gDetouredFunctions.EnumDisplaySettingsExW = true;
-
-        // Write to the log file
-        if (gLogFile != nullptr && !gLogFile->fail())
+        HANDLE thread = CreateThread(NULL, 0, InitializeThread, module, 0, NULL);
+        if (thread != NULL)
         {
-          std::time_t time = std::time(NULL);
-          std::tm localtime;
-          localtime_s(&localtime, &time);
-          *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
-            L" - Detouring EnumDisplaySettings functions" << std::endl;
+          CloseHandle(thread);
+          break;
         }
+        FreeLibrary(module);
       }
+    }
 
-      // Finish the detour process
-      DetourTransactionCommit();
+    // Initialize synchronously
+    CompleteInitialization(gInitializationState, Initialize(hModule, true));
+
+    // Finish timing the startup phases and take a reference to this DLL for the startup report thread and start it
+    // Note: the thread does not start running until DllMain returns and the loader lock is released so the report is
+    //   composed and written to the log file and debugger output outside of the loader lock
+    RecordStartupPhase(StartupPhaseTotal, gStartupStart);
+    const SpoofConfig* config = gConfig.load(std::memory_order_acquire);
+    HMODULE module;
+    if (config != nullptr && config->startupReport &&
+      GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)&StartupReportThread, &module))
+    {
+      HANDLE thread = CreateThread(NULL, 0, StartupReportThread, module, 0, NULL);
+      if (thread != NULL)
+        CloseHandle(thread);
+      else
+        FreeLibrary(module);
     }
 
+    break;
+  }
+  case DLL_THREAD_DETACH:
+    // Hand this thread's chunk to the trace writer thread
+    gTraceBuffer.Release(gThreadTraceChunk);
     break;
   case DLL_PROCESS_DETACH:
     // Write to the log file
-    if (gLogFile != nullptr && !gLogFile->fail())
+    if (std::wostringstream* logEntry = BeginLogEntry())
     {
       std::time_t time = std::time(NULL);
       std::tm localtime;
       localtime_s(&localtime, &time);
-      *gLogFile << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
+      *logEntry << std::put_time(&localtime, L"%d/%m/%y@%H:%M:%S") <<
         L" - DllMain function called with the following parameters: ul_reason_for_call = DLL_PROCESS_DETACH" <<
         std::endl;
+      EndLogEntry(*logEntry);
+    }
+    RecordTraceInstant("DllMain detach", "dllmain");
+
+    // Check if the process is exiting before the initialization thread finished
+    // Note: the initialization thread may have been terminated in the middle of a detour transaction so we leave the
+    //   detoured functions attached, they only pass calls straight through to the real functions anyway
+    if (IsInitializationPending(gInitializationState))
+    {
+      WriteTraceFile();
+      break;
     }
 
     // Detach the detoured functions
+    // Note: the other threads are not suspended under the loader lock, see DLL_PROCESS_ATTACH, when the process is
+    //   terminating they have already been terminated and otherwise the hot patches are undone with atomic stores
     DetourTransactionBegin();
-    DetourUpdateThread(GetCurrentThread());
     if (gDetouredFunctions.GetSystemMetrics)
       DetourDetach(&(PVOID&)WindowsGetSystemMetrics, DetouredGetSystemMetrics);
     if (gDetouredFunctions.GetDeviceCaps)
@@ -890,21 +1805,64 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
     if (gDetouredFunctions.EnumDisplaySettingsExW)
       DetourDetach(&(PVOID&)WindowsEnumDisplaySettingsExW, DetouredEnumDisplaySettingsExW);
     DetourTransactionCommit();
+    RecordTraceInstant("DetourTransactionCommit", "detours");
+
+    // Write and close the trace file
+    WriteTraceFile();
+
+    // Close the statistics shared memory block
+    gStatsEnabled = false;
+    gStats = nullptr;
+    gStatsSection.Close();
 
-    // Close the log file
-    if (gLogFile != nullptr)
+    // Stop the module notifications
+    if (gDllNotificationCookie != NULL)
     {
-      gLogFile->close();
-      gLogFile.reset();
+      LdrUnregisterDllNotificationFunction unregisterDllNotification =
+        (LdrUnregisterDllNotificationFunction)GetProcAddress(GetModuleHandle(L"ntdll.dll"),
+        "LdrUnregisterDllNotification");
+      if (unregisterDllNotification != NULL)
+        unregisterDllNotification(gDllNotificationCookie);
+      gDllNotificationCookie = NULL;
     }
 
-    // Close the ini file
-    if (gIniFile != nullptr)
+    // Release the caller module indexes
+    // Note: another thread may still be inside a detoured function in the middle of a lookup, so the indexes are only
+    //   freed once no lookup is searching any of them, lookups never wait on the loader lock while they count as
+    //   readers so this cannot deadlock
+    // Note: when the process is terminating the other threads were already terminated, possibly in the middle of a
+    //   lookup that never stops counting as a reader, so the indexes are left for the process exit to release
+    const CallerModuleIndex* callerModuleIndex = gCallerModuleIndex.exchange(&gReleasedCallerModuleIndex);
+    if (lpReserved == NULL)
     {
-      gIniFile->Reset();
-      gIniFile.reset();
+      while (gCallerModuleIndexReaders.load() != 0)
+        Sleep(0);
+      delete callerModuleIndex;
+      std::lock_guard<std::mutex> lock(gRetiredCallerModuleIndexesLock);
+      for (const CallerModuleIndex* index : gRetiredCallerModuleIndexes)
+        delete index;
+      gRetiredCallerModuleIndexes.clear();
     }
 
+    // Release the config
+    delete gConfig.exchange(nullptr);
+
+    // Write any remaining log entries and close the log file
+    // Note: the log writer thread has already been terminated by now and if that happened in the middle of a write the
+    //   log file lock is never released so we leave the log file as is
+    gLogEnabled = false;
+    if (gLogFile != nullptr && gLogFileLock.try_lock())
+    {
+      WriteLogEntries();
+      gLogFile->close();
+      gLogFile.reset();
+      gLogFileLock.unlock();
+    }
+
+    // Release the ini file contents and close the shared memory section holding the config
+    gIniContents.reset();
+    gSharedConfig.Close();
+
     break;
   }
 
@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+#include <windows.h>
+#include <CallerModuleIndex.h>
+
+#include "TestCommon.h"
+
+// Benchmark of how fast the detoured functions find the module a return address is in
+// Note: the ranges are laid out like the modules of a game process, 64 KB aligned with gaps between them, and are
+//   searched with FindCallerModuleRange, the branchy binary search of std::upper_bound, and a linear scan, then with
+//   the per-thread last-hit check in front of FindCallerModuleRange that the detoured functions use
+// Note: the return addresses either land in a random module for every lookup, which is the worst case for both the
+//   branch predictor and the last-hit check, or come in runs from the same module like a game calling the same
+//   function over and over, and one in eight lands in a gap between the modules
+
+static const ULONG_PTR kRegionSize = 0x10000;
+static const size_t kAddressCount = 0x10000;
+static const size_t kRunLength = 16;
+
+// Random function
+static uint64_t Random(uint64_t& state)
+{
+  // Same constants as Knuth's MMIX linear congruential generator, the high bits are the random ones
+  state = state * 6364136223846793005ull + 1442695040888963407ull;
+  return state >> 33;
+}
+
+// GenerateRanges function
+static std::vector<CallerModuleRange> GenerateRanges(size_t moduleCount, uint64_t& state)
+{
+  // Give every module between 64 KB and 4 MB and leave up to 1 MB between them, and mark one module in four as a
+  //   caller module of the config
+  std::vector<CallerModuleRange> ranges;
+  ULONG_PTR base = 0x140000000;
+  for (size_t i = 0; i < moduleCount; i++)
+  {
+    base += (Random(state) % 16) * kRegionSize;
+    ULONG_PTR size = (1 + Random(state) % 64) * kRegionSize;
+    ranges.push_back({ base, base + size, i % 4 == 0 ? 1ull << (i / 4 % 64) : 0 });
+    base += size;
+  }
+  return ranges;
+}
+
+// GenerateAddresses function
+static std::vector<ULONG_PTR> GenerateAddresses(const std::vector<CallerModuleRange>& ranges, bool runs,
+  uint64_t& state)
+{
+  std::vector<ULONG_PTR> addresses;
+  while (addresses.size() < kAddressCount)
+  {
+    const CallerModuleRange& range = ranges[Random(state) % ranges.size()];
+    size_t count = runs ? kRunLength : 1;
+    for (size_t i = 0; i < count; i++)
+    {
+      if (Random(state) % 8 == 0)
+        addresses.push_back(range.end + Random(state) % kRegionSize);
+      else
+        addresses.push_back(range.base + Random(state) % (range.end - range.base));
+    }
+  }
+  addresses.resize(kAddressCount);
+  return addresses;
+}
+
+// FindUpperBound function
+static uint64_t __attribute__((noinline)) FindUpperBound(const std::vector<CallerModuleRange>& ranges,
+  ULONG_PTR address)
+{
+  auto range = std::upper_bound(ranges.begin(), ranges.end(), address,
+    [](ULONG_PTR value, const CallerModuleRange& range) { return value < range.base; });
+  if (range == ranges.begin() || !IsInCallerModuleRange(*--range, address))
+    return 0;
+  return range->callers;
+}
+
+// FindLinear function
+static uint64_t __attribute__((noinline)) FindLinear(const std::vector<CallerModuleRange>& ranges, ULONG_PTR address)
+{
+  for (const CallerModuleRange& range : ranges)
+  {
+    if (IsInCallerModuleRange(range, address))
+      return range.callers;
+  }
+  return 0;
+}
+
+// FindBranchLight function
+static uint64_t __attribute__((noinline)) FindBranchLight(const std::vector<CallerModuleRange>& ranges,
+  ULONG_PTR address)
+{
+  const CallerModuleRange* range = FindCallerModuleRange(ranges.data(), ranges.size(), address);
+  return range != nullptr ? range->callers : 0;
+}
+
+// FindCached function
+static uint64_t __attribute__((noinline)) FindCached(const std::vector<CallerModuleRange>& ranges, ULONG_PTR address)
+{
+  // Same as GetCallerModules without the generation checks and the reader count
+  static CallerModuleRange lastRange = {};
+  if (IsInCallerModuleRange(lastRange, address))
+    return lastRange.callers;
+  const CallerModuleRange* range = FindCallerModuleRange(ranges.data(), ranges.size(), address);
+  if (range == nullptr)
+    return 0;
+  lastRange = *range;
+  return range->callers;
+}
+
+// TimeLookups function
+static double TimeLookups(const std::vector<CallerModuleRange>& ranges, const std::vector<ULONG_PTR>& addresses,
+  uint64_t lookups, uint64_t (*find)(const std::vector<CallerModuleRange>&, ULONG_PTR), uint64_t& checksum)
+{
+  // Return the nanoseconds per lookup and add up what was found so that every strategy can be checked against the
+  //   others
+  checksum = 0;
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < lookups; i++)
+    checksum += find(ranges, addresses[i % kAddressCount]) ^ i;
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  return seconds * 1e9 / lookups;
+}
+
+// TestLookup function
+static void TestLookup()
+{
+  // Check the edges of the ranges, the gaps between them, and an empty index
+  std::vector<CallerModuleRange> ranges = { { 0x1000, 0x2000, 1 }, { 0x2000, 0x3000, 2 }, { 0x5000, 0x6000, 4 } };
+  for (size_t count = 0; count <= ranges.size(); count++)
+  {
+    for (ULONG_PTR address : { 0x0, 0xfff, 0x1000, 0x1fff, 0x2000, 0x2fff, 0x3000, 0x4fff, 0x5000, 0x5fff, 0x6000 })
+    {
+      const CallerModuleRange* expected = nullptr;
+      for (size_t i = 0; i < count; i++)
+      {
+        if (address >= ranges[i].base && address < ranges[i].end)
+          expected = &ranges[i];
+      }
+      CHECK(FindCallerModuleRange(ranges.data(), count, address) == expected);
+    }
+  }
+  CHECK(FindCallerModuleRange(nullptr, 0, 0x1000) == nullptr);
+}
+
+// main function
+int main(int argc, char* argv[])
+{
+  // Parse the number of lookups to time for each strategy
+  uint64_t lookups = argc > 1 ? strtoull(argv[1], nullptr, 10) : 20000000;
+  if (lookups == 0)
+    lookups = 1;
+
+  TestLookup();
+
+  // Time every strategy for each number of modules and pattern of return addresses
+  printf("CallerModuleIndexBenchmark: %llu lookups, ns per lookup\n", (unsigned long long)lookups);
+  printf("%8s %8s %14s %14s %14s %14s\n", "modules", "pattern", "branch light", "upper_bound", "linear",
+    "last hit");
+  uint64_t state = 1;
+  for (size_t moduleCount : { 16, 64, 256, 1024 })
+  {
+    std::vector<CallerModuleRange> ranges = GenerateRanges(moduleCount, state);
+    for (bool runs : { false, true })
+    {
+      std::vector<ULONG_PTR> addresses = GenerateAddresses(ranges, runs, state);
+      uint64_t branchLightChecksum;
+      uint64_t upperBoundChecksum;
+      uint64_t linearChecksum;
+      uint64_t cachedChecksum;
+      double branchLight = TimeLookups(ranges, addresses, lookups, FindBranchLight, branchLightChecksum);
+      double upperBound = TimeLookups(ranges, addresses, lookups, FindUpperBound, upperBoundChecksum);
+      double linear = TimeLookups(ranges, addresses, lookups, FindLinear, linearChecksum);
+      double cached = TimeLookups(ranges, addresses, lookups, FindCached, cachedChecksum);
+      printf("%8zu %8s %14.2f %14.2f %14.2f %14.2f\n", moduleCount, runs ? "runs" : "random", branchLight, upperBound,
+        linear, cached);
+
+      // Check that every strategy found the same modules
+      CHECK_EQUAL(linearChecksum, branchLightChecksum);
+      CHECK_EQUAL(linearChecksum, upperBoundChecksum);
+      CHECK_EQUAL(linearChecksum, cachedChecksum);
+    }
+  }
+
+  return TestResult("CallerModuleIndexBenchmark");
+}
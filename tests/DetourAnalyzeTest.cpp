@@ -0,0 +1,322 @@
+#include <cstring>
+#include <sys/mman.h>
+#include <vector>
+
+#include <windows.h>
+#include <detours.h>
+
+#include "TestCommon.h"
+
+// Tests for DetourAnalyzeFunction, how DetourAttachEx uses the analysis, and DetourAnalyzeFunctions, on synthetic x64
+//   prologues
+// Note: every prologue is written into its own executable page, the bytes after it are left as zeros, which are not
+//   filler, so a target only gets the padding a test gives it
+
+static const size_t kPageSize = 0x1000;
+
+typedef int (*SyntheticFunction)();
+
+static int gDetourCalls = 0;
+
+// DetourFunction function
+static int DetourFunction()
+{
+  gDetourCalls++;
+  return -1;
+}
+
+// MapCode function
+static BYTE* MapCode(const BYTE* code, size_t size)
+{
+  BYTE* page = (BYTE*)mmap(NULL, kPageSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED)
+    return NULL;
+  memcpy(page, code, size);
+  return page;
+}
+
+// Attach function
+static LONG Attach(PVOID* pointer, PVOID* realTarget = NULL)
+{
+  DetourTransactionBegin();
+  LONG error = DetourAttachEx(pointer, (PVOID)DetourFunction, NULL, realTarget, NULL);
+  LONG commitError = DetourTransactionCommit();
+  return error != NO_ERROR ? error : commitError;
+}
+
+// Detach function
+static LONG Detach(PVOID* pointer)
+{
+  DetourTransactionBegin();
+  LONG error = DetourDetach(pointer, (PVOID)DetourFunction);
+  LONG commitError = DetourTransactionCommit();
+  return error != NO_ERROR ? error : commitError;
+}
+
+// TestPrologue function
+static void TestPrologue()
+{
+  // push rbp; mov rbp, rsp; sub rsp, 0x20; mov eax, 42; add rsp, 0x20; pop rbp; ret
+  static const BYTE kCode[] = { 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83, 0xec, 0x20, 0xb8, 0x2a, 0x00, 0x00, 0x00, 0x48,
+    0x83, 0xc4, 0x20, 0x5d, 0xc3 };
+  BYTE* code = MapCode(kCode, sizeof(kCode));
+  CHECK(code != NULL);
+  if (code == NULL)
+    return;
+
+  // Check that the first three instructions are moved, as they are the first to cover the jump
+  DETOUR_INSTRUCTION instructions[8];
+  DETOUR_FUNCTION_ANALYSIS analysis;
+  CHECK(DetourAnalyzeFunction(code, 0, instructions, 8, &analysis));
+  CHECK(analysis.pCode == code);
+  CHECK_EQUAL(3, analysis.cInstructions);
+  CHECK_EQUAL(8, analysis.cbTarget);
+  CHECK_EQUAL(8, analysis.cbTrampoline);
+  CHECK(analysis.fCanDetour);
+  static const ULONG kOffsets[] = { 0, 1, 4 };
+  static const ULONG kSizes[] = { 1, 3, 4 };
+  for (ULONG i = 0; i < 3; i++)
+  {
+    CHECK_EQUAL(kOffsets[i], instructions[i].obInstruction);
+    CHECK_EQUAL(kSizes[i], instructions[i].cbInstruction);
+    CHECK_EQUAL(0, instructions[i].lExtra);
+    CHECK_EQUAL(0, instructions[i].nFlags);
+    CHECK(instructions[i].pTarget == DETOUR_INSTRUCTION_TARGET_NONE);
+  }
+
+  // Check that a 14 byte jump needs two more instructions, which leaves no room for the jump back in a trampoline,
+  //   and that fewer slots only limit what is described
+  CHECK(DetourAnalyzeFunction(code, 14, instructions, 2, &analysis));
+  CHECK_EQUAL(5, analysis.cInstructions);
+  CHECK_EQUAL(17, analysis.cbTarget);
+  CHECK(!analysis.fCanDetour);
+  CHECK(!DetourAnalyzeFunction(code, 0, NULL, 1, &analysis));
+  CHECK(DetourAnalyzeFunction(code, 0, NULL, 0, &analysis));
+
+  // Check that the attached function routes to the detour and that the trampoline runs the moved instructions
+  PVOID pointer = code;
+  CHECK_EQUAL(NO_ERROR, Attach(&pointer));
+  gDetourCalls = 0;
+  CHECK_EQUAL(-1, ((SyntheticFunction)code)());
+  CHECK_EQUAL(1, gDetourCalls);
+  CHECK_EQUAL(42, ((SyntheticFunction)pointer)());
+  CHECK_EQUAL(NO_ERROR, Detach(&pointer));
+  CHECK(memcmp(code, kCode, sizeof(kCode)) == 0);
+  CHECK_EQUAL(42, ((SyntheticFunction)code)());
+  munmap(code, kPageSize);
+}
+
+// TestRelative function
+static void TestRelative()
+{
+  // jz +0x10; jrcxz +0x10; mov rbp, rsp, with the targets of both jumps inside the page
+  static const BYTE kCode[] = { 0x74, 0x10, 0xe3, 0x10, 0x48, 0x89, 0xe5 };
+  BYTE* code = MapCode(kCode, sizeof(kCode));
+  CHECK(code != NULL);
+  if (code == NULL)
+    return;
+
+  // Check the flags and targets, a short jcc grows by 4 bytes in a trampoline and a jrcxz cannot grow at all
+  DETOUR_INSTRUCTION instructions[8];
+  DETOUR_FUNCTION_ANALYSIS analysis;
+  CHECK(DetourAnalyzeFunction(code, 0, instructions, 8, &analysis));
+  CHECK_EQUAL(3, analysis.cInstructions);
+  CHECK_EQUAL(7, analysis.cbTarget);
+  CHECK(instructions[0].pTarget == code + 0x12);
+  CHECK_EQUAL(4, instructions[0].lExtra);
+  CHECK_EQUAL(DETOUR_INSTRUCTION_FLAG_TARGET | DETOUR_INSTRUCTION_FLAG_ENLARGE, instructions[0].nFlags);
+  CHECK(instructions[1].pTarget == code + 0x14);
+  CHECK_EQUAL(-3, instructions[1].lExtra);
+  CHECK_EQUAL(DETOUR_INSTRUCTION_FLAG_TARGET | DETOUR_INSTRUCTION_FLAG_NOENLARGE, instructions[1].nFlags);
+
+  // Check that the trampoline size counts the enlargement but never shrinks for an instruction that cannot grow
+  CHECK_EQUAL(2 + 4 + 2 + 3, analysis.cbTrampoline);
+  CHECK(analysis.fCanDetour);
+
+  // Check that the analysis measures against a destination out of rel8 reach, the short jcc grows the same when it is
+  //   copied within reach of its target, but the jrcxz fits as it is, so the analysis is an upper bound
+  PVOID target = NULL;
+  LONG extra = 0;
+  CHECK(DetourCopyInstruction(code + 0x40, NULL, code, &target, &extra) == code + 2);
+  CHECK(target == code + 0x12);
+  CHECK_EQUAL(4, extra);
+  CHECK(DetourCopyInstruction(code + 0x40, NULL, code + 2, &target, &extra) == code + 4);
+  CHECK(target == code + 0x14);
+  CHECK_EQUAL(0, extra);
+  munmap(code, kPageSize);
+}
+
+// TestSkippedJumps function
+static void TestSkippedJumps()
+{
+  // The function pointer is a short jump to a long jump, which DetourCodeFromPointer both skips, to code that starts
+  //   with another short jump
+  // Note: the code behind that short jump is a bare ret, too small to detour, so analyzing it instead of the code the
+  //   pointer resolves to makes the attach fail
+  static const BYTE kEntry[] = { 0xeb, 0x0e };
+  static const BYTE kLongJump[] = { 0xe9, 0x2b, 0x00, 0x00, 0x00 };
+  static const BYTE kTarget[] = { 0xeb, 0x3e, 0x90, 0x90, 0x90 };
+  BYTE* code = MapCode(kEntry, sizeof(kEntry));
+  CHECK(code != NULL);
+  if (code == NULL)
+    return;
+  memcpy(code + 0x10, kLongJump, sizeof(kLongJump));
+  memcpy(code + 0x40, kTarget, sizeof(kTarget));
+  code[0x80] = 0xc3;
+  CHECK(DetourCodeFromPointer(code, NULL) == code + 0x40);
+
+  // Check that the analysis starts at the code the pointer resolves to and uses the padding after the short jump
+  DETOUR_INSTRUCTION instructions[8];
+  DETOUR_FUNCTION_ANALYSIS analysis;
+  CHECK(DetourAnalyzeFunction(code, 0, instructions, 8, &analysis));
+  CHECK(analysis.pCode == code + 0x40);
+  CHECK_EQUAL(1, analysis.cInstructions);
+  CHECK_EQUAL(5, analysis.cbTarget);
+  CHECK(analysis.fCanDetour);
+  CHECK(instructions[0].pTarget == code + 0x80);
+  CHECK_EQUAL(DETOUR_INSTRUCTION_FLAG_TARGET | DETOUR_INSTRUCTION_FLAG_ENLARGE |
+    DETOUR_INSTRUCTION_FLAG_ENDS_FUNCTION, instructions[0].nFlags);
+
+  // Check that the attach patches that code and that both the pointer and the trampoline still run
+  PVOID pointer = code;
+  PVOID realTarget = NULL;
+  CHECK_EQUAL(NO_ERROR, Attach(&pointer, &realTarget));
+  CHECK(realTarget == code + 0x40);
+  CHECK_EQUAL(0xe9, code[0x40]);
+  gDetourCalls = 0;
+  ((SyntheticFunction)code)();
+  CHECK_EQUAL(1, gDetourCalls);
+  ((SyntheticFunction)pointer)();
+  CHECK_EQUAL(1, gDetourCalls);
+  CHECK_EQUAL(NO_ERROR, Detach(&pointer));
+  CHECK(memcmp(code + 0x40, kTarget, sizeof(kTarget)) == 0);
+  munmap(code, kPageSize);
+}
+
+// TestTooSmall function
+static void TestTooSmall()
+{
+  // ret, followed by zeros that are not filler
+  static const BYTE kCode[] = { 0xc3 };
+  BYTE* code = MapCode(kCode, sizeof(kCode));
+  CHECK(code != NULL);
+  if (code == NULL)
+    return;
+
+  DETOUR_FUNCTION_ANALYSIS analysis;
+  CHECK(DetourAnalyzeFunction(code, 0, NULL, 0, &analysis));
+  CHECK_EQUAL(1, analysis.cInstructions);
+  CHECK_EQUAL(1, analysis.cbTarget);
+  CHECK(!analysis.fCanDetour);
+
+  // Check that the attach fails the transaction, unless small targets are ignored
+  PVOID pointer = code;
+  CHECK_EQUAL(ERROR_INVALID_BLOCK, Attach(&pointer));
+  CHECK(pointer == code);
+  DetourSetIgnoreTooSmall(TRUE);
+  DetourTransactionBegin();
+  CHECK_EQUAL(ERROR_INVALID_BLOCK, DetourAttach(&pointer, (PVOID)DetourFunction));
+  CHECK_EQUAL(NO_ERROR, DetourTransactionCommit());
+  DetourSetIgnoreTooSmall(FALSE);
+  CHECK(pointer == code);
+  CHECK(memcmp(code, kCode, sizeof(kCode)) == 0);
+  munmap(code, kPageSize);
+}
+
+// GenerateFunctions function
+static BYTE* GenerateFunctions(ULONG count)
+{
+  // Four kinds of 16 byte functions in turn: a frame setup, "mov eax, imm32; ret", a short jcc ahead of
+  //   "mov rbp, rsp", and a bare ret that is too small to detour
+  static const BYTE kFrame[] = { 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83, 0xec, 0x20, 0x5d, 0xc3 };
+  static const BYTE kMove[] = { 0xb8, 0x2a, 0x00, 0x00, 0x00, 0xc3 };
+  static const BYTE kJump[] = { 0x74, 0x08, 0x48, 0x89, 0xe5, 0xc3 };
+  static const BYTE kReturn[] = { 0xc3 };
+  static const BYTE* const kKinds[] = { kFrame, kMove, kJump, kReturn };
+  static const size_t kSizes[] = { sizeof(kFrame), sizeof(kMove), sizeof(kJump), sizeof(kReturn) };
+  BYTE* code = (BYTE*)mmap(NULL, count * 16, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED)
+    return NULL;
+  for (ULONG i = 0; i < count; i++)
+    memcpy(code + i * 16, kKinds[i % 4], kSizes[i % 4]);
+  return code;
+}
+
+// CheckBatch function
+static void CheckBatch(PVOID* functions, ULONG count, ULONG jump, const DETOUR_FUNCTION_ANALYSIS* analyses)
+{
+  // Check every analysis of a batch against the same function analyzed on its own
+  ULONG wrong = 0;
+  for (ULONG i = 0; i < count; i++)
+  {
+    DETOUR_FUNCTION_ANALYSIS analysis;
+    ZeroMemory(&analysis, sizeof(analysis));
+    if (functions[i] != NULL)
+      CHECK(DetourAnalyzeFunction(functions[i], jump, NULL, 0, &analysis));
+    if (memcmp(&analysis, &analyses[i], sizeof(analysis)) != 0)
+      wrong++;
+  }
+  CHECK_EQUAL(0, wrong);
+}
+
+// TestBatch function
+static void TestBatch()
+{
+  const ULONG kCount = 4096;
+  BYTE* code = GenerateFunctions(kCount);
+  CHECK(code != NULL);
+  if (code == NULL)
+    return;
+  std::vector<PVOID> functions(kCount);
+  for (ULONG i = 0; i < kCount; i++)
+    functions[i] = code + i * 16;
+  std::vector<DETOUR_FUNCTION_ANALYSIS> analyses(kCount);
+
+  // Check that a large batch is spread over the thread pool, the calling thread being one of the eight workers, and
+  //   that it plans every function the same as one at a time for both jump sizes
+  // Note: every function but the bare ret fits the default jump, none of them fits a 14 byte jump
+  for (ULONG jump : { 0u, 14u })
+  {
+    ResetShimCounters();
+    CHECK(DetourAnalyzeFunctions(functions.data(), kCount, jump, analyses.data()));
+    CHECK_EQUAL(7, gShimCounters.queueUserWorkItem.load());
+    CheckBatch(functions.data(), kCount, jump, analyses.data());
+    ULONG detourable = 0;
+    for (const DETOUR_FUNCTION_ANALYSIS& analysis : analyses)
+      detourable += analysis.fCanDetour ? 1 : 0;
+    CHECK_EQUAL(jump == 0 ? kCount / 4 * 3 : 0, detourable);
+  }
+
+  // Check that a batch too small to pay for the hand off stays on the calling thread
+  ResetShimCounters();
+  CHECK(DetourAnalyzeFunctions(functions.data(), 100, 0, analyses.data()));
+  CHECK_EQUAL(0, gShimCounters.queueUserWorkItem.load());
+  CheckBatch(functions.data(), 100, 0, analyses.data());
+
+  // Check that a function that cannot be analyzed fails the batch, leaves its analysis zeroed, and still lets every
+  //   other function be analyzed
+  functions[1000] = NULL;
+  memset(analyses.data(), 0xff, kCount * sizeof(DETOUR_FUNCTION_ANALYSIS));
+  SetLastError(NO_ERROR);
+  CHECK(!DetourAnalyzeFunctions(functions.data(), kCount, 0, analyses.data()));
+  CHECK_EQUAL(ERROR_INVALID_DATA, GetLastError());
+  CheckBatch(functions.data(), kCount, 0, analyses.data());
+
+  // Check the parameters
+  CHECK(!DetourAnalyzeFunctions(NULL, 1, 0, analyses.data()));
+  CHECK_EQUAL(ERROR_INVALID_PARAMETER, GetLastError());
+  CHECK(!DetourAnalyzeFunctions(functions.data(), 1, 0, NULL));
+  CHECK(DetourAnalyzeFunctions(NULL, 0, 0, NULL));
+  munmap(code, kCount * 16);
+}
+
+// main function
+int main()
+{
+  TestPrologue();
+  TestRelative();
+  TestSkippedJumps();
+  TestTooSmall();
+  TestBatch();
+  return TestResult("DetourAnalyzeTest");
+}
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+#include <detours.h>
+
+#include "PeImage.h"
+#include "TestCommon.h"
+
+// Tests for how DetourFindFunctions resolves a batch of names against the export table of data/exports.dll
+// Note: the image is mapped by the test and registered with the shim's LoadLibrary, and the shim's GetProcAddress logs
+//   the names it is asked for, so the names resolved by the merge with the export name table can be told apart from
+//   the ones that fall back to GetProcAddress
+// Note: exports.dll exports Alpha, AlphaAlias, Beta, Gamma, and Value by name, and Sleep as a forwarder to
+//   KERNEL32.Sleep, which GetProcAddress resolves here to ForwardedSleep
+
+// ForwardedSleep function
+static INT_PTR WINAPI ForwardedSleep()
+{
+  return 0;
+}
+
+// Sorted function
+static std::vector<std::string> Sorted(std::vector<std::string> names)
+{
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+// TestMerge function
+static void TestMerge(HMODULE module)
+{
+  // Check that duplicate names all resolve, that names before the first and after the last export and between two
+  //   exports are missing, and that only the forwarder and the missing names are asked of GetProcAddress
+  LPCSTR names[] = {
+    "Gamma", "Alpha", "Sleep", "Missing", "Alpha", "AlphaAlias", "Beta", "Aardvark", "Zulu", "Value", "Gamma", "Alph",
+    "AlphaAliasX"
+  };
+  PVOID functions[std::size(names)];
+  memset(functions, 0xcc, sizeof(functions));
+  ResetShimCounters();
+  CHECK_EQUAL(8, DetourFindFunctions("exports.dll", names, std::size(names), functions));
+  CHECK_EQUAL(ERROR_PROC_NOT_FOUND, GetLastError());
+
+  PVOID alpha = DetourFindExportByName(module, "Alpha");
+  CHECK(alpha != NULL);
+  CHECK(functions[1] == alpha && functions[4] == alpha && functions[5] == alpha);
+  CHECK(functions[0] != NULL && functions[0] == DetourFindExportByName(module, "Gamma"));
+  CHECK(functions[10] == functions[0]);
+  CHECK(functions[6] != NULL && functions[6] == DetourFindExportByName(module, "Beta"));
+  CHECK(functions[9] != NULL && *(DWORD*)functions[9] == 0x12345678);
+  CHECK(functions[2] == (PVOID)ForwardedSleep);
+  for (size_t missing : { 3, 7, 8, 11, 12 })
+    CHECK(functions[missing] == NULL);
+  CHECK(Sorted(GetShimProcAddressCalls()) ==
+    std::vector<std::string>({ "Aardvark", "Alph", "AlphaAliasX", "Missing", "Sleep", "Zulu" }));
+
+  // Check that a second lookup is served from the cache except for the names that were not found
+  memset(functions, 0xcc, sizeof(functions));
+  ResetShimCounters();
+  CHECK_EQUAL(8, DetourFindFunctions("exports.dll", names, std::size(names), functions));
+  CHECK(functions[1] == alpha && functions[2] == (PVOID)ForwardedSleep && functions[3] == NULL);
+  CHECK(Sorted(GetShimProcAddressCalls()) ==
+    std::vector<std::string>({ "Aardvark", "Alph", "AlphaAliasX", "Missing", "Zulu" }));
+}
+
+// TestEdges function
+static void TestEdges()
+{
+  // Check that every name found gives NO_ERROR, including an empty batch
+  LPCSTR names[] = { "Value", "Beta" };
+  PVOID functions[std::size(names)] = {};
+  CHECK_EQUAL(2, DetourFindFunctions("EXPORTS.DLL", names, std::size(names), functions));
+  CHECK_EQUAL(NO_ERROR, GetLastError());
+  CHECK(functions[0] != NULL && functions[1] != NULL);
+  CHECK_EQUAL(0, DetourFindFunctions("exports.dll", names, 0, functions));
+  CHECK_EQUAL(NO_ERROR, GetLastError());
+
+  // Check that a module that cannot be loaded resolves nothing and that a missing name is refused
+  functions[0] = functions[1] = (PVOID)ForwardedSleep;
+  CHECK_EQUAL(0, DetourFindFunctions("missing.dll", names, std::size(names), functions));
+  CHECK(functions[0] == NULL && functions[1] == NULL);
+  LPCSTR nullName[] = { "Alpha", NULL };
+  CHECK_EQUAL(0, DetourFindFunctions("exports.dll", nullName, std::size(nullName), functions));
+  CHECK_EQUAL(ERROR_INVALID_PARAMETER, GetLastError());
+}
+
+// main function
+int main()
+{
+  PeImage image;
+  CHECK(ReadPeImage("exports.dll", image));
+  if (image.loaded.empty())
+    return TestResult("DetourFindFunctionsTest");
+  HMODULE module = (HMODULE)image.loaded.data();
+  SetShimModules({ { "exports.dll", module, { { "Sleep", (FARPROC)ForwardedSleep } } } });
+  TestMerge(module);
+  TestEdges();
+  SetShimModules({});
+  return TestResult("DetourFindFunctionsTest");
+}
@@ -0,0 +1,155 @@
+#include <cstring>
+#include <sys/mman.h>
+#include <vector>
+
+#include <windows.h>
+#define DETOURS_INTERNAL
+#include <detours.h>
+
+#include "TestCommon.h"
+
+// Tests for the hot patch helpers Detours uses on x86 functions compiled with /hotpatch, on byte buffers
+// Note: the helpers only move bytes so they are tested in the x64 build, every function is laid out in its own page
+//   filled with ret so that bytes written outside of the padding and the entry show up, and is preceded by another
+//   page so that padding can be laid out across the boundary
+
+static const size_t kPageSize = 0x1000;
+static const BYTE kFill = 0xc3;
+static const size_t kDetourOffset = 0x800;
+
+// MapPage function
+static BYTE* MapPage()
+{
+  BYTE* pages = (BYTE*)mmap(NULL, 2 * kPageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pages == MAP_FAILED)
+    return NULL;
+  memset(pages, kFill, 2 * kPageSize);
+  return pages + kPageSize;
+}
+
+// LayOut function
+// Note: writes the padding before the entry at the given offset and mov edi,edi in the given encoding
+static BYTE* LayOut(BYTE* page, size_t offset, const BYTE (&padding)[DETOUR_HOT_PATCH_PADDING], BYTE mov = 0x8b)
+{
+  memset(page, kFill, kPageSize);
+  BYTE* code = page + offset;
+  memcpy(code - DETOUR_HOT_PATCH_PADDING, padding, DETOUR_HOT_PATCH_PADDING);
+  code[0] = mov;
+  code[1] = 0xff;
+  return code;
+}
+
+static const BYTE kNops[DETOUR_HOT_PATCH_PADDING] = { 0x90, 0x90, 0x90, 0x90, 0x90 };
+static const BYTE kInt3s[DETOUR_HOT_PATCH_PADDING] = { 0xcc, 0xcc, 0xcc, 0xcc, 0xcc };
+static const BYTE kMixed[DETOUR_HOT_PATCH_PADDING] = { 0xcc, 0x90, 0x90, 0xcc, 0x90 };
+
+// TestDetection function
+static void TestDetection(BYTE* page)
+{
+  // Check both encodings of mov edi,edi and every kind of padding
+  CHECK(detour_is_hot_patchable(LayOut(page, 0x100, kNops)));
+  CHECK(detour_is_hot_patchable(LayOut(page, 0x100, kNops, 0x89)));
+  CHECK(detour_is_hot_patchable(LayOut(page, 0x100, kInt3s)));
+  CHECK(detour_is_hot_patchable(LayOut(page, 0x100, kMixed)));
+
+  // Check that any other entry is refused
+  BYTE* code = LayOut(page, 0x100, kNops);
+  code[1] = 0xec;
+  CHECK(!detour_is_hot_patchable(code));
+  code = LayOut(page, 0x100, kNops);
+  code[0] = 0x55;
+  CHECK(!detour_is_hot_patchable(code));
+
+  // Check that padding with any other byte is refused, whichever byte it is
+  for (LONG n = 1; n <= DETOUR_HOT_PATCH_PADDING; n++)
+  {
+    code = LayOut(page, 0x100, kNops);
+    code[-n] = 0x00;
+    CHECK(!detour_is_hot_patchable(code));
+  }
+
+  // Check that an entry that can't be switched by one aligned 2-byte store is refused
+  CHECK(!detour_is_hot_patchable(LayOut(page, 0x101, kNops)));
+
+  // Check that padding that would start on the previous page is refused
+  CHECK(!detour_is_hot_patchable(LayOut(page, 4, kNops)));
+  CHECK(detour_is_hot_patchable(LayOut(page, 6, kNops)));
+}
+
+// TestAttach function
+static void TestAttach(BYTE* page)
+{
+  // Check that the padding holds a jmp to the detour and the entry a jmp to the padding, and nothing else changes
+  BYTE* code = LayOut(page, 0x100, kNops);
+  std::vector<BYTE> before(page, page + kPageSize);
+  BYTE saved[DETOUR_HOT_PATCH_SAVED];
+  detour_hot_patch_save(code, saved);
+  CHECK(memcmp(saved, code, DETOUR_HOT_PATCH_ENTRY) == 0);
+  CHECK(memcmp(saved + DETOUR_HOT_PATCH_ENTRY, kNops, DETOUR_HOT_PATCH_PADDING) == 0);
+
+  detour_hot_patch_attach(code, page + kDetourOffset);
+  BYTE* jmp = code - DETOUR_HOT_PATCH_PADDING;
+  CHECK_EQUAL(0xe9, jmp[0]);
+  INT32 displacement;
+  memcpy(&displacement, jmp + 1, sizeof(displacement));
+  CHECK(code + displacement == page + kDetourOffset);
+  CHECK_EQUAL(0xeb, code[0]);
+  CHECK_EQUAL(0xf9, code[1]);
+  CHECK(code + DETOUR_HOT_PATCH_ENTRY + (signed char)code[1] == jmp);
+  CHECK(memcmp(page, before.data(), jmp - page) == 0);
+  CHECK(memcmp(code + DETOUR_HOT_PATCH_ENTRY, before.data() + (code - page) + DETOUR_HOT_PATCH_ENTRY,
+    kPageSize - (code - page) - DETOUR_HOT_PATCH_ENTRY) == 0);
+
+  // Check that a detour before the function gets a negative displacement
+  code = LayOut(page, 0xa00, kInt3s);
+  detour_hot_patch_attach(code, page + kDetourOffset);
+  memcpy(&displacement, code - DETOUR_HOT_PATCH_PADDING + 1, sizeof(displacement));
+  CHECK_EQUAL(-0x200, displacement);
+}
+
+// TestDetach function
+static void TestDetach(BYTE* page)
+{
+  // Check that detaching puts back every byte, for each alignment of the entry and each kind of padding, and that
+  //   only nop padding within one aligned qword can be put back while other threads run
+  const BYTE (*paddings[])[DETOUR_HOT_PATCH_PADDING] = { &kNops, &kInt3s, &kMixed };
+  for (size_t offset = 0x100; offset < 0x110; offset += 2)
+  {
+    for (size_t index = 0; index < ARRAYSIZE(paddings); index++)
+    {
+      for (BYTE mov = 0x89; mov <= 0x8b; mov += 2)
+      {
+        BYTE* code = LayOut(page, offset, *paddings[index], mov);
+        std::vector<BYTE> before(page, page + kPageSize);
+        BYTE saved[DETOUR_HOT_PATCH_SAVED];
+        detour_hot_patch_save(code, saved);
+        detour_hot_patch_attach(code, page + kDetourOffset);
+        CHECK(memcmp(page, before.data(), kPageSize) != 0);
+
+        bool qword = (offset % 8) == 0 || (offset % 8) == 6;
+        CHECK_EQUAL(qword, detour_hot_patch_padding_qword(code) != NULL);
+        CHECK_EQUAL(qword && index == 0, detour_hot_patch_restores_running(code, saved) != FALSE);
+        detour_hot_patch_detach(code, saved);
+        CHECK(memcmp(page, before.data(), kPageSize) == 0);
+      }
+    }
+  }
+
+  // Check which qword holds the padding
+  CHECK(detour_hot_patch_padding_qword(page + 0x100) == (LONGLONG volatile*)(page + 0xf8));
+  CHECK(detour_hot_patch_padding_qword(page + 0x106) == (LONGLONG volatile*)(page + 0x100));
+}
+
+// main function
+int main()
+{
+  BYTE* page = MapPage();
+  CHECK(page != NULL);
+  if (page == NULL)
+    return TestResult("DetourHotPatchTest");
+  TestDetection(page);
+  TestAttach(page);
+  TestDetach(page);
+  munmap(page - kPageSize, 2 * kPageSize);
+  return TestResult("DetourHotPatchTest");
+}
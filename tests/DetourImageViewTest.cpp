@@ -0,0 +1,362 @@
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+#define DETOURS_INTERNAL
+#include <detours.h>
+
+#include "PeImage.h"
+#include "TestCommon.h"
+
+// Tests for CDetourImageView over the loaded, file and remote layouts of a synthetic PE32+ image
+// Note: the image has two sections, .text and .data, and .data is longer in memory than in the file so that its
+//   uninitialized tail only exists in the loaded layout
+// Note: the remote layout is the loaded layout read through a callback at a made up base address, as the Detours
+//   process functions read another process
+// Note: the exports are checked against data/exports.dll, a real image linked from data/exports.s and data/exports.def
+
+static const DWORD kFileAlignment = 0x200;
+static const DWORD kTextRva = 0x2000;
+static const DWORD kDataRva = 0x3000;
+static const DWORD kDataVirtualSize = 0x2000;
+static const DWORD kImageSize = 0x5000;
+static const DWORD kStringRva = kDataRva + 0x10;
+static const DWORD kClrRva = kDataRva + 0x100;
+static const DWORD kClrSize = 0x48;
+static const ULONG_PTR kRemoteBase = 0x7ff600000000;
+
+// Both layouts of the synthetic image
+struct TestImage
+{
+  std::vector<BYTE> file;
+  std::vector<BYTE> loaded;
+  DWORD headersSize;
+};
+
+// BuildImage function
+static TestImage BuildImage(LONG ntHeaderOffset)
+{
+  // Lay out the headers and section table, then the raw data of each section at the next file alignment
+  TestImage image;
+  DWORD sectionsOffset = ntHeaderOffset + sizeof(IMAGE_NT_HEADERS64);
+  image.headersSize = (sectionsOffset + 2 * sizeof(IMAGE_SECTION_HEADER) + kFileAlignment - 1) & ~(kFileAlignment - 1);
+  image.file.assign(image.headersSize + 2 * kFileAlignment, 0);
+
+  PIMAGE_DOS_HEADER dosHeader = (PIMAGE_DOS_HEADER)image.file.data();
+  dosHeader->e_magic = IMAGE_DOS_SIGNATURE;
+  dosHeader->e_lfanew = ntHeaderOffset;
+
+  PIMAGE_NT_HEADERS64 ntHeader = (PIMAGE_NT_HEADERS64)(image.file.data() + ntHeaderOffset);
+  ntHeader->Signature = IMAGE_NT_SIGNATURE;
+  ntHeader->FileHeader.Machine = IMAGE_FILE_MACHINE_AMD64;
+  ntHeader->FileHeader.NumberOfSections = 2;
+  ntHeader->FileHeader.SizeOfOptionalHeader = sizeof(IMAGE_OPTIONAL_HEADER64);
+  ntHeader->OptionalHeader.Magic = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+  ntHeader->OptionalHeader.SectionAlignment = 0x1000;
+  ntHeader->OptionalHeader.FileAlignment = kFileAlignment;
+  ntHeader->OptionalHeader.SizeOfImage = kImageSize;
+  ntHeader->OptionalHeader.SizeOfHeaders = image.headersSize;
+  ntHeader->OptionalHeader.NumberOfRvaAndSizes = IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+  ntHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_COM_DESCRIPTOR].VirtualAddress = kClrRva;
+  ntHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_COM_DESCRIPTOR].Size = kClrSize;
+
+  PIMAGE_SECTION_HEADER sections = (PIMAGE_SECTION_HEADER)(image.file.data() + sectionsOffset);
+  memcpy(sections[0].Name, ".text", 5);
+  sections[0].Misc.VirtualSize = 0x100;
+  sections[0].VirtualAddress = kTextRva;
+  sections[0].SizeOfRawData = kFileAlignment;
+  sections[0].PointerToRawData = image.headersSize;
+  memcpy(sections[1].Name, ".data", 5);
+  sections[1].Misc.VirtualSize = kDataVirtualSize;
+  sections[1].VirtualAddress = kDataRva;
+  sections[1].SizeOfRawData = kFileAlignment;
+  sections[1].PointerToRawData = image.headersSize + kFileAlignment;
+
+  memset(image.file.data() + sections[0].PointerToRawData, 0xcc, kFileAlignment);
+  strcpy((char*)image.file.data() + sections[1].PointerToRawData + (kStringRva - kDataRva), "hello");
+  memset(image.file.data() + sections[1].PointerToRawData + (kClrRva - kDataRva), 0x5a, kClrSize);
+
+  // Map it the way the loader does
+  image.loaded.assign(kImageSize, 0);
+  memcpy(image.loaded.data(), image.file.data(), image.headersSize);
+  for (unsigned int i = 0; i < 2; i++)
+  {
+    memcpy(image.loaded.data() + sections[i].VirtualAddress, image.file.data() + sections[i].PointerToRawData,
+      sections[i].SizeOfRawData);
+  }
+  return image;
+}
+
+// Target read by the remote view
+struct RemoteImage
+{
+  const std::vector<BYTE>* loaded;
+  unsigned int reads;
+};
+
+// ReadRemote function
+static BOOL CALLBACK ReadRemote(PVOID context, LPCVOID remote, PVOID local, SIZE_T size)
+{
+  // Serve reads of the loaded layout at the remote base and fail the rest like ReadProcessMemory
+  RemoteImage* image = (RemoteImage*)context;
+  image->reads++;
+  ULONG_PTR address = (ULONG_PTR)remote;
+  if (address < kRemoteBase || address - kRemoteBase > image->loaded->size() ||
+    size > image->loaded->size() - (address - kRemoteBase))
+  {
+    SetLastError(ERROR_PARTIAL_COPY);
+    return FALSE;
+  }
+  memcpy(local, image->loaded->data() + (address - kRemoteBase), size);
+  return TRUE;
+}
+
+// CheckHeaders function
+static void CheckHeaders(const CDetourImageView& view)
+{
+  // Check what every layout agrees on
+  CHECK_EQUAL(kImageSize, view.SizeOfImage());
+  CHECK(view.DosHeader() != NULL && view.DosHeader()->e_magic == IMAGE_DOS_SIGNATURE);
+  CHECK(view.NtHeader() != NULL && view.Contains(view.NtHeader(), sizeof(IMAGE_NT_HEADERS64)));
+  DWORD sectionCount = 0;
+  PIMAGE_SECTION_HEADER sections = view.Sections(&sectionCount);
+  CHECK_EQUAL(2, sectionCount);
+  if (sections != NULL && sectionCount == 2)
+  {
+    CHECK(strcmp((const char*)sections[0].Name, ".text") == 0);
+    CHECK_EQUAL(kDataRva, sections[1].VirtualAddress);
+  }
+  DWORD clrSize = 0;
+  CHECK_EQUAL(kClrRva, view.DirectoryRva(IMAGE_DIRECTORY_ENTRY_COM_DESCRIPTOR, &clrSize));
+  CHECK_EQUAL(kClrSize, clrSize);
+  CHECK_EQUAL(0, view.DirectoryRva(IMAGE_DIRECTORY_ENTRY_EXPORT, NULL));
+
+  char text[6] = {};
+  CHECK(view.Read(kStringRva, text, sizeof(text)));
+  CHECK(strcmp(text, "hello") == 0);
+  CHECK(!view.Read(kImageSize - 4, text, 8));
+  CHECK_EQUAL(ERROR_INVALID_ADDRESS, GetLastError());
+  CHECK(view.RvaToPointer(kImageSize - 4, 8) == NULL);
+  CHECK(view.RvaToPointer(0, 1) == NULL);
+}
+
+// TestLoadedLayout function
+static void TestLoadedLayout()
+{
+  // Check that RVAs are offsets from the base, including the uninitialized tail of .data
+  TestImage image = BuildImage(0x80);
+  CDetourImageView view;
+  CHECK(view.Attach((HMODULE)image.loaded.data()));
+  CheckHeaders(view);
+  CHECK(view.Base() == image.loaded.data());
+  CHECK(view.RvaToString(kStringRva) == (PCHAR)image.loaded.data() + kStringRva);
+  CHECK(view.RvaToPointer(kDataRva + kDataVirtualSize - 16, 16) ==
+    image.loaded.data() + kDataRva + kDataVirtualSize - 16);
+  DWORD clrSize = 0;
+  CHECK(view.Directory(IMAGE_DIRECTORY_ENTRY_COM_DESCRIPTOR, &clrSize) == image.loaded.data() + kClrRva);
+  CHECK_EQUAL(kClrSize, clrSize);
+}
+
+// TestFileLayout function
+static void TestFileLayout()
+{
+  // Check that RVAs are translated through the section table and that bytes missing from the file are refused
+  TestImage image = BuildImage(0x80);
+  PBYTE data = image.file.data();
+  DWORD dataOffset = image.headersSize + kFileAlignment;
+  CDetourImageView view;
+  CHECK(view.AttachFile(data, image.file.size()));
+  CheckHeaders(view);
+  CHECK(view.Base() == data);
+  CHECK(view.RvaToPointer(0x100, 4) == data + 0x100);
+  CHECK(view.RvaToString(kStringRva) == (PCHAR)data + dataOffset + (kStringRva - kDataRva));
+  CHECK(view.RvaToPointer(kTextRva + 0x10, 1) == data + image.headersSize + 0x10);
+  CHECK(view.RvaToPointer(kDataRva + kFileAlignment, 1) == NULL);
+  CHECK(view.RvaToPointer(kDataRva + kFileAlignment - 8, 16) == NULL);
+  CHECK(view.Directory(IMAGE_DIRECTORY_ENTRY_COM_DESCRIPTOR, NULL) == data + dataOffset + (kClrRva - kDataRva));
+
+  // A file cut short in .data keeps what is left of it
+  CDetourImageView truncated;
+  CHECK(truncated.AttachFile(data, dataOffset + 0x80));
+  CHECK(truncated.RvaToString(kStringRva) != NULL);
+  DWORD clrSize = 1;
+  CHECK(truncated.Directory(IMAGE_DIRECTORY_ENTRY_COM_DESCRIPTOR, &clrSize) == NULL);
+  CHECK_EQUAL(0, clrSize);
+  BYTE clr[kClrSize];
+  CHECK(!truncated.Read(kClrRva, clr, sizeof(clr)));
+}
+
+// TestRemoteLayout function
+static void TestRemoteLayout()
+{
+  // Check that only the headers are copied, in one read, and that everything else is read on demand at the remote base
+  TestImage image = BuildImage(0x80);
+  RemoteImage remote = { &image.loaded, 0 };
+  CDetourImageView view;
+  CHECK(view.AttachRemote((HMODULE)kRemoteBase, ReadRemote, &remote));
+  CHECK_EQUAL(1, remote.reads);
+  CHECK(view.Base() == (PBYTE)kRemoteBase);
+  CHECK(view.RvaToPointer(kStringRva, 1) == NULL);
+  CHECK(view.Directory(IMAGE_DIRECTORY_ENTRY_COM_DESCRIPTOR, NULL) == NULL);
+  CheckHeaders(view);
+  CHECK_EQUAL(2, remote.reads);
+
+  // Headers that run past the first page are read again whole
+  TestImage farImage = BuildImage(0xfc0);
+  RemoteImage farRemote = { &farImage.loaded, 0 };
+  CDetourImageView farView;
+  CHECK(farView.AttachRemote((HMODULE)kRemoteBase, ReadRemote, &farRemote));
+  CHECK_EQUAL(2, farRemote.reads);
+  CheckHeaders(farView);
+
+  // A read failure is reported as it is
+  RemoteImage missing = { &image.loaded, 0 };
+  CHECK(!view.AttachRemote((HMODULE)(kRemoteBase + kImageSize), ReadRemote, &missing));
+  CHECK_EQUAL(ERROR_PARTIAL_COPY, GetLastError());
+  CHECK(view.NtHeader() == NULL);
+}
+
+// TestCorruptHeaders function
+static void TestCorruptHeaders()
+{
+  // Check that offsets are checked against the bytes present before they are followed
+  TestImage image = BuildImage(0x80);
+  CDetourImageView view;
+
+  ((PIMAGE_DOS_HEADER)image.file.data())->e_lfanew = 0x7ffffff0;
+  ((PIMAGE_DOS_HEADER)image.loaded.data())->e_lfanew = 0x7ffffff0;
+  CHECK(!view.AttachFile(image.file.data(), image.file.size()));
+  CHECK_EQUAL(ERROR_BAD_EXE_FORMAT, GetLastError());
+  RemoteImage remote = { &image.loaded, 0 };
+  CHECK(!view.AttachRemote((HMODULE)kRemoteBase, ReadRemote, &remote));
+  CHECK_EQUAL(ERROR_BAD_EXE_FORMAT, GetLastError());
+  CHECK_EQUAL(1, remote.reads);
+
+  image = BuildImage(0x80);
+  ((PIMAGE_NT_HEADERS64)(image.file.data() + 0x80))->FileHeader.SizeOfOptionalHeader = 0x10;
+  CHECK(!view.AttachFile(image.file.data(), image.file.size()));
+  CHECK_EQUAL(ERROR_EXE_MARKED_INVALID, GetLastError());
+
+  image = BuildImage(0x80);
+  CHECK(!view.AttachFile(image.file.data(), 0x80 + sizeof(IMAGE_NT_HEADERS64) - 8));
+  CHECK_EQUAL(ERROR_BAD_EXE_FORMAT, GetLastError());
+  CHECK(!view.AttachFile(image.file.data(), sizeof(IMAGE_DOS_HEADER) - 1));
+
+  ((PIMAGE_NT_HEADERS64)(image.file.data() + 0x80))->FileHeader.NumberOfSections = 0x400;
+  CHECK(view.AttachFile(image.file.data(), image.file.size()));
+  DWORD sectionCount = 1;
+  CHECK(view.Sections(&sectionCount) == NULL);
+  CHECK_EQUAL(0, sectionCount);
+}
+
+// Export reported by DetourEnumerateExports
+struct FixtureExport
+{
+  ULONG ordinal;
+  std::string name;
+  PBYTE code;
+};
+
+// CollectExport function
+static BOOL CALLBACK CollectExport(PVOID context, ULONG ordinal, LPCSTR name, PVOID code)
+{
+  std::vector<FixtureExport>* exports = (std::vector<FixtureExport>*)context;
+  exports->push_back({ ordinal, name != NULL ? name : "", (PBYTE)code });
+  return TRUE;
+}
+
+// StopAfterFirst function
+static BOOL CALLBACK StopAfterFirst(PVOID context, ULONG, LPCSTR, PVOID)
+{
+  (*(int*)context)++;
+  return FALSE;
+}
+
+// IsFunction function
+static bool IsFunction(PBYTE code, DWORD value)
+{
+  // Check for "mov eax, value; ret"
+  return code != NULL && code[0] == 0xb8 && memcmp(code + 1, &value, sizeof(value)) == 0 && code[5] == 0xc3;
+}
+
+// TestRealImage function
+static void TestRealImage()
+{
+  // Check the headers of the file and its export directory in both layouts
+  PeImage image;
+  CHECK(ReadPeImage("exports.dll", image));
+  std::vector<BYTE>& file = image.file;
+  std::vector<BYTE>& loaded = image.loaded;
+  CDetourImageView fileView;
+  CHECK(fileView.AttachFile(file.data(), file.size()));
+  if (fileView.NtHeader() == NULL)
+    return;
+  CHECK_EQUAL(IMAGE_FILE_MACHINE_AMD64, fileView.NtHeader()->FileHeader.Machine);
+  CHECK_EQUAL(IMAGE_NT_OPTIONAL_HDR64_MAGIC, fileView.NtHeader()->OptionalHeader.Magic);
+  DWORD exportSize = 0;
+  PIMAGE_EXPORT_DIRECTORY fileExports = (PIMAGE_EXPORT_DIRECTORY)
+    fileView.Directory(IMAGE_DIRECTORY_ENTRY_EXPORT, &exportSize);
+  CHECK(fileExports != NULL && exportSize >= sizeof(IMAGE_EXPORT_DIRECTORY));
+  if (fileExports == NULL)
+    return;
+  CHECK_EQUAL(7, fileExports->NumberOfFunctions);
+  CHECK_EQUAL(6, fileExports->NumberOfNames);
+  CHECK(fileView.RvaToString(fileExports->Name) != NULL &&
+    strcmp(fileView.RvaToString(fileExports->Name), "exports.dll") == 0);
+
+  CDetourImageView loadedView;
+  CHECK(loadedView.Attach((HMODULE)loaded.data()));
+  PIMAGE_EXPORT_DIRECTORY loadedExports = (PIMAGE_EXPORT_DIRECTORY)
+    loadedView.Directory(IMAGE_DIRECTORY_ENTRY_EXPORT, NULL);
+  CHECK(loadedExports != NULL && memcmp(loadedExports, fileExports, sizeof(IMAGE_EXPORT_DIRECTORY)) == 0);
+
+  // Check that every function is enumerated in ordinal order with its first name, that the forwarder has no code,
+  //   and that the function only exported by ordinal has no name
+  std::vector<FixtureExport> exports;
+  CHECK(DetourEnumerateExports((HMODULE)loaded.data(), &exports, CollectExport));
+  CHECK_EQUAL(7, exports.size());
+  if (exports.size() != 7)
+    return;
+  const char* names[] = { "Alpha", "Beta", "Gamma", "Sleep", "Value", "AlphaAlias", "" };
+  for (size_t i = 0; i < exports.size(); i++)
+  {
+    CHECK_EQUAL(i + 1, exports[i].ordinal);
+    CHECK(exports[i].name == names[i]);
+  }
+  CHECK(IsFunction(exports[0].code, 1));
+  CHECK(IsFunction(exports[1].code, 2));
+  CHECK(IsFunction(exports[2].code, 3));
+  CHECK(exports[3].code == NULL);
+  CHECK(exports[4].code != NULL && *(DWORD*)exports[4].code == 0x12345678);
+  CHECK(exports[5].code == exports[0].code);
+  CHECK(IsFunction(exports[6].code, 4));
+  int calls = 0;
+  CHECK(DetourEnumerateExports((HMODULE)loaded.data(), &calls, StopAfterFirst));
+  CHECK_EQUAL(1, calls);
+
+  // Check that names are found by the binary search, and that the forwarder, the function only exported by ordinal,
+  //   and names that are not exported are not
+  for (size_t i = 0; i < 6; i++)
+  {
+    if (exports[i].code != NULL)
+      CHECK(DetourFindExportByName((HMODULE)loaded.data(), names[i]) == exports[i].code);
+  }
+  const char* missing[] = { "Sleep", "Hidden", "alpha", "Alph", "AlphaAliasX", "", "Zeta" };
+  for (const char* name : missing)
+  {
+    CHECK(DetourFindExportByName((HMODULE)loaded.data(), name) == NULL);
+    CHECK_EQUAL(ERROR_PROC_NOT_FOUND, GetLastError());
+  }
+}
+
+// main function
+int main()
+{
+  TestLoadedLayout();
+  TestFileLayout();
+  TestRemoteLayout();
+  TestCorruptHeaders();
+  TestRealImage();
+  return TestResult("DetourImageViewTest");
+}
@@ -0,0 +1,272 @@
+#include <unistd.h>
+#include <vector>
+
+#include <windows.h>
+#include <detours.h>
+
+#include "TestCommon.h"
+
+// Tests for how a Detours transaction changes the protection of the pages holding its targets
+// Note: the targets are generated "mov eax, imm32; ret" functions, which is x64 code, in two adjacent allocations of
+//   four read only executable pages each, and the shim logs the ranges passed to VirtualProtect and
+//   FlushInstructionCache, backed by mprotect and __builtin___clear_cache, so the batching can be checked exactly
+
+static const unsigned int kPagesPerAllocation = 4;
+static const unsigned int kPageCount = 2 * kPagesPerAllocation;
+
+typedef int (*GeneratedFunction)();
+
+// Generated functions and where they live
+struct TestCode
+{
+  BYTE* code;
+  ULONG_PTR pageSize;
+  unsigned int functionsPerPage;
+  std::vector<PVOID> pointers;
+};
+
+// DetourFunction function
+static int DetourFunction()
+{
+  return -1;
+}
+
+// GenerateCode function
+static bool GenerateCode(TestCode& test)
+{
+  // Find room for both allocations, then make them separately at adjacent addresses
+  test.pageSize = (ULONG_PTR)sysconf(_SC_PAGESIZE);
+  test.functionsPerPage = (unsigned int)(test.pageSize / 16);
+  SIZE_T allocationSize = kPagesPerAllocation * test.pageSize;
+  BYTE* code = (BYTE*)VirtualAlloc(NULL, 2 * allocationSize, MEM_RESERVE, PAGE_NOACCESS);
+  if (code == NULL)
+    return false;
+  VirtualFree(code, 0, MEM_RELEASE);
+  for (unsigned int i = 0; i < 2; i++)
+  {
+    if (VirtualAlloc(code + i * allocationSize, allocationSize, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE) !=
+      code + i * allocationSize)
+      return false;
+  }
+
+  memset(code, 0xcc, 2 * allocationSize);
+  for (unsigned int i = 0; i < kPageCount * test.functionsPerPage; i++)
+  {
+    DWORD value = 1000 + i;
+    code[i * 16] = 0xb8;
+    memcpy(code + i * 16 + 1, &value, sizeof(value));
+    code[i * 16 + 5] = 0xc3;
+  }
+  for (unsigned int i = 0; i < 2; i++)
+  {
+    DWORD oldProtect;
+    if (!VirtualProtect(code + i * allocationSize, allocationSize, PAGE_EXECUTE_READ, &oldProtect))
+      return false;
+  }
+  test.code = code;
+  test.pointers.resize(kPageCount * test.functionsPerPage);
+  return true;
+}
+
+// FunctionsOn function
+static std::vector<unsigned int> FunctionsOn(const TestCode& test, std::initializer_list<unsigned int> pages)
+{
+  std::vector<unsigned int> functions;
+  for (unsigned int page : pages)
+  {
+    for (unsigned int i = 0; i < test.functionsPerPage; i++)
+      functions.push_back(page * test.functionsPerPage + i);
+  }
+  return functions;
+}
+
+// Change function
+static LONG Change(TestCode& test, const std::vector<unsigned int>& functions, bool attach, bool commit)
+{
+  // Attach or detach the functions in one transaction and commit or abort it, logging only the calls it makes
+  ResetShimCounters();
+  DetourTransactionBegin();
+  for (unsigned int function : functions)
+  {
+    if (attach)
+      test.pointers[function] = test.code + function * 16;
+    LONG error = attach ? DetourAttach(&test.pointers[function], (PVOID)DetourFunction) :
+      DetourDetach(&test.pointers[function], (PVOID)DetourFunction);
+    if (error != NO_ERROR)
+    {
+      DetourTransactionAbort();
+      return error;
+    }
+  }
+  return commit ? DetourTransactionCommit() : DetourTransactionAbort();
+}
+
+// CodeCalls function
+static std::vector<ShimRangeCall> CodeCalls(const TestCode& test, const std::vector<ShimRangeCall>& calls)
+{
+  // Keep the calls for the target pages, the rest are for the trampoline regions
+  std::vector<ShimRangeCall> codeCalls;
+  for (const ShimRangeCall& call : calls)
+  {
+    if (call.address >= (ULONG_PTR)test.code && call.address < (ULONG_PTR)test.code + kPageCount * test.pageSize)
+      codeCalls.push_back(call);
+  }
+  return codeCalls;
+}
+
+// CheckCall function
+static void CheckCall(const TestCode& test, const ShimRangeCall& call, unsigned int page, unsigned int pageCount,
+  DWORD protect)
+{
+  CHECK_EQUAL((ULONG_PTR)test.code + page * test.pageSize, call.address);
+  CHECK_EQUAL(pageCount * test.pageSize, call.size);
+  CHECK_EQUAL(protect, call.protect);
+}
+
+// CheckProtection function
+static void CheckProtection(const TestCode& test, DWORD protect)
+{
+  for (unsigned int page = 0; page < kPageCount; page++)
+  {
+    MEMORY_BASIC_INFORMATION mbi;
+    CHECK_EQUAL(sizeof(mbi), VirtualQuery(test.code + page * test.pageSize, &mbi, sizeof(mbi)));
+    CHECK_EQUAL(protect, mbi.Protect);
+  }
+}
+
+// CheckDetoured function
+static void CheckDetoured(const TestCode& test, const std::vector<unsigned int>& functions, bool detoured)
+{
+  unsigned int wrong = 0;
+  for (unsigned int function : functions)
+  {
+    if (((GeneratedFunction)(test.code + function * 16))() != (detoured ? -1 : (int)(1000 + function)))
+      wrong++;
+  }
+  CHECK_EQUAL(0, wrong);
+}
+
+// TestSharedPages function
+static void TestSharedPages(TestCode& test)
+{
+  // Check that every page is made writable once, and restored and flushed with one call for all of them
+  std::vector<unsigned int> functions = FunctionsOn(test, { 0, 1, 2, 3 });
+  for (bool attach : { true, false })
+  {
+    CHECK_EQUAL(NO_ERROR, Change(test, functions, attach, true));
+    std::vector<ShimRangeCall> protectCalls = CodeCalls(test, GetShimProtectCalls());
+    CHECK_EQUAL(5, protectCalls.size());
+    if (protectCalls.size() == 5)
+    {
+      for (unsigned int page = 0; page < 4; page++)
+        CheckCall(test, protectCalls[page], page, 1, PAGE_EXECUTE_READWRITE);
+      CheckCall(test, protectCalls[4], 0, 4, PAGE_EXECUTE_READ);
+    }
+    std::vector<ShimRangeCall> flushCalls = CodeCalls(test, GetShimFlushCalls());
+    CHECK_EQUAL(1, flushCalls.size());
+    if (flushCalls.size() == 1)
+      CheckCall(test, flushCalls[0], 0, 4, 0);
+    CheckProtection(test, PAGE_EXECUTE_READ);
+    CheckDetoured(test, functions, attach);
+  }
+}
+
+// TestMixedProtection function
+static void TestMixedProtection(TestCode& test)
+{
+  // Check that the restore is split where the protection to restore changes, but the flush is not
+  DWORD oldProtect;
+  VirtualProtect(test.code + 2 * test.pageSize, test.pageSize, PAGE_EXECUTE_READWRITE, &oldProtect);
+  std::vector<unsigned int> functions = FunctionsOn(test, { 0, 1, 2, 3 });
+  CHECK_EQUAL(NO_ERROR, Change(test, functions, true, true));
+  std::vector<ShimRangeCall> protectCalls = CodeCalls(test, GetShimProtectCalls());
+  CHECK_EQUAL(7, protectCalls.size());
+  if (protectCalls.size() == 7)
+  {
+    CheckCall(test, protectCalls[4], 0, 2, PAGE_EXECUTE_READ);
+    CheckCall(test, protectCalls[5], 2, 1, PAGE_EXECUTE_READWRITE);
+    CheckCall(test, protectCalls[6], 3, 1, PAGE_EXECUTE_READ);
+  }
+  CHECK_EQUAL(1, CodeCalls(test, GetShimFlushCalls()).size());
+  CheckDetoured(test, functions, true);
+
+  VirtualProtect(test.code + 2 * test.pageSize, test.pageSize, PAGE_EXECUTE_READ, &oldProtect);
+  CHECK_EQUAL(NO_ERROR, Change(test, functions, false, true));
+  CheckProtection(test, PAGE_EXECUTE_READ);
+  CheckDetoured(test, functions, false);
+}
+
+// TestPagesAcrossAllocations function
+static void TestPagesAcrossAllocations(TestCode& test)
+{
+  // Check that pages from two allocations are restored one at a time after the ranged call is refused
+  std::vector<unsigned int> functions = FunctionsOn(test, { 2, 3, 4, 5 });
+  CHECK_EQUAL(NO_ERROR, Change(test, functions, true, true));
+  std::vector<ShimRangeCall> protectCalls = CodeCalls(test, GetShimProtectCalls());
+  CHECK_EQUAL(9, protectCalls.size());
+  if (protectCalls.size() == 9)
+  {
+    CheckCall(test, protectCalls[4], 2, 4, PAGE_EXECUTE_READ);
+    for (unsigned int page = 2; page < 6; page++)
+      CheckCall(test, protectCalls[page + 3], page, 1, PAGE_EXECUTE_READ);
+  }
+  CHECK_EQUAL(1, CodeCalls(test, GetShimFlushCalls()).size());
+  CheckProtection(test, PAGE_EXECUTE_READ);
+  CheckDetoured(test, functions, true);
+
+  CHECK_EQUAL(NO_ERROR, Change(test, functions, false, true));
+  CheckProtection(test, PAGE_EXECUTE_READ);
+  CheckDetoured(test, functions, false);
+}
+
+// TestSeparatePages function
+static void TestSeparatePages(TestCode& test)
+{
+  // Check that pages that are not adjacent are restored and flushed separately
+  std::vector<unsigned int> functions = FunctionsOn(test, { 0, 2 });
+  CHECK_EQUAL(NO_ERROR, Change(test, functions, true, true));
+  std::vector<ShimRangeCall> protectCalls = CodeCalls(test, GetShimProtectCalls());
+  CHECK_EQUAL(4, protectCalls.size());
+  std::vector<ShimRangeCall> flushCalls = CodeCalls(test, GetShimFlushCalls());
+  CHECK_EQUAL(2, flushCalls.size());
+  if (flushCalls.size() == 2)
+  {
+    CheckCall(test, flushCalls[0], 0, 1, 0);
+    CheckCall(test, flushCalls[1], 2, 1, 0);
+  }
+  CheckDetoured(test, functions, true);
+
+  CHECK_EQUAL(NO_ERROR, Change(test, functions, false, true));
+  CheckProtection(test, PAGE_EXECUTE_READ);
+}
+
+// TestAbort function
+static void TestAbort(TestCode& test)
+{
+  // Check that an aborted transaction restores the pages it made writable without flushing or patching them
+  std::vector<unsigned int> functions = FunctionsOn(test, { 6, 7 });
+  CHECK_EQUAL(NO_ERROR, Change(test, functions, true, false));
+  std::vector<ShimRangeCall> protectCalls = CodeCalls(test, GetShimProtectCalls());
+  CHECK_EQUAL(3, protectCalls.size());
+  if (protectCalls.size() == 3)
+    CheckCall(test, protectCalls[2], 6, 2, PAGE_EXECUTE_READ);
+  CHECK_EQUAL(0, CodeCalls(test, GetShimFlushCalls()).size());
+  CheckProtection(test, PAGE_EXECUTE_READ);
+  CheckDetoured(test, functions, false);
+}
+
+// main function
+int main()
+{
+  TestCode test;
+  CHECK(GenerateCode(test));
+  if (gTestFailures != 0)
+    return TestResult("DetourPageTest");
+
+  TestSharedPages(test);
+  TestMixedProtection(test);
+  TestPagesAcrossAllocations(test);
+  TestSeparatePages(test);
+  TestAbort(test);
+  return TestResult("DetourPageTest");
+}
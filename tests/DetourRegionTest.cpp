@@ -0,0 +1,154 @@
+#include <set>
+#include <sys/mman.h>
+#include <vector>
+
+#include <windows.h>
+#include <detours.h>
+
+#include "TestCommon.h"
+
+// Tests for the Detours trampoline region allocator
+// Note: the functions that are detoured are generated at run time so that there are enough of them to fill several
+//   regions, each one is "mov eax, imm32; ret" padded to 16 bytes with int3, which is x64 code, and regions are found
+//   from the trampolines Detours hands back since the allocator itself is internal
+
+// Number of generated functions, enough for several regions of trampolines
+static const unsigned int kFunctionCount = 2048;
+static const ULONG_PTR kRegionSize = 0x10000;
+
+typedef int (*GeneratedFunction)();
+
+// DetourFunction function
+static int DetourFunction()
+{
+  return -1;
+}
+
+// GenerateFunctions function
+static BYTE* GenerateFunctions()
+{
+  BYTE* code = (BYTE*)mmap(NULL, kFunctionCount * 16, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS,
+    -1, 0);
+  if (code == MAP_FAILED)
+    return NULL;
+  memset(code, 0xcc, kFunctionCount * 16);
+  for (unsigned int i = 0; i < kFunctionCount; i++)
+  {
+    BYTE* function = code + i * 16;
+    DWORD value = 1000 + i;
+    function[0] = 0xb8;
+    memcpy(function + 1, &value, sizeof(value));
+    function[5] = 0xc3;
+  }
+  return code;
+}
+
+// AttachFunctions function
+static LONG AttachFunctions(BYTE* code, std::vector<PVOID>& pointers, std::vector<PDETOUR_TRAMPOLINE>& trampolines,
+  unsigned int first, unsigned int step)
+{
+  DetourTransactionBegin();
+  for (unsigned int i = first; i < kFunctionCount; i += step)
+  {
+    pointers[i] = code + i * 16;
+    LONG error = DetourAttachEx(&pointers[i], (PVOID)DetourFunction, &trampolines[i], NULL, NULL);
+    if (error != NO_ERROR)
+    {
+      DetourTransactionAbort();
+      return error;
+    }
+  }
+  return DetourTransactionCommit();
+}
+
+// DetachFunctions function
+static LONG DetachFunctions(std::vector<PVOID>& pointers, unsigned int first, unsigned int step)
+{
+  DetourTransactionBegin();
+  for (unsigned int i = first; i < kFunctionCount; i += step)
+  {
+    LONG error = DetourDetach(&pointers[i], (PVOID)DetourFunction);
+    if (error != NO_ERROR)
+    {
+      DetourTransactionAbort();
+      return error;
+    }
+  }
+  return DetourTransactionCommit();
+}
+
+// CheckFunctions function
+static void CheckFunctions(BYTE* code, const std::vector<PVOID>& pointers, bool detoured)
+{
+  // Check that the targets route to the detour and that the trampolines still run the original code
+  unsigned int wrong = 0;
+  for (unsigned int i = 0; i < kFunctionCount; i++)
+  {
+    if (((GeneratedFunction)(code + i * 16))() != (detoured ? -1 : (int)(1000 + i)))
+      wrong++;
+    if (((GeneratedFunction)pointers[i])() != (int)(1000 + i))
+      wrong++;
+  }
+  CHECK_EQUAL(0, wrong);
+}
+
+// RegionsOf function
+static std::set<ULONG_PTR> RegionsOf(const std::vector<PDETOUR_TRAMPOLINE>& trampolines)
+{
+  std::set<ULONG_PTR> regions;
+  for (PDETOUR_TRAMPOLINE trampoline : trampolines)
+    regions.insert((ULONG_PTR)trampoline & ~(kRegionSize - 1));
+  return regions;
+}
+
+// main function
+int main()
+{
+  BYTE* code = GenerateFunctions();
+  CHECK(code != NULL);
+  if (code == NULL)
+    return TestResult("DetourRegionTest");
+  std::vector<PVOID> pointers(kFunctionCount);
+  std::vector<PDETOUR_TRAMPOLINE> trampolines(kFunctionCount);
+
+  // Attach every function and check that it took several regions, all within jump range of the code
+  CHECK_EQUAL(NO_ERROR, AttachFunctions(code, pointers, trampolines, 0, 1));
+  CheckFunctions(code, pointers, true);
+  std::set<ULONG_PTR> regions = RegionsOf(trampolines);
+  CHECK(regions.size() >= 3);
+  for (ULONG_PTR region : regions)
+    CHECK(region - (ULONG_PTR)code + 0x80000000ull < 0x100000000ull);
+
+  // Detach every other function, which frees trampolines in every region but empties none of them, then attach them
+  //   again and check that the freed trampolines were reused rather than new regions allocated
+  CHECK_EQUAL(NO_ERROR, DetachFunctions(pointers, 1, 2));
+  for (unsigned int i = 1; i < kFunctionCount; i += 2)
+    CHECK_EQUAL(1000 + i, ((GeneratedFunction)(code + i * 16))());
+  ResetShimCounters();
+  CHECK_EQUAL(NO_ERROR, AttachFunctions(code, pointers, trampolines, 1, 2));
+  CHECK_EQUAL(0, gShimCounters.virtualAlloc.load());
+  CHECK_EQUAL(0, gShimCounters.virtualFree.load());
+  CHECK(RegionsOf(trampolines) == regions);
+  CheckFunctions(code, pointers, true);
+
+  // Detach everything and check that every region was released
+  ResetShimCounters();
+  CHECK_EQUAL(NO_ERROR, DetachFunctions(pointers, 0, 1));
+  CheckFunctions(code, pointers, false);
+  CHECK_EQUAL(regions.size(), gShimCounters.virtualFree.load());
+  for (ULONG_PTR region : regions)
+  {
+    MEMORY_BASIC_INFORMATION mbi;
+    CHECK_EQUAL(sizeof(mbi), VirtualQuery((PVOID)region, &mbi, sizeof(mbi)));
+    CHECK_EQUAL(MEM_FREE, mbi.State);
+  }
+
+  // Check that the allocator starts over cleanly once every region is gone
+  CHECK_EQUAL(NO_ERROR, AttachFunctions(code, pointers, trampolines, 0, 1));
+  CheckFunctions(code, pointers, true);
+  CHECK_EQUAL(NO_ERROR, DetachFunctions(pointers, 0, 1));
+  CheckFunctions(code, pointers, false);
+
+  munmap(code, kFunctionCount * 16);
+  return TestResult("DetourRegionTest");
+}
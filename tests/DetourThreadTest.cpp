@@ -0,0 +1,270 @@
+#include <cstring>
+#include <vector>
+
+#include <windows.h>
+#include <detours.h>
+
+#include "TestCommon.h"
+
+// Tests for how a Detours transaction suspends the other threads of the process and moves their instruction pointers
+//   out of the code it changes
+// Note: other threads cannot be suspended on Linux, so the shim lists simulated threads after the calling thread, keeps
+//   their suspend counts and open handles, and holds a context for each of them that the commit reads and writes
+// Note: the targets are generated x64 functions, "push rbx; mov eax, imm32; pop rbx; ret" whose first two instructions
+//   end at 1 and 6, and "push rbx; mov rax, imm64; pop rbx; ret" whose first two instructions end at 1 and 11, so the
+//   second one moves more code into its trampoline than the first 8 bytes of it
+
+static const DWORD kShortValue = 1234;
+static const DWORD64 kLongValue = 5678;
+static const LONG kShortMoved = 6;
+static const LONG kLongMoved = 11;
+
+typedef int (*GeneratedFunction)();
+
+// Generated functions and where they live
+struct TestCode
+{
+  BYTE* code;
+  BYTE* shortTarget;
+  BYTE* longTarget;
+  BYTE* unrelated;
+};
+
+// ShortDetour function
+static int ShortDetour()
+{
+  return -1;
+}
+
+// LongDetour function
+static int LongDetour()
+{
+  return -2;
+}
+
+// GenerateCode function
+static bool GenerateCode(TestCode& test)
+{
+  BYTE* code = (BYTE*)VirtualAlloc(NULL, 0x1000, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+  if (code == NULL)
+    return false;
+  memset(code, 0xcc, 0x1000);
+
+  BYTE* shortTarget = code;
+  shortTarget[0] = 0x53;
+  shortTarget[1] = 0xb8;
+  memcpy(shortTarget + 2, &kShortValue, sizeof(kShortValue));
+  shortTarget[6] = 0x5b;
+  shortTarget[7] = 0xc3;
+
+  BYTE* longTarget = code + 0x40;
+  longTarget[0] = 0x53;
+  longTarget[1] = 0x48;
+  longTarget[2] = 0xb8;
+  memcpy(longTarget + 3, &kLongValue, sizeof(kLongValue));
+  longTarget[11] = 0x5b;
+  longTarget[12] = 0xc3;
+
+  DWORD oldProtect;
+  if (!VirtualProtect(code, 0x1000, PAGE_EXECUTE_READ, &oldProtect))
+    return false;
+  test.code = code;
+  test.shortTarget = shortTarget;
+  test.longTarget = longTarget;
+  test.unrelated = code + 0x800;
+  return true;
+}
+
+// MakeThread function
+static ShimThread MakeThread(DWORD threadId, const void* ip)
+{
+  ShimThread thread = {};
+  thread.threadId = threadId;
+  thread.processId = GetCurrentProcessId();
+  thread.context.Rip = (DWORD64)(ULONG_PTR)ip;
+  return thread;
+}
+
+// FindThread function
+static ShimThread FindThread(DWORD threadId)
+{
+  for (const ShimThread& thread : GetShimThreads())
+  {
+    if (thread.threadId == threadId)
+      return thread;
+  }
+  CHECK(false);
+  return ShimThread();
+}
+
+// Attach function
+static bool Attach(TestCode& test, PVOID& shortPointer, PVOID& longPointer)
+{
+  shortPointer = test.shortTarget;
+  longPointer = test.longTarget;
+  return DetourTransactionBegin() == NO_ERROR &&
+    DetourAttach(&shortPointer, (PVOID)ShortDetour) == NO_ERROR &&
+    DetourAttach(&longPointer, (PVOID)LongDetour) == NO_ERROR &&
+    DetourUpdateAllThreads() == NO_ERROR &&
+    DetourTransactionCommit() == NO_ERROR;
+}
+
+// Detach function
+static bool Detach(PVOID& shortPointer, PVOID& longPointer)
+{
+  return DetourTransactionBegin() == NO_ERROR &&
+    DetourDetach(&shortPointer, (PVOID)ShortDetour) == NO_ERROR &&
+    DetourDetach(&longPointer, (PVOID)LongDetour) == NO_ERROR &&
+    DetourUpdateAllThreads() == NO_ERROR &&
+    DetourTransactionCommit() == NO_ERROR;
+}
+
+// TestBookkeeping function
+static void TestBookkeeping(TestCode& test)
+{
+  // Check that only the threads of this process that can be opened and suspended are, and that each of them is
+  //   suspended once until the commit
+  // Note: thread ids start above the largest Linux thread id so they never clash with the calling thread
+  std::vector<ShimThread> threads = {
+    MakeThread(0x40000001, test.unrelated),
+    MakeThread(0x40000002, test.unrelated),
+    MakeThread(0x40000003, test.unrelated),
+    MakeThread(0x40000004, test.unrelated),
+    MakeThread(0x40000005, test.unrelated)
+  };
+  threads[1].processId = GetCurrentProcessId() + 1;
+  threads[2].exited = true;
+  threads[3].suspendFails = true;
+  SetShimThreads(threads);
+
+  PVOID shortPointer = test.shortTarget;
+  PVOID longPointer = test.longTarget;
+  CHECK_EQUAL(NO_ERROR, DetourTransactionBegin());
+  CHECK_EQUAL(NO_ERROR, DetourAttach(&shortPointer, (PVOID)ShortDetour));
+  CHECK_EQUAL(NO_ERROR, DetourAttach(&longPointer, (PVOID)LongDetour));
+  CHECK_EQUAL(NO_ERROR, DetourUpdateAllThreads());
+  for (DWORD threadId : { 0x40000001, 0x40000005 })
+  {
+    ShimThread thread = FindThread(threadId);
+    CHECK_EQUAL(1, thread.suspendCount);
+    CHECK_EQUAL(1, thread.openHandles);
+  }
+  for (DWORD threadId : { 0x40000002, 0x40000003, 0x40000004 })
+  {
+    ShimThread thread = FindThread(threadId);
+    CHECK_EQUAL(0, thread.suspendCount);
+    CHECK_EQUAL(0, thread.openHandles);
+  }
+
+  // Check that a second snapshot in the same transaction is refused instead of suspending the threads twice
+  CHECK_EQUAL(ERROR_INVALID_OPERATION, DetourUpdateAllThreads());
+  CHECK_EQUAL(1, FindThread(0x40000001).suspends);
+
+  // Check that the commit resumes the threads, closes their handles, leaves contexts outside of the targets alone, and
+  //   reports how many threads were stopped
+  CHECK_EQUAL(NO_ERROR, DetourTransactionCommit());
+  for (const ShimThread& thread : GetShimThreads())
+  {
+    CHECK_EQUAL(0, thread.suspendCount);
+    CHECK_EQUAL(0, thread.openHandles);
+    CHECK_EQUAL(0, thread.contextWrites);
+    CHECK(thread.context.Rip == (DWORD64)(ULONG_PTR)test.unrelated);
+  }
+  CHECK_EQUAL(1, FindThread(0x40000001).suspends);
+  CHECK_EQUAL(0, FindThread(0x40000004).suspends);
+  ULONG suspended = 0;
+  DetourGetLastSuspendDuration(&suspended);
+  CHECK_EQUAL(2, suspended);
+
+  // Check that an abort resumes the threads and closes their handles too
+  CHECK_EQUAL(NO_ERROR, DetourTransactionBegin());
+  CHECK_EQUAL(NO_ERROR, DetourDetach(&shortPointer, (PVOID)ShortDetour));
+  CHECK_EQUAL(NO_ERROR, DetourUpdateAllThreads());
+  CHECK_EQUAL(1, FindThread(0x40000005).suspendCount);
+  CHECK_EQUAL(NO_ERROR, DetourTransactionAbort());
+  for (const ShimThread& thread : GetShimThreads())
+  {
+    CHECK_EQUAL(0, thread.suspendCount);
+    CHECK_EQUAL(0, thread.openHandles);
+  }
+  CHECK_EQUAL(2, FindThread(0x40000005).suspends);
+
+  SetShimThreads({});
+  CHECK(Detach(shortPointer, longPointer));
+}
+
+// TestAttachFixups function
+static void TestAttachFixups(TestCode& test)
+{
+  // Check that a thread stopped inside the code that is moved to a trampoline continues at the same instruction in the
+  //   trampoline, and that threads stopped anywhere else are left alone
+  SetShimThreads({
+    MakeThread(0x40000001, test.shortTarget + 1),
+    MakeThread(0x40000002, test.shortTarget + kShortMoved),
+    MakeThread(0x40000003, test.longTarget + 1),
+    MakeThread(0x40000004, test.unrelated)
+  });
+  PVOID shortPointer;
+  PVOID longPointer;
+  CHECK(Attach(test, shortPointer, longPointer));
+  CHECK(FindThread(0x40000001).context.Rip == (DWORD64)(ULONG_PTR)((BYTE*)shortPointer + 1));
+  CHECK(FindThread(0x40000002).context.Rip == (DWORD64)(ULONG_PTR)(test.shortTarget + kShortMoved));
+  CHECK_EQUAL(0, FindThread(0x40000002).contextWrites);
+  CHECK(FindThread(0x40000003).context.Rip == (DWORD64)(ULONG_PTR)((BYTE*)longPointer + 1));
+  CHECK(FindThread(0x40000004).context.Rip == (DWORD64)(ULONG_PTR)test.unrelated);
+  CHECK_EQUAL(0, FindThread(0x40000004).contextWrites);
+
+  // Check that the trampolines still run the original functions, including from where the threads were moved to
+  CHECK_EQUAL(-1, ((GeneratedFunction)test.shortTarget)());
+  CHECK_EQUAL(-2, ((GeneratedFunction)test.longTarget)());
+  CHECK_EQUAL((int)kShortValue, ((GeneratedFunction)shortPointer)());
+  CHECK_EQUAL((int)kLongValue, ((GeneratedFunction)longPointer)());
+
+  SetShimThreads({});
+  CHECK(Detach(shortPointer, longPointer));
+}
+
+// TestDetachFixups function
+static void TestDetachFixups(TestCode& test)
+{
+  // Check that a thread stopped in a trampoline goes back to the same instruction in the target before the trampoline
+  //   is freed, including a thread past the first 8 bytes of the trampoline and one about to jump back to the rest of
+  //   the target
+  // Note: the instruction ends recorded for a trampoline only have room for offsets up to 7 into the target, so the
+  //   thread about to jump back to offset 11 of the long target checks that they are found again past that
+  SetShimThreads({});
+  PVOID shortPointer;
+  PVOID longPointer;
+  CHECK(Attach(test, shortPointer, longPointer));
+  SetShimThreads({
+    MakeThread(0x40000001, (BYTE*)shortPointer + 1),
+    MakeThread(0x40000002, (BYTE*)shortPointer + kShortMoved),
+    MakeThread(0x40000003, (BYTE*)longPointer + kLongMoved),
+    MakeThread(0x40000004, test.unrelated)
+  });
+  CHECK(Detach(shortPointer, longPointer));
+  CHECK(shortPointer == test.shortTarget && longPointer == test.longTarget);
+  CHECK(FindThread(0x40000001).context.Rip == (DWORD64)(ULONG_PTR)(test.shortTarget + 1));
+  CHECK(FindThread(0x40000002).context.Rip == (DWORD64)(ULONG_PTR)(test.shortTarget + kShortMoved));
+  CHECK(FindThread(0x40000003).context.Rip == (DWORD64)(ULONG_PTR)(test.longTarget + kLongMoved));
+  CHECK(FindThread(0x40000004).context.Rip == (DWORD64)(ULONG_PTR)test.unrelated);
+  CHECK_EQUAL(0, FindThread(0x40000004).contextWrites);
+
+  // Check that the targets run their original code again
+  CHECK_EQUAL((int)kShortValue, ((GeneratedFunction)test.shortTarget)());
+  CHECK_EQUAL((int)kLongValue, ((GeneratedFunction)test.longTarget)());
+  SetShimThreads({});
+}
+
+// main function
+int main()
+{
+  TestCode test = {};
+  CHECK(GenerateCode(test));
+  if (test.code == NULL)
+    return TestResult("DetourThreadTest");
+  TestBookkeeping(test);
+  TestAttachFixups(test);
+  TestDetachFixups(test);
+  return TestResult("DetourThreadTest");
+}
@@ -0,0 +1,86 @@
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+#include <windows.h>
+#include <detours.h>
+
+#include "ElfText.h"
+#include "TestCommon.h"
+
+// Benchmark of the Detours x64 instruction decoder over the code of local ELF binaries
+// Note: every file is decoded front to back with DetourCopyInstruction, which is how Detours walks a target, so the
+//   padding and data between functions are decoded too, and every pass after the first decodes the same addresses again
+//   so that it also checks that the decode cache replays exactly what the decoder found
+
+// Result of decoding a file once
+struct DecodePass
+{
+  uint64_t instructions;
+  uint64_t bytes;
+  uint64_t badLengths;
+  double seconds;
+};
+
+// DecodeText function
+static DecodePass DecodeText(const ElfText& text)
+{
+  DecodePass pass = {};
+  PBYTE code = (PBYTE)text.code.data();
+  PBYTE end = code + text.size;
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  for (PBYTE instruction = code; instruction < end; pass.instructions++)
+  {
+    PBYTE next = (PBYTE)DetourCopyInstruction(NULL, NULL, instruction, NULL, NULL);
+    if (next <= instruction || next - instruction > 15)
+    {
+      pass.badLengths++;
+      next = instruction + 1;
+    }
+    instruction = next;
+  }
+  pass.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  pass.bytes = text.size;
+  return pass;
+}
+
+// main function
+int main(int argc, char* argv[])
+{
+  // Parse the number of passes and the files to decode, by default this executable
+  unsigned int passCount = argc > 1 ? (unsigned int)strtoul(argv[1], nullptr, 10) : 5;
+  std::vector<const char*> paths(argv + (argc > 2 ? 2 : argc), argv + argc);
+  if (paths.empty())
+    paths.push_back("/proc/self/exe");
+  CHECK(passCount > 0);
+  if (gTestFailures != 0)
+    return TestResult("DisasmBenchmark");
+
+  printf("%-48s %6s %12s %12s %14s %14s\n", "file", "pass", "instructions", "bytes", "instructions/s", "MB/s");
+  for (const char* path : paths)
+  {
+    ElfText text = {};
+    bool read = ReadElfText(path, text);
+    CHECK(read);
+    if (!read || text.size == 0)
+      continue;
+
+    std::vector<DecodePass> passes;
+    for (unsigned int i = 0; i < passCount; i++)
+    {
+      passes.push_back(DecodeText(text));
+      const DecodePass& pass = passes.back();
+      printf("%-48s %6u %12llu %12llu %14.0f %14.1f\n", path, i + 1, (unsigned long long)pass.instructions,
+        (unsigned long long)pass.bytes, pass.instructions / pass.seconds, pass.bytes / pass.seconds / 1e6);
+    }
+
+    // Check that every instruction had a valid length and that every pass found the same instructions
+    for (const DecodePass& pass : passes)
+    {
+      CHECK_EQUAL(0, pass.badLengths);
+      CHECK_EQUAL(passes[0].instructions, pass.instructions);
+    }
+    CHECK(passes[0].instructions > 0);
+  }
+  return TestResult("DisasmBenchmark");
+}
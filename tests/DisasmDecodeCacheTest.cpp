@@ -0,0 +1,197 @@
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <windows.h>
+#include <detours.h>
+
+#include "ElfText.h"
+#include "TestCommon.h"
+
+// Tests for the decode cache of the Detours x64 decoder, every decode replayed from the cache is compared against a
+//   decode of the same bytes with the cache disabled
+// Note: the cached decode and its replay copy to different destinations, so the relative targets they adjust and the
+//   extra bytes they need differ from each other and each is compared against the uncached decode to the same place
+// Note: disabling the cache empties it, so the first decode with the cache enabled again always walks the tables
+
+static const size_t kDstSize = 64;
+static const size_t kRandomSize = 0x10000;
+static const size_t kPadding = 32;
+
+// Result of one decode
+struct Decode
+{
+  PBYTE next;
+  PVOID target;
+  LONG extra;
+  BYTE dst[kDstSize];
+};
+
+// DecodeAt function
+static Decode DecodeAt(PBYTE src, PBYTE dst)
+{
+  Decode decode;
+  memset(dst, 0xcc, kDstSize);
+  decode.target = NULL;
+  decode.extra = 0;
+  decode.next = (PBYTE)DetourCopyInstruction(dst, NULL, src, &decode.target, &decode.extra);
+  memcpy(decode.dst, dst, kDstSize);
+  return decode;
+}
+
+// IsSameDecode function
+static bool IsSameDecode(const Decode& expected, const Decode& actual)
+{
+  return expected.next == actual.next && expected.target == actual.target && expected.extra == actual.extra &&
+    memcmp(expected.dst, actual.dst, kDstSize) == 0;
+}
+
+// CompareAt function
+// Note: decodes to a destination near the source and to a distant one, returns whether the replays matched, and
+//   prints the first few that did not
+static bool CompareAt(PBYTE src, PBYTE nearBy, PBYTE distant, uint64_t& mismatches)
+{
+  DetourSetDecodeCache(FALSE);
+  Decode expectedNear = DecodeAt(src, nearBy);
+  Decode expectedFar = DecodeAt(src, distant);
+  DetourSetDecodeCache(TRUE);
+  Decode cached = DecodeAt(src, nearBy);
+  Decode replayed = DecodeAt(src, distant);
+  Decode replayedNear = DecodeAt(src, nearBy);
+
+  bool same = IsSameDecode(expectedNear, cached) && IsSameDecode(expectedFar, replayed) &&
+    IsSameDecode(expectedNear, replayedNear);
+  if (!same && mismatches++ < 20)
+  {
+    fprintf(stderr, "decode at %p differs from the uncached decode:", (void*)src);
+    for (size_t n = 0; n < 16; n++)
+      fprintf(stderr, " %02x", src[n]);
+    fprintf(stderr, " (next %+ld/%+ld, extra %ld/%ld)\n", (long)(replayed.next - src), (long)(expectedFar.next - src),
+      (long)replayed.extra, (long)expectedFar.extra);
+  }
+  return same;
+}
+
+// Instruction of the hand written corpus
+struct CorpusInstruction
+{
+  const char* name;
+  BYTE bytes[16];
+  size_t size;
+};
+
+// One instruction for each way the decoder ends a decode: plain copies, relative code and data targets of each size,
+//   targets that must not be enlarged, dynamic targets, and the instructions that are never cached
+static const CorpusInstruction kCorpus[] = {
+  { "mov rbp, rsp", { 0x48, 0x89, 0xe5 }, 3 },
+  { "sub rsp, 0x28", { 0x48, 0x83, 0xec, 0x28 }, 4 },
+  { "mov rax, imm64", { 0x48, 0xb8, 1, 2, 3, 4, 5, 6, 7, 8 }, 10 },
+  { "mov rax, [rip+0x100]", { 0x48, 0x8b, 0x05, 0x00, 0x01, 0x00, 0x00 }, 7 },
+  { "lea rcx, [rip-0x100]", { 0x48, 0x8d, 0x0d, 0x00, 0xff, 0xff, 0xff }, 7 },
+  { "cmp byte [rip+0x10], 1", { 0x80, 0x3d, 0x10, 0x00, 0x00, 0x00, 0x01 }, 7 },
+  { "call rel32", { 0xe8, 0x00, 0x01, 0x00, 0x00 }, 5 },
+  { "jmp rel32", { 0xe9, 0x00, 0xff, 0xff, 0xff }, 5 },
+  { "jmp rel8", { 0xeb, 0x10 }, 2 },
+  { "je rel8", { 0x74, 0x10 }, 2 },
+  { "je rel32", { 0x0f, 0x84, 0x00, 0x01, 0x00, 0x00 }, 6 },
+  { "jrcxz rel8", { 0xe3, 0x10 }, 2 },
+  { "loop rel8", { 0xe2, 0xfe }, 2 },
+  { "call [rip]", { 0xff, 0x15, 0x00, 0x00, 0x00, 0x00 }, 6 },
+  { "jmp [rip]", { 0xff, 0x25, 0x00, 0x00, 0x00, 0x00 }, 6 },
+  { "jmp rax", { 0xff, 0xe0 }, 2 },
+  { "call rax", { 0xff, 0xd0 }, 2 },
+  { "ret", { 0xc3 }, 1 },
+  { "ret 8", { 0xc2, 0x08, 0x00 }, 3 },
+  { "int 3", { 0xcc }, 1 },
+  { "ud2", { 0x0f, 0x0b }, 2 },
+  { "nop word [rax+rax]", { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 }, 6 },
+  { "rep stosq", { 0xf3, 0x48, 0xab }, 3 },
+  { "mov ax, imm16", { 0x66, 0xb8, 0x34, 0x12 }, 4 },
+  { "vzeroupper", { 0xc5, 0xf8, 0x77 }, 3 },
+  { "vmovups ymm0, [rip+0x20]", { 0xc5, 0xfc, 0x10, 0x05, 0x20, 0x00, 0x00, 0x00 }, 8 },
+  { "vmovups zmm0, [rip+0x40]", { 0x62, 0xf1, 0x7c, 0x48, 0x10, 0x05, 0x40, 0x00, 0x00, 0x00 }, 10 },
+  { "movaps xmm0, [rip+0x30]", { 0x0f, 0x28, 0x05, 0x30, 0x00, 0x00, 0x00 }, 7 },
+};
+
+// TestCorpus function
+static void TestCorpus(PBYTE distant)
+{
+  // Check every instruction of the corpus, then that one with its first byte changed is decoded again rather than
+  //   replayed
+  // Note: the first byte is the one changed since another displacement would make an indirect call or jump read
+  //   outside of the code
+  uint64_t mismatches = 0;
+  for (const CorpusInstruction& instruction : kCorpus)
+  {
+    std::vector<BYTE> code(instruction.size + kPadding + kDstSize, 0x90);
+    memcpy(code.data(), instruction.bytes, instruction.size);
+    PBYTE src = code.data();
+    PBYTE nearBy = code.data() + instruction.size + kPadding;
+    if (!CompareAt(src, nearBy, distant, mismatches))
+      fprintf(stderr, "corpus instruction %s differs\n", instruction.name);
+
+    DetourSetDecodeCache(FALSE);
+    src[0] ^= 0x01;
+    Decode expected = DecodeAt(src, distant);
+    src[0] ^= 0x01;
+    DetourSetDecodeCache(TRUE);
+    DecodeAt(src, distant);
+    src[0] ^= 0x01;
+    CHECK(IsSameDecode(expected, DecodeAt(src, distant)));
+  }
+  CHECK_EQUAL(0, mismatches);
+}
+
+// TestRandom function
+static void TestRandom(PBYTE distant)
+{
+  // Check a decode at every offset of random bytes, which reach every opcode table and prefix combination
+  // Note: the bytes leave out 0xff since the decoder reads the pointer an indirect call or jump through memory goes
+  //   through, which random bytes would place anywhere, the corpus covers those instead
+  std::mt19937 random(0x5eed);
+  std::vector<BYTE> code(kRandomSize + kPadding + kDstSize);
+  for (BYTE& byte : code)
+    byte = (BYTE)(random() % 0xff);
+  PBYTE nearBy = code.data() + kRandomSize + kPadding;
+  uint64_t mismatches = 0;
+  for (size_t offset = 0; offset < kRandomSize; offset++)
+    CompareAt(code.data() + offset, nearBy, distant, mismatches);
+  printf("DisasmDecodeCacheTest: %zu random offsets, %llu mismatches\n", kRandomSize, (unsigned long long)mismatches);
+  CHECK_EQUAL(0, mismatches);
+}
+
+// TestText function
+static void TestText(PBYTE distant)
+{
+  // Check every instruction of this executable's own code in the order it is laid out
+  ElfText text = {};
+  bool read = ReadElfText("/proc/self/exe", text);
+  CHECK(read);
+  if (!read)
+    return;
+  std::vector<BYTE> nearBy(kDstSize);
+  uint64_t instructions = 0;
+  uint64_t mismatches = 0;
+  for (size_t offset = 0; offset < text.size; instructions++)
+  {
+    PBYTE src = text.code.data() + offset;
+    CompareAt(src, nearBy.data(), distant, mismatches);
+    PBYTE next = (PBYTE)DetourCopyInstruction(NULL, NULL, src, NULL, NULL);
+    offset += next != NULL && next > src ? (size_t)(next - src) : 1;
+  }
+  printf("DisasmDecodeCacheTest: %llu instructions, %llu mismatches\n", (unsigned long long)instructions,
+    (unsigned long long)mismatches);
+  CHECK(instructions > 0);
+  CHECK_EQUAL(0, mismatches);
+}
+
+// main function
+int main()
+{
+  // The distant destination is allocated apart from every source, like a trampoline
+  std::vector<BYTE> distant(kDstSize);
+  TestCorpus(distant.data());
+  TestRandom(distant.data());
+  TestText(distant.data());
+  return TestResult("DisasmDecodeCacheTest");
+}
@@ -0,0 +1,123 @@
+#include <cctype>
+#include <climits>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <windows.h>
+#include <detours.h>
+
+#include "ElfText.h"
+#include "TestCommon.h"
+
+// Differential test of the instruction lengths found by the Detours x64 decoder against objdump
+// Note: objdump decodes the .text section of every file and the Detours decoder is run at each address objdump found
+//   an instruction at, so the two only have to agree on lengths, which is all Detours needs to relocate code
+// Note: the test is skipped, with the return code ctest is told to treat as skipped, when objdump is not installed
+
+static const char* const kObjdumpPath = "/usr/bin/objdump";
+static const int kSkipReturnCode = 77;
+
+// Instruction decoded by objdump
+struct ReferenceInstruction
+{
+  ULONG_PTR address;
+  unsigned int length;
+  std::string line;
+};
+
+// ParseObjdumpLine function
+static bool ParseObjdumpLine(const char* line, ReferenceInstruction& instruction)
+{
+  // Parse "  address:<tab>bytes<tab>mnemonic operands", where the bytes are two hex digits each separated by spaces
+  // Note: lines objdump could not decode are left out since there is no length to compare with
+  unsigned long long address;
+  int consumed = 0;
+  if (sscanf(line, " %llx:%n", &address, &consumed) != 1 || consumed == 0 || line[consumed] != '\t' ||
+    strstr(line, "(bad)") != NULL)
+    return false;
+  instruction.address = (ULONG_PTR)address;
+  instruction.length = 0;
+  for (const char* bytes = line + consumed + 1; isxdigit((unsigned char)bytes[0]) && isxdigit((unsigned char)bytes[1]);
+    bytes += bytes[2] == ' ' ? 3 : 2)
+  {
+    instruction.length++;
+    if (bytes[2] != ' ')
+      break;
+  }
+  instruction.line = line;
+  return instruction.length != 0;
+}
+
+// DecodedLength function
+static unsigned int DecodedLength(const ElfText& text, const ReferenceInstruction& instruction)
+{
+  // Decode at the same address, counting a wait that objdump folds into the x87 instruction after it, like fstsw, as
+  //   part of that instruction since Detours rightly decodes it as an instruction of its own
+  PBYTE code = (PBYTE)text.code.data() + (instruction.address - text.address);
+  unsigned int length = (unsigned int)((PBYTE)DetourCopyInstruction(NULL, NULL, code, NULL, NULL) - code);
+  if (code[0] == 0x9b && length == 1 && instruction.length > 1)
+    length += (unsigned int)((PBYTE)DetourCopyInstruction(NULL, NULL, code + 1, NULL, NULL) - (code + 1));
+  return length;
+}
+
+// CompareFile function
+static void CompareFile(const char* path)
+{
+  ElfText text = {};
+  bool read = ReadElfText(path, text);
+  CHECK(read);
+  if (!read)
+    return;
+
+  std::string command = std::string(kObjdumpPath) + " -d --wide -j .text '" + path + "'";
+  FILE* objdump = popen(command.c_str(), "r");
+  CHECK(objdump != NULL);
+  if (objdump == NULL)
+    return;
+
+  // Compare every instruction and print the first few that disagree
+  uint64_t instructions = 0;
+  uint64_t mismatches = 0;
+  char line[1024];
+  ReferenceInstruction instruction;
+  while (fgets(line, sizeof(line), objdump) != NULL)
+  {
+    if (!ParseObjdumpLine(line, instruction) || instruction.address < text.address ||
+      instruction.address - text.address >= text.size)
+      continue;
+    instructions++;
+    unsigned int length = DecodedLength(text, instruction);
+    if (length != instruction.length && mismatches++ < 20)
+      fprintf(stderr, "%s: Detours decoded %u bytes, objdump %u: %s", path, length, instruction.length,
+        instruction.line.c_str());
+  }
+  CHECK_EQUAL(0, pclose(objdump));
+
+  printf("%s: %llu instructions, %llu mismatches\n", path, (unsigned long long)instructions,
+    (unsigned long long)mismatches);
+  CHECK(instructions > 0);
+  CHECK_EQUAL(0, mismatches);
+}
+
+// main function
+int main(int argc, char* argv[])
+{
+  if (access(kObjdumpPath, X_OK) != 0)
+  {
+    printf("DisasmDifferentialTest: %s not found, skipped\n", kObjdumpPath);
+    return kSkipReturnCode;
+  }
+
+  // Compare the files given, by default this executable
+  // Note: the link to this executable is resolved since /proc/self/exe would name objdump itself in objdump
+  std::vector<const char*> paths(argv + 1, argv + argc);
+  char selfPath[PATH_MAX];
+  if (paths.empty() && realpath("/proc/self/exe", selfPath) != NULL)
+    paths.push_back(selfPath);
+  CHECK(!paths.empty());
+  for (const char* path : paths)
+    CompareFile(path);
+  return TestResult("DisasmDifferentialTest");
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <elf.h>
+#include <vector>
+
+#include <windows.h>
+
+// Reader for the code of local ELF binaries, used as a corpus by the disassembler tests
+// Note: only 64 bit ELF files are read since the tests build Detours for x64 only
+
+// Padding after the code, longer than any instruction so that decoding the last bytes never reads past the buffer
+static const size_t kElfTextPadding = 16;
+
+// Code of the .text section of an ELF file
+struct ElfText
+{
+  std::vector<BYTE> code;
+  ULONG_PTR address;
+  size_t size;
+};
+
+// ReadElfText function
+inline bool ReadElfText(const char* path, ElfText& text)
+{
+  // Read the whole file and copy the .text section out of it, followed by int3 padding
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+  std::vector<BYTE> image;
+  BYTE buffer[65536];
+  size_t read;
+  while ((read = fread(buffer, 1, sizeof(buffer), file)) != 0)
+    image.insert(image.end(), buffer, buffer + read);
+  fclose(file);
+
+  if (image.size() < sizeof(Elf64_Ehdr))
+    return false;
+  const Elf64_Ehdr* header = (const Elf64_Ehdr*)image.data();
+  if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64 ||
+    header->e_shentsize != sizeof(Elf64_Shdr) || header->e_shoff > image.size() ||
+    header->e_shnum > (image.size() - header->e_shoff) / sizeof(Elf64_Shdr) || header->e_shstrndx >= header->e_shnum)
+    return false;
+  const Elf64_Shdr* sections = (const Elf64_Shdr*)(image.data() + header->e_shoff);
+  const Elf64_Shdr& names = sections[header->e_shstrndx];
+  if (names.sh_offset > image.size() || names.sh_size > image.size() - names.sh_offset)
+    return false;
+
+  for (unsigned int i = 0; i < header->e_shnum; i++)
+  {
+    const Elf64_Shdr& section = sections[i];
+    if (section.sh_name >= names.sh_size || section.sh_type != SHT_PROGBITS)
+      continue;
+    const char* name = (const char*)image.data() + names.sh_offset + section.sh_name;
+    if (strncmp(name, ".text", names.sh_size - section.sh_name) != 0)
+      continue;
+    if (section.sh_offset > image.size() || section.sh_size > image.size() - section.sh_offset)
+      return false;
+    text.code.assign(image.begin() + section.sh_offset, image.begin() + section.sh_offset + section.sh_size);
+    text.code.resize(section.sh_size + kElfTextPadding, 0xcc);
+    text.address = (ULONG_PTR)section.sh_addr;
+    text.size = (size_t)section.sh_size;
+    return true;
+  }
+  return false;
+}
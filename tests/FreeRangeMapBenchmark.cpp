@@ -0,0 +1,206 @@
+#include <chrono>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <vector>
+
+#include <windows.h>
+#include <detours.h>
+
+#include "TestCommon.h"
+
+// Benchmark of how Detours places new trampoline regions near a target in a fragmented address space
+// Note: a window just below where Detours starts looking is filled with small mappings, either replayed from a
+//   /proc/<pid>/maps file passed on the command line or generated so that no region aligned 64 KB block is free, and
+//   the same regions are allocated with the free range map in detours.cpp and with the VirtualQuery probe it replaced,
+//   counting the VirtualQuery calls each needs through the shim
+// Note: the shim answers every VirtualQuery by reading /proc/self/maps, which is far slower than on Windows, so the
+//   number of calls is the figure to compare rather than the time
+
+static const ULONG_PTR kRegionSize = 0x10000;
+static const ULONG_PTR kPageSize = 0x1000;
+static const ULONG_PTR kGigabyte = 0x40000000;
+
+// Mapping of the fragmented layout, relative to the bottom of the window
+struct LayoutMapping
+{
+  ULONG_PTR offset;
+  ULONG_PTR size;
+};
+
+// Result of allocating the regions with one of the placement strategies
+struct PlacementResult
+{
+  std::vector<PVOID> regions;
+  uint64_t virtualQueries;
+  double seconds;
+};
+
+// ReadLayout function
+static std::vector<LayoutMapping> ReadLayout(const char* path, ULONG_PTR windowSize)
+{
+  // Replay the sizes of the mappings in the file and the gaps between them until the window is full
+  // Note: gaps are capped at 1 MB so that the far apart parts of a real layout, like the stack and the executable,
+  //   do not leave the window mostly empty
+  std::vector<LayoutMapping> layout;
+  FILE* maps = fopen(path, "r");
+  if (maps == NULL)
+    return layout;
+  char line[512];
+  ULONG_PTR offset = kPageSize;
+  unsigned long long lastEnd = 0;
+  while (fgets(line, sizeof(line), maps) != NULL && offset < windowSize)
+  {
+    unsigned long long start;
+    unsigned long long end;
+    if (sscanf(line, "%llx-%llx", &start, &end) != 2 || end <= start)
+      continue;
+    if (lastEnd != 0 && start > lastEnd)
+      offset += (ULONG_PTR)std::min<unsigned long long>(start - lastEnd, 0x100000);
+    ULONG_PTR size = (ULONG_PTR)std::min<unsigned long long>(end - start, windowSize - offset);
+    if (size == 0)
+      break;
+    layout.push_back({ offset, size });
+    offset += size + kPageSize;
+    lastEnd = end;
+  }
+  fclose(maps);
+  return layout;
+}
+
+// GenerateLayout function
+static std::vector<LayoutMapping> GenerateLayout(ULONG_PTR windowSize)
+{
+  // Put one page somewhere other than the start of every 64 KB block, like the small allocations and guard pages that
+  //   fragment a process with many modules loaded
+  std::vector<LayoutMapping> layout;
+  for (ULONG_PTR block = 0; block < windowSize / kRegionSize; block++)
+    layout.push_back({ block * kRegionSize + (1 + (block * 7919) % 15) * kPageSize, kPageSize });
+  return layout;
+}
+
+// MapLayout function
+static bool MapLayout(BYTE* window, const std::vector<LayoutMapping>& layout)
+{
+  // Alternate the protection so that neighbouring mappings are never merged into one
+  for (size_t i = 0; i < layout.size(); i++)
+  {
+    void* pv = mmap(window + layout[i].offset, layout[i].size, i % 2 == 0 ? PROT_READ : PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (pv != window + layout[i].offset)
+      return false;
+  }
+  return true;
+}
+
+// ProbeRegionFromHi function
+static PVOID ProbeRegionFromHi(BYTE* lo, BYTE* hi)
+{
+  // Same as the probe Detours used before it had the free range map, one VirtualQuery per mapping it steps over
+  BYTE* tryAddress = (BYTE*)(((ULONG_PTR)hi - kRegionSize) & ~(kRegionSize - 1));
+  while (tryAddress > lo)
+  {
+    MEMORY_BASIC_INFORMATION mbi;
+    if (!VirtualQuery(tryAddress, &mbi, sizeof(mbi)))
+      break;
+    if (mbi.State == MEM_FREE && mbi.RegionSize >= kRegionSize)
+    {
+      PVOID pv = VirtualAlloc(tryAddress, kRegionSize, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+      if (pv != NULL)
+        return pv;
+      tryAddress -= kRegionSize;
+    }
+    else
+    {
+      // Note: free blocks smaller than a region only exist on Linux, where pages rather than 64 KB blocks are the
+      //   allocation granularity, and they have no allocation base to step below
+      PVOID base = mbi.State == MEM_FREE ? mbi.BaseAddress : mbi.AllocationBase;
+      tryAddress = (BYTE*)(((ULONG_PTR)base - kRegionSize) & ~(kRegionSize - 1));
+    }
+  }
+  return NULL;
+}
+
+// PlaceRegions function
+static PlacementResult PlaceRegions(BYTE* target, unsigned int regionCount, bool freeRangeMap)
+{
+  // Allocate the regions one at a time like attaching functions that each need a new region
+  PlacementResult result;
+  ResetShimCounters();
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  for (unsigned int i = 0; i < regionCount; i++)
+  {
+    PVOID region;
+    if (freeRangeMap)
+    {
+      DWORD size = 0;
+      region = DetourAllocateRegionWithinJumpBounds(target, &size);
+    }
+    else
+      region = ProbeRegionFromHi(target - 2 * kGigabyte, target - kGigabyte);
+    result.regions.push_back(region);
+  }
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  result.virtualQueries = gShimCounters.virtualQuery.load();
+  return result;
+}
+
+// main function
+int main(int argc, char* argv[])
+{
+  // Parse the number of regions to allocate, the size of the fragmented window, and the maps file to replay
+  unsigned int regionCount = argc > 1 ? (unsigned int)strtoul(argv[1], nullptr, 10) : 32;
+  ULONG_PTR windowSize = (argc > 2 ? strtoull(argv[2], nullptr, 10) : 512) * kRegionSize;
+  const char* mapsPath = argc > 3 ? argv[3] : nullptr;
+
+  // Map the target and find the window Detours searches first, the 1 GB or more below it
+  BYTE* target = (BYTE*)mmap(NULL, kPageSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK(target != MAP_FAILED);
+  BYTE* window = (BYTE*)(((ULONG_PTR)target - kGigabyte) & ~(kRegionSize - 1)) - windowSize;
+  MEMORY_BASIC_INFORMATION mbi;
+  CHECK(VirtualQuery(window, &mbi, sizeof(mbi)) != 0 && mbi.State == MEM_FREE && mbi.RegionSize >= windowSize);
+
+  // Fragment the window
+  std::vector<LayoutMapping> layout = mapsPath != nullptr ? ReadLayout(mapsPath, windowSize) :
+    GenerateLayout(windowSize);
+  CHECK(!layout.empty());
+  CHECK(MapLayout(window, layout));
+  if (gTestFailures != 0)
+    return TestResult("FreeRangeMapBenchmark");
+
+  // Allocate the regions with the probe and release them, then again with the free range map
+  PlacementResult probe = PlaceRegions(target, regionCount, false);
+  for (PVOID region : probe.regions)
+  {
+    if (region != NULL)
+      VirtualFree(region, 0, MEM_RELEASE);
+  }
+  PlacementResult map = PlaceRegions(target, regionCount, true);
+
+  printf("FreeRangeMapBenchmark: %zu mappings in a %llu MB window (%s), %u regions\n", layout.size(),
+    (unsigned long long)(windowSize >> 20), mapsPath != nullptr ? mapsPath : "generated", regionCount);
+  printf("%16s %14s %16s %14s\n", "strategy", "seconds", "VirtualQuery", "regions/s");
+  printf("%16s %14.4f %16llu %14.0f\n", "probe", probe.seconds, (unsigned long long)probe.virtualQueries,
+    regionCount / probe.seconds);
+  printf("%16s %14.4f %16llu %14.0f\n", "free range map", map.seconds, (unsigned long long)map.virtualQueries,
+    regionCount / map.seconds);
+
+  // Check that both strategies placed every region at the same addresses, and that the map swept the address space
+  //   once rather than probing for every region
+  for (unsigned int i = 0; i < regionCount; i++)
+  {
+    CHECK(map.regions[i] != NULL);
+    CHECK(map.regions[i] == probe.regions[i]);
+    CHECK(((ULONG_PTR)map.regions[i] & (kRegionSize - 1)) == 0);
+  }
+  CHECK(map.virtualQueries < probe.virtualQueries);
+
+  for (PVOID region : map.regions)
+  {
+    if (region != NULL)
+      VirtualFree(region, 0, MEM_RELEASE);
+  }
+  for (const LayoutMapping& mapping : layout)
+    munmap(window + mapping.offset, mapping.size);
+  munmap(target, kPageSize);
+  return TestResult("FreeRangeMapBenchmark");
+}
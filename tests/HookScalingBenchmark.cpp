@@ -0,0 +1,163 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <InitializationState.h>
+
+#include "TestCommon.h"
+
+// Benchmark of how the detoured functions scale with the number of threads calling them at the same time
+// Note: the detoured functions themselves need Windows so this runs a portable model of their body, which has the same
+//   shared state accesses: the initialization state and reentrancy guard checks, the acquire load of the config
+//   pointer, and the relaxed statistics counters, and compares it with the same body serialized on a global mutex as
+//   the detoured functions used to be
+
+// Config the modelled detoured function spoofs the resolution with
+struct ModelConfig
+{
+  std::optional<int> width;
+  std::optional<int> height;
+};
+
+// Shared state of the modelled DLL
+std::atomic<InitializationState> gInitializationState = InitializationPending;
+std::atomic<const ModelConfig*> gConfig = nullptr;
+std::atomic<bool> gStatsEnabled = false;
+std::atomic<uint64_t> gStatsCalls = 0;
+std::atomic<uint64_t> gStatsSpoofHits = 0;
+std::mutex gConfigLock;
+thread_local bool gThreadInDetouredFunction = false;
+
+// ModelRealFunction function
+static int __attribute__((noinline)) ModelRealFunction(int index)
+{
+  return index == 0 ? 1280 : 720;
+}
+
+// ModelSpoof function
+static int ModelSpoof(const ModelConfig* config, int value, int index)
+{
+  const std::optional<int>& spoofedValue = index == 0 ? config->width : config->height;
+  if (!spoofedValue.has_value())
+    return value;
+  if (gStatsEnabled.load(std::memory_order_relaxed))
+    gStatsSpoofHits.fetch_add(1, std::memory_order_relaxed);
+  return *spoofedValue;
+}
+
+// ModelDetouredFunction function
+static int __attribute__((noinline)) ModelDetouredFunction(int index)
+{
+  // Pass the call straight through if initialization has not finished or if this thread is already inside
+  if (!IsInitializationReady(gInitializationState) || gThreadInDetouredFunction)
+    return ModelRealFunction(index);
+  gThreadInDetouredFunction = true;
+
+  // Call the real function, spoof the resolution, and update the statistics
+  int value = ModelRealFunction(index);
+  const ModelConfig* config = gConfig.load(std::memory_order_acquire);
+  if (config != nullptr)
+    value = ModelSpoof(config, value, index);
+  if (gStatsEnabled.load(std::memory_order_relaxed))
+    gStatsCalls.fetch_add(1, std::memory_order_relaxed);
+
+  gThreadInDetouredFunction = false;
+  return value;
+}
+
+// ModelLockedDetouredFunction function
+static int __attribute__((noinline)) ModelLockedDetouredFunction(int index)
+{
+  // Same as above but serialized on a global mutex
+  std::lock_guard<std::mutex> configLock(gConfigLock);
+  int value = ModelRealFunction(index);
+  const ModelConfig* config = gConfig.load(std::memory_order_relaxed);
+  if (config != nullptr)
+    value = ModelSpoof(config, value, index);
+  if (gStatsEnabled.load(std::memory_order_relaxed))
+    gStatsCalls.fetch_add(1, std::memory_order_relaxed);
+  return value;
+}
+
+// RunThreads function
+static double RunThreads(unsigned int threadCount, uint64_t callsPerThread, int (*function)(int))
+{
+  // Start all of the threads at once and time until the last one has made all of its calls
+  std::atomic<unsigned int> ready = 0;
+  std::atomic<bool> start = false;
+  std::atomic<uint64_t> checksum = 0;
+  std::vector<std::thread> threads;
+  for (unsigned int i = 0; i < threadCount; i++)
+  {
+    threads.emplace_back([&]()
+    {
+      ready.fetch_add(1);
+      while (!start.load(std::memory_order_acquire))
+        std::this_thread::yield();
+      uint64_t sum = 0;
+      for (uint64_t call = 0; call < callsPerThread; call++)
+        sum += function((int)(call & 1));
+      checksum.fetch_add(sum, std::memory_order_relaxed);
+    });
+  }
+  while (ready.load() != threadCount)
+    std::this_thread::yield();
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  start.store(true, std::memory_order_release);
+  for (std::thread& thread : threads)
+    thread.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  // Check that every call was spoofed
+  CHECK_EQUAL(threadCount * (callsPerThread / 2) * (1920 + 1080), checksum.load());
+  return threadCount * callsPerThread / seconds;
+}
+
+// main function
+int main(int argc, char* argv[])
+{
+  // Parse the number of calls each thread makes
+  uint64_t callsPerThread = argc > 1 ? strtoull(argv[1], nullptr, 10) : 2000000;
+  callsPerThread &= ~1ull;
+
+  // Set up the modelled DLL
+  static const ModelConfig config = { 1920, 1080 };
+  gConfig.store(&config, std::memory_order_release);
+  CompleteInitialization(gInitializationState, true);
+
+  // Run the lock free and locked models with 1 to 64 threads, with statistics disabled and enabled
+  printf("HookScalingBenchmark: %u hardware threads, %llu calls per thread\n", std::thread::hardware_concurrency(),
+    (unsigned long long)callsPerThread);
+  for (bool stats : { false, true })
+  {
+    gStatsEnabled = stats;
+    printf("\nstatistics %s\n%8s %18s %10s %18s %10s\n", stats ? "enabled" : "disabled", "threads", "lock free calls/s",
+      "scaling", "mutex calls/s", "scaling");
+    double lockFreeBase = 0.0;
+    double lockedBase = 0.0;
+    for (unsigned int threadCount = 1; threadCount <= 64; threadCount *= 2)
+    {
+      double lockFree = RunThreads(threadCount, callsPerThread, ModelDetouredFunction);
+      double locked = RunThreads(threadCount, callsPerThread, ModelLockedDetouredFunction);
+      if (threadCount == 1)
+      {
+        lockFreeBase = lockFree;
+        lockedBase = locked;
+      }
+      printf("%8u %18.0f %9.2fx %18.0f %9.2fx\n", threadCount, lockFree, lockFree / lockFreeBase, locked,
+        locked / lockedBase);
+    }
+  }
+
+  // Check that a nested call made from inside a detoured function is passed straight through
+  gThreadInDetouredFunction = true;
+  CHECK_EQUAL(1280, ModelDetouredFunction(0));
+  gThreadInDetouredFunction = false;
+  CHECK_EQUAL(1920, ModelDetouredFunction(0));
+
+  return TestResult("HookScalingBenchmark");
+}
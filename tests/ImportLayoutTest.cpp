@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <windows.h>
+
+// The import functions are static in creatwth.cpp, which includes them from uimports.cpp, so the test is built with it
+#include <creatwth.cpp>
+
+#include "TestCommon.h"
+
+// Tests for how the Detours process functions add DLLs to the import table of a process, PlanImportLayout and
+//   BuildImports64 on their own and UpdateImports64 end to end on a synthetic PE32+ image mapped into the test
+// Note: the image is updated through a CDetourRemoteSession on the current process, as the Detours process functions
+//   update a suspended child process
+
+static const DWORD kHeadersSize = 0x400;
+static const DWORD kImportsRva = 0x1000;
+static const DWORD kImageSize = 0x3000;
+static const DWORD kOldImportCount = 2;
+
+// Names of the DLLs that are added, the second with the ?? that is replaced by the bitness
+static LPCSTR gDlls[] = { "first.dll", "spoofres??.dll" };
+
+// TestPlan function
+static void TestPlan()
+{
+  // Check the layout for two DLLs in front of the old descriptors, with every table pointer aligned
+  DETOUR_IMPORT_LAYOUT layout;
+  CHECK(PlanImportLayout(sizeof(IMAGE_THUNK_DATA64), 3, gDlls, 2, layout));
+  CHECK_EQUAL(5, layout.nDescriptors);
+  CHECK_EQUAL(104, layout.obOriginalThunks);
+  CHECK_EQUAL(104 + 2 * 2 * sizeof(IMAGE_THUNK_DATA64), layout.obFirstThunks);
+  CHECK_EQUAL(layout.obFirstThunks + 2 * 2 * sizeof(IMAGE_THUNK_DATA64), layout.obNames);
+  CHECK_EQUAL(layout.obNames + 12 + 16, layout.cbTotal);
+
+  // Check that a terminator is reserved when there is no old import directory
+  CHECK(PlanImportLayout(sizeof(IMAGE_THUNK_DATA64), 0, gDlls, 1, layout));
+  CHECK_EQUAL(2, layout.nDescriptors);
+  CHECK_EQUAL(40, layout.obOriginalThunks);
+  CHECK_EQUAL(layout.obNames + 12, layout.cbTotal);
+
+  // Check that descriptor counts read from a corrupt image are refused instead of wrapping the sizes
+  CHECK(!PlanImportLayout(sizeof(IMAGE_THUNK_DATA64), 0xffffffff, gDlls, 2, layout));
+  CHECK(!PlanImportLayout(sizeof(IMAGE_THUNK_DATA64), 0xffffffff / sizeof(IMAGE_IMPORT_DESCRIPTOR), gDlls, 2,
+    layout));
+  CHECK(!PlanImportLayout(sizeof(IMAGE_THUNK_DATA64), 0xfffffff0 / sizeof(IMAGE_IMPORT_DESCRIPTOR) - 1, gDlls, 2,
+    layout));
+}
+
+// CheckNewDescriptors function
+static void CheckNewDescriptors(const BYTE* block, DWORD obBase, const DETOUR_IMPORT_LAYOUT& layout)
+{
+  // Check that every new DLL imports ordinal 1 through its own thunks and that its name had the bitness filled in
+  // Note: the RVAs are relative to the module so they are turned back into offsets in the block with obBase
+  const IMAGE_IMPORT_DESCRIPTOR* descriptors = (const IMAGE_IMPORT_DESCRIPTOR*)block;
+  const char* names[] = { "first.dll", "spoofres64.dll" };
+  for (DWORD n = 0; n < 2; n++)
+  {
+    CHECK_EQUAL(obBase + layout.obOriginalThunks + n * 2 * sizeof(IMAGE_THUNK_DATA64),
+      descriptors[n].OriginalFirstThunk);
+    CHECK_EQUAL(obBase + layout.obFirstThunks + n * 2 * sizeof(IMAGE_THUNK_DATA64), descriptors[n].FirstThunk);
+    CHECK_EQUAL(0, descriptors[n].TimeDateStamp);
+    CHECK(descriptors[n].Name >= obBase + layout.obNames && descriptors[n].Name < obBase + layout.cbTotal);
+    if (descriptors[n].Name >= obBase + layout.obNames && descriptors[n].Name < obBase + layout.cbTotal)
+      CHECK(strcmp((const char*)block + (descriptors[n].Name - obBase), names[n]) == 0);
+    for (DWORD table : { layout.obOriginalThunks, layout.obFirstThunks })
+    {
+      const IMAGE_THUNK_DATA64* thunks = (const IMAGE_THUNK_DATA64*)(block + table) + n * 2;
+      CHECK(thunks[0].u1.Ordinal == IMAGE_ORDINAL_FLAG64 + 1);
+      CHECK(thunks[1].u1.Ordinal == 0);
+    }
+  }
+}
+
+// TestBuild function
+static void TestBuild()
+{
+  // Check the block built for two DLLs, with the room for the old descriptors left zeroed for the caller
+  DETOUR_IMPORT_LAYOUT layout;
+  CHECK(PlanImportLayout(sizeof(IMAGE_THUNK_DATA64), 3, gDlls, 2, layout));
+  std::vector<BYTE> block(layout.cbTotal, 0xcd);
+  const DWORD obBase = 0x20000;
+  CHECK(BuildImports64(layout, obBase, gDlls, 2, block.data()));
+  CheckNewDescriptors(block.data(), obBase, layout);
+  const BYTE* oldDescriptors = block.data() + 2 * sizeof(IMAGE_IMPORT_DESCRIPTOR);
+  const BYTE* thunks = block.data() + layout.obOriginalThunks;
+  CHECK(std::all_of(oldDescriptors, thunks, [](BYTE b) { return b == 0; }));
+}
+
+// MapImage function
+static PBYTE MapImage(DWORD importRva, DWORD importSize, WORD magic)
+{
+  // Lay out the headers and an .idata section holding the old import directory, the names it refers to, and a bound
+  //   import directory that has to be dropped
+  PBYTE module = (PBYTE)VirtualAlloc(NULL, kImageSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  if (module == NULL)
+    return NULL;
+  PIMAGE_DOS_HEADER dosHeader = (PIMAGE_DOS_HEADER)module;
+  dosHeader->e_magic = IMAGE_DOS_SIGNATURE;
+  dosHeader->e_lfanew = 0x80;
+
+  PIMAGE_NT_HEADERS64 ntHeader = (PIMAGE_NT_HEADERS64)(module + dosHeader->e_lfanew);
+  ntHeader->Signature = IMAGE_NT_SIGNATURE;
+  ntHeader->FileHeader.Machine = IMAGE_FILE_MACHINE_AMD64;
+  ntHeader->FileHeader.NumberOfSections = 1;
+  ntHeader->FileHeader.SizeOfOptionalHeader = sizeof(IMAGE_OPTIONAL_HEADER64);
+  ntHeader->OptionalHeader.Magic = magic;
+  ntHeader->OptionalHeader.BaseOfCode = kImportsRva;
+  ntHeader->OptionalHeader.SizeOfInitializedData = kImageSize - kImportsRva;
+  ntHeader->OptionalHeader.SectionAlignment = 0x1000;
+  ntHeader->OptionalHeader.FileAlignment = 0x200;
+  ntHeader->OptionalHeader.SizeOfImage = kImageSize;
+  ntHeader->OptionalHeader.SizeOfHeaders = kHeadersSize;
+  ntHeader->OptionalHeader.CheckSum = 0x12345;
+  ntHeader->OptionalHeader.NumberOfRvaAndSizes = IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+  ntHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress = importRva;
+  ntHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size = importSize;
+  ntHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT].VirtualAddress = 0x300;
+  ntHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT].Size = 0x40;
+
+  PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(ntHeader);
+  memcpy(section->Name, ".idata", 6);
+  section->Misc.VirtualSize = 0x1000;
+  section->VirtualAddress = kImportsRva;
+  section->SizeOfRawData = 0x200;
+  section->PointerToRawData = kHeadersSize;
+
+  PIMAGE_IMPORT_DESCRIPTOR descriptors = (PIMAGE_IMPORT_DESCRIPTOR)(module + kImportsRva);
+  const char* names[kOldImportCount] = { "kernel32.dll", "user32.dll" };
+  for (DWORD n = 0; n < kOldImportCount; n++)
+  {
+    descriptors[n].OriginalFirstThunk = kImportsRva + 0x200 + n * 0x10;
+    descriptors[n].FirstThunk = kImportsRva + 0x300 + n * 0x10;
+    descriptors[n].Name = kImportsRva + 0x100 + n * 0x20;
+    strcpy((char*)module + descriptors[n].Name, names[n]);
+  }
+  return module;
+}
+
+// UpdateImage function
+static BOOL UpdateImage(PBYTE module)
+{
+  CDetourRemoteSession session(GetCurrentProcess());
+  return UpdateImports64(session, (HMODULE)module, gDlls, 2) && session.Flush();
+}
+
+// TestUpdate function
+static void TestUpdate()
+{
+  // Check that the new directory lists the new DLLs, then the old descriptors and their terminator, and that the
+  //   header points the loader at it and no longer at the bound imports
+  const DWORD importSize = (kOldImportCount + 1) * sizeof(IMAGE_IMPORT_DESCRIPTOR);
+  PBYTE module = MapImage(kImportsRva, importSize, IMAGE_NT_OPTIONAL_HDR64_MAGIC);
+  CHECK(module != NULL);
+  if (module == NULL)
+    return;
+  std::vector<BYTE> oldDirectory(module + kImportsRva, module + kImportsRva + importSize);
+  CHECK(UpdateImage(module));
+
+  PIMAGE_NT_HEADERS64 ntHeader = (PIMAGE_NT_HEADERS64)(module + ((PIMAGE_DOS_HEADER)module)->e_lfanew);
+  IMAGE_DATA_DIRECTORY imports = ntHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+  DETOUR_IMPORT_LAYOUT layout;
+  CHECK(PlanImportLayout(sizeof(IMAGE_THUNK_DATA64), kOldImportCount + 1, gDlls, 2, layout));
+  CHECK(imports.VirtualAddress >= kImageSize);
+  CHECK_EQUAL(layout.cbTotal, imports.Size);
+  CHECK_EQUAL(0, ntHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT].VirtualAddress);
+  CHECK_EQUAL(0, ntHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT].Size);
+  CHECK_EQUAL(kImportsRva, ntHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IAT].VirtualAddress);
+  CHECK_EQUAL(0, ntHeader->OptionalHeader.CheckSum);
+  if (imports.VirtualAddress >= kImageSize && imports.Size == layout.cbTotal)
+  {
+    const BYTE* block = module + imports.VirtualAddress;
+    CheckNewDescriptors(block, imports.VirtualAddress, layout);
+    CHECK(memcmp(block + 2 * sizeof(IMAGE_IMPORT_DESCRIPTOR), oldDirectory.data(), importSize) == 0);
+    VirtualFree(module + imports.VirtualAddress, 0, MEM_RELEASE);
+  }
+  VirtualFree(module, 0, MEM_RELEASE);
+
+  // Check that an image without imports gets a terminator after the new descriptors and the block as its IAT
+  module = MapImage(0, 0, IMAGE_NT_OPTIONAL_HDR64_MAGIC);
+  CHECK(module != NULL);
+  if (module == NULL)
+    return;
+  CHECK(UpdateImage(module));
+  ntHeader = (PIMAGE_NT_HEADERS64)(module + ((PIMAGE_DOS_HEADER)module)->e_lfanew);
+  imports = ntHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+  CHECK(PlanImportLayout(sizeof(IMAGE_THUNK_DATA64), 0, gDlls, 2, layout));
+  CHECK_EQUAL(3, layout.nDescriptors);
+  CHECK_EQUAL(layout.cbTotal, imports.Size);
+  CHECK_EQUAL(imports.VirtualAddress, ntHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IAT].VirtualAddress);
+  if (imports.VirtualAddress >= kImageSize && imports.Size == layout.cbTotal)
+  {
+    const BYTE* block = module + imports.VirtualAddress;
+    CheckNewDescriptors(block, imports.VirtualAddress, layout);
+    IMAGE_IMPORT_DESCRIPTOR terminator = {};
+    CHECK(memcmp(block + 2 * sizeof(IMAGE_IMPORT_DESCRIPTOR), &terminator, sizeof(terminator)) == 0);
+    VirtualFree(module + imports.VirtualAddress, 0, MEM_RELEASE);
+  }
+  VirtualFree(module, 0, MEM_RELEASE);
+}
+
+// TestUpdateErrors function
+static void TestUpdateErrors()
+{
+  // Check that a corrupt import directory size and a PE32 image are refused before anything is allocated or written
+  for (WORD magic : { (WORD)IMAGE_NT_OPTIONAL_HDR64_MAGIC, (WORD)IMAGE_NT_OPTIONAL_HDR32_MAGIC })
+  {
+    bool corrupt = magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+    PBYTE module = MapImage(kImportsRva, corrupt ? 0xfffffff0 : sizeof(IMAGE_IMPORT_DESCRIPTOR), magic);
+    CHECK(module != NULL);
+    if (module == NULL)
+      continue;
+    std::vector<BYTE> headers(module, module + kHeadersSize);
+    ResetShimCounters();
+    CHECK(!UpdateImage(module));
+    if (!corrupt)
+      CHECK_EQUAL(ERROR_INVALID_BLOCK, GetLastError());
+    CHECK_EQUAL(0, gShimCounters.virtualAlloc);
+    CHECK(memcmp(module, headers.data(), kHeadersSize) == 0);
+    VirtualFree(module, 0, MEM_RELEASE);
+  }
+}
+
+// main function
+int main()
+{
+  TestPlan();
+  TestBuild();
+  TestUpdate();
+  TestUpdateErrors();
+  return TestResult("ImportLayoutTest");
+}
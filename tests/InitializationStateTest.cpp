@@ -0,0 +1,148 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <InitializationState.h>
+
+#include "TestCommon.h"
+
+// Tests for the staged initialization state machine
+// Note: the concurrent tests model DllMain attaching a detoured function that passes calls straight through while an
+//   initialization thread sets up the config, so that the callers can check they never see a partially set up config
+
+// Config set up by the modelled initialization thread, it is written with plain stores on purpose
+struct ModelConfig
+{
+  int width;
+  int height;
+  int refreshRate;
+  int checksum;
+};
+
+// ModelDetouredFunction function
+static bool ModelDetouredFunction(const std::atomic<InitializationState>& state, const ModelConfig& config,
+  bool& consistent)
+{
+  // Pass the call straight through until the initialization is ready, then spoof it using the config
+  if (!IsInitializationReady(state))
+    return false;
+  consistent = config.width + config.height + config.refreshRate == config.checksum && config.width == 1920;
+  return true;
+}
+
+// TestTransitions function
+static void TestTransitions()
+{
+  std::atomic<InitializationState> state = InitializationPending;
+  CHECK(IsInitializationPending(state));
+  CHECK(!IsInitializationReady(state));
+  CHECK(CompleteInitialization(state, true));
+  CHECK(IsInitializationReady(state));
+  CHECK(!IsInitializationPending(state));
+
+  // Check that the initialization cannot be completed twice
+  CHECK(!CompleteInitialization(state, false));
+  CHECK(IsInitializationReady(state));
+
+  // Check that a failed initialization keeps the detoured functions passing calls through
+  std::atomic<InitializationState> failed = InitializationPending;
+  CHECK(CompleteInitialization(failed, false));
+  CHECK(!IsInitializationReady(failed));
+  CHECK(!IsInitializationPending(failed));
+  CHECK(!CompleteInitialization(failed, true));
+  CHECK_EQUAL(InitializationFailed, failed.load());
+}
+
+// TestConcurrentCallers function
+static void TestConcurrentCallers(bool succeeded)
+{
+  std::atomic<InitializationState> state = InitializationPending;
+  ModelConfig config = {};
+
+  // Start the callers, each keeps calling the detoured function until it has seen the initialization finish
+  const unsigned int callerCount = 8;
+  std::atomic<bool> stop = false;
+  std::atomic<uint64_t> passedThrough = 0;
+  std::atomic<uint64_t> spoofed = 0;
+  std::atomic<uint64_t> inconsistent = 0;
+  std::vector<std::thread> callers;
+  for (unsigned int i = 0; i < callerCount; i++)
+  {
+    callers.emplace_back([&]()
+    {
+      while (!stop.load(std::memory_order_relaxed))
+      {
+        bool consistent = false;
+        if (!ModelDetouredFunction(state, config, consistent))
+        {
+          passedThrough.fetch_add(1, std::memory_order_relaxed);
+          continue;
+        }
+        spoofed.fetch_add(1, std::memory_order_relaxed);
+        if (!consistent)
+          inconsistent.fetch_add(1, std::memory_order_relaxed);
+      }
+    });
+  }
+
+  // Let the callers run against the pass through state for a while, then set up the config and complete the
+  //   initialization on a separate thread
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  std::thread initializer([&]()
+  {
+    config.width = 1920;
+    config.height = 1080;
+    config.refreshRate = 60;
+    config.checksum = config.width + config.height + config.refreshRate;
+    CHECK(CompleteInitialization(state, succeeded));
+  });
+  initializer.join();
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  stop = true;
+  for (std::thread& caller : callers)
+    caller.join();
+
+  // Check that calls were passed through before and spoofed with a complete config after, or passed through all along
+  //   if the initialization failed
+  CHECK(passedThrough.load() > 0);
+  if (succeeded)
+    CHECK(spoofed.load() > 0);
+  else
+    CHECK_EQUAL(0, spoofed.load());
+  CHECK_EQUAL(0, inconsistent.load());
+}
+
+// TestRacingCompletions function
+static void TestRacingCompletions()
+{
+  // Check that exactly one of several threads racing to complete the initialization wins
+  for (int round = 0; round < 100; round++)
+  {
+    std::atomic<InitializationState> state = InitializationPending;
+    std::atomic<int> winners = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++)
+    {
+      threads.emplace_back([&, i]()
+      {
+        if (CompleteInitialization(state, i % 2 == 0))
+          winners.fetch_add(1);
+      });
+    }
+    for (std::thread& thread : threads)
+      thread.join();
+    CHECK_EQUAL(1, winners.load());
+    CHECK(!IsInitializationPending(state));
+  }
+}
+
+// main function
+int main()
+{
+  TestTransitions();
+  TestConcurrentCallers(true);
+  TestConcurrentCallers(false);
+  TestRacingCompletions();
+  return TestResult("InitializationStateTest");
+}
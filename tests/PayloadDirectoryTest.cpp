@@ -0,0 +1,220 @@
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+#include <windows.h>
+
+// The remote payload lookup is static in creatwth.cpp, so the test is built with it like the import layout test
+#include <creatwth.cpp>
+
+#include "TestCommon.h"
+
+// Tests for the payload directory that DetourCopyPayloadsToProcess writes in front of the payloads of a .detour
+//   section, and for how DetourFindPayload and the remote lookup use it
+// Note: the payloads are copied into the current process, so the block is both the module DetourFindPayload reads and
+//   the remote section the remote lookup reads through the shim's ReadProcessMemory
+// Note: the GUIDs are listed out of the byte order the directory is sorted in, and one payload is empty
+
+static const GUID kGuids[] = {
+  { 0x7f000000, 0x0001, 0x0001, { 1, 1, 1, 1, 1, 1, 1, 1 } },
+  { 0x01000000, 0x0002, 0x0002, { 2, 2, 2, 2, 2, 2, 2, 2 } },
+  { 0x40000000, 0x0003, 0x0003, { 3, 3, 3, 3, 3, 3, 3, 3 } }
+};
+static const GUID kMissingGuid = { 0x40000000, 0x0003, 0x0003, { 3, 3, 3, 3, 3, 3, 3, 4 } };
+static const char kFirstData[] = "first payload";
+static const DWORD kSecondData[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+// Payloads copied into the current process and where their section is
+struct CopiedPayloads
+{
+  PBYTE base;
+  PDETOUR_SECTION_HEADER header;
+  PDETOUR_SECTION_RECORD first;
+  PVOID data[std::size(kGuids)];
+};
+
+// CopyPayloads function
+static bool CopyPayloads(DWORD count, CopiedPayloads& payloads)
+{
+  LPCVOID data[] = { kFirstData, kSecondData, NULL };
+  DWORD sizes[] = { sizeof(kFirstData), sizeof(kSecondData), 0 };
+  memset(&payloads, 0, sizeof(payloads));
+  if (!DetourCopyPayloadsToProcess(GetCurrentProcess(), count, kGuids, data, sizes, payloads.data))
+    return false;
+
+  // Find the block the payloads were copied into and its .detour section
+  MEMORY_BASIC_INFORMATION mbi;
+  if (VirtualQuery(payloads.data[0], &mbi, sizeof(mbi)) == 0)
+    return false;
+  payloads.base = (PBYTE)mbi.AllocationBase;
+  CDetourImageView view;
+  if (!view.Attach((HMODULE)payloads.base))
+    return false;
+  DWORD sectionCount = 0;
+  PIMAGE_SECTION_HEADER sections = view.Sections(&sectionCount);
+  if (sectionCount != 1 || strncmp((const char*)sections[0].Name, ".detour", sizeof(sections[0].Name)) != 0)
+    return false;
+  payloads.header = (PDETOUR_SECTION_HEADER)(payloads.base + sections[0].VirtualAddress);
+  payloads.first = (PDETOUR_SECTION_RECORD)((PBYTE)payloads.header + payloads.header->nDataOffset);
+  return true;
+}
+
+// Entries function
+static PDETOUR_PAYLOAD_DIRECTORY_ENTRY Entries(const CopiedPayloads& payloads)
+{
+  return (PDETOUR_PAYLOAD_DIRECTORY_ENTRY)(payloads.first + 1);
+}
+
+// FindLocal function
+static PVOID FindLocal(const CopiedPayloads& payloads, REFGUID guid, DWORD* size)
+{
+  return DetourFindPayload((HMODULE)payloads.base, guid, size);
+}
+
+// FindRemote function
+static PVOID FindRemote(const CopiedPayloads& payloads, REFGUID guid, DWORD* size)
+{
+  return FindPayloadInRemoteDetourSection(GetCurrentProcess(), guid, size, payloads.header);
+}
+
+// CheckFound function
+static void CheckFound(const CopiedPayloads& payloads)
+{
+  // Check that every payload is found at the address it was copied to with its size, both locally and remotely, and
+  //   that a GUID that is not there is not
+  DWORD sizes[] = { sizeof(kFirstData), sizeof(kSecondData), 0 };
+  for (auto find : { FindLocal, FindRemote })
+  {
+    for (size_t i = 0; i < std::size(kGuids); i++)
+    {
+      DWORD size = 0xffffffff;
+      CHECK(find(payloads, kGuids[i], &size) == payloads.data[i]);
+      CHECK_EQUAL(sizes[i], size);
+    }
+    DWORD size = 0xffffffff;
+    CHECK(find(payloads, kMissingGuid, &size) == NULL);
+    CHECK_EQUAL(0, size);
+  }
+}
+
+// CheckNotFound function
+static void CheckNotFound(const CopiedPayloads& payloads)
+{
+  // Check that no payload is found, locally or remotely
+  for (auto find : { FindLocal, FindRemote })
+  {
+    for (const GUID& guid : kGuids)
+      CHECK(find(payloads, guid, NULL) == NULL);
+  }
+}
+
+// TestRoundTrip function
+static void TestRoundTrip()
+{
+  // Check the layout of the directory: the first record, one entry per payload sorted by the bytes of the GUIDs, and
+  //   offsets from the section header to the data that follows each payload's own record
+  CopiedPayloads payloads;
+  CHECK(CopyPayloads(3, payloads));
+  if (payloads.header == NULL)
+    return;
+  CHECK(DetourAreSameGuid(payloads.first->guid, DETOUR_PAYLOAD_DIRECTORY_GUID));
+  CHECK_EQUAL(sizeof(DETOUR_SECTION_RECORD) + 3 * sizeof(DETOUR_PAYLOAD_DIRECTORY_ENTRY), payloads.first->cbBytes);
+  PDETOUR_PAYLOAD_DIRECTORY_ENTRY entries = Entries(payloads);
+  size_t order[] = { 1, 2, 0 };
+  for (size_t i = 0; i < 3; i++)
+  {
+    const GUID& guid = kGuids[order[i]];
+    CHECK(DetourAreSameGuid(entries[i].guid, guid));
+    CHECK((PBYTE)payloads.header + entries[i].nOffset == payloads.data[order[i]]);
+    PDETOUR_SECTION_RECORD record = (PDETOUR_SECTION_RECORD)payloads.data[order[i]] - 1;
+    CHECK(DetourAreSameGuid(record->guid, guid));
+    CHECK_EQUAL(record->cbBytes - sizeof(DETOUR_SECTION_RECORD), entries[i].cbData);
+    if (i > 0)
+      CHECK(memcmp(&entries[i - 1].guid, &entries[i].guid, sizeof(GUID)) < 0);
+  }
+  CHECK(memcmp(payloads.data[0], kFirstData, sizeof(kFirstData)) == 0);
+  CHECK(memcmp(payloads.data[1], kSecondData, sizeof(kSecondData)) == 0);
+  CheckFound(payloads);
+
+  // Check that asking for the directory itself finds its record like any other payload
+  DWORD size = 0;
+  CHECK(FindLocal(payloads, DETOUR_PAYLOAD_DIRECTORY_GUID, &size) == entries);
+  CHECK_EQUAL(3 * sizeof(DETOUR_PAYLOAD_DIRECTORY_ENTRY), size);
+  VirtualFree(payloads.base, 0, MEM_RELEASE);
+
+  // Check that a single payload is copied without a directory
+  CHECK(CopyPayloads(1, payloads));
+  if (payloads.header == NULL)
+    return;
+  CHECK(DetourAreSameGuid(payloads.first->guid, kGuids[0]));
+  CHECK(payloads.first + 1 == payloads.data[0]);
+  CHECK(FindLocal(payloads, kGuids[0], &size) == payloads.data[0] && size == sizeof(kFirstData));
+  CHECK(FindRemote(payloads, kGuids[0], &size) == payloads.data[0] && size == sizeof(kFirstData));
+  CHECK(FindLocal(payloads, kGuids[1], NULL) == NULL);
+  VirtualFree(payloads.base, 0, MEM_RELEASE);
+}
+
+// TestCorruptDirectory function
+static void TestCorruptDirectory()
+{
+  // Check that a first record that is no longer a directory is skipped and the payloads found by walking the records
+  CopiedPayloads payloads;
+  CHECK(CopyPayloads(3, payloads));
+  if (payloads.header == NULL)
+    return;
+  memset(&payloads.first->guid, 0, sizeof(GUID));
+  CheckFound(payloads);
+  VirtualFree(payloads.base, 0, MEM_RELEASE);
+
+  // Check that a directory whose size is too small to be a record, or that runs past the section, ends the lookup
+  //   instead of looping on it or reading past the section
+  DWORD badSizes[] = { 0, sizeof(DETOUR_SECTION_RECORD) - 1, 0x7fffffff };
+  for (DWORD badSize : badSizes)
+  {
+    CHECK(CopyPayloads(3, payloads));
+    if (payloads.header == NULL)
+      return;
+    payloads.first->cbBytes = badSize;
+    CheckNotFound(payloads);
+    VirtualFree(payloads.base, 0, MEM_RELEASE);
+  }
+
+  // Check that entries whose data is not inside the section are refused, since the directory is authoritative
+  for (int corruption = 0; corruption < 3; corruption++)
+  {
+    CHECK(CopyPayloads(3, payloads));
+    if (payloads.header == NULL)
+      return;
+    PDETOUR_PAYLOAD_DIRECTORY_ENTRY entries = Entries(payloads);
+    for (size_t i = 0; i < 3; i++)
+    {
+      if (corruption == 0)
+        entries[i].nOffset = payloads.header->cbDataSize + 1;
+      else if (corruption == 1)
+        entries[i].cbData = payloads.header->cbDataSize - entries[i].nOffset + 1;
+      else
+        entries[i].nOffset = payloads.header->nDataOffset - 1;
+    }
+    CheckNotFound(payloads);
+    VirtualFree(payloads.base, 0, MEM_RELEASE);
+  }
+
+  // Check that a directory listing fewer entries than there are payloads only finds the ones it lists
+  CHECK(CopyPayloads(3, payloads));
+  if (payloads.header == NULL)
+    return;
+  payloads.first->cbBytes -= sizeof(DETOUR_PAYLOAD_DIRECTORY_ENTRY);
+  CHECK(FindLocal(payloads, kGuids[1], NULL) == payloads.data[1]);
+  CHECK(FindRemote(payloads, kGuids[2], NULL) == payloads.data[2]);
+  CHECK(FindLocal(payloads, kGuids[0], NULL) == NULL);
+  CHECK(FindRemote(payloads, kGuids[0], NULL) == NULL);
+  VirtualFree(payloads.base, 0, MEM_RELEASE);
+}
+
+// main function
+int main()
+{
+  TestRoundTrip();
+  TestCorruptDirectory();
+  return TestResult("PayloadDirectoryTest");
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+// Reader for the PE images in tests/data, used by the image view and export tests
+// Note: SPOOFRES_TEST_DATA_DIR is defined by CMakeLists.txt for the tests that read them, and only PE32+ images are
+//   mapped since the tests build Detours for x64 only
+
+// Both layouts of a PE image read from disk
+struct PeImage
+{
+  std::vector<BYTE> file;
+  std::vector<BYTE> loaded;
+};
+
+// ReadPeImage function
+inline bool ReadPeImage(const char* name, PeImage& image)
+{
+  // Read the whole file
+  std::string path = std::string(SPOOFRES_TEST_DATA_DIR "/") + name;
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == NULL)
+    return false;
+  image.file.clear();
+  BYTE buffer[4096];
+  size_t read;
+  while ((read = fread(buffer, 1, sizeof(buffer), file)) != 0)
+    image.file.insert(image.file.end(), buffer, buffer + read);
+  fclose(file);
+
+  // Check the headers and the section table against the size of the file
+  if (image.file.size() < sizeof(IMAGE_DOS_HEADER))
+    return false;
+  const IMAGE_DOS_HEADER* dosHeader = (const IMAGE_DOS_HEADER*)image.file.data();
+  if (dosHeader->e_magic != IMAGE_DOS_SIGNATURE || dosHeader->e_lfanew < 0 ||
+    (size_t)dosHeader->e_lfanew + sizeof(IMAGE_NT_HEADERS64) > image.file.size())
+    return false;
+  const IMAGE_NT_HEADERS64* ntHeader = (const IMAGE_NT_HEADERS64*)(image.file.data() + dosHeader->e_lfanew);
+  if (ntHeader->Signature != IMAGE_NT_SIGNATURE || ntHeader->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+    return false;
+  size_t sectionsOffset = dosHeader->e_lfanew + FIELD_OFFSET(IMAGE_NT_HEADERS64, OptionalHeader) +
+    ntHeader->FileHeader.SizeOfOptionalHeader;
+  WORD sectionCount = ntHeader->FileHeader.NumberOfSections;
+  DWORD imageSize = ntHeader->OptionalHeader.SizeOfImage;
+  DWORD headersSize = ntHeader->OptionalHeader.SizeOfHeaders;
+  if (sectionsOffset + sectionCount * sizeof(IMAGE_SECTION_HEADER) > image.file.size() ||
+    headersSize > image.file.size() || headersSize > imageSize)
+    return false;
+
+  // Map the headers and the sections the way the loader does, leaving the rest of each section zero
+  image.loaded.assign(imageSize, 0);
+  memcpy(image.loaded.data(), image.file.data(), headersSize);
+  const IMAGE_SECTION_HEADER* sections = (const IMAGE_SECTION_HEADER*)(image.file.data() + sectionsOffset);
+  for (WORD i = 0; i < sectionCount; i++)
+  {
+    DWORD size = sections[i].SizeOfRawData < sections[i].Misc.VirtualSize ? sections[i].SizeOfRawData :
+      sections[i].Misc.VirtualSize;
+    if ((size_t)sections[i].PointerToRawData + size > image.file.size() ||
+      (size_t)sections[i].VirtualAddress + size > imageSize)
+      return false;
+    memcpy(image.loaded.data() + sections[i].VirtualAddress, image.file.data() + sections[i].PointerToRawData, size);
+  }
+  return true;
+}
@@ -0,0 +1,356 @@
+#include <cstring>
+#include <vector>
+
+#include <windows.h>
+
+// The remote session is static in creatwth.cpp, so the test is built with it like the import layout test
+#include <creatwth.cpp>
+
+#include "TestCommon.h"
+
+// Tests for how CDetourRemoteSession batches the reads, writes, and protection changes it makes to a target process
+// Note: the session runs against a fake process whose memory is a local buffer placed at an address that is never
+//   dereferenced, every page has its own protection, and every call the session makes to it is logged
+// Note: pages that cannot be written are refused by the fake process like WriteProcessMemory refuses them, so a write
+//   that reaches it without the protection change fails
+
+static const SIZE_T kPageSize = DETOUR_REMOTE_PAGE_SIZE;
+static const SIZE_T kPageCount = 32;
+static PBYTE const kRemoteBase = (PBYTE)(ULONG_PTR)0x10000000;
+
+// Call made to the fake process
+struct FakeCall
+{
+  char kind;
+  SIZE_T offset;
+  SIZE_T size;
+  DWORD protect;
+
+  bool operator==(const FakeCall& other) const
+  {
+    return kind == other.kind && offset == other.offset && size == other.size && protect == other.protect;
+  }
+};
+
+// Fake target process
+struct FakeProcess
+{
+  std::vector<BYTE> memory;
+  std::vector<DWORD> protections;
+  std::vector<FakeCall> calls;
+  bool writeFails = false;
+
+  FakeProcess() : memory(kPageCount * kPageSize), protections(kPageCount, PAGE_READONLY)
+  {
+    for (SIZE_T i = 0; i < memory.size(); i++)
+      memory[i] = (BYTE)(i * 7 + i / kPageSize);
+  }
+
+  // Contains function
+  bool Contains(LPCVOID remote, SIZE_T size) const
+  {
+    return (PBYTE)remote >= kRemoteBase && size <= memory.size() && (PBYTE)remote - kRemoteBase <= memory.size() - size;
+  }
+
+  // Offset function
+  static SIZE_T Offset(LPCVOID remote)
+  {
+    return (PBYTE)remote - kRemoteBase;
+  }
+
+  // Count function
+  size_t Count(char kind) const
+  {
+    size_t count = 0;
+    for (const FakeCall& call : calls)
+      count += call.kind == kind;
+    return count;
+  }
+};
+
+// FakeRead function
+static BOOL FakeRead(HANDLE process, LPCVOID remote, PVOID local, SIZE_T size)
+{
+  FakeProcess& fake = *(FakeProcess*)process;
+  fake.calls.push_back({ 'r', FakeProcess::Offset(remote), size, 0 });
+  if (!fake.Contains(remote, size))
+  {
+    SetLastError(ERROR_PARTIAL_COPY);
+    return FALSE;
+  }
+  for (SIZE_T page = FakeProcess::Offset(remote) / kPageSize; page * kPageSize < FakeProcess::Offset(remote) + size;
+    page++)
+  {
+    if (fake.protections[page] == PAGE_NOACCESS)
+    {
+      SetLastError(ERROR_PARTIAL_COPY);
+      return FALSE;
+    }
+  }
+  memcpy(local, fake.memory.data() + FakeProcess::Offset(remote), size);
+  return TRUE;
+}
+
+// FakeWrite function
+static BOOL FakeWrite(HANDLE process, PVOID remote, LPCVOID local, SIZE_T size)
+{
+  FakeProcess& fake = *(FakeProcess*)process;
+  fake.calls.push_back({ 'w', FakeProcess::Offset(remote), size, 0 });
+  if (fake.writeFails || !fake.Contains(remote, size))
+  {
+    SetLastError(ERROR_PARTIAL_COPY);
+    return FALSE;
+  }
+  for (SIZE_T page = FakeProcess::Offset(remote) / kPageSize; page * kPageSize < FakeProcess::Offset(remote) + size;
+    page++)
+  {
+    if (fake.protections[page] != PAGE_READWRITE && fake.protections[page] != PAGE_EXECUTE_READWRITE)
+    {
+      SetLastError(ERROR_ACCESS_DENIED);
+      return FALSE;
+    }
+  }
+  memcpy(fake.memory.data() + FakeProcess::Offset(remote), local, size);
+  return TRUE;
+}
+
+// FakeProtect function
+static BOOL FakeProtect(HANDLE process, PVOID remote, SIZE_T size, DWORD newProtect, PDWORD oldProtect)
+{
+  FakeProcess& fake = *(FakeProcess*)process;
+  fake.calls.push_back({ 'p', FakeProcess::Offset(remote), size, newProtect });
+  if (!fake.Contains(remote, size))
+  {
+    SetLastError(ERROR_INVALID_ADDRESS);
+    return FALSE;
+  }
+  SIZE_T first = FakeProcess::Offset(remote) / kPageSize;
+  *oldProtect = fake.protections[first];
+  for (SIZE_T page = first; page * kPageSize < FakeProcess::Offset(remote) + size; page++)
+    fake.protections[page] = newProtect;
+  return TRUE;
+}
+
+// FakeQuery function
+static SIZE_T FakeQuery(HANDLE process, LPCVOID remote, PMEMORY_BASIC_INFORMATION mbi)
+{
+  // The region is the run of pages from the one queried that share its protection
+  FakeProcess& fake = *(FakeProcess*)process;
+  fake.calls.push_back({ 'q', FakeProcess::Offset(remote), 0, 0 });
+  if (!fake.Contains(remote, 1))
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return 0;
+  }
+  SIZE_T first = FakeProcess::Offset(remote) / kPageSize;
+  SIZE_T last = first + 1;
+  while (last < kPageCount && fake.protections[last] == fake.protections[first])
+    last++;
+  mbi->BaseAddress = kRemoteBase + first * kPageSize;
+  mbi->AllocationBase = kRemoteBase;
+  mbi->RegionSize = (last - first) * kPageSize;
+  mbi->State = MEM_COMMIT;
+  mbi->Protect = fake.protections[first];
+  return sizeof(*mbi);
+}
+
+static const DETOUR_REMOTE_MEMORY kFakeMemory = { FakeRead, FakeWrite, FakeProtect, FakeQuery };
+
+// Remote function
+static PBYTE Remote(SIZE_T offset)
+{
+  return kRemoteBase + offset;
+}
+
+// TestReads function
+static void TestReads()
+{
+  // Check that reads inside a page are served from one read of the whole page
+  FakeProcess fake;
+  CDetourRemoteSession session((HANDLE)&fake, &kFakeMemory);
+  BYTE header[0x40];
+  BYTE section[0x100];
+  CHECK(session.Read(Remote(0x10), header, sizeof(header)));
+  CHECK(session.Read(Remote(0x200), section, sizeof(section)));
+  CHECK(session.Read(Remote(0x20), header, 8));
+  CHECK(fake.calls == std::vector<FakeCall>({ { 'r', 0, kPageSize, 0 } }));
+  CHECK(memcmp(header, fake.memory.data() + 0x20, 8) == 0);
+  CHECK(memcmp(section, fake.memory.data() + 0x200, sizeof(section)) == 0);
+
+  // Check that a read crossing into the next page replaces the cached page by one span covering both
+  fake.calls.clear();
+  CHECK(session.Read(Remote(kPageSize - 0x10), section, 0x20));
+  CHECK(fake.calls == std::vector<FakeCall>({ { 'r', 0, 2 * kPageSize, 0 } }));
+  CHECK(memcmp(section, fake.memory.data() + kPageSize - 0x10, 0x20) == 0);
+  CHECK(session.Read(Remote(kPageSize + 0x800), section, sizeof(section)));
+  CHECK_EQUAL(1, fake.Count('r'));
+
+  // Check that a failed read is reported and caches nothing, and that an empty read, a wrapping read, and a read in
+  //   the last page of the address space, which cannot be rounded up to a page, are refused
+  fake.protections[6] = PAGE_NOACCESS;
+  fake.calls.clear();
+  CHECK(!session.Read(Remote(6 * kPageSize + 0x10), header, sizeof(header)));
+  CHECK_EQUAL(ERROR_PARTIAL_COPY, GetLastError());
+  CHECK(!session.Read(Remote(6 * kPageSize + 0x10), header, sizeof(header)));
+  CHECK_EQUAL(2, fake.Count('r'));
+  fake.calls.clear();
+  CHECK(!session.Read(Remote(0x10), header, 0));
+  CHECK_EQUAL(ERROR_INVALID_PARAMETER, GetLastError());
+  CHECK(!session.Read((LPCVOID)~(ULONG_PTR)0xf, header, 0x20));
+  CHECK_EQUAL(ERROR_INVALID_PARAMETER, GetLastError());
+  CHECK(!session.Read((LPCVOID)(~(ULONG_PTR)0xfff + 0x10), header, 0x10));
+  CHECK_EQUAL(ERROR_INVALID_PARAMETER, GetLastError());
+  CHECK(fake.calls.empty());
+}
+
+// TestSpanLimit function
+static void TestSpanLimit()
+{
+  // Check that the session refuses a span past its limit, but still maps one that merges the spans around it
+  FakeProcess fake;
+  CDetourRemoteSession session((HANDLE)&fake, &kFakeMemory);
+  BYTE data[0x10];
+  for (SIZE_T i = 0; i < DETOUR_REMOTE_MAX_SPANS; i++)
+    CHECK(session.Read(Remote(2 * i * kPageSize), data, sizeof(data)));
+  CHECK(!session.Read(Remote(2 * DETOUR_REMOTE_MAX_SPANS * kPageSize), data, sizeof(data)));
+  CHECK_EQUAL(ERROR_NOT_ENOUGH_MEMORY, GetLastError());
+  fake.calls.clear();
+  CHECK(session.Read(Remote(kPageSize + 0x10), data, sizeof(data)));
+  CHECK(fake.calls == std::vector<FakeCall>({ { 'r', 0, 3 * kPageSize, 0 } }));
+  CHECK(memcmp(data, fake.memory.data() + kPageSize + 0x10, sizeof(data)) == 0);
+  CHECK(session.Read(Remote(2 * DETOUR_REMOTE_MAX_SPANS * kPageSize), data, sizeof(data)));
+}
+
+// TestFlush function
+static void TestFlush()
+{
+  // Check that writes are staged, seen by later reads of the session, and do not reach the process before the flush
+  FakeProcess fake;
+  fake.protections[1] = PAGE_EXECUTE_READ;
+  fake.protections[2] = PAGE_EXECUTE_READ;
+  std::vector<BYTE> original = fake.memory;
+  CDetourRemoteSession session((HANDLE)&fake, &kFakeMemory);
+  BYTE data[0x40];
+  memset(data, 0xab, sizeof(data));
+  CHECK(session.Write(Remote(kPageSize - 0x20), data, sizeof(data)));
+  CHECK(session.Write(Remote(2 * kPageSize + 0x100), data, 4));
+  CHECK(session.Write(Remote(0x100), data, 4));
+  BYTE read[0x40] = {};
+  CHECK(session.Read(Remote(kPageSize - 0x20), read, sizeof(read)));
+  CHECK(memcmp(read, data, sizeof(data)) == 0);
+  CHECK_EQUAL(0, fake.Count('w'));
+  CHECK_EQUAL(0, fake.Count('p'));
+  CHECK(fake.memory == original);
+
+  // Check that the flush writes the dirty range once per run of pages sharing a protection, makes each run writable
+  //   while keeping it executable, and puts its protection back
+  // Note: the first write mapped pages 0 and 1 and the second merged page 2 into the same span, so the dirty range runs
+  //   from the first staged byte of page 0 to the last of page 2 and includes the bytes in between
+  fake.calls.clear();
+  CHECK(session.Flush());
+  CHECK(fake.calls == std::vector<FakeCall>({
+    { 'q', 0x100, 0, 0 },
+    { 'p', 0x100, kPageSize - 0x100, PAGE_READWRITE },
+    { 'w', 0x100, kPageSize - 0x100, 0 },
+    { 'p', 0x100, kPageSize - 0x100, PAGE_READONLY },
+    { 'q', kPageSize, 0, 0 },
+    { 'p', kPageSize, kPageSize + 0x104, PAGE_EXECUTE_READWRITE },
+    { 'w', kPageSize, kPageSize + 0x104, 0 },
+    { 'p', kPageSize, kPageSize + 0x104, PAGE_EXECUTE_READ } }));
+  CHECK(fake.protections[0] == PAGE_READONLY);
+  CHECK(fake.protections[1] == PAGE_EXECUTE_READ && fake.protections[2] == PAGE_EXECUTE_READ);
+  std::vector<BYTE> expected = original;
+  memset(expected.data() + kPageSize - 0x20, 0xab, sizeof(data));
+  memset(expected.data() + 2 * kPageSize + 0x100, 0xab, 4);
+  memset(expected.data() + 0x100, 0xab, 4);
+  CHECK(fake.memory == expected);
+
+  // Check that a second flush has nothing left to write
+  fake.calls.clear();
+  CHECK(session.Flush());
+  CHECK(fake.calls.empty());
+}
+
+// TestFlushMerge function
+static void TestFlushMerge()
+{
+  // Check that a write staged in a span that a later read merges into a wider span is still flushed, and only the
+  //   range that was written
+  FakeProcess fake;
+  CDetourRemoteSession session((HANDLE)&fake, &kFakeMemory);
+  DWORD value = 0x12345678;
+  CHECK(session.Write(Remote(3 * kPageSize + 0x40), &value, sizeof(value)));
+  BYTE data[0x20];
+  CHECK(session.Read(Remote(3 * kPageSize - 0x10), data, sizeof(data)));
+  CHECK(session.Read(Remote(4 * kPageSize - 0x10), data, sizeof(data)));
+  DWORD read = 0;
+  CHECK(session.Read(Remote(3 * kPageSize + 0x40), &read, sizeof(read)));
+  CHECK_EQUAL(value, read);
+  fake.calls.clear();
+  CHECK(session.Flush());
+  CHECK_EQUAL(1, fake.Count('w'));
+  CHECK(fake.calls[2] == (FakeCall{ 'w', 3 * kPageSize + 0x40, sizeof(value), 0 }));
+  CHECK(memcmp(fake.memory.data() + 3 * kPageSize + 0x40, &value, sizeof(value)) == 0);
+}
+
+// TestFlushFailure function
+static void TestFlushFailure()
+{
+  // Check that a write that fails during the flush is reported after the protection is put back
+  FakeProcess fake;
+  CDetourRemoteSession session((HANDLE)&fake, &kFakeMemory);
+  DWORD value = 0x12345678;
+  CHECK(session.Write(Remote(0x40), &value, sizeof(value)));
+  fake.writeFails = true;
+  fake.calls.clear();
+  CHECK(!session.Flush());
+  CHECK_EQUAL(ERROR_PARTIAL_COPY, GetLastError());
+  CHECK_EQUAL(2, fake.Count('p'));
+  CHECK(fake.protections[0] == PAGE_READONLY);
+
+  // Check that the staged write is kept, so a later flush can still write it
+  fake.writeFails = false;
+  CHECK(session.Flush());
+  CHECK(memcmp(fake.memory.data() + 0x40, &value, sizeof(value)) == 0);
+
+  // Check that a flush stops at a range whose protection cannot be queried
+  FakeProcess failing;
+  CDetourRemoteSession failingSession((HANDLE)&failing, &kFakeMemory);
+  CHECK(failingSession.Write(Remote(0x40), &value, sizeof(value)));
+  failing.memory.resize(0);
+  CHECK(!failingSession.Flush());
+  CHECK_EQUAL(0, failing.Count('w'));
+}
+
+// TestWriteUncached function
+static void TestWriteUncached()
+{
+  // Check that an uncached write goes straight to the process without a protection change or a read of its page
+  FakeProcess fake;
+  fake.protections[5] = PAGE_READWRITE;
+  CDetourRemoteSession session((HANDLE)&fake, &kFakeMemory);
+  BYTE data[0x30];
+  memset(data, 0x5a, sizeof(data));
+  CHECK(session.WriteUncached(Remote(5 * kPageSize + 0x10), data, sizeof(data)));
+  CHECK(fake.calls == std::vector<FakeCall>({ { 'w', 5 * kPageSize + 0x10, sizeof(data), 0 } }));
+  CHECK(memcmp(fake.memory.data() + 5 * kPageSize + 0x10, data, sizeof(data)) == 0);
+  fake.calls.clear();
+  CHECK(session.Flush());
+  CHECK(fake.calls.empty());
+
+  // Check that its failure is reported
+  CHECK(!session.WriteUncached(Remote(0x10), data, sizeof(data)));
+  CHECK_EQUAL(ERROR_ACCESS_DENIED, GetLastError());
+}
+
+// main function
+int main()
+{
+  TestReads();
+  TestSpanLimit();
+  TestFlush();
+  TestFlushMerge();
+  TestFlushFailure();
+  TestWriteUncached();
+  return TestResult("RemoteSessionTest");
+}
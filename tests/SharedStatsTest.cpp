@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <windows.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <SharedStats.h>
+
+#include "TestCommon.h"
+
+// Tests for the sequence lock protecting the shared statistics block
+// Note: the contention test has one publisher writing blocks in which every counter holds the same value while several
+//   readers copy the block as fast as they can, so any copy that mixes two publishes shows up as counters that differ
+// Note: the section tests go through the POSIX backend that spoofresmon reads with on Linux, the blocks are named after
+//   this process or a child process so that concurrent test runs never share one
+
+// FillStats function
+static void FillStats(SpoofResStats& stats, uint64_t value)
+{
+  stats.ticksPerSecond = value;
+  stats.publishCount = value;
+  stats.logQueueDepth = value;
+  stats.logEntriesWritten = value;
+  stats.callerCacheHits = value;
+  stats.callerCacheMisses = value;
+  for (SpoofResStatsApiCounters& counters : stats.apis)
+    counters = { value, value, value, value, value };
+}
+
+// IsConsistent function
+static bool IsConsistent(const SpoofResStats& stats)
+{
+  uint64_t value = stats.ticksPerSecond;
+  if (stats.publishCount != value || stats.logQueueDepth != value || stats.logEntriesWritten != value ||
+    stats.callerCacheHits != value || stats.callerCacheMisses != value)
+    return false;
+  for (const SpoofResStatsApiCounters& counters : stats.apis)
+  {
+    if (counters.calls != value || counters.spoofHits != value || counters.spoofMisses != value ||
+      counters.realCallTicks != value || counters.hookTicks != value)
+      return false;
+  }
+  return true;
+}
+
+// TestRoundTrip function
+static void TestRoundTrip()
+{
+  SpoofResStats shared = {};
+  shared.version = SPOOFRES_STATS_VERSION;
+  shared.size = sizeof(SpoofResStats);
+
+  SpoofResStats values = {};
+  FillStats(values, 42);
+  WriteSpoofResStats(&shared, values);
+  CHECK_EQUAL(2, shared.sequence);
+
+  SpoofResStats snapshot = {};
+  CHECK(ReadSpoofResStats(&shared, snapshot));
+  CHECK(IsConsistent(snapshot));
+  CHECK_EQUAL(42, snapshot.apis[SpoofResStatsEnumDisplaySettingsExW].hookTicks);
+}
+
+// TestLayoutMismatch function
+static void TestLayoutMismatch()
+{
+  SpoofResStats shared = {};
+  SpoofResStats snapshot;
+  shared.version = SPOOFRES_STATS_VERSION + 1;
+  shared.size = sizeof(SpoofResStats);
+  CHECK(!ReadSpoofResStats(&shared, snapshot));
+  shared.version = SPOOFRES_STATS_VERSION;
+  shared.size = sizeof(SpoofResStats) - 8;
+  CHECK(!ReadSpoofResStats(&shared, snapshot));
+}
+
+// TestWriterInProgress function
+static void TestWriterInProgress()
+{
+  // Check that a reader gives up instead of returning a block whose publish never finished
+  SpoofResStats shared = {};
+  SpoofResStats snapshot;
+  shared.version = SPOOFRES_STATS_VERSION;
+  shared.size = sizeof(SpoofResStats);
+  shared.sequence = 1;
+  CHECK(!ReadSpoofResStats(&shared, snapshot));
+}
+
+// TestContention function
+static void TestContention()
+{
+  SpoofResStats* shared = new SpoofResStats();
+  shared->version = SPOOFRES_STATS_VERSION;
+  shared->size = sizeof(SpoofResStats);
+  SpoofResStats initial = {};
+  WriteSpoofResStats(shared, initial);
+
+  // Start publishing as fast as possible until every reader is done
+  std::atomic<bool> stop = false;
+  std::atomic<bool> published = false;
+  std::thread publisher([&]()
+  {
+    SpoofResStats values = {};
+    for (uint64_t value = 1; !stop.load(std::memory_order_relaxed); value++)
+    {
+      FillStats(values, value);
+      WriteSpoofResStats(shared, values);
+      published.store(true, std::memory_order_relaxed);
+    }
+  });
+  while (!published.load(std::memory_order_relaxed))
+    std::this_thread::yield();
+
+  // Start the readers, each keeps reading for a while so that the threads get preempted in the middle of copying the
+  //   block even when there are fewer processors than threads
+  const unsigned int readerCount = std::max(2u, std::min(8u, std::thread::hardware_concurrency()));
+  const std::chrono::milliseconds duration(300);
+  std::atomic<uint64_t> reads = 0;
+  std::atomic<uint64_t> tornReads = 0;
+  std::atomic<uint64_t> failedReads = 0;
+  std::atomic<uint64_t> regressions = 0;
+  std::vector<std::thread> readers;
+  for (unsigned int i = 0; i < readerCount; i++)
+  {
+    readers.emplace_back([&]()
+    {
+      uint64_t last = 0;
+      std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + duration;
+      while (std::chrono::steady_clock::now() < end)
+      {
+        SpoofResStats snapshot;
+        if (!ReadSpoofResStats(shared, snapshot))
+        {
+          failedReads.fetch_add(1, std::memory_order_relaxed);
+          continue;
+        }
+        if (!IsConsistent(snapshot))
+          tornReads.fetch_add(1, std::memory_order_relaxed);
+        else if (snapshot.publishCount < last)
+          regressions.fetch_add(1, std::memory_order_relaxed);
+        last = snapshot.publishCount;
+        reads.fetch_add(1, std::memory_order_relaxed);
+      }
+    });
+  }
+  for (std::thread& reader : readers)
+    reader.join();
+  stop = true;
+  publisher.join();
+
+  // Check that no reader ever saw a mixed block or went back in time
+  // Note: readers may give up after too many attempts while the publisher is hammering the block, which is allowed
+  printf("SharedStatsTest: %u readers, %llu reads, %llu failed attempts\n", readerCount,
+    (unsigned long long)reads.load(), (unsigned long long)failedReads.load());
+  CHECK(reads.load() > 0);
+  CHECK_EQUAL(0, tornReads.load());
+  CHECK_EQUAL(0, regressions.load());
+  CHECK_EQUAL(0, shared->sequence & 1);
+  delete shared;
+}
+
+// GetMode function
+static mode_t GetMode(const std::string& name)
+{
+  int descriptor = shm_open(name.c_str(), O_RDONLY, 0);
+  if (descriptor < 0)
+    return (mode_t)-1;
+  struct stat status;
+  mode_t mode = fstat(descriptor, &status) == 0 ? status.st_mode & 0777 : (mode_t)-1;
+  close(descriptor);
+  return mode;
+}
+
+// TestNames function
+static void TestNames()
+{
+  CHECK(GetSpoofResStatsName(1234) == L"Local\\SpoofResolution.Stats.1234");
+  CHECK(GetSpoofResStatsPosixName(1234) == "/SpoofResolution.Stats.1234");
+  CHECK(GetSpoofResStatsPosixName(0xffffffff) == "/SpoofResolution.Stats.4294967295");
+}
+
+// TestSection function
+static void TestSection()
+{
+  // Check that a created block is initialized and can only be read and written by its owner
+  DWORD processId = (DWORD)getpid();
+  std::string name = GetSpoofResStatsPosixName(processId);
+  SpoofResStatsSection publisher;
+  SpoofResStats* shared = publisher.Create(processId, 1000000);
+  CHECK(shared != nullptr);
+  if (shared == nullptr)
+    return;
+  CHECK_EQUAL(SPOOFRES_STATS_VERSION, shared->version);
+  CHECK_EQUAL(sizeof(SpoofResStats), shared->size);
+  CHECK_EQUAL(0, shared->sequence);
+  CHECK_EQUAL(1000000, shared->ticksPerSecond);
+  CHECK_EQUAL(S_IRUSR | S_IWUSR, GetMode(name));
+
+  // Check that a reader maps the same block at its own address and reads what is published
+  SpoofResStatsSection reader;
+  const SpoofResStats* opened = reader.Open(processId);
+  CHECK(opened != nullptr && (const void*)opened != (const void*)shared);
+  SpoofResStats values = *shared;
+  FillStats(values, 7);
+  WriteSpoofResStats(shared, values);
+  SpoofResStats snapshot;
+  CHECK(opened != nullptr && ReadSpoofResStats(opened, snapshot) && IsConsistent(snapshot));
+  CHECK_EQUAL(7, snapshot.callerCacheMisses);
+
+  // Check that creating the block again replaces a block that was left behind instead of failing
+  SpoofResStatsSection second;
+  CHECK(second.Create(processId, 1) != nullptr);
+  second.Close();
+  CHECK_EQUAL((mode_t)-1, GetMode(name));
+  shared = publisher.Create(processId, 1000000);
+  CHECK(shared != nullptr);
+
+  // Check that closing the publisher unlinks the block while a reader that has it mapped keeps the last statistics
+  publisher.Close();
+  CHECK_EQUAL((mode_t)-1, GetMode(name));
+  CHECK(opened != nullptr && ReadSpoofResStats(opened, snapshot) && snapshot.publishCount == 7);
+  SpoofResStatsSection late;
+  CHECK(late.Open(processId) == nullptr);
+
+  // Check that a block that is too small for the layout is refused instead of faulting when it is read
+  int descriptor = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  CHECK(descriptor >= 0);
+  if (descriptor < 0)
+    return;
+  CHECK(ftruncate(descriptor, offsetof(SpoofResStats, apis)) == 0);
+  close(descriptor);
+  CHECK(late.Open(processId) == nullptr);
+  shm_unlink(name.c_str());
+}
+
+// TestCrossProcess function
+static void TestCrossProcess()
+{
+  // Start a child process that publishes as fast as it can into a block named after itself, the way the DLL does
+  int ready[2];
+  CHECK(pipe(ready) == 0);
+  pid_t child = fork();
+  CHECK(child >= 0);
+  if (child < 0)
+    return;
+  if (child == 0)
+  {
+    close(ready[0]);
+    SpoofResStatsSection publisher;
+    SpoofResStats* shared = publisher.Create((DWORD)getpid(), 1000000);
+    SpoofResStats values = {};
+    if (shared != nullptr)
+    {
+      FillStats(values, 1);
+      WriteSpoofResStats(shared, values);
+    }
+    char created = shared != nullptr ? 1 : 0;
+    if (write(ready[1], &created, 1) != 1 || shared == nullptr)
+      _exit(1);
+    for (uint64_t value = 2;; value++)
+    {
+      FillStats(values, value);
+      WriteSpoofResStats(shared, values);
+    }
+  }
+  close(ready[1]);
+  char created = 0;
+  CHECK(read(ready[0], &created, 1) == 1 && created == 1);
+  close(ready[0]);
+
+  // Read the block from this process like spoofresmon does and check that no copy mixes two publishes
+  SpoofResStatsSection reader;
+  const SpoofResStats* shared = reader.Open((DWORD)child);
+  CHECK(shared != nullptr);
+  uint64_t reads = 0;
+  uint64_t tornReads = 0;
+  uint64_t last = 0;
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+  while (shared != nullptr && std::chrono::steady_clock::now() < end)
+  {
+    SpoofResStats snapshot;
+    if (!ReadSpoofResStats(shared, snapshot))
+      continue;
+    if (!IsConsistent(snapshot) || snapshot.publishCount < last)
+      tornReads++;
+    last = snapshot.publishCount;
+    reads++;
+  }
+
+  // Kill the child and check that the block stops changing, which is how spoofresmon notices a process exited
+  // Note: the child may be killed in the middle of a publish, which leaves the sequence odd and the block unreadable
+  kill(child, SIGKILL);
+  waitpid(child, nullptr, 0);
+  if (shared != nullptr)
+  {
+    LONG sequence = shared->sequence;
+    Sleep(10);
+    CHECK_EQUAL(sequence, shared->sequence);
+  }
+  CHECK(reads > 0 && last > 0);
+  CHECK_EQUAL(0, tornReads);
+  shm_unlink(GetSpoofResStatsPosixName((DWORD)child).c_str());
+}
+
+// main function
+int main()
+{
+  TestRoundTrip();
+  TestLayoutMismatch();
+  TestWriterInProgress();
+  TestContention();
+  TestNames();
+  TestSection();
+  TestCrossProcess();
+  return TestResult("SharedStatsTest");
+}
@@ -0,0 +1,197 @@
+// SimpleIni is used with wide strings like in the DLL and converts with the Windows functions, which the shim
+//   implements for UTF-8
+#define _UNICODE
+#define SI_CONVERT_WIN32
+#define SI_NO_MBCS
+
+#include <string>
+#include <vector>
+
+#include <windows.h>
+#include <SpoofConfigShared.h>
+
+#include "TestCommon.h"
+
+// Tests for the shared memory section the DLL publishes a compiled config into, through the POSIX backend
+// Note: every section is named after a hash mixed with the process id so that concurrent test runs never share one,
+//   and every object a test creates itself is unlinked again
+
+// Ini file the published config is compiled from
+static const char* const kIni =
+  "[SpoofResolution]\n"
+  "SharedConfig=On\n"
+  "[GSM]\n"
+  "Width=1920\n"
+  "Height=1080\n"
+  "Callers=Game.exe\n"
+  "[EDS|*|*]\n"
+  "Width=800\n";
+
+// GetTestHash function
+static uint64_t GetTestHash(uint64_t index)
+{
+  return HashSpoofConfigIni(kIni, strlen(kIni)) ^ ((uint64_t)getpid() << 16) ^ index;
+}
+
+// GetPayload function
+static std::vector<uint8_t> GetPayload()
+{
+  CSimpleIni ini;
+  ini.SetUnicode();
+  CHECK(ini.LoadData(kIni) >= 0);
+  SpoofConfig config;
+  CHECK(CompileSpoofConfig(ini, config));
+  return SerializeSpoofConfig(config);
+}
+
+// TestNames function
+static void TestNames()
+{
+  // Check that the names carry both layout versions, the hash, and on POSIX the user
+  std::wstring expected = L"Local\\SpoofResolution.Config." + std::to_wstring(SPOOFRES_CONFIG_SHARED_VERSION) + L"." +
+    std::to_wstring(SPOOFRES_CONFIG_PAYLOAD_VERSION) + L".0123456789abcdef";
+  CHECK(GetSpoofConfigSharedName(0x0123456789abcdefull) == expected);
+  std::string expectedPosix = "/SpoofResolution.Config." + std::to_string(SPOOFRES_CONFIG_SHARED_VERSION) + "." +
+    std::to_string(SPOOFRES_CONFIG_PAYLOAD_VERSION) + ".00000000000000ff.1000";
+  CHECK(GetSpoofConfigSharedPosixName(0xff, 1000) == expectedPosix);
+  CHECK(GetSpoofConfigSharedPosixName(0xff, 1000) != GetSpoofConfigSharedPosixName(0xff, 1001));
+  CHECK(GetSpoofConfigSharedPosixName(~0ull, ~0u).size() < 80);
+}
+
+// Reads function
+static bool Reads(const std::vector<uint8_t>& section, uint64_t iniHash = 1, uint64_t iniSize = 2)
+{
+  size_t payloadSize = 0;
+  return ReadSpoofConfigShared(section.data(), section.size(), iniHash, iniSize, payloadSize) != nullptr;
+}
+
+// Patch function
+template <typename T>
+static std::vector<uint8_t> Patch(std::vector<uint8_t> section, size_t offset, T value)
+{
+  memcpy(section.data() + offset, &value, sizeof(value));
+  return section;
+}
+
+// TestHeader function
+static void TestHeader()
+{
+  // Check that a written section reads back with its payload
+  std::vector<uint8_t> payload = { 1, 2, 3, 4, 5 };
+  std::vector<uint8_t> section(sizeof(SpoofConfigSharedHeader) + payload.size());
+  CHECK(WriteSpoofConfigShared(section.data(), section.size(), 1, 2, payload));
+  size_t payloadSize = 0;
+  const void* read = ReadSpoofConfigShared(section.data(), section.size(), 1, 2, payloadSize);
+  CHECK(read == section.data() + sizeof(SpoofConfigSharedHeader));
+  CHECK_EQUAL(payload.size(), payloadSize);
+  CHECK(read != nullptr && memcmp(read, payload.data(), payload.size()) == 0);
+
+  // Check that a payload that does not fit is not written
+  CHECK(!WriteSpoofConfigShared(section.data(), section.size() - 1, 1, 2, payload));
+  CHECK(!WriteSpoofConfigShared(nullptr, section.size(), 1, 2, payload));
+
+  // Check every way the header can be wrong
+  CHECK(Reads(section));
+  CHECK(!Reads(section, 3, 2));
+  CHECK(!Reads(section, 1, 3));
+  CHECK(!Reads(std::vector<uint8_t>(section.begin(), section.end() - 1)));
+  CHECK(!Reads(std::vector<uint8_t>(section.begin(), section.begin() + sizeof(SpoofConfigSharedHeader) - 1)));
+  CHECK(!Reads(std::vector<uint8_t>(sizeof(SpoofConfigSharedHeader))));
+  CHECK(!Reads(Patch(section, offsetof(SpoofConfigSharedHeader, ready), (LONG)0)));
+  CHECK(!Reads(Patch(section, offsetof(SpoofConfigSharedHeader, magic), (uint32_t)0x53435254)));
+  CHECK(!Reads(Patch(section, offsetof(SpoofConfigSharedHeader, version),
+    (uint32_t)SPOOFRES_CONFIG_SHARED_VERSION + 1)));
+  CHECK(!Reads(Patch(section, offsetof(SpoofConfigSharedHeader, headerSize),
+    (uint32_t)sizeof(SpoofConfigSharedHeader) + 8)));
+  CHECK(!Reads(Patch(section, offsetof(SpoofConfigSharedHeader, payloadSize), (uint32_t)payload.size() + 1)));
+  CHECK(!Reads(Patch(section, offsetof(SpoofConfigSharedHeader, payloadSize), 0xffffffffu)));
+  size_t unused = 0;
+  CHECK(ReadSpoofConfigShared(nullptr, section.size(), 1, 2, unused) == nullptr);
+}
+
+// GetMode function
+static mode_t GetMode(const std::string& name)
+{
+  int descriptor = shm_open(name.c_str(), O_RDONLY, 0);
+  if (descriptor < 0)
+    return (mode_t)-1;
+  struct stat status;
+  mode_t mode = fstat(descriptor, &status) == 0 ? status.st_mode & 0777 : (mode_t)-1;
+  close(descriptor);
+  return mode;
+}
+
+// TestPublish function
+static void TestPublish()
+{
+  // Check that a published config loads back the same and that the object can only be read by its owner
+  std::vector<uint8_t> payload = GetPayload();
+  uint64_t hash = GetTestHash(1);
+  std::string name = GetSpoofConfigSharedPosixName(hash, geteuid());
+  {
+    SpoofConfigSharedSection publisher;
+    CHECK(publisher.Publish(hash, strlen(kIni), payload));
+    CHECK_EQUAL(S_IRUSR, GetMode(name));
+
+    SpoofConfigSharedSection reader;
+    std::unique_ptr<SpoofConfig> config = reader.Load(hash, strlen(kIni));
+    CHECK(config != nullptr && SerializeSpoofConfig(*config) == payload);
+    CHECK(reader.Load(hash, strlen(kIni) + 1) == nullptr);
+    CHECK(reader.Load(hash + 1, strlen(kIni)) == nullptr);
+
+    // Check that a second publisher of the same config backs off and leaves the object in place
+    SpoofConfigSharedSection second;
+    CHECK(!second.Publish(hash, strlen(kIni), payload));
+    second.Close();
+    CHECK(reader.Load(hash, strlen(kIni)) != nullptr);
+
+    // Check that closing the publisher unlinks the object
+    publisher.Close();
+    CHECK(reader.Load(hash, strlen(kIni)) == nullptr);
+    CHECK_EQUAL((mode_t)-1, GetMode(name));
+    CHECK(publisher.Publish(hash, strlen(kIni), payload));
+  }
+  CHECK_EQUAL((mode_t)-1, GetMode(name));
+}
+
+// TestForeignObject function
+static void TestForeignObject()
+{
+  // Check that an object with a valid section that can still be written to is refused
+  std::vector<uint8_t> payload = GetPayload();
+  uint64_t hash = GetTestHash(2);
+  std::string name = GetSpoofConfigSharedPosixName(hash, geteuid());
+  size_t size = sizeof(SpoofConfigSharedHeader) + payload.size();
+  int descriptor = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  CHECK(descriptor >= 0);
+  if (descriptor < 0)
+    return;
+  CHECK(ftruncate(descriptor, (off_t)size) == 0);
+  void* section = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+  CHECK(section != MAP_FAILED && WriteSpoofConfigShared(section, size, hash, strlen(kIni), payload));
+  SpoofConfigSharedSection reader;
+  CHECK(reader.Load(hash, strlen(kIni)) == nullptr);
+
+  // Check that the same object is loaded once the write permission is gone
+  CHECK(fchmod(descriptor, S_IRUSR) == 0);
+  CHECK(reader.Load(hash, strlen(kIni)) != nullptr);
+
+  // Check that an object that is too small to hold the header is refused
+  // Note: the descriptor keeps the write access it was opened with whatever the permissions of the object
+  CHECK(ftruncate(descriptor, 8) == 0);
+  CHECK(reader.Load(hash, strlen(kIni)) == nullptr);
+  if (section != MAP_FAILED)
+    munmap(section, size);
+  close(descriptor);
+  shm_unlink(name.c_str());
+}
+
+// main function
+int main()
+{
+  TestNames();
+  TestHeader();
+  TestPublish();
+  TestForeignObject();
+  return TestResult("SpoofConfigSharedTest");
+}
@@ -0,0 +1,250 @@
+// SimpleIni is used with wide strings like in the DLL and converts with the Windows functions, which the shim
+//   implements for UTF-8
+#define _UNICODE
+#define SI_CONVERT_WIN32
+#define SI_NO_MBCS
+
+#include <string>
+#include <vector>
+
+#include <windows.h>
+#include <SpoofConfig.h>
+
+#include "TestCommon.h"
+
+// Tests for compiling spoofres.ini into a SpoofConfig and for the payload a launcher hands the compiled config over in
+// Note: the payload is read from another process, so besides the round trip every way of corrupting it is checked to
+//   be rejected rather than read past its end
+
+// Ini file that sets every value the config can hold
+static const char* const kFullIni =
+  "[SpoofResolution]\n"
+  "Logging=On\n"
+  "Tracing=yes\n"
+  "Statistics=TRUE\n"
+  "StartupReport=Off\n"
+  "Initialization=synchronous\n"
+  "SharedConfig=On\n"
+  "LogFile=C:\\Logs\\spoofres.log\n"
+  "TraceFile=\n"
+  "[GSM]\n"
+  "Width=1920\n"
+  "Height=1080\n"
+  "Callers=Game.exe, C:\\Game\\Render.dll\n"
+  "[GDC]\n"
+  "Width=-1\n"
+  "BitsPerPixel=32\n"
+  "Frequency=144\n"
+  "Callers=game.EXE\n"
+  "[EDS|\\\\.\\DISPLAY1|Current]\n"
+  "Width=2560\n"
+  "Height=1440\n"
+  "Frequency=165\n"
+  "PositionX=-2560\n"
+  "PositionY=0\n"
+  "Callers=Launcher.exe\n"
+  "[EDS|*|*]\n"
+  "BitsPerPixel=32\n"
+  "Flags=0\n"
+  "Orientation=1\n"
+  "[EDS|*|12]\n"
+  "Width=800\n"
+  "[EDS|*|Bogus]\n"
+  "Width=1\n";
+
+// LoadIni function
+static bool LoadIni(const char* text, SpoofConfig& config)
+{
+  CSimpleIni ini;
+  ini.SetUnicode();
+  CHECK(ini.LoadData(text) >= 0);
+  return CompileSpoofConfig(ini, config);
+}
+
+// Equal function
+template <typename T>
+static bool Equal(const std::unique_ptr<T>& left, const std::unique_ptr<T>& right)
+{
+  return left == nullptr ? right == nullptr : right != nullptr && *left == *right;
+}
+
+// Equal function
+static bool Equal(const std::unique_ptr<POINTL>& left, const std::unique_ptr<POINTL>& right)
+{
+  return left == nullptr ? right == nullptr : right != nullptr && left->x == right->x && left->y == right->y;
+}
+
+// CheckSameConfig function
+static void CheckSameConfig(const SpoofConfig& expected, const SpoofConfig& actual)
+{
+  CHECK_EQUAL(expected.logging, actual.logging);
+  CHECK_EQUAL(expected.tracing, actual.tracing);
+  CHECK_EQUAL(expected.statistics, actual.statistics);
+  CHECK_EQUAL(expected.startupReport, actual.startupReport);
+  CHECK_EQUAL(expected.synchronousInitialization, actual.synchronousInitialization);
+  CHECK_EQUAL(expected.sharedConfig, actual.sharedConfig);
+  CHECK(Equal(expected.logFile, actual.logFile));
+  CHECK(Equal(expected.traceFile, actual.traceFile));
+  CHECK_EQUAL(expected.gsmSection, actual.gsmSection);
+  CHECK_EQUAL(expected.gdcSection, actual.gdcSection);
+  CHECK_EQUAL(expected.edsSection, actual.edsSection);
+  CHECK(Equal(expected.gsmWidth, actual.gsmWidth));
+  CHECK(Equal(expected.gsmHeight, actual.gsmHeight));
+  CHECK(Equal(expected.gdcWidth, actual.gdcWidth));
+  CHECK(Equal(expected.gdcHeight, actual.gdcHeight));
+  CHECK(Equal(expected.gdcBitsPerPixel, actual.gdcBitsPerPixel));
+  CHECK(Equal(expected.gdcFrequency, actual.gdcFrequency));
+  CHECK(expected.callerModules == actual.callerModules);
+  CHECK_EQUAL(expected.gsmCallers, actual.gsmCallers);
+  CHECK_EQUAL(expected.gdcCallers, actual.gdcCallers);
+  CHECK_EQUAL(expected.edsSections.size(), actual.edsSections.size());
+  for (size_t i = 0; i < expected.edsSections.size() && i < actual.edsSections.size(); i++)
+  {
+    const SpoofConfig::EDSSection& left = expected.edsSections[i];
+    const SpoofConfig::EDSSection& right = actual.edsSections[i];
+    CHECK(left.device == right.device);
+    CHECK_EQUAL(left.anyDevice, right.anyDevice);
+    CHECK_EQUAL(left.anyMode, right.anyMode);
+    if (!left.anyMode)
+      CHECK_EQUAL(left.mode, right.mode);
+    CHECK(Equal(left.width, right.width));
+    CHECK(Equal(left.height, right.height));
+    CHECK(Equal(left.bitsPerPixel, right.bitsPerPixel));
+    CHECK(Equal(left.frequency, right.frequency));
+    CHECK(Equal(left.flags, right.flags));
+    CHECK(Equal(left.position, right.position));
+    CHECK(Equal(left.orientation, right.orientation));
+    CHECK_EQUAL(left.callers, right.callers);
+  }
+}
+
+// TestCompile function
+static void TestCompile()
+{
+  // Check that every key ends up in the config and that sections with modes that can never match are left out
+  SpoofConfig config;
+  CHECK(LoadIni(kFullIni, config));
+  CHECK(config.logging && config.tracing && config.statistics && !config.startupReport);
+  CHECK(config.synchronousInitialization && config.sharedConfig);
+  CHECK(config.logFile != nullptr && *config.logFile == L"C:\\Logs\\spoofres.log");
+  CHECK(config.traceFile != nullptr && config.traceFile->empty());
+  CHECK(config.gsmSection && config.gdcSection && config.edsSection);
+  CHECK(config.gsmWidth != nullptr && *config.gsmWidth == 1920);
+  CHECK(config.gdcWidth != nullptr && *config.gdcWidth == -1);
+  CHECK(config.gdcHeight == nullptr);
+  CHECK(config.callerModules == std::vector<std::wstring>({ L"Game.exe", L"Render.dll", L"Launcher.exe" }));
+  CHECK_EQUAL(0x3, config.gsmCallers);
+  CHECK_EQUAL(0x1, config.gdcCallers);
+  // Note: SimpleIni returns the sections sorted by name so the EDS sections are compiled in that order
+  CHECK_EQUAL(3, config.edsSections.size());
+  if (config.edsSections.size() == 3)
+  {
+    CHECK(config.edsSections[0].anyDevice && config.edsSections[0].anyMode);
+    CHECK(config.edsSections[0].orientation != nullptr && *config.edsSections[0].orientation == 1);
+    CHECK(config.edsSections[1].anyDevice && !config.edsSections[1].anyMode);
+    CHECK_EQUAL(12, config.edsSections[1].mode);
+    CHECK(config.edsSections[2].device == L"\\\\.\\DISPLAY1" && !config.edsSections[2].anyDevice);
+    CHECK_EQUAL(ENUM_CURRENT_SETTINGS, config.edsSections[2].mode);
+    CHECK(config.edsSections[2].position != nullptr && config.edsSections[2].position->x == -2560);
+    CHECK_EQUAL(0x4, config.edsSections[2].callers);
+  }
+}
+
+// TestCompileErrors function
+static void TestCompileErrors()
+{
+  // Check that a bad value drops all of the resolution information but keeps the settings
+  SpoofConfig config;
+  CHECK(!LoadIni("[SpoofResolution]\nLogging=On\n[GSM]\nWidth=1920\nCallers=a.exe\n[GDC]\nWidth=wide\n", config));
+  CHECK(config.logging && config.gsmSection && config.gdcSection);
+  CHECK(config.gsmWidth == nullptr && config.callerModules.empty() && config.gsmCallers == 0);
+
+  // Check that more than 64 caller modules are refused
+  std::string ini = "[GSM]\nCallers=";
+  for (int i = 0; i < 65; i++)
+    ini += "m" + std::to_string(i) + ".dll,";
+  SpoofConfig manyCallers;
+  CHECK(!LoadIni(ini.c_str(), manyCallers));
+  CHECK(manyCallers.callerModules.empty());
+}
+
+// TestRoundTrip function
+static void TestRoundTrip()
+{
+  // Check that a full and an empty config come back the same and serialize to the same bytes again
+  for (const char* text : { kFullIni, "" })
+  {
+    SpoofConfig config;
+    CHECK(LoadIni(text, config));
+    std::vector<uint8_t> payload = SerializeSpoofConfig(config);
+    std::unique_ptr<SpoofConfig> loaded = DeserializeSpoofConfig(payload.data(), payload.size());
+    CHECK(loaded != nullptr);
+    if (loaded == nullptr)
+      continue;
+    CheckSameConfig(config, *loaded);
+    CHECK(SerializeSpoofConfig(*loaded) == payload);
+  }
+}
+
+// Deserializes function
+static bool Deserializes(const std::vector<uint8_t>& payload)
+{
+  return DeserializeSpoofConfig(payload.data(), payload.size()) != nullptr;
+}
+
+// Patch function
+template <typename T>
+static std::vector<uint8_t> Patch(std::vector<uint8_t> payload, size_t offset, T value)
+{
+  memcpy(payload.data() + offset, &value, sizeof(value));
+  return payload;
+}
+
+// TestCorruptPayloads function
+static void TestCorruptPayloads()
+{
+  // Check every truncation, then every header field that a corrupted or foreign payload could get wrong
+  SpoofConfig config;
+  CHECK(LoadIni(kFullIni, config));
+  std::vector<uint8_t> payload = SerializeSpoofConfig(config);
+  CHECK(Deserializes(payload));
+  CHECK(DeserializeSpoofConfig(nullptr, payload.size()) == nullptr);
+  unsigned int accepted = 0;
+  for (size_t size = 0; size < payload.size(); size++)
+  {
+    // Check the truncated payload both as is and with the size in its header matching the truncation
+    std::vector<uint8_t> truncated(payload.begin(), payload.begin() + size);
+    if (Deserializes(truncated) || (size >= sizeof(SpoofConfigPayloadHeader) &&
+      Deserializes(Patch(truncated, offsetof(SpoofConfigPayloadHeader, size), (uint32_t)size))))
+      accepted++;
+  }
+  CHECK_EQUAL(0, accepted);
+  std::vector<uint8_t> extended = payload;
+  extended.resize(payload.size() + 2);
+  CHECK(!Deserializes(extended));
+  CHECK(!Deserializes(Patch(extended, offsetof(SpoofConfigPayloadHeader, size), (uint32_t)extended.size())));
+
+  CHECK(!Deserializes(Patch(payload, offsetof(SpoofConfigPayloadHeader, version),
+    (uint32_t)SPOOFRES_CONFIG_PAYLOAD_VERSION + 1)));
+  CHECK(!Deserializes(Patch(payload, offsetof(SpoofConfigPayloadHeader, size), (uint32_t)payload.size() - 1)));
+  CHECK(!Deserializes(Patch(payload, offsetof(SpoofConfigPayloadHeader, edsSectionCount), 0x10000000u)));
+  CHECK(!Deserializes(Patch(payload, offsetof(SpoofConfigPayloadHeader, edsSectionCount), 4u)));
+  CHECK(!Deserializes(Patch(payload, offsetof(SpoofConfigPayloadHeader, logFileLength), 0xfffffffeu)));
+  CHECK(!Deserializes(Patch(payload, offsetof(SpoofConfigPayloadHeader, logFileLength), 0u)));
+  CHECK(!Deserializes(Patch(payload, offsetof(SpoofConfigPayloadHeader, callerModulesLength), 0xfffffffeu)));
+  CHECK(!Deserializes(Patch(payload, offsetof(SpoofConfigPayloadHeader, gsmCallers), 0x8ull)));
+  CHECK(!Deserializes(Patch(payload, sizeof(SpoofConfigPayloadHeader) + offsetof(SpoofConfigPayloadEDSSection, callers),
+    0x10ull)));
+  CHECK(!Deserializes(Patch(payload, sizeof(SpoofConfigPayloadHeader) +
+    offsetof(SpoofConfigPayloadEDSSection, deviceLength), 0x7fffffffu)));
+}
+
+// main function
+int main()
+{
+  TestCompile();
+  TestCompileErrors();
+  TestRoundTrip();
+  TestCorruptPayloads();
+  return TestResult("SpoofConfigTest");
+}
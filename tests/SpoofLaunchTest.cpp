@@ -0,0 +1,250 @@
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+#include <SpoofLaunch.h>
+
+#include "TestCommon.h"
+
+// Tests for the manifest parsing and the scheduling of the spoofreslaunch utility against a fake process backend
+// Note: the fake backend fails the step named in a command line, fail-create, fail-payload, or fail-resume, and records
+//   every call so the tests can check that each launch went through its steps once and in order
+
+// Errors the fake backend fails its steps with
+static const DWORD kCreateError = 2;
+static const DWORD kPayloadError = 299;
+static const DWORD kResumeError = 5;
+
+// Process backend that records its calls instead of creating processes
+class FakeLaunchBackend : public LaunchBackend
+{
+public:
+  bool Create(const std::wstring& commandLine, PROCESS_INFORMATION& processInfo) override
+  {
+    std::lock_guard<std::mutex> lock(callsLock);
+    if (commandLine.find(L"fail-create") != std::wstring::npos)
+    {
+      SetLastError(kCreateError);
+      return false;
+    }
+    processInfo.dwProcessId = ++lastProcessId;
+    processInfo.hProcess = (HANDLE)(ULONG_PTR)processInfo.dwProcessId;
+    processInfo.hThread = (HANDLE)(ULONG_PTR)(processInfo.dwProcessId | 0x10000);
+    commandLines[processInfo.dwProcessId] = commandLine;
+    calls[processInfo.dwProcessId] += L"C";
+    return true;
+  }
+
+  bool CopyPayload(const PROCESS_INFORMATION& processInfo, const std::vector<uint8_t>& payload) override
+  {
+    std::lock_guard<std::mutex> lock(callsLock);
+    calls[processInfo.dwProcessId] += L"P";
+    payloadSize = payload.size();
+    return Succeeds(processInfo, L"fail-payload", kPayloadError);
+  }
+
+  bool Resume(const PROCESS_INFORMATION& processInfo) override
+  {
+    std::lock_guard<std::mutex> lock(callsLock);
+    calls[processInfo.dwProcessId] += L"R";
+    return Succeeds(processInfo, L"fail-resume", kResumeError);
+  }
+
+  void Terminate(const PROCESS_INFORMATION& processInfo) override
+  {
+    std::lock_guard<std::mutex> lock(callsLock);
+    calls[processInfo.dwProcessId] += L"T";
+  }
+
+  void Close(const PROCESS_INFORMATION& processInfo) override
+  {
+    std::lock_guard<std::mutex> lock(callsLock);
+    calls[processInfo.dwProcessId] += L"X";
+  }
+
+  std::mutex callsLock;
+  DWORD lastProcessId = 0;
+  std::map<DWORD, std::wstring> commandLines; // Command line of each process created by its id
+  std::map<DWORD, std::wstring> calls;        // Steps made for each process by its id, see CheckLaunches
+  size_t payloadSize = 0;
+
+private:
+  // Succeeds function
+  bool Succeeds(const PROCESS_INFORMATION& processInfo, const wchar_t* failure, DWORD error)
+  {
+    if (commandLines[processInfo.dwProcessId].find(failure) == std::wstring::npos)
+      return true;
+    SetLastError(error);
+    return false;
+  }
+};
+
+// TestManifest function
+static void TestManifest()
+{
+  // Check that blank lines and comments are skipped and command lines are trimmed, with and without a UTF-8 BOM
+  for (const char* bom : { "", "\xEF\xBB\xBF" })
+  {
+    std::string manifest = std::string(bom) +
+      "game.exe -windowed\r\n"
+      "\r\n"
+      "; comment\r\n"
+      "   \t\r\n"
+      "  \"C:\\Games\\Other Game\\other.exe\" \t\r\n"
+      "  ; indented comment\n"
+      "\xC3\xA9" "diteur.exe";
+    std::vector<LaunchTarget> targets = ParseLaunchManifest(manifest);
+    CHECK_EQUAL(3, targets.size());
+    if (targets.size() == 3)
+    {
+      CHECK(targets[0].commandLine == L"game.exe -windowed");
+      CHECK(targets[1].commandLine == L"\"C:\\Games\\Other Game\\other.exe\"");
+      CHECK(targets[2].commandLine == L"\u00e9diteur.exe");
+      CHECK(targets[0].failedStep == nullptr && targets[0].processId == 0);
+    }
+  }
+
+  // Check a UTF-16 manifest with a byte order mark and an odd trailing byte
+  std::string utf16 = "\xFF\xFE";
+  for (char c : std::string("a.exe\r\n;b.exe\r\nc.exe"))
+    utf16 += std::string(1, c) + '\0';
+  utf16 += '\x42';
+  std::vector<LaunchTarget> targets = ParseLaunchManifest(utf16);
+  CHECK_EQUAL(2, targets.size());
+  if (targets.size() == 2)
+    CHECK(targets[0].commandLine == L"a.exe" && targets[1].commandLine == L"c.exe");
+
+  CHECK(ParseLaunchManifest("").empty());
+  CHECK(ParseLaunchManifest("\xEF\xBB\xBF").empty());
+  CHECK(ParseLaunchManifest("\xFF\xFE").empty());
+  CHECK(ParseLaunchManifest("\n;only comments\n\n").empty());
+}
+
+// TestThreadCount function
+static void TestThreadCount()
+{
+  // Check that the worker threads are limited to the number of launches and that there is always one
+  CHECK_EQUAL(4, GetLaunchThreadCount(4, 100));
+  CHECK_EQUAL(3, GetLaunchThreadCount(16, 3));
+  CHECK_EQUAL(1, GetLaunchThreadCount(0, 3));
+  CHECK_EQUAL(1, GetLaunchThreadCount(8, 0));
+}
+
+// CheckLaunches function
+static void CheckLaunches(FakeLaunchBackend& backend, const std::vector<LaunchTarget>& targets, bool payload)
+{
+  // Check that every launch that got past creating its process went through its steps once, in order, and was closed
+  //   and that only the launches that failed were terminated
+  // Note: the steps are C for create, P for copy payload, R for resume, T for terminate, and X for close
+  std::set<DWORD> processIds;
+  for (const LaunchTarget& target : targets)
+  {
+    std::wstring expected = payload ? L"CPRX" : L"CRX";
+    const wchar_t* failedStep = nullptr;
+    DWORD error = ERROR_SUCCESS;
+    if (target.commandLine.find(L"fail-create") != std::wstring::npos)
+    {
+      expected.clear();
+      failedStep = L"create";
+      error = kCreateError;
+    }
+    else if (payload && target.commandLine.find(L"fail-payload") != std::wstring::npos)
+    {
+      expected = L"CPTX";
+      failedStep = L"copy payload";
+      error = kPayloadError;
+    }
+    else if (target.commandLine.find(L"fail-resume") != std::wstring::npos)
+    {
+      expected = payload ? L"CPRTX" : L"CRTX";
+      failedStep = L"resume";
+      error = kResumeError;
+    }
+
+    CHECK(failedStep == nullptr ? target.failedStep == nullptr :
+      target.failedStep != nullptr && wcscmp(target.failedStep, failedStep) == 0);
+    CHECK_EQUAL(error, target.error);
+    if (failedStep == nullptr)
+      CHECK(target.totalTicks >= target.createTicks + target.payloadTicks + target.resumeTicks);
+    else
+      CHECK_EQUAL(0, target.resumeTicks);
+    if (expected.empty())
+    {
+      CHECK_EQUAL(0, target.processId);
+      continue;
+    }
+    CHECK(target.processId != 0 && processIds.insert(target.processId).second);
+    CHECK(backend.commandLines[target.processId] == target.commandLine);
+    CHECK(backend.calls[target.processId] == expected);
+  }
+  CHECK_EQUAL(backend.calls.size(), processIds.size());
+}
+
+// TestLaunches function
+static void TestLaunches()
+{
+  // Check many launches on one worker thread, on several, and on the fallback for an unknown processor count, with and
+  //   without a payload
+  for (bool payload : { true, false })
+  {
+    for (unsigned long threadCount : { 1ul, 8ul, 0ul })
+    {
+      std::vector<LaunchTarget> targets;
+      for (int i = 0; i < 200; i++)
+      {
+        LaunchTarget target;
+        const wchar_t* failures[] = { L"", L" fail-create", L" fail-payload", L" fail-resume", L"", L"" };
+        target.commandLine = L"app" + std::to_wstring(i) + L".exe" + failures[i % 6];
+        targets.push_back(std::move(target));
+      }
+      FakeLaunchBackend backend;
+      LaunchShared shared;
+      if (payload)
+        shared.configPayload.assign(64, 0x5a);
+      RunLaunches(backend, shared, targets, threadCount);
+      CHECK(shared.start.QuadPart != 0);
+      CheckLaunches(backend, targets, payload);
+      CHECK_EQUAL(payload ? 64 : 0, backend.payloadSize);
+
+      LaunchSummary summary = SummarizeLaunches(targets);
+      CHECK_EQUAL(payload ? 100 : 133, summary.launched);
+    }
+  }
+}
+
+// TestSummary function
+static void TestSummary()
+{
+  // Check the latency of the launches that succeeded, skipping the failed ones whatever their times
+  std::vector<LaunchTarget> targets(6);
+  LONGLONG totals[] = { 40, 10, 1000, 30, 20, 5 };
+  for (size_t i = 0; i < targets.size(); i++)
+    targets[i].totalTicks = totals[i];
+  targets[2].failedStep = L"resume";
+  targets[5].failedStep = L"create";
+  LaunchSummary summary = SummarizeLaunches(targets);
+  CHECK_EQUAL(4, summary.launched);
+  CHECK_EQUAL(10, summary.minTicks);
+  CHECK_EQUAL(30, summary.medianTicks);
+  CHECK_EQUAL(25, summary.averageTicks);
+  CHECK_EQUAL(40, summary.maxTicks);
+
+  for (LaunchTarget& target : targets)
+    target.failedStep = L"create";
+  summary = SummarizeLaunches(targets);
+  CHECK_EQUAL(0, summary.launched);
+  CHECK_EQUAL(0, summary.maxTicks);
+}
+
+// main function
+int main()
+{
+  TestManifest();
+  TestThreadCount();
+  TestLaunches();
+  TestSummary();
+  return TestResult("SpoofLaunchTest");
+}
@@ -0,0 +1,109 @@
+#include <iterator>
+#include <string>
+
+#include <windows.h>
+#include <SpoofStartup.h>
+
+#include "TestCommon.h"
+
+// Tests for the timing of the startup phases and the startup report composed from them
+// Note: the timings use a frequency of one tick per microsecond so that the expected reports are easy to read
+
+// Frequency the tests format with
+static const LONGLONG kFrequency = 1000000;
+
+// Format function
+static std::wstring Format(const StartupTimings& timings, size_t size = 1024)
+{
+  wchar_t details[1024];
+  size_t length = FormatStartupReport(timings, kFrequency, details, size);
+  CHECK_EQUAL(wcslen(details), length);
+  return details;
+}
+
+// TestNames function
+static void TestNames()
+{
+  // Check that every phase has a name and that they are unique
+  for (int phase = 0; phase < StartupPhaseCount; phase++)
+  {
+    CHECK(StartupPhaseNames[phase] != nullptr && StartupPhaseNames[phase][0] != L'\0');
+    for (int other = 0; other < phase; other++)
+      CHECK(wcscmp(StartupPhaseNames[phase], StartupPhaseNames[other]) != 0);
+  }
+  CHECK(wcscmp(StartupPhaseNames[StartupPhaseDetourAttach], L"DetourAttach") == 0);
+  CHECK(wcscmp(StartupPhaseNames[StartupPhaseTotal], L"Total") == 0);
+}
+
+// TestRecord function
+static void TestRecord()
+{
+  // Check that a phase recorded more than once adds up its times and that other phases are left alone
+  StartupTimings timings;
+  for (int phase = 0; phase < StartupPhaseCount; phase++)
+    CHECK(!timings.recorded[phase] && timings.ticks[phase] == 0);
+  timings.Record(StartupPhaseDetourAttach, 100);
+  timings.Record(StartupPhaseDetourAttach, 250);
+  timings.Record(StartupPhaseLoadIniFile, 0);
+  CHECK(timings.recorded[StartupPhaseDetourAttach]);
+  CHECK_EQUAL(350, timings.ticks[StartupPhaseDetourAttach]);
+  CHECK(timings.recorded[StartupPhaseLoadIniFile]);
+  CHECK_EQUAL(0, timings.ticks[StartupPhaseLoadIniFile]);
+  CHECK(!timings.recorded[StartupPhaseLoadLogFile]);
+}
+
+// TestReport function
+static void TestReport()
+{
+  // Check that only the recorded phases are reported, in phase order, with their share of the total
+  StartupTimings timings;
+  timings.Record(StartupPhaseTransactionCommit, 500);
+  timings.Record(StartupPhaseRestoreAfterWith, 1500);
+  timings.Record(StartupPhaseDetourAttach, 1000);
+  timings.Record(StartupPhaseDetourAttach, 1000);
+  timings.Record(StartupPhaseTotal, 6000);
+  CHECK(Format(timings) == L"DetourRestoreAfterWith = 1.500 ms (25.0%), DetourAttach = 2.000 ms (33.3%), "
+    L"DetourTransactionCommit = 0.500 ms (8.3%), Total = 6.000 ms (100.0%)");
+
+  // Check that a report without a total, which happens when the report is written before the total is recorded, gives
+  //   every phase a share of zero instead of dividing by zero
+  StartupTimings partial;
+  partial.Record(StartupPhaseLoadIniFile, 42);
+  CHECK(Format(partial) == L"LoadIniFile = 0.042 ms (0.0%)");
+
+  // Check that nothing recorded gives an empty report
+  CHECK(Format(StartupTimings()).empty());
+}
+
+// TestTruncation function
+static void TestTruncation()
+{
+  // Check that a report that does not fit keeps the phases that do and leaves out the rest whole
+  StartupTimings timings;
+  timings.Record(StartupPhaseLoadIniFile, 1000);
+  timings.Record(StartupPhaseLoadLogFile, 1000);
+  timings.Record(StartupPhaseTotal, 2000);
+  std::wstring full = Format(timings);
+  std::wstring first = L"LoadIniFile = 1.000 ms (50.0%)";
+  CHECK(full.compare(0, first.size(), first) == 0);
+  CHECK(Format(timings, first.size() + 1) == first);
+  CHECK(Format(timings, first.size() + 10) == first);
+  CHECK(Format(timings, first.size()).empty());
+  CHECK(Format(timings, full.size() + 1) == full);
+  CHECK(Format(timings, full.size()) == first + L", LoadLogFile = 1.000 ms (50.0%)");
+
+  // Check that an empty buffer is left alone
+  wchar_t sentinel = L'x';
+  CHECK_EQUAL(0, FormatStartupReport(timings, kFrequency, &sentinel, 0));
+  CHECK(sentinel == L'x');
+}
+
+// main function
+int main()
+{
+  TestNames();
+  TestRecord();
+  TestReport();
+  TestTruncation();
+  return TestResult("SpoofStartupTest");
+}
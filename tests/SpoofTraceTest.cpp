@@ -0,0 +1,539 @@
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <windows.h>
+#include <SpoofTrace.h>
+
+#include "TestCommon.h"
+
+// Tests for the trace chunk pool and the Chrome trace event JSON it is serialized into
+// Note: the trace files are parsed back with a minimal JSON parser and checked against the schema Perfetto and
+//   chrome://tracing read, so that a file that only looks right is not enough
+
+// Parsed JSON value
+struct JsonValue
+{
+  enum Type
+  {
+    Null,
+    Boolean,
+    Number,
+    String,
+    Array,
+    Object
+  } type = Null;
+  bool boolean = false;
+  double number = 0;
+  std::string string;
+  std::vector<JsonValue> array;
+  std::vector<std::pair<std::string, JsonValue>> object;
+
+  // Find function
+  const JsonValue* Find(const char* key) const
+  {
+    for (const std::pair<std::string, JsonValue>& member : object)
+      if (member.first == key)
+        return &member.second;
+    return nullptr;
+  }
+};
+
+// Minimal strict JSON parser
+class JsonParser
+{
+public:
+  explicit JsonParser(const std::string& text) : position(text.c_str()) {}
+
+  // Parse function
+  // Note: fails on anything but a single value surrounded by whitespace
+  bool Parse(JsonValue& value)
+  {
+    if (!ParseValue(value))
+      return false;
+    SkipWhitespace();
+    return *position == 0;
+  }
+
+private:
+  // SkipWhitespace function
+  void SkipWhitespace()
+  {
+    while (*position == ' ' || *position == '\t' || *position == '\r' || *position == '\n')
+      position++;
+  }
+
+  // ParseLiteral function
+  bool ParseLiteral(const char* literal)
+  {
+    size_t length = strlen(literal);
+    if (strncmp(position, literal, length) != 0)
+      return false;
+    position += length;
+    return true;
+  }
+
+  // ParseString function
+  bool ParseString(std::string& string)
+  {
+    if (*position++ != '"')
+      return false;
+    while (*position != '"')
+    {
+      unsigned char character = (unsigned char)*position++;
+      if (character < 0x20)
+        return false;
+      if (character != '\\')
+      {
+        string += (char)character;
+        continue;
+      }
+      switch (*position++)
+      {
+      case '"': string += '"'; break;
+      case '\\': string += '\\'; break;
+      case '/': string += '/'; break;
+      case 'b': string += '\b'; break;
+      case 'f': string += '\f'; break;
+      case 'n': string += '\n'; break;
+      case 'r': string += '\r'; break;
+      case 't': string += '\t'; break;
+      case 'u':
+      {
+        // Only code points below 0x80 are written by the serializer
+        char digits[5] = {};
+        for (int i = 0; i < 4; i++)
+        {
+          if (!isxdigit((unsigned char)*position))
+            return false;
+          digits[i] = *position++;
+        }
+        unsigned long codePoint = strtoul(digits, nullptr, 16);
+        if (codePoint >= 0x80)
+          return false;
+        string += (char)codePoint;
+        break;
+      }
+      default:
+        return false;
+      }
+    }
+    position++;
+    return true;
+  }
+
+  // ParseNumber function
+  bool ParseNumber(double& number)
+  {
+    const char* start = position;
+    if (*position == '-')
+      position++;
+    if (*position == '0')
+      position++;
+    else if (*position >= '1' && *position <= '9')
+      while (isdigit((unsigned char)*position))
+        position++;
+    else
+      return false;
+    if (*position == '.')
+    {
+      position++;
+      if (!isdigit((unsigned char)*position))
+        return false;
+      while (isdigit((unsigned char)*position))
+        position++;
+    }
+    if (*position == 'e' || *position == 'E')
+    {
+      position++;
+      if (*position == '+' || *position == '-')
+        position++;
+      if (!isdigit((unsigned char)*position))
+        return false;
+      while (isdigit((unsigned char)*position))
+        position++;
+    }
+    number = strtod(std::string(start, position).c_str(), nullptr);
+    return true;
+  }
+
+  // ParseValue function
+  bool ParseValue(JsonValue& value)
+  {
+    SkipWhitespace();
+    switch (*position)
+    {
+    case 'n':
+      value.type = JsonValue::Null;
+      return ParseLiteral("null");
+    case 't':
+    case 'f':
+      value.type = JsonValue::Boolean;
+      value.boolean = *position == 't';
+      return ParseLiteral(value.boolean ? "true" : "false");
+    case '"':
+      value.type = JsonValue::String;
+      return ParseString(value.string);
+    case '[':
+      value.type = JsonValue::Array;
+      position++;
+      SkipWhitespace();
+      if (*position == ']')
+      {
+        position++;
+        return true;
+      }
+      for (;;)
+      {
+        value.array.emplace_back();
+        if (!ParseValue(value.array.back()))
+          return false;
+        SkipWhitespace();
+        if (*position == ']')
+        {
+          position++;
+          return true;
+        }
+        if (*position++ != ',')
+          return false;
+      }
+    case '{':
+      value.type = JsonValue::Object;
+      position++;
+      SkipWhitespace();
+      if (*position == '}')
+      {
+        position++;
+        return true;
+      }
+      for (;;)
+      {
+        SkipWhitespace();
+        std::string key;
+        if (!ParseString(key))
+          return false;
+        SkipWhitespace();
+        if (*position++ != ':')
+          return false;
+        value.object.emplace_back(key, JsonValue());
+        if (!ParseValue(value.object.back().second))
+          return false;
+        SkipWhitespace();
+        if (*position == '}')
+        {
+          position++;
+          return true;
+        }
+        if (*position++ != ',')
+          return false;
+      }
+    default:
+      value.type = JsonValue::Number;
+      return ParseNumber(value.number);
+    }
+  }
+
+  const char* position;
+};
+
+// Event as parsed back from a trace file
+struct ParsedEvent
+{
+  std::string name;
+  std::string category;
+  char phase;
+  double processId;
+  double threadId;
+  double start;
+  double duration;
+};
+
+// HasKeys function
+// Note: checks that an object has exactly the given keys, each once
+static bool HasKeys(const JsonValue& value, std::vector<const char*> keys)
+{
+  if (value.type != JsonValue::Object || value.object.size() != keys.size())
+    return false;
+  for (const char* key : keys)
+    if (value.Find(key) == nullptr)
+      return false;
+  return true;
+}
+
+// IsType function
+static bool IsType(const JsonValue* value, JsonValue::Type type)
+{
+  return value != nullptr && value->type == type;
+}
+
+// ValidateTrace function
+// Note: checks the trace file against the schema and returns its events and dropped event count
+static bool ValidateTrace(const std::string& text, std::vector<ParsedEvent>& events, double& droppedEvents)
+{
+  JsonValue root;
+  if (!JsonParser(text).Parse(root))
+    return false;
+
+  // Check the top level object
+  if (!HasKeys(root, { "traceEvents", "displayTimeUnit", "otherData" }))
+    return false;
+  const JsonValue* unit = root.Find("displayTimeUnit");
+  const JsonValue* otherData = root.Find("otherData");
+  if (!IsType(unit, JsonValue::String) || unit->string != "ms" || !HasKeys(*otherData, { "droppedEvents" }) ||
+    !IsType(otherData->Find("droppedEvents"), JsonValue::Number) || !IsType(root.Find("traceEvents"), JsonValue::Array))
+    return false;
+  droppedEvents = otherData->Find("droppedEvents")->number;
+
+  // Check every event, a duration slice carries a non negative duration and an instant event is thread scoped
+  for (const JsonValue& value : root.Find("traceEvents")->array)
+  {
+    const JsonValue* phase = value.Find("ph");
+    if (!IsType(phase, JsonValue::String) || (phase->string != "X" && phase->string != "i"))
+      return false;
+    if (phase->string == "X" ? !HasKeys(value, { "name", "cat", "ph", "pid", "tid", "ts", "dur" })
+                             : !HasKeys(value, { "name", "cat", "ph", "s", "pid", "tid", "ts" }))
+      return false;
+    if (!IsType(value.Find("name"), JsonValue::String) || !IsType(value.Find("cat"), JsonValue::String) ||
+      !IsType(value.Find("pid"), JsonValue::Number) || !IsType(value.Find("tid"), JsonValue::Number) ||
+      !IsType(value.Find("ts"), JsonValue::Number))
+      return false;
+    ParsedEvent event = { value.Find("name")->string, value.Find("cat")->string, phase->string[0],
+      value.Find("pid")->number, value.Find("tid")->number, value.Find("ts")->number, 0 };
+    if (event.phase == 'X')
+    {
+      if (!IsType(value.Find("dur"), JsonValue::Number) || value.Find("dur")->number < 0)
+        return false;
+      event.duration = value.Find("dur")->number;
+    }
+    else if (!IsType(value.Find("s"), JsonValue::String) || value.Find("s")->string != "t")
+      return false;
+    events.push_back(event);
+  }
+  return true;
+}
+
+// ReadFile function
+static std::string ReadFile(FILE* file)
+{
+  std::string text;
+  rewind(file);
+  char buffer[4096];
+  size_t read;
+  while ((read = fread(buffer, 1, sizeof(buffer), file)) != 0)
+    text.append(buffer, read);
+  return text;
+}
+
+// Clock the tests write with, one tick per microsecond
+static const TraceClock kClock = { 4321, 1000, 1000000 };
+
+// TestSerializer function
+static void TestSerializer()
+{
+  // Check that events with names that need escaping are written to the schema and read back the same
+  std::vector<TraceEvent> written = {
+    { "GetSystemMetrics", "detour", 'X', 7, 1500, 1750 },
+    { "DllMain \"attach\"", "init", 'i', 8, 3000, 3000 },
+    { "C:\\Games\\Game.exe", "caller\tpath", 'X', 4000000000u, 2000, 2000 },
+    { "\x01\x1f", "", 'i', 0, 1000, 1000 },
+  };
+  FILE* file = tmpfile();
+  CHECK(file != nullptr);
+  if (file == nullptr)
+    return;
+  WriteTraceBegin(file);
+  for (size_t i = 0; i < written.size(); i++)
+    WriteTraceEvent(file, written[i], kClock, i == 0);
+  WriteTraceEnd(file, 12345678901ull);
+  std::string text = ReadFile(file);
+  fclose(file);
+
+  std::vector<ParsedEvent> events;
+  double droppedEvents = -1;
+  CHECK(ValidateTrace(text, events, droppedEvents));
+  CHECK_EQUAL(12345678901ull, droppedEvents);
+  CHECK_EQUAL(written.size(), events.size());
+  for (size_t i = 0; i < written.size() && i < events.size(); i++)
+  {
+    CHECK(events[i].name == written[i].name);
+    CHECK(events[i].category == written[i].category);
+    CHECK(events[i].phase == written[i].phase);
+    CHECK_EQUAL(kClock.processId, events[i].processId);
+    CHECK_EQUAL(written[i].threadId, events[i].threadId);
+    CHECK(fabs(events[i].start - (double)(written[i].start - kClock.start)) < 0.001);
+    CHECK(fabs(events[i].duration - (written[i].phase == 'X' ? (double)(written[i].end - written[i].start) : 0)) <
+      0.001);
+  }
+
+  // Check that a trace without any events is still valid
+  file = tmpfile();
+  CHECK(file != nullptr);
+  if (file == nullptr)
+    return;
+  WriteTraceBegin(file);
+  WriteTraceEnd(file, 0);
+  text = ReadFile(file);
+  fclose(file);
+  events.clear();
+  CHECK(ValidateTrace(text, events, droppedEvents));
+  CHECK(events.empty());
+  CHECK_EQUAL(0, droppedEvents);
+
+  // Check that the validation itself rejects what the serializer must never write
+  CHECK(!ValidateTrace("{\"traceEvents\":[],\"displayTimeUnit\":\"ms\"}", events, droppedEvents));
+  CHECK(!ValidateTrace("{\"traceEvents\":[{\"name\":\"a\",\"cat\":\"b\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":0}],"
+    "\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":0}}", events, droppedEvents));
+  CHECK(!ValidateTrace("{\"traceEvents\":[{\"name\":\"a\",\"cat\":\"b\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":1,"
+    "\"ts\":0}],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":0}}", events, droppedEvents));
+  CHECK(!ValidateTrace("{\"traceEvents\":[\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":0}},",
+    events, droppedEvents));
+  CHECK(!ValidateTrace("{\"traceEvents\":[{\"name\":\"\x01\"}]}", events, droppedEvents));
+}
+
+// MakeEvent function
+// Note: the start time identifies the event so that every event can be followed through the pool
+static TraceEvent MakeEvent(DWORD threadId, LONGLONG sequence)
+{
+  return { "Event", "test", 'X', threadId, sequence, sequence + 1 };
+}
+
+// TestPool function
+static void TestPool()
+{
+  // Check that nothing is recorded before the pool is allocated and tracing is enabled
+  TraceBuffer buffer;
+  TraceChunk* threadChunk = nullptr;
+  buffer.Enable();
+  CHECK(!buffer.IsEnabled());
+  CHECK(!buffer.Record(threadChunk, MakeEvent(1, 0)));
+  CHECK(buffer.Initialize(2));
+  CHECK(!buffer.Record(threadChunk, MakeEvent(1, 0)));
+  CHECK(threadChunk == nullptr);
+  buffer.Enable();
+  CHECK(buffer.IsEnabled());
+
+  // Check that once both chunks are full further events are dropped and counted instead of growing the pool
+  std::vector<LONGLONG> flushed;
+  auto write = [&](const TraceEvent& event) { flushed.push_back(event.start); };
+  LONGLONG sequence = 0;
+  for (; sequence < 2 * SPOOFRES_TRACE_CHUNK_EVENTS; sequence++)
+    CHECK(buffer.Record(threadChunk, MakeEvent(1, sequence)));
+  CHECK_EQUAL(0, buffer.GetDroppedEvents());
+  for (int i = 0; i < 10; i++)
+    CHECK(!buffer.Record(threadChunk, MakeEvent(1, sequence + i)));
+  CHECK_EQUAL(10, buffer.GetDroppedEvents());
+  CHECK(threadChunk == nullptr);
+
+  // Check that flushing writes both chunks in recording order within each chunk and hands them back to the pool
+  CHECK_EQUAL(2 * SPOOFRES_TRACE_CHUNK_EVENTS, buffer.Flush(write));
+  CHECK_EQUAL(2 * SPOOFRES_TRACE_CHUNK_EVENTS, flushed.size());
+  std::vector<bool> seen(2 * SPOOFRES_TRACE_CHUNK_EVENTS);
+  for (size_t i = 0; i < flushed.size(); i++)
+  {
+    CHECK(flushed[i] >= 0 && flushed[i] < (LONGLONG)seen.size() && !seen[(size_t)flushed[i]]);
+    if (flushed[i] >= 0 && flushed[i] < (LONGLONG)seen.size())
+      seen[(size_t)flushed[i]] = true;
+    if (i % SPOOFRES_TRACE_CHUNK_EVENTS != 0)
+      CHECK_EQUAL(flushed[i - 1] + 1, flushed[i]);
+  }
+  CHECK_EQUAL(0, buffer.Flush(write));
+  flushed.clear();
+  CHECK(buffer.Record(threadChunk, MakeEvent(1, 100)));
+  CHECK(threadChunk != nullptr);
+
+  // Check that a partially filled chunk is not flushed until its thread exits and releases it
+  CHECK_EQUAL(0, buffer.Flush(write));
+  buffer.Release(threadChunk);
+  CHECK(threadChunk == nullptr);
+  buffer.Release(threadChunk);
+  CHECK_EQUAL(1, buffer.Flush(write));
+  CHECK(flushed.size() == 1 && flushed[0] == 100);
+
+  // Check that an empty chunk that is released goes straight back to the pool and that the pool is still whole
+  flushed.clear();
+  TraceChunk* otherChunk = nullptr;
+  CHECK(buffer.Record(threadChunk, MakeEvent(1, 200)));
+  CHECK(buffer.Record(otherChunk, MakeEvent(2, 300)));
+  TraceChunk* thirdChunk = nullptr;
+  CHECK(!buffer.Record(thirdChunk, MakeEvent(3, 400)));
+  CHECK_EQUAL(11, buffer.GetDroppedEvents());
+
+  // Check that draining writes the chunks that are still being recorded into and stops recording
+  CHECK_EQUAL(2, buffer.Drain(write));
+  CHECK(flushed.size() == 2 && flushed[0] + flushed[1] == 500);
+  CHECK(!buffer.IsEnabled());
+  CHECK(!buffer.Record(threadChunk, MakeEvent(1, 201)));
+  CHECK_EQUAL(0, buffer.Drain(write));
+}
+
+// TestThreads function
+static void TestThreads()
+{
+  // Record from several threads while another thread flushes like the trace writer thread and check that every event
+  //   is either written exactly once or counted as dropped
+  const int threadCount = 8;
+  const LONGLONG eventsPerThread = 50000;
+  TraceBuffer buffer;
+  CHECK(buffer.Initialize(4));
+  buffer.Enable();
+  std::vector<std::vector<bool>> seen(threadCount, std::vector<bool>((size_t)eventsPerThread));
+  std::atomic<int> duplicates = 0;
+  std::atomic<size_t> written = 0;
+  auto write = [&](const TraceEvent& event)
+  {
+    std::vector<bool>& threadSeen = seen[event.threadId];
+    if (threadSeen[(size_t)event.start])
+      duplicates++;
+    threadSeen[(size_t)event.start] = true;
+    written++;
+  };
+  std::atomic<bool> recording = true;
+  std::thread writer([&]()
+  {
+    while (recording)
+    {
+      buffer.Flush(write);
+      Sleep(1);
+    }
+  });
+  std::vector<std::thread> threads;
+  std::atomic<size_t> recorded = 0;
+  for (int thread = 0; thread < threadCount; thread++)
+  {
+    threads.emplace_back([&, thread]()
+    {
+      TraceChunk* threadChunk = nullptr;
+      for (LONGLONG sequence = 0; sequence < eventsPerThread; sequence++)
+        if (buffer.Record(threadChunk, MakeEvent((DWORD)thread, sequence)))
+          recorded++;
+
+      // Only release the chunks of half the threads so that draining has to pick up the others
+      if (thread % 2 == 0)
+        buffer.Release(threadChunk);
+    });
+  }
+  for (std::thread& thread : threads)
+    thread.join();
+  recording = false;
+  writer.join();
+  buffer.Drain(write);
+
+  CHECK_EQUAL(0, duplicates.load());
+  CHECK_EQUAL(recorded.load(), written.load());
+  CHECK_EQUAL(threadCount * eventsPerThread, written.load() + buffer.GetDroppedEvents());
+  CHECK(written.load() != 0);
+}
+
+// main function
+int main()
+{
+  TestSerializer();
+  TestPool();
+  TestThreads();
+  return TestResult("SpoofTraceTest");
+}
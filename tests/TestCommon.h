@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdio>
+
+// Minimal test helpers shared by the Spoof Resolution tests
+// Note: every test is its own executable that returns a non zero exit code if any check failed so that it can be run
+//   by ctest without a test framework
+
+inline int gTestFailures = 0;
+
+// Check that a condition is true and report where it failed otherwise
+#define CHECK(condition) \
+  do \
+  { \
+    if (!(condition)) \
+    { \
+      fprintf(stderr, "%s(%d): check failed: %s\n", __FILE__, __LINE__, #condition); \
+      gTestFailures++; \
+    } \
+  } while (0)
+
+// Check that two integer values are equal and report both values otherwise
+#define CHECK_EQUAL(expected, actual) \
+  do \
+  { \
+    long long expectedValue = (long long)(expected); \
+    long long actualValue = (long long)(actual); \
+    if (expectedValue != actualValue) \
+    { \
+      fprintf(stderr, "%s(%d): check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #expected, #actual, \
+        expectedValue, actualValue); \
+      gTestFailures++; \
+    } \
+  } while (0)
+
+// TestResult function
+inline int TestResult(const char* name)
+{
+  if (gTestFailures != 0)
+  {
+    fprintf(stderr, "%s: %d check(s) failed\n", name, gTestFailures);
+    return 1;
+  }
+
+  printf("%s: all checks passed\n", name);
+  return 0;
+}
@@ -0,0 +1,33 @@
+# Source of exports.dll, the PE32+ image the image view and export tests read from disk
+# Note: the image is checked in so that the tests do not need a Windows toolchain, it is rebuilt with LLVM and the
+#   PE linker in GNU binutils, which leave no timestamp in it, from this directory with
+#     llvm-mc -filetype=obj -triple x86_64-pc-windows-gnu exports.s -o exports.obj
+#     ld -m i386pep --dll -e DllMain --no-insert-timestamp -s exports.obj exports.def -o exports.dll
+# Note: every function is "mov eax, imm32; ret" returning a value of its own so that the tests can tell them apart
+
+	.text
+	.globl	Alpha
+Alpha:
+	movl	$1, %eax
+	retq
+	.globl	Beta
+Beta:
+	movl	$2, %eax
+	retq
+	.globl	Gamma
+Gamma:
+	movl	$3, %eax
+	retq
+	.globl	Hidden
+Hidden:
+	movl	$4, %eax
+	retq
+	.globl	DllMain
+DllMain:
+	movl	$1, %eax
+	retq
+
+	.data
+	.globl	Value
+Value:
+	.long	0x12345678
@@ -0,0 +1,3 @@
+#pragma once
+
+// Debug CRT declarations of the Windows API shim, Detours only uses them in debug builds on Windows
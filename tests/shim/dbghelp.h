@@ -0,0 +1,53 @@
+#pragma once
+#include <windows.h>
+
+// Debug help declarations of the Windows API shim, only the types Detours needs for its symbol lookup, which always
+//   fails on Linux since dbghelp.dll can never be loaded
+
+#define IMAGEAPI WINAPI
+#define DBHLPAPI WINAPI
+#define API_VERSION_NUMBER 12
+#define SYMOPT_CASE_INSENSITIVE 0x00000001
+#define SYMOPT_UNDNAME 0x00000002
+#define SYMOPT_DEFERRED_LOADS 0x00000004
+
+typedef struct API_VERSION
+{
+  USHORT MajorVersion;
+  USHORT MinorVersion;
+  USHORT Revision;
+  USHORT Reserved;
+} API_VERSION, *LPAPI_VERSION;
+
+typedef struct _IMAGEHLP_MODULE64
+{
+  DWORD SizeOfStruct;
+  DWORD64 BaseOfImage;
+  DWORD ImageSize;
+  DWORD TimeDateStamp;
+  DWORD CheckSum;
+  DWORD NumSyms;
+  DWORD SymType;
+  CHAR ModuleName[32];
+  CHAR ImageName[256];
+  CHAR LoadedImageName[256];
+} IMAGEHLP_MODULE64, *PIMAGEHLP_MODULE64;
+
+typedef struct _SYMBOL_INFO
+{
+  ULONG SizeOfStruct;
+  ULONG TypeIndex;
+  ULONG64 Reserved[2];
+  ULONG Index;
+  ULONG Size;
+  ULONG64 ModBase;
+  ULONG Flags;
+  ULONG64 Value;
+  ULONG64 Address;
+  ULONG Register;
+  ULONG Scope;
+  ULONG Tag;
+  ULONG NameLen;
+  ULONG MaxNameLen;
+  CHAR Name[1];
+} SYMBOL_INFO, *PSYMBOL_INFO;
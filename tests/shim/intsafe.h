@@ -0,0 +1,31 @@
+#pragma once
+#include <windows.h>
+
+// Integer overflow checking declarations of the Windows API shim, implemented with the compiler builtins
+
+#define INTSAFE_E_ARITHMETIC_OVERFLOW ((HRESULT)0x80070216)
+
+inline HRESULT DWordAdd(DWORD augend, DWORD addend, DWORD* result)
+{
+  return __builtin_add_overflow(augend, addend, result) ? INTSAFE_E_ARITHMETIC_OVERFLOW : S_OK;
+}
+
+inline HRESULT DWordMult(DWORD multiplicand, DWORD multiplier, DWORD* result)
+{
+  return __builtin_mul_overflow(multiplicand, multiplier, result) ? INTSAFE_E_ARITHMETIC_OVERFLOW : S_OK;
+}
+
+inline HRESULT ULongAdd(ULONG augend, ULONG addend, ULONG* result)
+{
+  return __builtin_add_overflow(augend, addend, result) ? INTSAFE_E_ARITHMETIC_OVERFLOW : S_OK;
+}
+
+inline HRESULT SIZETAdd(SIZE_T augend, SIZE_T addend, SIZE_T* result)
+{
+  return __builtin_add_overflow(augend, addend, result) ? INTSAFE_E_ARITHMETIC_OVERFLOW : S_OK;
+}
+
+inline HRESULT SIZETMult(SIZE_T multiplicand, SIZE_T multiplier, SIZE_T* result)
+{
+  return __builtin_mul_overflow(multiplicand, multiplier, result) ? INTSAFE_E_ARITHMETIC_OVERFLOW : S_OK;
+}
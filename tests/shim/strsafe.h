@@ -0,0 +1,79 @@
+#pragma once
+#include <cstdarg>
+#include <cwchar>
+#include <windows.h>
+
+// Safe string declarations of the Windows API shim, implemented with the bounded C string functions
+
+#define STRSAFE_E_INSUFFICIENT_BUFFER ((HRESULT)0x8007007a)
+#define STRSAFE_E_INVALID_PARAMETER ((HRESULT)0x80070057)
+
+inline HRESULT StringCchCopyA(LPSTR destination, size_t size, LPCSTR source)
+{
+  if (size == 0)
+    return STRSAFE_E_INSUFFICIENT_BUFFER;
+  size_t length = strlen(source);
+  size_t copied = length < size ? length : size - 1;
+  memcpy(destination, source, copied);
+  destination[copied] = '\0';
+  return copied == length ? S_OK : STRSAFE_E_INSUFFICIENT_BUFFER;
+}
+
+inline HRESULT StringCchCatNA(LPSTR destination, size_t size, LPCSTR source, size_t maxAppend)
+{
+  size_t length = strnlen(destination, size);
+  if (length == size)
+    return STRSAFE_E_INSUFFICIENT_BUFFER;
+  size_t append = strnlen(source, maxAppend);
+  size_t copied = append < size - length ? append : size - length - 1;
+  memcpy(destination + length, source, copied);
+  destination[length + copied] = '\0';
+  return copied == append ? S_OK : STRSAFE_E_INSUFFICIENT_BUFFER;
+}
+
+inline HRESULT StringCchCatA(LPSTR destination, size_t size, LPCSTR source)
+{
+  return StringCchCatNA(destination, size, source, strlen(source));
+}
+
+inline HRESULT StringCchCatW(LPWSTR destination, size_t size, LPCWSTR source)
+{
+  size_t length = wcsnlen(destination, size);
+  if (length == size)
+    return STRSAFE_E_INSUFFICIENT_BUFFER;
+  size_t append = wcslen(source);
+  size_t copied = append < size - length ? append : size - length - 1;
+  wmemcpy(destination + length, source, copied);
+  destination[length + copied] = L'\0';
+  return copied == append ? S_OK : STRSAFE_E_INSUFFICIENT_BUFFER;
+}
+
+inline HRESULT StringCchLengthA(LPCSTR source, size_t maxSize, size_t* length)
+{
+  size_t found = source == NULL ? maxSize : strnlen(source, maxSize);
+  if (length != NULL)
+    *length = found == maxSize ? 0 : found;
+  return found == maxSize ? STRSAFE_E_INVALID_PARAMETER : S_OK;
+}
+
+inline HRESULT StringCchPrintfA(LPSTR destination, size_t size, LPCSTR format, ...)
+{
+  if (size == 0)
+    return STRSAFE_E_INSUFFICIENT_BUFFER;
+  va_list arguments;
+  va_start(arguments, format);
+  int length = vsnprintf(destination, size, format, arguments);
+  va_end(arguments);
+  return length >= 0 && (size_t)length < size ? S_OK : STRSAFE_E_INSUFFICIENT_BUFFER;
+}
+
+inline HRESULT StringCchPrintfW(LPWSTR destination, size_t size, LPCWSTR format, ...)
+{
+  if (size == 0)
+    return STRSAFE_E_INSUFFICIENT_BUFFER;
+  va_list arguments;
+  va_start(arguments, format);
+  int length = vswprintf(destination, size, format, arguments);
+  va_end(arguments);
+  return length >= 0 ? S_OK : STRSAFE_E_INSUFFICIENT_BUFFER;
+}
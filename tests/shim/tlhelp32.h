@@ -0,0 +1,23 @@
+#pragma once
+#include <windows.h>
+
+// Toolhelp declarations of the Windows API shim, thread snapshots list the calling thread and the simulated threads,
+//   see ShimThread
+
+#define TH32CS_SNAPPROCESS 0x00000002
+#define TH32CS_SNAPTHREAD 0x00000004
+
+typedef struct tagTHREADENTRY32
+{
+  DWORD dwSize;
+  DWORD cntUsage;
+  DWORD th32ThreadID;
+  DWORD th32OwnerProcessID;
+  LONG tpBasePri;
+  LONG tpDeltaPri;
+  DWORD dwFlags;
+} THREADENTRY32, *PTHREADENTRY32, *LPTHREADENTRY32;
+
+HANDLE CreateToolhelp32Snapshot(DWORD flags, DWORD processId);
+BOOL Thread32First(HANDLE snapshot, LPTHREADENTRY32 entry);
+BOOL Thread32Next(HANDLE snapshot, LPTHREADENTRY32 entry);
@@ -0,0 +1,957 @@
+#include <windows.h>
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// POSIX implementation of the Windows API shim, see windows.h
+
+ShimCounters gShimCounters;
+static thread_local DWORD gLastError = 0;
+
+// Highest user mode address handed out by the Linux kernel on x64 and arm64 with 48-bit address spaces
+static const ULONG_PTR kUserAddressLimit = 0x00007ffffffff000ull;
+
+// Size of every allocation made with VirtualAlloc by base address, used to release whole allocations and to report
+//   their base in VirtualQuery
+static std::mutex gAllocationsLock;
+static std::map<ULONG_PTR, SIZE_T> gAllocations;
+
+// Ranges changed by VirtualProtect and FlushInstructionCache since the last ResetShimCounters
+static std::mutex gRangeCallsLock;
+static std::vector<ShimRangeCall> gProtectCalls;
+static std::vector<ShimRangeCall> gFlushCalls;
+
+// Modules registered by tests and the names passed to GetProcAddress since the last ResetShimCounters
+static std::mutex gModulesLock;
+static std::vector<ShimModule> gModules;
+static std::vector<std::string> gProcAddressCalls;
+
+// Pseudo handles
+static HANDLE const kCurrentProcess = (HANDLE)(LONG_PTR)-1;
+static HANDLE const kCurrentThread = (HANDLE)(LONG_PTR)-2;
+
+// Event object behind the handles returned by CreateEventW
+struct ShimEvent
+{
+  uint32_t signature = 0x45766e74;
+  std::mutex lock;
+  std::condition_variable signaled;
+  bool manualReset = false;
+  bool state = false;
+};
+
+// Simulated threads registered by the tests and the objects behind the handles returned by OpenThread and
+//   CreateToolhelp32Snapshot, every object starts with its signature so that CloseHandle can tell them apart
+static std::mutex gThreadsLock;
+static std::vector<ShimThread> gThreads;
+struct ShimThreadHandle
+{
+  uint32_t signature = 0x54687264;
+  DWORD threadId = 0;
+};
+struct ShimSnapshot
+{
+  uint32_t signature = 0x536e6170;
+  std::vector<ShimThread> threads;
+  size_t next = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////// Errors
+
+DWORD GetLastError()
+{
+  return gLastError;
+}
+
+void SetLastError(DWORD error)
+{
+  gLastError = error;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////// Threads and timing
+
+HANDLE GetCurrentProcess()
+{
+  return kCurrentProcess;
+}
+
+HANDLE GetCurrentThread()
+{
+  return kCurrentThread;
+}
+
+DWORD GetCurrentProcessId()
+{
+  return (DWORD)getpid();
+}
+
+DWORD GetCurrentThreadId()
+{
+  return (DWORD)syscall(SYS_gettid);
+}
+
+DWORD GetThreadId(HANDLE thread)
+{
+  return thread == kCurrentThread ? GetCurrentThreadId() : 0;
+}
+
+DWORD GetProcessId(HANDLE process)
+{
+  return process == kCurrentProcess ? GetCurrentProcessId() : 0;
+}
+
+// FindShimThread function
+static ShimThread* FindShimThread(DWORD threadId)
+{
+  for (ShimThread& thread : gThreads)
+  {
+    if (thread.threadId == threadId)
+      return &thread;
+  }
+  return nullptr;
+}
+
+// FindShimThread function
+// Note: only handles returned by OpenThread refer to simulated threads
+static ShimThread* FindShimThread(HANDLE handle)
+{
+  ShimThreadHandle* threadHandle = (ShimThreadHandle*)handle;
+  if (handle == NULL || handle == INVALID_HANDLE_VALUE || handle == kCurrentThread || handle == kCurrentProcess ||
+    threadHandle->signature != 0x54687264)
+    return nullptr;
+  return FindShimThread(threadHandle->threadId);
+}
+
+void SetShimThreads(const std::vector<ShimThread>& threads)
+{
+  std::lock_guard<std::mutex> threadsLock(gThreadsLock);
+  gThreads = threads;
+}
+
+std::vector<ShimThread> GetShimThreads()
+{
+  std::lock_guard<std::mutex> threadsLock(gThreadsLock);
+  return gThreads;
+}
+
+HANDLE OpenThread(DWORD access, BOOL inherit, DWORD threadId)
+{
+  // Only simulated threads that have not exited can be opened, other threads cannot be suspended on Linux
+  std::lock_guard<std::mutex> threadsLock(gThreadsLock);
+  ShimThread* thread = FindShimThread(threadId);
+  if (thread == nullptr || thread->exited)
+  {
+    SetLastError(thread == nullptr ? ERROR_NOT_SUPPORTED : ERROR_INVALID_PARAMETER);
+    return NULL;
+  }
+  thread->openHandles++;
+  ShimThreadHandle* handle = new ShimThreadHandle();
+  handle->threadId = threadId;
+  return handle;
+}
+
+HANDLE OpenProcess(DWORD access, BOOL inherit, DWORD processId)
+{
+  SetLastError(ERROR_NOT_SUPPORTED);
+  return NULL;
+}
+
+DWORD SuspendThread(HANDLE handle)
+{
+  std::lock_guard<std::mutex> threadsLock(gThreadsLock);
+  ShimThread* thread = FindShimThread(handle);
+  if (thread == nullptr || thread->suspendFails)
+  {
+    SetLastError(thread == nullptr ? ERROR_NOT_SUPPORTED : ERROR_ACCESS_DENIED);
+    return (DWORD)-1;
+  }
+  thread->suspends++;
+  return (DWORD)thread->suspendCount++;
+}
+
+DWORD ResumeThread(HANDLE handle)
+{
+  std::lock_guard<std::mutex> threadsLock(gThreadsLock);
+  ShimThread* thread = FindShimThread(handle);
+  if (thread == nullptr)
+  {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return (DWORD)-1;
+  }
+  return (DWORD)(thread->suspendCount > 0 ? thread->suspendCount-- : 0);
+}
+
+BOOL GetThreadContext(HANDLE handle, CONTEXT* context)
+{
+  // Only the control registers are simulated
+  std::lock_guard<std::mutex> threadsLock(gThreadsLock);
+  ShimThread* thread = FindShimThread(handle);
+  if (thread == nullptr)
+  {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+  }
+  DWORD flags = context->ContextFlags;
+  *context = thread->context;
+  context->ContextFlags = flags;
+  return TRUE;
+}
+
+BOOL SetThreadContext(HANDLE handle, const CONTEXT* context)
+{
+  std::lock_guard<std::mutex> threadsLock(gThreadsLock);
+  ShimThread* thread = FindShimThread(handle);
+  if (thread == nullptr)
+  {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+  }
+  thread->context = *context;
+  thread->contextWrites++;
+  return TRUE;
+}
+
+BOOL CloseHandle(HANDLE handle)
+{
+  // Only events, simulated thread handles, and snapshots are real objects, every other handle is a pseudo handle
+  if (handle == NULL || handle == INVALID_HANDLE_VALUE || handle == kCurrentThread || handle == kCurrentProcess)
+    return TRUE;
+  uint32_t signature = *(uint32_t*)handle;
+  if (signature == 0x45766e74)
+  {
+    ShimEvent* event = (ShimEvent*)handle;
+    event->signature = 0;
+    delete event;
+  }
+  else if (signature == 0x54687264)
+  {
+    ShimThreadHandle* threadHandle = (ShimThreadHandle*)handle;
+    std::lock_guard<std::mutex> threadsLock(gThreadsLock);
+    if (ShimThread* thread = FindShimThread(threadHandle->threadId))
+      thread->openHandles--;
+    threadHandle->signature = 0;
+    delete threadHandle;
+  }
+  else if (signature == 0x536e6170)
+  {
+    ShimSnapshot* snapshot = (ShimSnapshot*)handle;
+    snapshot->signature = 0;
+    delete snapshot;
+  }
+  return TRUE;
+}
+
+HANDLE CreateEventW(LPSECURITY_ATTRIBUTES attributes, BOOL manualReset, BOOL initialState, LPCWSTR name)
+{
+  ShimEvent* event = new ShimEvent();
+  event->manualReset = manualReset;
+  event->state = initialState;
+  return event;
+}
+
+BOOL SetEvent(HANDLE handle)
+{
+  ShimEvent* event = (ShimEvent*)handle;
+  std::lock_guard<std::mutex> eventLock(event->lock);
+  event->state = true;
+  event->signaled.notify_all();
+  return TRUE;
+}
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds)
+{
+  ShimEvent* event = (ShimEvent*)handle;
+  std::unique_lock<std::mutex> eventLock(event->lock);
+  if (milliseconds == INFINITE)
+    event->signaled.wait(eventLock, [&]() { return event->state; });
+  else if (!event->signaled.wait_for(eventLock, std::chrono::milliseconds(milliseconds),
+    [&]() { return event->state; }))
+    return WAIT_TIMEOUT;
+  if (!event->manualReset)
+    event->state = false;
+  return WAIT_OBJECT_0;
+}
+
+BOOL QueueUserWorkItem(LPTHREAD_START_ROUTINE function, PVOID context, ULONG flags)
+{
+  gShimCounters.queueUserWorkItem.fetch_add(1, std::memory_order_relaxed);
+  std::thread(function, context).detach();
+  return TRUE;
+}
+
+// Processes can not be created with a DLL on Linux so only the current process exists
+
+BOOL CreateProcessA(LPCSTR applicationName, LPSTR commandLine, LPSECURITY_ATTRIBUTES processAttributes,
+  LPSECURITY_ATTRIBUTES threadAttributes, BOOL inheritHandles, DWORD creationFlags, LPVOID environment,
+  LPCSTR currentDirectory, LPSTARTUPINFOA startupInfo, LPPROCESS_INFORMATION processInformation)
+{
+  SetLastError(ERROR_NOT_SUPPORTED);
+  return FALSE;
+}
+
+BOOL CreateProcessW(LPCWSTR applicationName, LPWSTR commandLine, LPSECURITY_ATTRIBUTES processAttributes,
+  LPSECURITY_ATTRIBUTES threadAttributes, BOOL inheritHandles, DWORD creationFlags, LPVOID environment,
+  LPCWSTR currentDirectory, LPSTARTUPINFOW startupInfo, LPPROCESS_INFORMATION processInformation)
+{
+  SetLastError(ERROR_NOT_SUPPORTED);
+  return FALSE;
+}
+
+BOOL TerminateProcess(HANDLE process, UINT exitCode)
+{
+  if (process == kCurrentProcess)
+    _exit((int)exitCode);
+  SetLastError(ERROR_INVALID_HANDLE);
+  return FALSE;
+}
+
+BOOL GetExitCodeProcess(HANDLE process, LPDWORD exitCode)
+{
+  SetLastError(ERROR_INVALID_HANDLE);
+  return FALSE;
+}
+
+void ExitProcess(UINT exitCode)
+{
+  exit((int)exitCode);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////// Virtual memory
+
+// ProtectionToPosix function
+static int ProtectionToPosix(DWORD protect)
+{
+  switch (protect & 0xff)
+  {
+  case PAGE_READONLY:
+    return PROT_READ;
+  case PAGE_READWRITE:
+  case PAGE_WRITECOPY:
+    return PROT_READ | PROT_WRITE;
+  case PAGE_EXECUTE:
+    return PROT_EXEC;
+  case PAGE_EXECUTE_READ:
+    return PROT_READ | PROT_EXEC;
+  case PAGE_EXECUTE_READWRITE:
+  case PAGE_EXECUTE_WRITECOPY:
+    return PROT_READ | PROT_WRITE | PROT_EXEC;
+  default:
+    return PROT_NONE;
+  }
+}
+
+// ProtectionFromPosix function
+static DWORD ProtectionFromPosix(bool read, bool write, bool execute)
+{
+  if (execute)
+    return write ? PAGE_EXECUTE_READWRITE : read ? PAGE_EXECUTE_READ : PAGE_EXECUTE;
+  return write ? PAGE_READWRITE : read ? PAGE_READONLY : PAGE_NOACCESS;
+}
+
+// Mapping read from /proc/self/maps
+struct ShimMapping
+{
+  ULONG_PTR start;
+  ULONG_PTR end;
+  DWORD protect;
+  bool file;
+};
+
+// FindMapping function
+static bool FindMapping(ULONG_PTR address, ShimMapping& mapping, ULONG_PTR& nextStart)
+{
+  // Find the mapping containing the address, or the start of the first mapping above it if there is none
+  nextStart = kUserAddressLimit;
+  FILE* maps = fopen("/proc/self/maps", "r");
+  if (maps == NULL)
+    return false;
+  bool found = false;
+  char line[512];
+  while (fgets(line, sizeof(line), maps) != NULL)
+  {
+    unsigned long long start;
+    unsigned long long end;
+    char permissions[8];
+    unsigned long long offset;
+    unsigned int major;
+    unsigned int minor;
+    unsigned long long inode;
+    if (sscanf(line, "%llx-%llx %7s %llx %x:%x %llu", &start, &end, permissions, &offset, &major, &minor,
+      &inode) != 7)
+      continue;
+    if (address >= end)
+      continue;
+    if (address < start)
+    {
+      nextStart = start;
+      break;
+    }
+    mapping.start = start;
+    mapping.end = end;
+    mapping.protect = ProtectionFromPosix(permissions[0] == 'r', permissions[1] == 'w', permissions[2] == 'x');
+    mapping.file = inode != 0;
+    found = true;
+    break;
+  }
+  fclose(maps);
+  return found;
+}
+
+// FindAllocationBase function
+static ULONG_PTR FindAllocationBase(ULONG_PTR address)
+{
+  std::lock_guard<std::mutex> allocationsLock(gAllocationsLock);
+  std::map<ULONG_PTR, SIZE_T>::iterator allocation = gAllocations.upper_bound(address);
+  if (allocation == gAllocations.begin())
+    return 0;
+  allocation--;
+  return address < allocation->first + allocation->second ? allocation->first : 0;
+}
+
+LPVOID VirtualAlloc(LPVOID address, SIZE_T size, DWORD allocationType, DWORD protect)
+{
+  gShimCounters.virtualAlloc.fetch_add(1, std::memory_order_relaxed);
+  ULONG_PTR pageSize = (ULONG_PTR)sysconf(_SC_PAGESIZE);
+  ULONG_PTR start = (ULONG_PTR)address & ~(pageSize - 1);
+  size = (size + ((ULONG_PTR)address - start) + pageSize - 1) & ~(pageSize - 1);
+
+  // Commit pages of an existing allocation by changing their protection
+  if (address != NULL && (allocationType & MEM_RESERVE) == 0)
+  {
+    if (FindAllocationBase(start) == 0 || mprotect((void*)start, size, ProtectionToPosix(protect)) != 0)
+    {
+      SetLastError(ERROR_INVALID_ADDRESS);
+      return NULL;
+    }
+    return (LPVOID)start;
+  }
+
+  // Reserve a new allocation, at the requested address only, and leave it inaccessible if it is not committed
+  int posixProtect = (allocationType & MEM_COMMIT) != 0 ? ProtectionToPosix(protect) : PROT_NONE;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | (address != NULL ? MAP_FIXED_NOREPLACE : 0);
+  void* pv = mmap((void*)start, size, posixProtect, flags, -1, 0);
+  if (pv == MAP_FAILED)
+  {
+    SetLastError(errno == ENOMEM ? ERROR_NOT_ENOUGH_MEMORY : ERROR_INVALID_ADDRESS);
+    return NULL;
+  }
+  if (address != NULL && (ULONG_PTR)pv != start)
+  {
+    // Older kernels ignore MAP_FIXED_NOREPLACE and treat the address as a hint
+    munmap(pv, size);
+    SetLastError(ERROR_INVALID_ADDRESS);
+    return NULL;
+  }
+
+  std::lock_guard<std::mutex> allocationsLock(gAllocationsLock);
+  gAllocations[(ULONG_PTR)pv] = size;
+  return pv;
+}
+
+LPVOID VirtualAllocEx(HANDLE process, LPVOID address, SIZE_T size, DWORD allocationType, DWORD protect)
+{
+  if (process != kCurrentProcess)
+  {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return NULL;
+  }
+  return VirtualAlloc(address, size, allocationType, protect);
+}
+
+BOOL VirtualFree(LPVOID address, SIZE_T size, DWORD freeType)
+{
+  gShimCounters.virtualFree.fetch_add(1, std::memory_order_relaxed);
+
+  // Release a whole allocation, which has to be done with its base address and a size of zero
+  if (freeType == MEM_RELEASE)
+  {
+    std::lock_guard<std::mutex> allocationsLock(gAllocationsLock);
+    std::map<ULONG_PTR, SIZE_T>::iterator allocation = gAllocations.find((ULONG_PTR)address);
+    if (size != 0 || allocation == gAllocations.end())
+    {
+      SetLastError(ERROR_INVALID_PARAMETER);
+      return FALSE;
+    }
+    munmap(address, allocation->second);
+    gAllocations.erase(allocation);
+    return TRUE;
+  }
+
+  // Decommit pages by dropping their contents and making them inaccessible
+  if (freeType == MEM_DECOMMIT && FindAllocationBase((ULONG_PTR)address) != 0)
+  {
+    madvise(address, size, MADV_DONTNEED);
+    return mprotect(address, size, PROT_NONE) == 0;
+  }
+
+  SetLastError(ERROR_INVALID_PARAMETER);
+  return FALSE;
+}
+
+BOOL VirtualFreeEx(HANDLE process, LPVOID address, SIZE_T size, DWORD freeType)
+{
+  if (process != kCurrentProcess)
+  {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  return VirtualFree(address, size, freeType);
+}
+
+BOOL VirtualProtect(LPVOID address, SIZE_T size, DWORD newProtect, PDWORD oldProtect)
+{
+  gShimCounters.virtualProtect.fetch_add(1, std::memory_order_relaxed);
+  ULONG_PTR pageSize = (ULONG_PTR)sysconf(_SC_PAGESIZE);
+  ULONG_PTR start = (ULONG_PTR)address & ~(pageSize - 1);
+  ULONG_PTR end = ((ULONG_PTR)address + size + pageSize - 1) & ~(pageSize - 1);
+  {
+    std::lock_guard<std::mutex> rangeCallsLock(gRangeCallsLock);
+    gProtectCalls.push_back({ start, end - start, newProtect });
+  }
+
+  // Report the protection of the first page, like Windows does
+  ShimMapping mapping;
+  ULONG_PTR nextStart;
+  if (!FindMapping(start, mapping, nextStart))
+  {
+    SetLastError(ERROR_INVALID_ADDRESS);
+    return FALSE;
+  }
+
+  // Fail like Windows does if the range spans more than one VirtualAlloc allocation
+  if (FindAllocationBase(start) != FindAllocationBase(end - 1))
+  {
+    SetLastError(ERROR_INVALID_ADDRESS);
+    return FALSE;
+  }
+
+  if (mprotect((void*)start, end - start, ProtectionToPosix(newProtect)) != 0)
+  {
+    SetLastError(errno == EACCES ? ERROR_ACCESS_DENIED : ERROR_INVALID_ADDRESS);
+    return FALSE;
+  }
+  if (oldProtect != NULL)
+    *oldProtect = mapping.protect;
+  return TRUE;
+}
+
+BOOL VirtualProtectEx(HANDLE process, LPVOID address, SIZE_T size, DWORD newProtect, PDWORD oldProtect)
+{
+  if (process != kCurrentProcess)
+  {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  return VirtualProtect(address, size, newProtect, oldProtect);
+}
+
+SIZE_T VirtualQuery(LPCVOID address, PMEMORY_BASIC_INFORMATION buffer, SIZE_T length)
+{
+  gShimCounters.virtualQuery.fetch_add(1, std::memory_order_relaxed);
+  ULONG_PTR pageSize = (ULONG_PTR)sysconf(_SC_PAGESIZE);
+  ULONG_PTR page = (ULONG_PTR)address & ~(pageSize - 1);
+  if (page >= kUserAddressLimit || length < sizeof(MEMORY_BASIC_INFORMATION))
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return 0;
+  }
+
+  // Describe the mapping containing the address, or the gap up to the next mapping as free memory
+  ShimMapping mapping;
+  ULONG_PTR nextStart;
+  ZeroMemory(buffer, sizeof(MEMORY_BASIC_INFORMATION));
+  buffer->BaseAddress = (PVOID)page;
+  if (!FindMapping(page, mapping, nextStart))
+  {
+    buffer->RegionSize = nextStart - page;
+    buffer->State = MEM_FREE;
+    buffer->Protect = PAGE_NOACCESS;
+    return sizeof(MEMORY_BASIC_INFORMATION);
+  }
+  ULONG_PTR allocationBase = FindAllocationBase(page);
+  buffer->AllocationBase = (PVOID)(allocationBase != 0 ? allocationBase : mapping.start);
+  buffer->AllocationProtect = mapping.protect;
+  buffer->RegionSize = mapping.end - page;
+  buffer->State = mapping.protect == PAGE_NOACCESS && allocationBase != 0 ? MEM_RESERVE : MEM_COMMIT;
+  buffer->Protect = buffer->State == MEM_RESERVE ? 0 : mapping.protect;
+  buffer->Type = mapping.file ? MEM_IMAGE : MEM_PRIVATE;
+  return sizeof(MEMORY_BASIC_INFORMATION);
+}
+
+SIZE_T VirtualQueryEx(HANDLE process, LPCVOID address, PMEMORY_BASIC_INFORMATION buffer, SIZE_T length)
+{
+  if (process != kCurrentProcess)
+  {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return 0;
+  }
+  return VirtualQuery(address, buffer, length);
+}
+
+BOOL ReadProcessMemory(HANDLE process, LPCVOID address, LPVOID buffer, SIZE_T size, SIZE_T* read)
+{
+  if (process != kCurrentProcess)
+  {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  memcpy(buffer, address, size);
+  if (read != NULL)
+    *read = size;
+  return TRUE;
+}
+
+BOOL WriteProcessMemory(HANDLE process, LPVOID address, LPCVOID buffer, SIZE_T size, SIZE_T* written)
+{
+  if (process != kCurrentProcess)
+  {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  memcpy(address, buffer, size);
+  if (written != NULL)
+    *written = size;
+  return TRUE;
+}
+
+BOOL FlushInstructionCache(HANDLE process, LPCVOID address, SIZE_T size)
+{
+  gShimCounters.flushInstructionCache.fetch_add(1, std::memory_order_relaxed);
+  {
+    std::lock_guard<std::mutex> rangeCallsLock(gRangeCallsLock);
+    gFlushCalls.push_back({ (ULONG_PTR)address, size, 0 });
+  }
+  if (address != NULL)
+    __builtin___clear_cache((char*)address, (char*)address + size);
+  return TRUE;
+}
+
+void GetSystemInfo(LPSYSTEM_INFO systemInfo)
+{
+  ZeroMemory(systemInfo, sizeof(SYSTEM_INFO));
+  systemInfo->dwPageSize = (DWORD)sysconf(_SC_PAGESIZE);
+  systemInfo->lpMinimumApplicationAddress = (LPVOID)0x10000;
+  systemInfo->lpMaximumApplicationAddress = (LPVOID)(kUserAddressLimit - 1);
+  systemInfo->dwNumberOfProcessors = (DWORD)sysconf(_SC_NPROCESSORS_ONLN);
+  systemInfo->dwAllocationGranularity = 0x10000;
+}
+
+HANDLE GetProcessHeap()
+{
+  return kCurrentProcess;
+}
+
+LPVOID HeapAlloc(HANDLE heap, DWORD flags, SIZE_T size)
+{
+  return calloc(1, size);
+}
+
+BOOL HeapFree(HANDLE heap, DWORD flags, LPVOID memory)
+{
+  free(memory);
+  return TRUE;
+}
+
+std::vector<ShimRangeCall> GetShimProtectCalls()
+{
+  std::lock_guard<std::mutex> rangeCallsLock(gRangeCallsLock);
+  return gProtectCalls;
+}
+
+std::vector<ShimRangeCall> GetShimFlushCalls()
+{
+  std::lock_guard<std::mutex> rangeCallsLock(gRangeCallsLock);
+  return gFlushCalls;
+}
+
+void ResetShimCounters()
+{
+  {
+    std::lock_guard<std::mutex> rangeCallsLock(gRangeCallsLock);
+    gProtectCalls.clear();
+    gFlushCalls.clear();
+  }
+  {
+    std::lock_guard<std::mutex> modulesLock(gModulesLock);
+    gProcAddressCalls.clear();
+  }
+  gShimCounters.virtualAlloc = 0;
+  gShimCounters.virtualFree = 0;
+  gShimCounters.virtualProtect = 0;
+  gShimCounters.virtualQuery = 0;
+  gShimCounters.flushInstructionCache = 0;
+  gShimCounters.queueUserWorkItem = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////// Modules
+
+// Modules are not PE images on Linux so only the ones registered by tests can be found or loaded, see ShimModule
+
+void SetShimModules(const std::vector<ShimModule>& modules)
+{
+  std::lock_guard<std::mutex> modulesLock(gModulesLock);
+  gModules = modules;
+}
+
+std::vector<std::string> GetShimProcAddressCalls()
+{
+  std::lock_guard<std::mutex> modulesLock(gModulesLock);
+  return gProcAddressCalls;
+}
+
+// FindShimModule function
+// Note: the caller holds gModulesLock, names are compared without case like Windows does
+static HMODULE FindShimModule(LPCSTR moduleName)
+{
+  for (const ShimModule& module : gModules)
+  {
+    if (moduleName != NULL && strcasecmp(module.name, moduleName) == 0)
+      return module.module;
+  }
+  SetLastError(ERROR_MOD_NOT_FOUND);
+  return NULL;
+}
+
+HMODULE GetModuleHandleA(LPCSTR moduleName)
+{
+  std::lock_guard<std::mutex> modulesLock(gModulesLock);
+  return FindShimModule(moduleName);
+}
+
+HMODULE GetModuleHandleW(LPCWSTR moduleName)
+{
+  SetLastError(ERROR_MOD_NOT_FOUND);
+  return NULL;
+}
+
+DWORD GetModuleFileNameA(HMODULE module, LPSTR fileName, DWORD size)
+{
+  SetLastError(ERROR_MOD_NOT_FOUND);
+  return 0;
+}
+
+DWORD GetModuleFileNameW(HMODULE module, LPWSTR fileName, DWORD size)
+{
+  SetLastError(ERROR_MOD_NOT_FOUND);
+  return 0;
+}
+
+FARPROC GetProcAddress(HMODULE module, LPCSTR procName)
+{
+  std::lock_guard<std::mutex> modulesLock(gModulesLock);
+  gProcAddressCalls.push_back(procName);
+  for (const ShimModule& shimModule : gModules)
+  {
+    if (shimModule.module != module)
+      continue;
+    for (const ShimProcedure& procedure : shimModule.procedures)
+    {
+      if (strcmp(procedure.name, procName) == 0)
+        return procedure.address;
+    }
+  }
+  SetLastError(ERROR_PROC_NOT_FOUND);
+  return NULL;
+}
+
+HMODULE LoadLibraryA(LPCSTR fileName)
+{
+  std::lock_guard<std::mutex> modulesLock(gModulesLock);
+  return FindShimModule(fileName);
+}
+
+HMODULE LoadLibraryW(LPCWSTR fileName)
+{
+  SetLastError(ERROR_MOD_NOT_FOUND);
+  return NULL;
+}
+
+HMODULE LoadLibraryExA(LPCSTR fileName, HANDLE file, DWORD flags)
+{
+  std::lock_guard<std::mutex> modulesLock(gModulesLock);
+  return FindShimModule(fileName);
+}
+
+HMODULE LoadLibraryExW(LPCWSTR fileName, HANDLE file, DWORD flags)
+{
+  SetLastError(ERROR_MOD_NOT_FOUND);
+  return NULL;
+}
+
+BOOL FreeLibrary(HMODULE module)
+{
+  return TRUE;
+}
+
+BOOL IsWow64Process(HANDLE process, PBOOL wow64Process)
+{
+  *wow64Process = FALSE;
+  return TRUE;
+}
+
+DWORD GetEnvironmentVariableA(LPCSTR name, LPSTR buffer, DWORD size)
+{
+  const char* value = getenv(name);
+  if (value == NULL)
+    return 0;
+  DWORD length = (DWORD)strlen(value);
+  if (length >= size)
+    return length + 1;
+  memcpy(buffer, value, length + 1);
+  return length;
+}
+
+DWORD GetEnvironmentVariableW(LPCWSTR name, LPWSTR buffer, DWORD size)
+{
+  SetLastError(ERROR_NOT_SUPPORTED);
+  return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////// Strings
+
+void OutputDebugStringA(LPCSTR outputString)
+{
+  fputs(outputString, stderr);
+}
+
+// MultiByteToWideChar function
+int MultiByteToWideChar(UINT codePage, DWORD flags, LPCSTR multiByte, int multiByteLength, LPWSTR wide,
+  int wideLength)
+{
+  // Decode the UTF-8 characters, including the terminator when the length is -1, and count them when there is no
+  //   buffer to decode them into
+  if (codePage != CP_UTF8 || multiByte == NULL)
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return 0;
+  }
+  size_t length = multiByteLength < 0 ? strlen(multiByte) + 1 : (size_t)multiByteLength;
+  const unsigned char* bytes = (const unsigned char*)multiByte;
+  int count = 0;
+  for (size_t i = 0; i < length; count++)
+  {
+    unsigned char lead = bytes[i];
+    size_t extra = lead < 0x80 ? 0 : (lead & 0xe0) == 0xc0 ? 1 : (lead & 0xf0) == 0xe0 ? 2 : (lead & 0xf8) == 0xf0 ? 3 :
+      4;
+    if (extra == 4 || extra >= length - i)
+    {
+      SetLastError(ERROR_NO_UNICODE_TRANSLATION);
+      return 0;
+    }
+    uint32_t character = extra == 0 ? lead : lead & (0x3f >> extra);
+    for (size_t j = 1; j <= extra; j++)
+    {
+      if ((bytes[i + j] & 0xc0) != 0x80)
+      {
+        SetLastError(ERROR_NO_UNICODE_TRANSLATION);
+        return 0;
+      }
+      character = (character << 6) | (bytes[i + j] & 0x3f);
+    }
+    i += extra + 1;
+    if (wideLength == 0)
+      continue;
+    if (count >= wideLength)
+    {
+      SetLastError(ERROR_INSUFFICIENT_BUFFER);
+      return 0;
+    }
+    wide[count] = (wchar_t)character;
+  }
+  return count;
+}
+
+// WideCharToMultiByte function
+int WideCharToMultiByte(UINT codePage, DWORD flags, LPCWSTR wide, int wideLength, LPSTR multiByte,
+  int multiByteLength, LPCSTR defaultChar, LPBOOL usedDefaultChar)
+{
+  // Encode the characters as UTF-8, including the terminator when the length is -1, and count the bytes when there is
+  //   no buffer to encode them into
+  if (codePage != CP_UTF8 || wide == NULL)
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return 0;
+  }
+  size_t length = wideLength < 0 ? wcslen(wide) + 1 : (size_t)wideLength;
+  int count = 0;
+  for (size_t i = 0; i < length; i++)
+  {
+    uint32_t character = (uint32_t)wide[i];
+    if (character > 0x10ffff)
+    {
+      SetLastError(ERROR_NO_UNICODE_TRANSLATION);
+      return 0;
+    }
+    unsigned char encoded[4];
+    int size = character < 0x80 ? 1 : character < 0x800 ? 2 : character < 0x10000 ? 3 : 4;
+    if (size == 1)
+      encoded[0] = (unsigned char)character;
+    else
+    {
+      for (int j = size - 1; j > 0; j--, character >>= 6)
+        encoded[j] = (unsigned char)(0x80 | (character & 0x3f));
+      encoded[0] = (unsigned char)((0xf00 >> size) | character);
+    }
+    if (multiByteLength != 0)
+    {
+      if (count + size > multiByteLength)
+      {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return 0;
+      }
+      memcpy(multiByte + count, encoded, size);
+    }
+    count += size;
+  }
+  return count;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////// Toolhelp
+
+#include <tlhelp32.h>
+
+HANDLE CreateToolhelp32Snapshot(DWORD flags, DWORD processId)
+{
+  // List the calling thread followed by the simulated threads
+  if ((flags & TH32CS_SNAPTHREAD) == 0)
+  {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return INVALID_HANDLE_VALUE;
+  }
+  ShimSnapshot* snapshot = new ShimSnapshot();
+  ShimThread current = {};
+  current.threadId = GetCurrentThreadId();
+  current.processId = GetCurrentProcessId();
+  snapshot->threads.push_back(current);
+  std::lock_guard<std::mutex> threadsLock(gThreadsLock);
+  snapshot->threads.insert(snapshot->threads.end(), gThreads.begin(), gThreads.end());
+  return snapshot;
+}
+
+BOOL Thread32First(HANDLE snapshot, LPTHREADENTRY32 entry)
+{
+  ((ShimSnapshot*)snapshot)->next = 0;
+  return Thread32Next(snapshot, entry);
+}
+
+BOOL Thread32Next(HANDLE handle, LPTHREADENTRY32 entry)
+{
+  ShimSnapshot* snapshot = (ShimSnapshot*)handle;
+  if (snapshot->next >= snapshot->threads.size())
+  {
+    SetLastError(ERROR_NO_MORE_FILES);
+    return FALSE;
+  }
+  const ShimThread& thread = snapshot->threads[snapshot->next++];
+  entry->th32ThreadID = thread.threadId;
+  entry->th32OwnerProcessID = thread.processId;
+  return TRUE;
+}
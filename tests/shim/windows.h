@@ -0,0 +1,915 @@
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cwchar>
+#include <cwctype>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Minimal Windows API shim used to build the portable parts of Spoof Resolution and Detours on Linux so that they can
+//   be tested
+// Note: only what the tested headers and sources use is declared, types have the same sizes as on 64-bit Windows so
+//   that shared memory and PE layouts match, and functions are implemented with their POSIX equivalents in windows.cpp
+// Note: the virtual memory functions are backed by mmap, mprotect, and /proc/self/maps so that the Detours trampoline
+//   allocator runs against the real address space of the test, and they count their calls so tests can check how many
+//   system calls an operation needs, see ShimCounters, and log the ranges they change, see ShimRangeCall
+
+#if !defined(_AMD64_) && !defined(_ARM64_)
+#if defined(__x86_64__)
+#define _AMD64_
+#elif defined(__aarch64__)
+#define _ARM64_
+#endif
+#endif
+#ifndef _WIN64
+#define _WIN64
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////// Keywords
+
+#define WINAPI
+#define APIENTRY
+#define CALLBACK
+#define NTAPI
+#define WINAPIV
+#define __cdecl
+#define __stdcall
+#define far
+#define near
+#define FAR
+#define NEAR
+#define CONST const
+#define VOID void
+#define EXTERN_C extern "C"
+#define FORCEINLINE inline
+#define DECLSPEC_ALIGN(x) __attribute__((aligned(x)))
+#define __declspec(x) __declspec_##x
+#define __declspec_align(x) __attribute__((aligned(x)))
+#define UNREFERENCED_PARAMETER(x) (void)(x)
+#define C_ASSERT(e) static_assert(e, #e)
+#define FIELD_OFFSET(type, field) offsetof(type, field)
+#define CONTAINING_RECORD(address, type, field) ((type*)((char*)(address) - offsetof(type, field)))
+#define ARRAYSIZE(x) (sizeof(x) / sizeof(x[0]))
+#define _countof(x) (sizeof(x) / sizeof(x[0]))
+#define __debugbreak() __builtin_trap()
+#define UNALIGNED
+
+// SAL annotations that detours.h uses without defining them itself
+#define _Deref_out_opt_z_
+#define _Inout_updates_(x)
+#define _Out_writes_bytes_(x)
+#define _Out_writes_opt_(x)
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////// Types
+
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef uint8_t BOOLEAN;
+typedef uint8_t UCHAR;
+typedef char CHAR;
+typedef wchar_t WCHAR;
+typedef int16_t SHORT;
+typedef uint16_t WORD;
+typedef uint16_t USHORT;
+typedef int32_t INT;
+typedef int32_t INT32;
+typedef uint32_t UINT;
+typedef uint32_t UINT32;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint32_t DWORD;
+typedef int64_t LONGLONG;
+typedef int64_t LONG64;
+typedef int64_t INT64;
+typedef uint64_t ULONGLONG;
+typedef uint64_t DWORDLONG;
+typedef uint64_t DWORD64;
+typedef uint64_t ULONG64;
+typedef uint64_t UINT64;
+typedef int64_t LONG_PTR;
+typedef uint64_t ULONG_PTR;
+typedef int64_t INT_PTR;
+typedef uint64_t UINT_PTR;
+typedef uint64_t SIZE_T;
+typedef int64_t SSIZE_T;
+typedef ULONG_PTR DWORD_PTR;
+typedef LONG HRESULT;
+typedef LONG NTSTATUS;
+typedef DWORD ACCESS_MASK;
+typedef void* PVOID;
+typedef void* PVOID64;
+typedef void* LPVOID;
+typedef const void* LPCVOID;
+typedef void* HANDLE;
+typedef HANDLE HMODULE;
+typedef HANDLE HINSTANCE;
+typedef HANDLE HKEY;
+typedef HANDLE HWND;
+typedef HANDLE* PHANDLE;
+typedef BOOL* PBOOL;
+typedef BOOL* LPBOOL;
+typedef BYTE* PBYTE;
+typedef BYTE* LPBYTE;
+typedef UCHAR* PUCHAR;
+typedef WORD* PWORD;
+typedef DWORD* PDWORD;
+typedef DWORD* LPDWORD;
+typedef INT* PINT;
+typedef LONG* PLONG;
+typedef ULONG* PULONG;
+typedef SIZE_T* PSIZE_T;
+typedef ULONG_PTR* PULONG_PTR;
+typedef CHAR* PCHAR;
+typedef CHAR* LPSTR;
+typedef CHAR* PSTR;
+typedef const CHAR* LPCSTR;
+typedef const CHAR* PCSTR;
+typedef WCHAR* PWCHAR;
+typedef WCHAR* LPWSTR;
+typedef WCHAR* PWSTR;
+typedef const WCHAR* LPCWSTR;
+typedef const WCHAR* PCWSTR;
+typedef INT_PTR (WINAPI* FARPROC)();
+typedef DWORD (WINAPI* LPTHREAD_START_ROUTINE)(LPVOID parameter);
+
+#define TRUE 1
+#define FALSE 0
+#ifndef NULL
+#define NULL 0
+#endif
+#define MAX_PATH 260
+#define MAXDWORD 0xffffffff
+#define INVALID_HANDLE_VALUE ((HANDLE)(LONG_PTR)-1)
+#define INFINITE 0xffffffff
+
+typedef union _LARGE_INTEGER
+{
+  struct
+  {
+    DWORD LowPart;
+    LONG HighPart;
+  };
+  LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _GUID
+{
+  DWORD Data1;
+  WORD Data2;
+  WORD Data3;
+  BYTE Data4[8];
+} GUID;
+#define GUID_DEFINED
+#ifdef INITGUID
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+  extern "C" const GUID name = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
+#else
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) extern "C" const GUID name
+#endif
+
+typedef struct _SECURITY_ATTRIBUTES
+{
+  DWORD nLength;
+  LPVOID lpSecurityDescriptor;
+  BOOL bInheritHandle;
+} SECURITY_ATTRIBUTES, *PSECURITY_ATTRIBUTES, *LPSECURITY_ATTRIBUTES;
+
+#define MAKEWORD(a, b) ((WORD)(((BYTE)(a)) | (((WORD)((BYTE)(b))) << 8)))
+#define MAKEINTRESOURCEA(i) ((LPSTR)(ULONG_PTR)(WORD)(i))
+#define CopyMemory(destination, source, length) memcpy((destination), (source), (length))
+#define MoveMemory(destination, source, length) memmove((destination), (source), (length))
+#define ZeroMemory(destination, length) memset((destination), 0, (length))
+#define FillMemory(destination, length, fill) memset((destination), (fill), (length))
+#define RtlZeroMemory(destination, length) memset((destination), 0, (length))
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////// Errors
+
+#define NO_ERROR 0L
+#define ERROR_SUCCESS 0L
+#define ERROR_INVALID_FUNCTION 1L
+#define ERROR_FILE_NOT_FOUND 2L
+#define ERROR_ACCESS_DENIED 5L
+#define ERROR_INVALID_HANDLE 6L
+#define ERROR_NOT_ENOUGH_MEMORY 8L
+#define ERROR_INVALID_BLOCK 9L
+#define ERROR_INVALID_DATA 13L
+#define ERROR_OUTOFMEMORY 14L
+#define ERROR_NO_MORE_FILES 18L
+#define ERROR_NOT_SUPPORTED 50L
+#define ERROR_INVALID_PARAMETER 87L
+#define ERROR_INSUFFICIENT_BUFFER 122L
+#define ERROR_MOD_NOT_FOUND 126L
+#define ERROR_PROC_NOT_FOUND 127L
+#define ERROR_ALREADY_EXISTS 183L
+#define ERROR_INVALID_EXE_SIGNATURE 191L
+#define ERROR_EXE_MARKED_INVALID 192L
+#define ERROR_BAD_EXE_FORMAT 193L
+#define ERROR_PARTIAL_COPY 299L
+#define ERROR_INVALID_ADDRESS 487L
+#define ERROR_ARITHMETIC_OVERFLOW 534L
+#define ERROR_NO_UNICODE_TRANSLATION 1113L
+#define ERROR_INVALID_OPERATION 4317L
+#define S_OK ((HRESULT)0)
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+
+#define EXCEPTION_ACCESS_VIOLATION 0xc0000005
+#define EXCEPTION_EXECUTE_HANDLER 1
+#define EXCEPTION_CONTINUE_SEARCH 0
+inline DWORD GetExceptionCode()
+{
+  return 0;
+}
+
+DWORD GetLastError();
+void SetLastError(DWORD error);
+
+//////////////////////////////////////////////////////////////////////////////////////////////////// Interlocked
+
+inline LONG InterlockedIncrement(volatile LONG* addend)
+{
+  return __atomic_add_fetch(addend, 1, __ATOMIC_SEQ_CST);
+}
+inline LONG InterlockedDecrement(volatile LONG* addend)
+{
+  return __atomic_sub_fetch(addend, 1, __ATOMIC_SEQ_CST);
+}
+inline LONG InterlockedExchange(volatile LONG* target, LONG value)
+{
+  return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+inline SHORT InterlockedExchange16(volatile SHORT* target, SHORT value)
+{
+  return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+inline LONG InterlockedCompareExchange(volatile LONG* destination, LONG exchange, LONG comparand)
+{
+  __atomic_compare_exchange_n(destination, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return comparand;
+}
+inline LONGLONG InterlockedCompareExchange64(volatile LONGLONG* destination, LONGLONG exchange, LONGLONG comparand)
+{
+  __atomic_compare_exchange_n(destination, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return comparand;
+}
+inline PVOID InterlockedCompareExchangePointer(PVOID volatile* destination, PVOID exchange, PVOID comparand)
+{
+  __atomic_compare_exchange_n(destination, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return comparand;
+}
+inline PVOID InterlockedExchangePointer(PVOID volatile* target, PVOID value)
+{
+  return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+inline void MemoryBarrier()
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+inline void YieldProcessor()
+{
+#if defined(__x86_64__)
+  __builtin_ia32_pause();
+#else
+  std::this_thread::yield();
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////// Interlocked lists
+// Note: the list head is guarded by a spin lock instead of a 16-byte compare exchange, which keeps the behavior the
+//   tested code relies on
+
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+
+typedef struct DECLSPEC_ALIGN(16) _SLIST_ENTRY
+{
+  struct _SLIST_ENTRY* Next;
+} SLIST_ENTRY, *PSLIST_ENTRY;
+
+typedef struct DECLSPEC_ALIGN(16) _SLIST_HEADER
+{
+  PSLIST_ENTRY Next;
+  LONG Lock;
+} SLIST_HEADER, *PSLIST_HEADER;
+
+inline void InitializeSListHead(PSLIST_HEADER head)
+{
+  head->Next = NULL;
+  head->Lock = 0;
+}
+inline void LockSListHead(PSLIST_HEADER head)
+{
+  while (__atomic_exchange_n(&head->Lock, 1, __ATOMIC_ACQUIRE) != 0)
+    YieldProcessor();
+}
+inline void UnlockSListHead(PSLIST_HEADER head)
+{
+  __atomic_store_n(&head->Lock, 0, __ATOMIC_RELEASE);
+}
+inline PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER head, PSLIST_ENTRY entry)
+{
+  LockSListHead(head);
+  PSLIST_ENTRY first = head->Next;
+  entry->Next = first;
+  head->Next = entry;
+  UnlockSListHead(head);
+  return first;
+}
+inline PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER head)
+{
+  LockSListHead(head);
+  PSLIST_ENTRY first = head->Next;
+  if (first != NULL)
+    head->Next = first->Next;
+  UnlockSListHead(head);
+  return first;
+}
+inline PSLIST_ENTRY InterlockedFlushSList(PSLIST_HEADER head)
+{
+  LockSListHead(head);
+  PSLIST_ENTRY first = head->Next;
+  head->Next = NULL;
+  UnlockSListHead(head);
+  return first;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////// Threads and timing
+
+#define THREAD_ALL_ACCESS 0x1fffff
+#define THREAD_SUSPEND_RESUME 0x0002
+#define THREAD_GET_CONTEXT 0x0008
+#define THREAD_SET_CONTEXT 0x0010
+#define THREAD_QUERY_INFORMATION 0x0040
+#define PROCESS_ALL_ACCESS 0x1fffff
+#define CREATE_SUSPENDED 0x4
+#define WT_EXECUTEDEFAULT 0x0
+#define WAIT_OBJECT_0 0x0
+#define WAIT_TIMEOUT 0x102
+#define WAIT_FAILED 0xffffffff
+
+typedef struct _STARTUPINFOA
+{
+  DWORD cb;
+  LPSTR lpReserved;
+  LPSTR lpDesktop;
+  LPSTR lpTitle;
+  DWORD dwX;
+  DWORD dwY;
+  DWORD dwXSize;
+  DWORD dwYSize;
+  DWORD dwXCountChars;
+  DWORD dwYCountChars;
+  DWORD dwFillAttribute;
+  DWORD dwFlags;
+  WORD wShowWindow;
+  WORD cbReserved2;
+  LPBYTE lpReserved2;
+  HANDLE hStdInput;
+  HANDLE hStdOutput;
+  HANDLE hStdError;
+} STARTUPINFOA, *LPSTARTUPINFOA;
+
+typedef struct _STARTUPINFOW
+{
+  DWORD cb;
+  LPWSTR lpReserved;
+  LPWSTR lpDesktop;
+  LPWSTR lpTitle;
+  DWORD dwX;
+  DWORD dwY;
+  DWORD dwXSize;
+  DWORD dwYSize;
+  DWORD dwXCountChars;
+  DWORD dwYCountChars;
+  DWORD dwFillAttribute;
+  DWORD dwFlags;
+  WORD wShowWindow;
+  WORD cbReserved2;
+  LPBYTE lpReserved2;
+  HANDLE hStdInput;
+  HANDLE hStdOutput;
+  HANDLE hStdError;
+} STARTUPINFOW, *LPSTARTUPINFOW;
+
+typedef struct _PROCESS_INFORMATION
+{
+  HANDLE hProcess;
+  HANDLE hThread;
+  DWORD dwProcessId;
+  DWORD dwThreadId;
+} PROCESS_INFORMATION, *PPROCESS_INFORMATION, *LPPROCESS_INFORMATION;
+
+typedef struct DECLSPEC_ALIGN(16) _CONTEXT
+{
+  DWORD ContextFlags;
+  DWORD64 Rax;
+  DWORD64 Rsp;
+  DWORD64 Rip;
+  DWORD64 Pc;
+} CONTEXT, *PCONTEXT;
+#define CONTEXT_CONTROL 0x1
+
+inline void Sleep(DWORD milliseconds)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+}
+inline BOOL QueryPerformanceCounter(LARGE_INTEGER* counter)
+{
+  counter->QuadPart = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+  return TRUE;
+}
+inline BOOL QueryPerformanceFrequency(LARGE_INTEGER* frequency)
+{
+  frequency->QuadPart = 1000000000;
+  return TRUE;
+}
+
+HANDLE GetCurrentProcess();
+HANDLE GetCurrentThread();
+DWORD GetCurrentProcessId();
+DWORD GetCurrentThreadId();
+DWORD GetThreadId(HANDLE thread);
+DWORD GetProcessId(HANDLE process);
+HANDLE OpenThread(DWORD access, BOOL inherit, DWORD threadId);
+HANDLE OpenProcess(DWORD access, BOOL inherit, DWORD processId);
+DWORD SuspendThread(HANDLE thread);
+DWORD ResumeThread(HANDLE thread);
+BOOL GetThreadContext(HANDLE thread, CONTEXT* context);
+BOOL SetThreadContext(HANDLE thread, const CONTEXT* context);
+BOOL CloseHandle(HANDLE handle);
+HANDLE CreateEventW(LPSECURITY_ATTRIBUTES attributes, BOOL manualReset, BOOL initialState, LPCWSTR name);
+BOOL SetEvent(HANDLE event);
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds);
+BOOL QueueUserWorkItem(LPTHREAD_START_ROUTINE function, PVOID context, ULONG flags);
+BOOL CreateProcessA(LPCSTR applicationName, LPSTR commandLine, LPSECURITY_ATTRIBUTES processAttributes,
+  LPSECURITY_ATTRIBUTES threadAttributes, BOOL inheritHandles, DWORD creationFlags, LPVOID environment,
+  LPCSTR currentDirectory, LPSTARTUPINFOA startupInfo, LPPROCESS_INFORMATION processInformation);
+BOOL CreateProcessW(LPCWSTR applicationName, LPWSTR commandLine, LPSECURITY_ATTRIBUTES processAttributes,
+  LPSECURITY_ATTRIBUTES threadAttributes, BOOL inheritHandles, DWORD creationFlags, LPVOID environment,
+  LPCWSTR currentDirectory, LPSTARTUPINFOW startupInfo, LPPROCESS_INFORMATION processInformation);
+BOOL TerminateProcess(HANDLE process, UINT exitCode);
+BOOL GetExitCodeProcess(HANDLE process, LPDWORD exitCode);
+[[noreturn]] void ExitProcess(UINT exitCode);
+
+// Simulated thread that the toolhelp snapshot lists and the thread functions work on
+// Note: other threads cannot be suspended on Linux, so tests register simulated threads instead and check their suspend
+//   counts, open handles, and contexts afterwards, a thread that has exited is still listed but cannot be opened as if
+//   it exited after the snapshot was taken
+struct ShimThread
+{
+  DWORD threadId;
+  DWORD processId;
+  CONTEXT context;
+  bool exited;
+  bool suspendFails;
+  LONG suspendCount;
+  LONG suspends;       // Calls to SuspendThread that succeeded
+  LONG openHandles;
+  LONG contextWrites;  // Calls to SetThreadContext
+};
+void SetShimThreads(const std::vector<ShimThread>& threads);
+std::vector<ShimThread> GetShimThreads();
+
+////////////////////////////////////////////////////////////////////////////////////////////////// Virtual memory
+
+#define PAGE_NOACCESS 0x01
+#define PAGE_READONLY 0x02
+#define PAGE_READWRITE 0x04
+#define PAGE_WRITECOPY 0x08
+#define PAGE_EXECUTE 0x10
+#define PAGE_EXECUTE_READ 0x20
+#define PAGE_EXECUTE_READWRITE 0x40
+#define PAGE_EXECUTE_WRITECOPY 0x80
+#define PAGE_GUARD 0x100
+#define MEM_COMMIT 0x1000
+#define MEM_RESERVE 0x2000
+#define MEM_DECOMMIT 0x4000
+#define MEM_RELEASE 0x8000
+#define MEM_FREE 0x10000
+#define MEM_PRIVATE 0x20000
+#define MEM_MAPPED 0x40000
+#define MEM_IMAGE 0x1000000
+
+typedef struct _MEMORY_BASIC_INFORMATION
+{
+  PVOID BaseAddress;
+  PVOID AllocationBase;
+  DWORD AllocationProtect;
+  SIZE_T RegionSize;
+  DWORD State;
+  DWORD Protect;
+  DWORD Type;
+} MEMORY_BASIC_INFORMATION, *PMEMORY_BASIC_INFORMATION;
+
+typedef struct _SYSTEM_INFO
+{
+  WORD wProcessorArchitecture;
+  WORD wReserved;
+  DWORD dwPageSize;
+  LPVOID lpMinimumApplicationAddress;
+  LPVOID lpMaximumApplicationAddress;
+  DWORD_PTR dwActiveProcessorMask;
+  DWORD dwNumberOfProcessors;
+  DWORD dwProcessorType;
+  DWORD dwAllocationGranularity;
+  WORD wProcessorLevel;
+  WORD wProcessorRevision;
+} SYSTEM_INFO, *LPSYSTEM_INFO;
+
+LPVOID VirtualAlloc(LPVOID address, SIZE_T size, DWORD allocationType, DWORD protect);
+LPVOID VirtualAllocEx(HANDLE process, LPVOID address, SIZE_T size, DWORD allocationType, DWORD protect);
+BOOL VirtualFree(LPVOID address, SIZE_T size, DWORD freeType);
+BOOL VirtualFreeEx(HANDLE process, LPVOID address, SIZE_T size, DWORD freeType);
+BOOL VirtualProtect(LPVOID address, SIZE_T size, DWORD newProtect, PDWORD oldProtect);
+BOOL VirtualProtectEx(HANDLE process, LPVOID address, SIZE_T size, DWORD newProtect, PDWORD oldProtect);
+SIZE_T VirtualQuery(LPCVOID address, PMEMORY_BASIC_INFORMATION buffer, SIZE_T length);
+SIZE_T VirtualQueryEx(HANDLE process, LPCVOID address, PMEMORY_BASIC_INFORMATION buffer, SIZE_T length);
+BOOL ReadProcessMemory(HANDLE process, LPCVOID address, LPVOID buffer, SIZE_T size, SIZE_T* read);
+BOOL WriteProcessMemory(HANDLE process, LPVOID address, LPCVOID buffer, SIZE_T size, SIZE_T* written);
+BOOL FlushInstructionCache(HANDLE process, LPCVOID address, SIZE_T size);
+void GetSystemInfo(LPSYSTEM_INFO systemInfo);
+HANDLE GetProcessHeap();
+LPVOID HeapAlloc(HANDLE heap, DWORD flags, SIZE_T size);
+BOOL HeapFree(HANDLE heap, DWORD flags, LPVOID memory);
+
+// Number of calls made to the virtual memory and thread pool functions, which tests reset and compare before and after
+//   an operation
+struct ShimCounters
+{
+  std::atomic<uint64_t> virtualAlloc;
+  std::atomic<uint64_t> virtualFree;
+  std::atomic<uint64_t> virtualProtect;
+  std::atomic<uint64_t> virtualQuery;
+  std::atomic<uint64_t> flushInstructionCache;
+  std::atomic<uint64_t> queueUserWorkItem;
+};
+extern ShimCounters gShimCounters;
+
+// Range passed to VirtualProtect or FlushInstructionCache, logged so tests can check how calls were batched
+struct ShimRangeCall
+{
+  ULONG_PTR address;
+  SIZE_T size;
+  DWORD protect;
+};
+std::vector<ShimRangeCall> GetShimProtectCalls();
+std::vector<ShimRangeCall> GetShimFlushCalls();
+
+// Reset the counters and the logs
+void ResetShimCounters();
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////// Modules
+
+HMODULE GetModuleHandleA(LPCSTR moduleName);
+HMODULE GetModuleHandleW(LPCWSTR moduleName);
+DWORD GetModuleFileNameA(HMODULE module, LPSTR fileName, DWORD size);
+DWORD GetModuleFileNameW(HMODULE module, LPWSTR fileName, DWORD size);
+FARPROC GetProcAddress(HMODULE module, LPCSTR procName);
+HMODULE LoadLibraryA(LPCSTR fileName);
+HMODULE LoadLibraryW(LPCWSTR fileName);
+HMODULE LoadLibraryExA(LPCSTR fileName, HANDLE file, DWORD flags);
+HMODULE LoadLibraryExW(LPCWSTR fileName, HANDLE file, DWORD flags);
+BOOL FreeLibrary(HMODULE module);
+
+// Module that LoadLibrary finds by name and the procedures that GetProcAddress finds in it
+// Note: modules are not PE images on Linux, so tests register an image they mapped themselves, GetProcAddress does not
+//   read its export table but only finds the procedures registered with it, and the names it is asked for are logged
+//   so that tests can tell what Detours resolved by itself from what it fell back to GetProcAddress for
+struct ShimProcedure
+{
+  const char* name;
+  FARPROC address;
+};
+struct ShimModule
+{
+  const char* name;
+  HMODULE module;
+  std::vector<ShimProcedure> procedures;
+};
+void SetShimModules(const std::vector<ShimModule>& modules);
+std::vector<std::string> GetShimProcAddressCalls();
+BOOL IsWow64Process(HANDLE process, PBOOL wow64Process);
+DWORD GetEnvironmentVariableA(LPCSTR name, LPSTR buffer, DWORD size);
+DWORD GetEnvironmentVariableW(LPCWSTR name, LPWSTR buffer, DWORD size);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////// Strings
+
+// Note: wide characters are 32 bits on Linux, so the conversions use UTF-32 where Windows uses UTF-16, and only the
+//   UTF-8 code page is supported
+#define CP_ACP 0
+#define CP_UTF8 65001
+
+int MultiByteToWideChar(UINT codePage, DWORD flags, LPCSTR multiByte, int multiByteLength, LPWSTR wide,
+  int wideLength);
+int WideCharToMultiByte(UINT codePage, DWORD flags, LPCWSTR wide, int wideLength, LPSTR multiByte,
+  int multiByteLength, LPCSTR defaultChar, LPBOOL usedDefaultChar);
+
+#define TEXT(text) text
+#define OutputDebugString OutputDebugStringA
+
+void OutputDebugStringA(LPCSTR outputString);
+
+inline int _wcsnicmp(const wchar_t* left, const wchar_t* right, size_t count)
+{
+  for (; count != 0; left++, right++, count--)
+  {
+    wint_t a = towlower(*left);
+    wint_t b = towlower(*right);
+    if (a != b)
+      return a < b ? -1 : 1;
+    if (a == 0)
+      break;
+  }
+  return 0;
+}
+inline int _wcsicmp(const wchar_t* left, const wchar_t* right)
+{
+  return _wcsnicmp(left, right, (size_t)-1);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////// Display settings
+
+typedef struct _POINTL
+{
+  LONG x;
+  LONG y;
+} POINTL, *PPOINTL;
+
+#define ENUM_CURRENT_SETTINGS ((DWORD)-1)
+#define ENUM_REGISTRY_SETTINGS ((DWORD)-2)
+
+//////////////////////////////////////////////////////////////////////////////////////////////////// PE structures
+
+#define IMAGE_DOS_SIGNATURE 0x5a4d
+#define IMAGE_NT_SIGNATURE 0x00004550
+#define IMAGE_NT_OPTIONAL_HDR32_MAGIC 0x10b
+#define IMAGE_NT_OPTIONAL_HDR64_MAGIC 0x20b
+#define IMAGE_NT_OPTIONAL_HDR_MAGIC IMAGE_NT_OPTIONAL_HDR64_MAGIC
+#define IMAGE_NUMBEROF_DIRECTORY_ENTRIES 16
+#define IMAGE_SIZEOF_SHORT_NAME 8
+#define IMAGE_DIRECTORY_ENTRY_EXPORT 0
+#define IMAGE_DIRECTORY_ENTRY_IMPORT 1
+#define IMAGE_DIRECTORY_ENTRY_RESOURCE 2
+#define IMAGE_DIRECTORY_ENTRY_EXCEPTION 3
+#define IMAGE_DIRECTORY_ENTRY_SECURITY 4
+#define IMAGE_DIRECTORY_ENTRY_BASERELOC 5
+#define IMAGE_DIRECTORY_ENTRY_DEBUG 6
+#define IMAGE_DIRECTORY_ENTRY_TLS 9
+#define IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG 10
+#define IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT 11
+#define IMAGE_DIRECTORY_ENTRY_IAT 12
+#define IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT 13
+#define IMAGE_DIRECTORY_ENTRY_COM_DESCRIPTOR 14
+#define IMAGE_FILE_MACHINE_I386 0x014c
+#define IMAGE_FILE_MACHINE_IA64 0x0200
+#define IMAGE_FILE_MACHINE_ARMNT 0x01c4
+#define IMAGE_FILE_MACHINE_AMD64 0x8664
+#define IMAGE_FILE_MACHINE_ARM64 0xaa64
+#define IMAGE_FILE_RELOCS_STRIPPED 0x0001
+#define IMAGE_FILE_DLL 0x2000
+#define IMAGE_SCN_CNT_CODE 0x00000020
+#define IMAGE_SCN_CNT_INITIALIZED_DATA 0x00000040
+#define IMAGE_SCN_MEM_EXECUTE 0x20000000
+#define IMAGE_SCN_MEM_READ 0x40000000
+#define IMAGE_SCN_MEM_WRITE 0x80000000
+#define IMAGE_ORDINAL_FLAG32 0x80000000
+#define IMAGE_ORDINAL_FLAG64 0x8000000000000000ull
+#define IMAGE_ORDINAL_FLAG IMAGE_ORDINAL_FLAG64
+#define IMAGE_ORDINAL32(ordinal) ((ordinal) & 0xffff)
+#define IMAGE_ORDINAL64(ordinal) ((ordinal) & 0xffff)
+#define IMAGE_SNAP_BY_ORDINAL32(ordinal) (((ordinal) & IMAGE_ORDINAL_FLAG32) != 0)
+#define IMAGE_SNAP_BY_ORDINAL64(ordinal) (((ordinal) & IMAGE_ORDINAL_FLAG64) != 0)
+#define IMAGE_ORDINAL(ordinal) IMAGE_ORDINAL64(ordinal)
+#define IMAGE_SNAP_BY_ORDINAL(ordinal) IMAGE_SNAP_BY_ORDINAL64(ordinal)
+#define IMAGE_REL_BASED_ABSOLUTE 0
+#define COMIMAGE_FLAGS_ILONLY 0x00000001
+#define COMIMAGE_FLAGS_32BITREQUIRED 0x00000002
+#define COMIMAGE_FLAGS_32BITPREFERRED 0x00020000
+
+typedef struct _IMAGE_DOS_HEADER
+{
+  WORD e_magic;
+  WORD e_cblp;
+  WORD e_cp;
+  WORD e_crlc;
+  WORD e_cparhdr;
+  WORD e_minalloc;
+  WORD e_maxalloc;
+  WORD e_ss;
+  WORD e_sp;
+  WORD e_csum;
+  WORD e_ip;
+  WORD e_cs;
+  WORD e_lfarlc;
+  WORD e_ovno;
+  WORD e_res[4];
+  WORD e_oemid;
+  WORD e_oeminfo;
+  WORD e_res2[10];
+  LONG e_lfanew;
+} IMAGE_DOS_HEADER, *PIMAGE_DOS_HEADER;
+
+typedef struct _IMAGE_FILE_HEADER
+{
+  WORD Machine;
+  WORD NumberOfSections;
+  DWORD TimeDateStamp;
+  DWORD PointerToSymbolTable;
+  DWORD NumberOfSymbols;
+  WORD SizeOfOptionalHeader;
+  WORD Characteristics;
+} IMAGE_FILE_HEADER, *PIMAGE_FILE_HEADER;
+
+typedef struct _IMAGE_DATA_DIRECTORY
+{
+  DWORD VirtualAddress;
+  DWORD Size;
+} IMAGE_DATA_DIRECTORY, *PIMAGE_DATA_DIRECTORY;
+
+typedef struct _IMAGE_OPTIONAL_HEADER
+{
+  WORD Magic;
+  BYTE MajorLinkerVersion;
+  BYTE MinorLinkerVersion;
+  DWORD SizeOfCode;
+  DWORD SizeOfInitializedData;
+  DWORD SizeOfUninitializedData;
+  DWORD AddressOfEntryPoint;
+  DWORD BaseOfCode;
+  DWORD BaseOfData;
+  DWORD ImageBase;
+  DWORD SectionAlignment;
+  DWORD FileAlignment;
+  WORD MajorOperatingSystemVersion;
+  WORD MinorOperatingSystemVersion;
+  WORD MajorImageVersion;
+  WORD MinorImageVersion;
+  WORD MajorSubsystemVersion;
+  WORD MinorSubsystemVersion;
+  DWORD Win32VersionValue;
+  DWORD SizeOfImage;
+  DWORD SizeOfHeaders;
+  DWORD CheckSum;
+  WORD Subsystem;
+  WORD DllCharacteristics;
+  DWORD SizeOfStackReserve;
+  DWORD SizeOfStackCommit;
+  DWORD SizeOfHeapReserve;
+  DWORD SizeOfHeapCommit;
+  DWORD LoaderFlags;
+  DWORD NumberOfRvaAndSizes;
+  IMAGE_DATA_DIRECTORY DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+} IMAGE_OPTIONAL_HEADER32, *PIMAGE_OPTIONAL_HEADER32;
+
+typedef struct _IMAGE_OPTIONAL_HEADER64
+{
+  WORD Magic;
+  BYTE MajorLinkerVersion;
+  BYTE MinorLinkerVersion;
+  DWORD SizeOfCode;
+  DWORD SizeOfInitializedData;
+  DWORD SizeOfUninitializedData;
+  DWORD AddressOfEntryPoint;
+  DWORD BaseOfCode;
+  ULONGLONG ImageBase;
+  DWORD SectionAlignment;
+  DWORD FileAlignment;
+  WORD MajorOperatingSystemVersion;
+  WORD MinorOperatingSystemVersion;
+  WORD MajorImageVersion;
+  WORD MinorImageVersion;
+  WORD MajorSubsystemVersion;
+  WORD MinorSubsystemVersion;
+  DWORD Win32VersionValue;
+  DWORD SizeOfImage;
+  DWORD SizeOfHeaders;
+  DWORD CheckSum;
+  WORD Subsystem;
+  WORD DllCharacteristics;
+  ULONGLONG SizeOfStackReserve;
+  ULONGLONG SizeOfStackCommit;
+  ULONGLONG SizeOfHeapReserve;
+  ULONGLONG SizeOfHeapCommit;
+  DWORD LoaderFlags;
+  DWORD NumberOfRvaAndSizes;
+  IMAGE_DATA_DIRECTORY DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+} IMAGE_OPTIONAL_HEADER64, *PIMAGE_OPTIONAL_HEADER64;
+typedef IMAGE_OPTIONAL_HEADER64 IMAGE_OPTIONAL_HEADER;
+typedef PIMAGE_OPTIONAL_HEADER64 PIMAGE_OPTIONAL_HEADER;
+
+typedef struct _IMAGE_NT_HEADERS
+{
+  DWORD Signature;
+  IMAGE_FILE_HEADER FileHeader;
+  IMAGE_OPTIONAL_HEADER32 OptionalHeader;
+} IMAGE_NT_HEADERS32, *PIMAGE_NT_HEADERS32;
+
+typedef struct _IMAGE_NT_HEADERS64
+{
+  DWORD Signature;
+  IMAGE_FILE_HEADER FileHeader;
+  IMAGE_OPTIONAL_HEADER64 OptionalHeader;
+} IMAGE_NT_HEADERS64, *PIMAGE_NT_HEADERS64;
+typedef IMAGE_NT_HEADERS64 IMAGE_NT_HEADERS;
+typedef PIMAGE_NT_HEADERS64 PIMAGE_NT_HEADERS;
+
+typedef struct _IMAGE_SECTION_HEADER
+{
+  BYTE Name[IMAGE_SIZEOF_SHORT_NAME];
+  union
+  {
+    DWORD PhysicalAddress;
+    DWORD VirtualSize;
+  } Misc;
+  DWORD VirtualAddress;
+  DWORD SizeOfRawData;
+  DWORD PointerToRawData;
+  DWORD PointerToRelocations;
+  DWORD PointerToLinenumbers;
+  WORD NumberOfRelocations;
+  WORD NumberOfLinenumbers;
+  DWORD Characteristics;
+} IMAGE_SECTION_HEADER, *PIMAGE_SECTION_HEADER;
+
+#define IMAGE_FIRST_SECTION(ntHeader) ((PIMAGE_SECTION_HEADER)((ULONG_PTR)(ntHeader) + \
+  offsetof(IMAGE_NT_HEADERS, OptionalHeader) + ((ntHeader))->FileHeader.SizeOfOptionalHeader))
+
+typedef struct _IMAGE_EXPORT_DIRECTORY
+{
+  DWORD Characteristics;
+  DWORD TimeDateStamp;
+  WORD MajorVersion;
+  WORD MinorVersion;
+  DWORD Name;
+  DWORD Base;
+  DWORD NumberOfFunctions;
+  DWORD NumberOfNames;
+  DWORD AddressOfFunctions;
+  DWORD AddressOfNames;
+  DWORD AddressOfNameOrdinals;
+} IMAGE_EXPORT_DIRECTORY, *PIMAGE_EXPORT_DIRECTORY;
+
+typedef struct _IMAGE_IMPORT_DESCRIPTOR
+{
+  union
+  {
+    DWORD Characteristics;
+    DWORD OriginalFirstThunk;
+  };
+  DWORD TimeDateStamp;
+  DWORD ForwarderChain;
+  DWORD Name;
+  DWORD FirstThunk;
+} IMAGE_IMPORT_DESCRIPTOR, *PIMAGE_IMPORT_DESCRIPTOR;
+
+typedef struct _IMAGE_IMPORT_BY_NAME
+{
+  WORD Hint;
+  CHAR Name[1];
+} IMAGE_IMPORT_BY_NAME, *PIMAGE_IMPORT_BY_NAME;
+
+typedef struct _IMAGE_THUNK_DATA32
+{
+  union
+  {
+    DWORD ForwarderString;
+    DWORD Function;
+    DWORD Ordinal;
+    DWORD AddressOfData;
+  } u1;
+} IMAGE_THUNK_DATA32, *PIMAGE_THUNK_DATA32;
+
+typedef struct _IMAGE_THUNK_DATA64
+{
+  union
+  {
+    ULONGLONG ForwarderString;
+    ULONGLONG Function;
+    ULONGLONG Ordinal;
+    ULONGLONG AddressOfData;
+  } u1;
+} IMAGE_THUNK_DATA64, *PIMAGE_THUNK_DATA64;
+typedef IMAGE_THUNK_DATA64 IMAGE_THUNK_DATA;
+typedef PIMAGE_THUNK_DATA64 PIMAGE_THUNK_DATA;
+
+typedef struct _IMAGE_COR20_HEADER
+{
+  DWORD cb;
+  WORD MajorRuntimeVersion;
+  WORD MinorRuntimeVersion;
+  IMAGE_DATA_DIRECTORY MetaData;
+  DWORD Flags;
+  DWORD EntryPointToken;
+  IMAGE_DATA_DIRECTORY Resources;
+  IMAGE_DATA_DIRECTORY StrongNameSignature;
+  IMAGE_DATA_DIRECTORY CodeManagerTable;
+  IMAGE_DATA_DIRECTORY VTableFixups;
+  IMAGE_DATA_DIRECTORY ExportAddressTableJumps;
+  IMAGE_DATA_DIRECTORY ManagedNativeHeader;
+} IMAGE_COR20_HEADER, *PIMAGE_COR20_HEADER;